@@ -37,12 +37,52 @@ st_index(shardcache_storage_index_item_t *index, size_t isize, void *priv)
     return isize;
 }
 
+static void *
+st_index_open(void *priv)
+{
+    // the cursor is just the position of the next key
+    // (which is enough because the keys are never removed,
+    // see shardcache_index_open_callback_t)
+    return calloc(1, sizeof(int));
+}
+
+static size_t
+st_index_next(void *cursor, shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    int *next = (int *)cursor;
+    size_t count = 0;
+
+    while (count < isize && *next < FAKE_KEYS_NUMBERS) {
+        char key[50];
+
+        snprintf(key, sizeof(key), FAKE_KEYS_FORMAT, *next);
+
+        index[count].key  = strndup(key, sizeof(key));
+        index[count].klen = strlen(key);
+        index[count].vlen = strlen(key);
+
+        (*next)++;
+        count++;
+    }
+
+    return count;
+}
+
+static void
+st_index_close(void *cursor, void *priv)
+{
+    free(cursor);
+}
+
 int
 storage_init(shardcache_storage_t *storage, const char **options)
 {
     storage->fetch  = st_fetch;
     storage->count  = st_count;
     storage->index  = st_index;
+    storage->index_open  = st_index_open;
+    storage->index_next  = st_index_next;
+    storage->index_close = st_index_close;
     storage->shared = 1;
     storage->global = 1;
 
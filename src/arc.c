@@ -605,6 +605,79 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen)
     return rc;
 }
 
+arc_resource_t
+arc_preload(arc_t *cache, const void *key, size_t klen, void *value, size_t vlen)
+{
+    arc_object_t *obj = arc_object_create(cache, key, klen);
+    if (!obj)
+        return NULL;
+
+    // let our cache user initialize the underlying object
+    cache->ops->init(key, klen, 0, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
+    cache->ops->store(obj->ptr, value, vlen, cache->ops->priv);
+
+    retain_ref(cache->refcnt, obj->node);
+    // NOTE: atomicity here is ensured by the hashtable implementation
+    int rc = ht_set_if_not_exists(cache->hash, (void *)key, klen, obj, sizeof(arc_object_t));
+    if (rc != 0) {
+        // either the object exists already (and its value can't be older
+        // than the one we are preloading) or we failed adding it
+        release_ref(cache->refcnt, obj->node);
+        release_ref(cache->refcnt, obj->node);
+        return NULL;
+    }
+
+    MUTEX_LOCK(&cache->lock);
+    obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + vlen;
+    arc_list_prepend(&obj->head, &cache->mru.head);
+    ATOMIC_INCREMENT(cache->mru.count);
+    ATOMIC_SET(obj->state, &cache->mru);
+    ATOMIC_INCREASE(cache->mru.size, obj->size);
+    ATOMIC_INCREMENT(cache->needs_balance);
+    MUTEX_UNLOCK(&cache->lock);
+
+    arc_balance(cache);
+    return obj;
+}
+
+int
+arc_foreach(arc_t *cache, arc_foreach_callback_t cb, void *priv)
+{
+    MUTEX_LOCK(&cache->lock);
+
+    uint64_t count = ATOMIC_READ(cache->mru.count) + ATOMIC_READ(cache->mfu.count);
+    arc_object_t **objs = malloc(sizeof(arc_object_t *) * (count ? count : 1));
+    arc_state_t *states[2] = { &cache->mru, &cache->mfu };
+    int num_objs = 0;
+    int i;
+
+    // retain the objects so that the callback can be called without
+    // holding the cache lock (the callback might need to lock the objects
+    // and the lock order is object -> cache)
+    for (i = 0; i < 2; i++) {
+        arc_list_t *pos;
+        arc_list_each_prev(pos, &states[i]->head) {
+            if (num_objs == count)
+                break;
+            arc_object_t *obj = arc_list_entry(pos, arc_object_t, head);
+            retain_ref(cache->refcnt, obj->node);
+            objs[num_objs++] = obj;
+        }
+    }
+
+    MUTEX_UNLOCK(&cache->lock);
+
+    for (i = 0; i < num_objs; i++) {
+        arc_object_t *obj = objs[i];
+        if (obj->ptr)
+            cb(obj->key, obj->klen, obj->ptr, priv);
+        release_ref(cache->refcnt, obj->node);
+    }
+    free(objs);
+
+    return num_objs;
+}
+
 size_t
 arc_size(arc_t *cache)
 {
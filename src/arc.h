@@ -84,6 +84,37 @@ arc_resource_t arc_lookup(arc_t *cache, const void *key, size_t klen, void **val
 
 int arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen);
 
+/**
+ * @brief Put an object whose value is already known directly in the mru list
+ *        (used to warm up the cache)
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param key    : The key
+ * @param klen   : The length of the key
+ * @param value  : The value
+ * @param vlen   : The length of the value
+ * @return The ARC resource holding the new object (which needs to be released
+ *         using arc_release_resource()), NULL if the key is already cached
+ *         or in case of errors
+ * @note Unlike arc_load() the object is accounted in the size of the cache
+ *       (and can be evicted) right away
+ */
+arc_resource_t arc_preload(arc_t *cache, const void *key, size_t klen, void *value, size_t vlen);
+
+typedef void (*arc_foreach_callback_t)(const void *key, size_t klen, void *ptr, void *priv);
+
+/**
+ * @brief Call the provided callback for each object in the mru and mfu lists
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param cb     : The callback
+ * @param priv   : A pointer which will be passed to the callback
+ * @return The number of objects passed to the callback
+ * @note The objects are visited from the least to the most recently used,
+ *       first the ones in the mru list then the ones in the mfu list
+ * @note The callback is called without holding the cache lock
+ *       (the objects are retained while being visited)
+ */
+int arc_foreach(arc_t *cache, arc_foreach_callback_t cb, void *priv);
+
 /**
  * @brief Release the resource previously alloc'd by arc_lookup()
  * @note  The retain count will be decreased by 1.\nThe underlying
@@ -1,7 +1,9 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/time.h>
 
 #include "shardcache.h"
 #include "shardcache_internal.h"
@@ -58,9 +60,50 @@ typedef struct
     cached_object_t *obj;
     shardcache_t *cache;
     char *peer_addr;
+    shardcache_node_t *node;
+    int addr_index;
+    struct timeval start;
     int fd;
+    shardcache_peer_stats_t *stats;
+    uint64_t trace_id;
 } shc_fetch_async_arg_t;
 
+static void
+arc_ops_release_peer_address(shardcache_t *cache,
+                             shardcache_node_t *node,
+                             int index,
+                             shardcache_peer_stats_t *stats,
+                             struct timeval *start,
+                             int error,
+                             char *peer_addr,
+                             uint64_t trace_id)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    uint64_t usecs = diff.tv_sec * 1000000 + diff.tv_usec;
+    shardcache_node_release_address(node, index, error, usecs);
+    shardcache_peer_stats_add(stats, SHARDCACHE_PEER_STAT_FETCHES_IN_FLIGHT, -1);
+    shardcache_histogram_record(cache->latencies[SHARDCACHE_LATENCY_PEER_FETCH], usecs);
+    if (trace_id) {
+        // the spans are timed with the monotonic clock
+        uint64_t end = shardcache_histogram_now();
+        shardcache_tracer_span(cache->tracer, trace_id, SHARDCACHE_TRACE_SPAN_PEER_FETCH,
+                               end - usecs, end, peer_addr, strlen(peer_addr));
+    }
+}
+
+static void
+arc_ops_fetch_from_peer_async_done(shc_fetch_async_arg_t *arg, int error)
+{
+    // report the outcome only once
+    if (arg->node) {
+        arc_ops_release_peer_address(arg->cache, arg->node, arg->addr_index, arg->stats,
+                                     &arg->start, error, arg->peer_addr, arg->trace_id);
+        arg->node = NULL;
+    }
+}
+
 static int
 arc_ops_fetch_from_peer_async_cb(char *peer,
                                  void *key,
@@ -80,16 +123,16 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
     MUTEX_LOCK(&obj->lock);
 
     if (!obj->res) {
+        arc_ops_fetch_from_peer_async_done(arg, 1);
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
-        if (fd >= 0)
-            close(fd);
+        shardcache_discard_connection_for_peer(cache, peer_addr, fd, 0);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         MUTEX_UNLOCK(&obj->lock);
         return -1;
     }
     if (!obj->listeners) {
-        if (fd >= 0)
-            close(fd);
+        arc_ops_fetch_from_peer_async_done(arg, 0);
+        shardcache_discard_connection_for_peer(cache, peer_addr, fd, 0);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         MUTEX_UNLOCK(&obj->lock);
         free(arg);
@@ -97,9 +140,10 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         return -1;
     }
     if (status == -1) {
+        // discard the connection first, errno still tells if the fetch timed out
+        shardcache_discard_connection_for_peer(cache, peer_addr, fd, 1);
+        arc_ops_fetch_from_peer_async_done(arg, 1);
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
-        if (fd >= 0)
-            close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         MUTEX_UNLOCK(&obj->lock);
         arc_drop_resource(cache->arc, obj->res);
@@ -107,6 +151,7 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         return -1;
     } else if (status == 1) {
 
+        arc_ops_fetch_from_peer_async_done(arg, 0);
         if (fd >= 0)
             shardcache_release_connection_for_peer(cache, peer_addr, fd);
         free(arg);
@@ -123,6 +168,7 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
 
         return 0;
     } else if (len) {
+        shardcache_peer_stats_add(arg->stats, SHARDCACHE_PEER_STAT_BYTES_IN, len);
         size_t olen = obj->dlen;
         obj->dlen += len;
         if (obj->dlen > sizeof(obj->dbuf)) {
@@ -174,28 +220,39 @@ static int
 arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
 {
     int rc = -1;
-    if (shardcache_log_level() >= LOG_DEBUG) {
-        char keystr[1024];
-        KEY2STR(obj->key, obj->klen, keystr, sizeof(keystr));
-        SHC_DEBUG2("Fetching data for key %s from peer %s", keystr, peer); 
-    }
+    SHC_DEBUG2("Fetching data for key %.*s from peer %s", KEYFMT(obj->key, obj->klen), peer);
 
     shardcache_node_t *node = shardcache_node_select(cache, peer);
-    if (!peer) {
+    if (!node) {
         SHC_ERROR("Can't find address for node %s\n", peer);
         return rc;
     }
-    char *peer_addr = shardcache_node_get_address(node);
+
+    // send the request to the replica of the node with
+    // the least outstanding requests
+    int addr_index = 0;
+    char *peer_addr = shardcache_node_acquire_address(node, &addr_index);
+    struct timeval start;
+    gettimeofday(&start, NULL);
 
     // another peer is responsible for this item, let's get the value from there
 
     int fd = shardcache_get_connection_for_peer(cache, peer_addr);
+    uint64_t trace_id = shardcache_trace_current();
+    shardcache_peer_stats_t *stats = shardcache_peers_stats_lookup(cache->peers_stats, peer_addr);
+    shardcache_peer_stats_request(stats, obj->klen);
+    shardcache_peer_stats_add(stats, SHARDCACHE_PEER_STAT_FETCHES_IN_FLIGHT, 1);
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
         shc_fetch_async_arg_t *arg = malloc(sizeof(shc_fetch_async_arg_t));
         arg->obj = obj;
         arg->cache = cache;
         arg->peer_addr = peer_addr;
+        arg->node = node;
+        arg->addr_index = addr_index;
+        arg->start = start;
         arg->fd = fd;
+        arg->stats = stats;
+        arg->trace_id = trace_id;
         async_read_wrk_t *wrk = NULL;
         arc_retain_resource(cache->arc, obj->res);
         rc = fetch_from_peer_async(peer_addr,
@@ -205,6 +262,7 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
                                    obj->klen,
                                    0,
                                    0,
+                                   trace_id,
                                    arc_ops_fetch_from_peer_async_cb,
                                    arg,
                                    fd,
@@ -230,18 +288,20 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
 
                 COBJ_SET_FLAG(obj, COBJ_FLAG_EVICTED);
             }
-            if (fd >= 0)
-                close(fd);
+            shardcache_discard_connection_for_peer(cache, peer_addr, fd, 1);
             arc_release_resource(cache->arc, obj->res);
 
+            arc_ops_fetch_from_peer_async_done(arg, 1);
             free(arg);
         }
     } else { 
         fbuf_t value = FBUF_STATIC_INITIALIZER;
         rc = fetch_from_peer(peer_addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, obj->key, obj->klen, &value, fd);
+        arc_ops_release_peer_address(cache, node, addr_index, stats, &start, (rc != 0), peer_addr, trace_id);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         if (rc == 0) {
             shardcache_release_connection_for_peer(cache, peer_addr, fd);
+            shardcache_peer_stats_add(stats, SHARDCACHE_PEER_STAT_BYTES_IN, fbuf_used(&value));
             if (fbuf_used(&value)) {
                 obj->data = fbuf_data(&value);
                 obj->dlen = fbuf_used(&value);
@@ -255,7 +315,7 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
             // if succeded the fbuf buffer has been moved to the obj structure
             // but otherwise we have to release it
             fbuf_destroy(&value);
-            close(fd);
+            shardcache_discard_connection_for_peer(cache, peer_addr, fd, 1);
         }
     }
 
@@ -287,17 +347,15 @@ arc_ops_init(const void *key, size_t len, int async, arc_resource_t res, void *p
     MUTEX_INIT(&obj->lock);
 }
 
-static void *
-arc_ops_fetch_copy_volatile_object_cb(void *ptr, size_t len, void *user)
+static void
+arc_ops_fetch_copy_volatile_object_cb(void *value, size_t vlen, uint32_t expire, void *user)
 {
     cached_object_t *obj = (cached_object_t *)user;
-    volatile_object_t *item = (volatile_object_t *)ptr;
-    if (item->dlen) {
-        obj->data = (item->dlen > sizeof(obj->dbuf)) ? malloc(item->dlen) : obj->dbuf;
-        memcpy(obj->data, item->data, item->dlen);
-        obj->dlen = item->dlen;
+    if (vlen) {
+        obj->data = (vlen > sizeof(obj->dbuf)) ? malloc(vlen) : obj->dbuf;
+        memcpy(obj->data, value, vlen);
+        obj->dlen = vlen;
     }
-    return (void *)obj;
 }
 
 int
@@ -318,7 +376,7 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
 
     COBJ_SET_FLAG(obj, COBJ_FLAG_FETCHING);
 
-    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+    SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_CACHE_MISSES);
 
     // this object is not evicted anymore (if it eventually was)
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_EVICTED);
@@ -350,7 +408,7 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
             }
         }
         if (done) {
-            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_FETCH_REMOTE].value);
+            SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_FETCH_REMOTE);
             if (ret == 0) {
                 ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
                 gettimeofday(&obj->ts, NULL);
@@ -361,48 +419,50 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
                 return drop ? 1 : 0;
             }
             MUTEX_UNLOCK(&obj->lock);
-            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+            SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_ERRORS);
             return -1;
         }
     }
 
-    char keystr[1024];
-    if (shardcache_log_level() >= LOG_DEBUG)
-        KEY2STR(obj->key, obj->klen, keystr, sizeof(keystr));
-
-    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_FETCH_LOCAL].value);
+    SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_FETCH_LOCAL);
 
     // we are responsible for this item ... 
     // let's first check if it's among the volatile keys otherwise
     // fetch it from the storage
-    ht_get_deep_copy(cache->volatile_storage,
-                     obj->key,
-                     obj->klen,
-                     NULL,
-                     arc_ops_fetch_copy_volatile_object_cb,
-                     obj);
+    volatile_storage_get(cache->volatile_storage,
+                         obj->key,
+                         obj->klen,
+                         arc_ops_fetch_copy_volatile_object_cb,
+                         obj);
     if (obj->data && obj->dlen) {
-        SHC_DEBUG3("Found volatile value %s (%lu) for key %s",
+        SHC_DEBUG3("Found volatile value %s (%lu) for key %.*s",
                shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
-               (unsigned long)obj->dlen, keystr);
+               (unsigned long)obj->dlen, KEYFMT(obj->key, obj->klen));
     } else if (cache->use_persistent_storage && cache->storage.fetch) {
+        uint64_t start = shardcache_histogram_now();
         int rc = cache->storage.fetch(obj->key, obj->klen, &obj->data, &obj->dlen, cache->storage.priv);
+        SHARDCACHE_LATENCY_RECORD(cache, SHARDCACHE_LATENCY_STORAGE_FETCH, start);
+        uint64_t trace_id = shardcache_trace_current();
+        if (trace_id)
+            shardcache_tracer_span(cache->tracer, trace_id, SHARDCACHE_TRACE_SPAN_STORAGE_FETCH,
+                                   start, shardcache_histogram_now(), NULL, 0);
         if (rc == -1) {
             if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
                 list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
             SHC_ERROR("Fetch storage callback returned an error (%d)", rc);
-            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+            SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_ERRORS);
             COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
             COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
             MUTEX_UNLOCK(&obj->lock);
             return -1;
         }
         if (obj->data && obj->dlen) {
-            SHC_DEBUG3("Fetch storage callback returned value %s (%lu) for key %s",
+            SHC_DEBUG3("Fetch storage callback returned value %s (%lu) for key %.*s",
                    shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
-                   (unsigned long)obj->dlen, keystr);
+                   (unsigned long)obj->dlen, KEYFMT(obj->key, obj->klen));
         } else {
-            SHC_DEBUG3("Fetch storage callback returned an empty value for key %s", keystr);
+            SHC_DEBUG3("Fetch storage callback returned an empty value for key %.*s",
+                       KEYFMT(obj->key, obj->klen));
         }
     }
 
@@ -416,8 +476,8 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
             list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
 
         MUTEX_UNLOCK(&obj->lock);
-        SHC_DEBUG("Item not found for key %s", keystr);
-        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_NOT_FOUND].value);
+        SHC_DEBUG("Item not found for key %.*s", KEYFMT(obj->key, obj->klen));
+        SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_NOT_FOUND);
         return 1;
     }
 
@@ -461,6 +521,10 @@ arc_ops_store(void *item, void *data, size_t size, void *priv)
     memcpy(obj->data, data, size);
     obj->dlen = size;
 
+    // the value is known already, there is nothing left to fetch
+    gettimeofday(&obj->ts, NULL);
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+
     MUTEX_UNLOCK(&obj->lock);
 }
 
@@ -490,7 +554,7 @@ arc_ops_evict(void *item, void *priv)
     MUTEX_UNLOCK(&obj->lock);
 
     if (obj->data)
-        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EVICTS].value);
+        SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_EVICTS);
 
     // no lock is necessary here ... if we are here
     // nobody is referencing us anymore
@@ -293,6 +293,7 @@ open_connection(const char *host, int port, unsigned int timeout)
         struct timeval timeout = { tv.tv_sec, tv.tv_usec };
         struct timeval before;
         gettimeofday(&before, NULL);
+        int error = 0;
         rc = select(sock + 1, NULL, (fd_set *)fdset, NULL, &timeout);
         while (rc >= 0)
         {
@@ -320,6 +321,7 @@ open_connection(const char *host, int port, unsigned int timeout)
             timersub(&now, &before, &diff);
             if (timercmp(&diff, &tv, >)) {
                 fprintf(stderr, "Can't connect to %s:%d : Timeout occurred\n", host, port);
+                error = ETIMEDOUT;
                 break;
             }
             memcpy(&timeout, &tv, sizeof(struct timeval));
@@ -328,9 +330,13 @@ open_connection(const char *host, int port, unsigned int timeout)
             rc = select(sock + 1, NULL, (fd_set *)fdset, NULL, &timeout);
         }
 
+        if (!error)
+            error = errno;
         free(fdset);
         shutdown(sock, SHUT_RDWR);
         close(sock);
+        // let the caller know why we failed
+        errno = error;
         return -1;
     }
 
@@ -344,6 +350,53 @@ open_connection(const char *host, int port, unsigned int timeout)
     return sock;
 }
 
+/*!
+ * \brief Start opening a TCP connection without waiting for it to complete.
+ * \param host hostname
+ * \param port port number
+ * \returns a non-blocking file handle on success, or -1 otherwise (errno is set).
+ *
+ * \note The connection might still be in progress when this function returns,
+ * its outcome is known once the socket becomes writable (or the first write fails).
+ */
+int
+open_connection_nonblocking(const char *host, int port)
+{
+    int val = 1;
+    struct sockaddr_in sockaddr;
+    int sock;
+
+    errno = EINVAL;
+    if (host == NULL || !*host || port == 0)
+        return -1;
+
+    if (string2sockaddr(host, port, &sockaddr) == -1)
+        return -1;
+
+    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == -1)
+        return -1;
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val,  sizeof(val));
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    if (connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1 && errno != EINPROGRESS) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
 /*!
  * \brief Open a UNIX domain socket.
  * \param filename filename for socket
@@ -7,6 +7,7 @@ extern "C" {
 
 int open_socket(const char *host, int port);
 int open_connection(const char *host, int port, unsigned int timeout);
+int open_connection_nonblocking(const char *host, int port);
 int open_lsocket(const char *filename);
 int open_fifo(const char *filename);
 
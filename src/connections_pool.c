@@ -171,8 +171,11 @@ write_noop(connections_pool_t *cc, int fd, int flags)
 }
 
 int
-connections_pool_get(connections_pool_t *cc, char *addr)
+connections_pool_get_ext(connections_pool_t *cc, char *addr, int *connected)
 {
+    if (connected)
+        *connected = 0;
+
     queue_t *connection_queue = get_connection_queue(cc, addr);
     if (!connection_queue)
         return -1;
@@ -201,6 +204,9 @@ connections_pool_get(connections_pool_t *cc, char *addr)
         entry = queue_pop_left(connection_queue);
     }
 
+    if (connected)
+        *connected = 1;
+
     int new_fd = connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
     if (new_fd == -1 && (errno == EMFILE || errno == ENFILE)) {
         ht_foreach_value(cc->table, connections_queue_empty, NULL);
@@ -210,6 +216,20 @@ connections_pool_get(connections_pool_t *cc, char *addr)
     return new_fd;
 }
 
+int
+connections_pool_get(connections_pool_t *cc, char *addr)
+{
+    return connections_pool_get_ext(cc, addr, NULL);
+}
+
+int
+connections_pool_idle(connections_pool_t *cc, char *addr)
+{
+    // don't use get_connection_queue() which would create the queue
+    queue_t *connection_queue = ht_get(cc->table, addr, strlen(addr), NULL);
+    return connection_queue ? queue_count(connection_queue) : 0;
+}
+
 
 void
 connections_pool_add(connections_pool_t *cc, char *addr, int fd)
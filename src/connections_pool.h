@@ -8,6 +8,11 @@ typedef struct __connection_pool_entry_s connection_pool_entry_t;
 connections_pool_t * connections_pool_create(int tcp_timeout, int expire_time, int max_spare);
 void connections_pool_destroy(connections_pool_t *cc);
 int connections_pool_get(connections_pool_t *cc, char *addr);
+// same as connections_pool_get() but also reports if a new connection
+// had to be established (instead of reusing an idle one)
+int connections_pool_get_ext(connections_pool_t *cc, char *addr, int *connected);
+// the number of idle connections to 'addr' held by the pool
+int connections_pool_idle(connections_pool_t *cc, char *addr);
 void connections_pool_add(connections_pool_t *cc, char *addr, int fd);
 int connections_pool_tcp_timeout(connections_pool_t *cc, int new_value);
 int connections_pool_check(connections_pool_t *cc, int new_value);
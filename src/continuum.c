@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <chash.h>
+#include <hashtable.h>
+
+#ifndef HAVE_UINT64_T
+#define HAVE_UINT64_T
+#endif
+#include <siphash.h>
+
+#include "continuum.h"
+
+#define CONTINUUM_TABLE_EMPTY 0xFFFF
+
+typedef struct chash_t chash_t;
+
+struct __shardcache_continuum_s {
+    shardcache_continuum_mode_t mode;
+    int num_nodes;
+    chash_t *chash;       // the libchash ring (SHARDCACHE_CONTINUUM_MODE_CHASH)
+    hashtable_t *labels;  // label -> (index + 1) used to map back the
+                          // ring lookups to a node index
+    char **names;         // the names of the points added to the ring
+    int num_names;        // (weighted nodes are added multiple times)
+    uint16_t *table;      // the precomputed buckets (SHARDCACHE_CONTINUUM_MODE_TABLE)
+};
+
+typedef struct {
+    char *label;
+    int index;
+    int weight;
+    uint32_t offset;
+    uint32_t skip;
+    uint32_t next;
+} continuum_table_node_t;
+
+// NOTE: these seeds are part of the placement algorithm,
+//       changing them will move (almost) all the keys
+static unsigned char continuum_key_seed[16]    = "shc_table_key_00";
+static unsigned char continuum_offset_seed[16] = "shc_table_offset";
+static unsigned char continuum_skip_seed[16]   = "shc_table_skip_0";
+
+static int
+continuum_table_node_cmp(const void *a, const void *b)
+{
+    return strcmp(((continuum_table_node_t *)a)->label,
+                  ((continuum_table_node_t *)b)->label);
+}
+
+static uint16_t *
+continuum_table_create(shardcache_node_t **nodes, int num_nodes)
+{
+    int i;
+    uint32_t filled = 0;
+    continuum_table_node_t tnodes[num_nodes];
+
+    for (i = 0; i < num_nodes; i++) {
+        char *label = shardcache_node_get_label(nodes[i]);
+        size_t llen = strlen(label);
+        tnodes[i].label = label;
+        tnodes[i].index = i;
+        tnodes[i].weight = shardcache_node_get_weight(nodes[i]);
+        tnodes[i].offset = sip_hash24(continuum_offset_seed, (uint8_t *)label, llen)
+                           % SHARDCACHE_CONTINUUM_TABLE_SIZE;
+        tnodes[i].skip = sip_hash24(continuum_skip_seed, (uint8_t *)label, llen)
+                         % (SHARDCACHE_CONTINUUM_TABLE_SIZE - 1) + 1;
+        tnodes[i].next = 0;
+    }
+
+    // the resulting table must not depend on the order
+    // in which the nodes have been provided
+    qsort(tnodes, num_nodes, sizeof(continuum_table_node_t), continuum_table_node_cmp);
+
+    uint16_t *table = malloc(sizeof(uint16_t) * SHARDCACHE_CONTINUUM_TABLE_SIZE);
+    if (!table)
+        return NULL;
+
+    memset(table, 0xFF, sizeof(uint16_t) * SHARDCACHE_CONTINUUM_TABLE_SIZE);
+
+    // each node, in turn, claims the next free bucket(s) in its own
+    // permutation of the table until all the buckets have been assigned
+    // (since the table size is prime each permutation covers all the buckets).
+    // At each round a node claims as many buckets as its weight, so that
+    // the share of the table it ends up owning is proportional to its weight
+    while (filled < SHARDCACHE_CONTINUUM_TABLE_SIZE) {
+        for (i = 0; i < num_nodes && filled < SHARDCACHE_CONTINUUM_TABLE_SIZE; i++) {
+            continuum_table_node_t *tnode = &tnodes[i];
+            int n;
+            for (n = 0; n < tnode->weight && filled < SHARDCACHE_CONTINUUM_TABLE_SIZE; n++) {
+                uint32_t bucket;
+                do {
+                    bucket = (tnode->offset + (uint64_t)tnode->skip * tnode->next)
+                             % SHARDCACHE_CONTINUUM_TABLE_SIZE;
+                    tnode->next++;
+                } while (table[bucket] != CONTINUUM_TABLE_EMPTY);
+                table[bucket] = tnode->index;
+                filled++;
+            }
+        }
+    }
+
+    return table;
+}
+
+shardcache_continuum_t *
+shardcache_continuum_create(shardcache_node_t **nodes,
+                            int num_nodes,
+                            shardcache_continuum_mode_t mode)
+{
+    int i;
+
+    if (num_nodes <= 0 || num_nodes >= CONTINUUM_TABLE_EMPTY) {
+        SHC_ERROR("Can't create a continuum with %d nodes", num_nodes);
+        return NULL;
+    }
+
+    shardcache_continuum_t *continuum = calloc(1, sizeof(shardcache_continuum_t));
+    continuum->mode = mode;
+    continuum->num_nodes = num_nodes;
+
+    switch(mode) {
+        case SHARDCACHE_CONTINUUM_MODE_TABLE:
+            continuum->table = continuum_table_create(nodes, num_nodes);
+            if (!continuum->table) {
+                SHC_ERROR("Can't create the continuum lookup table");
+                free(continuum);
+                return NULL;
+            }
+            break;
+        case SHARDCACHE_CONTINUUM_MODE_CHASH:
+        {
+            int num_names = 0;
+            for (i = 0; i < num_nodes; i++)
+                num_names += shardcache_node_get_weight(nodes[i]);
+
+            size_t lens[num_names];
+            continuum->names = calloc(num_names, sizeof(char *));
+            continuum->labels = ht_create(128, 65535, NULL);
+
+            // a node with weight N is added to the ring N times: using its
+            // plain label the first time (so that nodes with the default
+            // weight keep the same points they always had) and using
+            // 'label#n' for any additional set of points
+            for (i = 0; i < num_nodes; i++) {
+                char *label = shardcache_node_get_label(nodes[i]);
+                int weight = shardcache_node_get_weight(nodes[i]);
+                int n;
+                for (n = 0; n < weight; n++) {
+                    char *name = NULL;
+                    if (n == 0) {
+                        name = strdup(label);
+                    } else {
+                        size_t nlen = strlen(label) + 16;
+                        name = malloc(nlen);
+                        snprintf(name, nlen, "%s#%d", label, n);
+                    }
+                    // a label containing '#' (or a duplicated label) would
+                    // make two nodes share the same points
+                    if (ht_exists(continuum->labels, name, strlen(name))) {
+                        SHC_ERROR("Can't add node %s to the continuum, the name %s is already taken",
+                                  label, name);
+                        free(name);
+                        shardcache_continuum_destroy(continuum);
+                        return NULL;
+                    }
+                    lens[continuum->num_names] = strlen(name);
+                    continuum->names[continuum->num_names++] = name;
+                    ht_set(continuum->labels, name, strlen(name), (void *)(intptr_t)(i + 1), 0);
+                }
+            }
+            continuum->chash = chash_create((const char **)continuum->names,
+                                            lens,
+                                            continuum->num_names,
+                                            SHARDCACHE_CONTINUUM_REPLICAS);
+            break;
+        }
+        default:
+            SHC_ERROR("Unknown continuum mode %d", mode);
+            free(continuum);
+            return NULL;
+    }
+
+    return continuum;
+}
+
+void
+shardcache_continuum_destroy(shardcache_continuum_t *continuum)
+{
+    if (continuum->chash)
+        chash_free(continuum->chash);
+    if (continuum->labels)
+        ht_destroy(continuum->labels);
+    int i;
+    for (i = 0; i < continuum->num_names; i++)
+        free(continuum->names[i]);
+    free(continuum->names);
+    free(continuum->table);
+    free(continuum);
+}
+
+int
+shardcache_continuum_lookup(shardcache_continuum_t *continuum, void *key, size_t klen)
+{
+    if (continuum->num_nodes == 1)
+        return 0;
+
+    if (continuum->table) {
+        uint64_t hash = sip_hash24(continuum_key_seed, key, klen);
+        return continuum->table[hash % SHARDCACHE_CONTINUUM_TABLE_SIZE];
+    }
+
+    const char *node_name = NULL;
+    size_t name_len = 0;
+    chash_lookup(continuum->chash, key, klen, &node_name, &name_len);
+    if (!node_name)
+        return -1;
+
+    intptr_t index = (intptr_t)ht_get(continuum->labels, (void *)node_name, name_len, NULL);
+    return index - 1;
+}
+
+shardcache_continuum_mode_t
+shardcache_continuum_mode_get(shardcache_continuum_t *continuum)
+{
+    return continuum->mode;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
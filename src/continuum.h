@@ -0,0 +1,71 @@
+#ifndef __SHARDCACHE_CONTINUUM_H__
+#define __SHARDCACHE_CONTINUUM_H__
+
+#include <sys/types.h>
+#include "shardcache.h"
+
+/* Internal abstraction over the key -> owner mapping shared by the
+ * shardcache server and the shardcache client.
+ *
+ * Two engines are available:
+ *
+ *  - SHARDCACHE_CONTINUUM_MODE_CHASH : the classic libchash ring
+ *    (SHARDCACHE_CONTINUUM_REPLICAS points per node). This is the default
+ *    and stays compatible with any other client using the same ring.
+ *
+ *  - SHARDCACHE_CONTINUUM_MODE_TABLE : a dense lookup table with
+ *    SHARDCACHE_CONTINUUM_TABLE_SIZE buckets precomputed at creation time
+ *    using the maglev algorithm. A lookup is a single hash of the key plus
+ *    one array access. Adding/removing a node moves only (roughly) the
+ *    share of the keyspace owned by that node.
+ *
+ * All the nodes (and clients) of a cloud MUST use the same engine.
+ * A continuum is immutable once created, so it can be safely queried
+ * concurrently by multiple threads.
+ */
+
+#define SHARDCACHE_CONTINUUM_REPLICAS   200
+#define SHARDCACHE_CONTINUUM_TABLE_SIZE 65537 // MUST be a prime number
+
+typedef struct __shardcache_continuum_s shardcache_continuum_t;
+
+/*
+ * @brief Create a new continuum for the given nodes
+ * @param nodes     The nodes taking part to the continuum
+ * @param num_nodes The number of nodes in the array
+ * @param mode      The engine to use
+ * @return A newly initialized continuum, NULL in case of errors
+ * @note The indexes returned by shardcache_continuum_lookup() refer to
+ *       the position of the owner in the nodes array passed at creation time
+ */
+shardcache_continuum_t *shardcache_continuum_create(shardcache_node_t **nodes,
+                                                    int num_nodes,
+                                                    shardcache_continuum_mode_t mode);
+
+/*
+ * @brief Release all the resources used by a continuum
+ * @param continuum A valid shardcache_continuum_t structure
+ */
+void shardcache_continuum_destroy(shardcache_continuum_t *continuum);
+
+/*
+ * @brief Determine the owner of a key
+ * @param continuum A valid shardcache_continuum_t structure
+ * @param key       A valid pointer to the key
+ * @param klen      The length of the key
+ * @return The index of the owner in the nodes array used to create the continuum,
+ *         -1 in case of errors
+ */
+int shardcache_continuum_lookup(shardcache_continuum_t *continuum, void *key, size_t klen);
+
+/*
+ * @brief Get the engine used by a continuum
+ * @param continuum A valid shardcache_continuum_t structure
+ * @return The mode the continuum has been created with
+ */
+shardcache_continuum_mode_t shardcache_continuum_mode_get(shardcache_continuum_t *continuum);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
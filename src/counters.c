@@ -2,6 +2,10 @@
 #include "counters.h"
 #include <linklist.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define COUNTERS_ALLOC_CHUNK 128
 
@@ -9,6 +13,32 @@ struct __shardcache_counters_s {
     linked_list_t *lookup;
 };
 
+// where the value of an exported counter can be found
+typedef struct {
+    const uint64_t *ptr;               // a plain counter
+    shardcache_sharded_counters_t *sc; // or a sharded one
+    int index;
+    shardcache_counter_callback_t cb;  // or a computed one
+    void *priv;
+} shardcache_counter_source_t;
+
+struct __shardcache_sharded_counters_s {
+    int num_counters;
+    size_t row_size; // the size of the row of counters in each slot
+                     // (multiple of the cache line size)
+    char *rows;
+};
+
+// the slots are assigned to the threads the first time they need one
+// and released when they exit (by the destructor of the thread key),
+// a thread gets the first free slot or (if all of them are taken) the
+// one shared by the fewest threads
+static pthread_once_t shardcache_sharded_counters_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shardcache_sharded_counters_key;
+static pthread_mutex_t shardcache_sharded_counters_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shardcache_sharded_counters_slot_threads[SHARDCACHE_COUNTERS_SLOTS];
+static __thread int shardcache_sharded_counters_slot = -1;
+
 shardcache_counters_t *shardcache_init_counters()
 {
     shardcache_counters_t *c = calloc(1, sizeof(shardcache_counters_t));
@@ -16,25 +46,81 @@ shardcache_counters_t *shardcache_init_counters()
     return c;
 }
 
+static int
+shardcache_counter_free_source(void *item, uint32_t idx, void *user)
+{
+    tagged_value_t *tval = (tagged_value_t *)item;
+    free(tval->value);
+    return 1;
+}
+
 void shardcache_release_counters(shardcache_counters_t *c)
 {
+    list_foreach_value(c->lookup, shardcache_counter_free_source, NULL);
     list_destroy(c->lookup);
     free(c);
 }
 
+static void
+shardcache_counter_add_source(shardcache_counters_t *c,
+                              const char *name,
+                              const uint64_t *counter_ptr,
+                              shardcache_sharded_counters_t *sc,
+                              int index)
+{
+    shardcache_counter_source_t *src = calloc(1, sizeof(shardcache_counter_source_t));
+    src->ptr = counter_ptr;
+    src->sc = sc;
+    src->index = index;
+    tagged_value_t *tval = list_create_tagged_value_nocopy((char *)name, src);
+    list_push_tagged_value(c->lookup, tval);
+}
+
 void
 shardcache_counter_add(shardcache_counters_t *c, const char *name, const uint64_t *counter_ptr)
 {
-    tagged_value_t *tval = list_create_tagged_value_nocopy((char *)name, (void *)counter_ptr);
+    shardcache_counter_add_source(c, name, counter_ptr, NULL, 0);
+}
+
+void
+shardcache_counter_add_sharded(shardcache_counters_t *c,
+                               const char *name,
+                               shardcache_sharded_counters_t *sc,
+                               int index)
+{
+    shardcache_counter_add_source(c, name, NULL, sc, index);
+}
+
+void
+shardcache_counter_add_callback(shardcache_counters_t *c,
+                                const char *name,
+                                shardcache_counter_callback_t cb,
+                                void *priv)
+{
+    shardcache_counter_source_t *src = calloc(1, sizeof(shardcache_counter_source_t));
+    src->cb = cb;
+    src->priv = priv;
+    tagged_value_t *tval = list_create_tagged_value_nocopy((char *)name, src);
     list_push_tagged_value(c->lookup, tval);
 }
 
+static inline uint64_t
+shardcache_counter_source_read(shardcache_counter_source_t *src)
+{
+    if (src->cb)
+        return src->cb(src->priv);
+    if (src->sc)
+        return shardcache_sharded_counter_get(src->sc, src->index);
+    return (uint64_t)__sync_fetch_and_add((uint64_t *)src->ptr, 0);
+}
+
 static int
 shardcache_counter_remove_helper(void *item, uint32_t idx, void *user)
 {
     char *name = (char *)user;
     tagged_value_t *tval = (tagged_value_t *)item;
     if (strcmp(tval->tag, name) == 0) {
+        free(tval->value);
         list_destroy_tagged_value(tval);
         return -2;
     }
@@ -54,44 +140,68 @@ typedef struct {
 } counters_iterator_arg_t;
 
 int
-shardcache_get_all_counters(shardcache_counters_t *c, shardcache_counter_t **out_counters)
+shardcache_read_counters(shardcache_counters_t *c, shardcache_counter_t **out_counters, int *size)
 {
     int i = 0;
-    size_t size = sizeof(shardcache_counter_t) * COUNTERS_ALLOC_CHUNK;
-    shardcache_counter_t *counters = malloc(sizeof(shardcache_counter_t) * COUNTERS_ALLOC_CHUNK);
+    shardcache_counter_t *counters = *out_counters;
     list_lock(c->lookup);
-    for (i = 0; i < list_count(c->lookup); i++) {
-        tagged_value_t *tval = list_pick_tagged_value(c->lookup, i);
-        if (i == (size/sizeof(shardcache_counter_t))-1) {
-            size += (sizeof(shardcache_counter_t) * COUNTERS_ALLOC_CHUNK);
-            counters = realloc(counters, size);
+    int count = list_count(c->lookup);
+    if (count > *size || !counters) {
+        // grow in chunks, so that a few counters added later
+        // don't require a new allocation
+        int new_size = ((count / COUNTERS_ALLOC_CHUNK) + 1) * COUNTERS_ALLOC_CHUNK;
+        shardcache_counter_t *new_counters = realloc(counters, sizeof(shardcache_counter_t) * new_size);
+        if (!new_counters) {
+            list_unlock(c->lookup);
+            return 0;
         }
+        counters = new_counters;
+        *out_counters = counters;
+        *size = new_size;
+    }
+    for (i = 0; i < count; i++) {
+        tagged_value_t *tval = list_pick_tagged_value(c->lookup, i);
         shardcache_counter_t *counter = &counters[i];
         snprintf(counter->name, sizeof(counter->name), "%s", tval->tag);
-        counter->value = (uint64_t)__sync_fetch_and_add((uint64_t *)tval->value, 0);
- 
+        // sharded counters are aggregated here, only when they are read
+        counter->value = shardcache_counter_source_read((shardcache_counter_source_t *)tval->value);
     }
     list_unlock(c->lookup);
-    *out_counters = counters;
     return i;
 }
 
+int
+shardcache_get_all_counters(shardcache_counters_t *c, shardcache_counter_t **out_counters)
+{
+    shardcache_counter_t *counters = NULL;
+    int size = 0;
+    int count = shardcache_read_counters(c, &counters, &size);
+    *out_counters = counters;
+    return count;
+}
+
 int
 shardcache_counter_value_add(shardcache_counters_t *c, char *name, int value)
 {
     tagged_value_t *tval = list_get_tagged_value(c->lookup, name);
-    if (tval)
-        return __sync_fetch_and_add((uint64_t *)tval->value, value);
+    if (tval) {
+        shardcache_counter_source_t *src = (shardcache_counter_source_t *)tval->value;
+        if (src->cb) // computed counters can't be changed
+            return src->cb(src->priv);
+        if (src->sc) {
+            int old = shardcache_sharded_counter_get(src->sc, src->index);
+            shardcache_sharded_counter_add(src->sc, src->index, value);
+            return old;
+        }
+        return __sync_fetch_and_add((uint64_t *)src->ptr, value);
+    }
     return 0;
 }
 
 int
 shardcache_counter_value_sub(shardcache_counters_t *c, char *name, int value)
 {
-    tagged_value_t *tval = list_get_tagged_value(c->lookup, name);
-    if (tval)
-        return __sync_fetch_and_sub((uint64_t *)tval->value, value);
-    return 0;
+    return shardcache_counter_value_add(c, name, -value);
 }
 
 int
@@ -99,15 +209,131 @@ shardcache_counter_value_set(shardcache_counters_t *c, char *name, int value)
 {
     tagged_value_t *tval = list_get_tagged_value(c->lookup, name);
     if (tval) {
+        shardcache_counter_source_t *src = (shardcache_counter_source_t *)tval->value;
+        if (src->cb) // computed counters can't be changed
+            return src->cb(src->priv);
+        if (src->sc) {
+            int old = shardcache_sharded_counter_get(src->sc, src->index);
+            shardcache_sharded_counter_set(src->sc, src->index, value);
+            return old;
+        }
         int b = 0;
-        int old = __sync_fetch_and_add((uint64_t *)tval->value, 0);
+        int old = __sync_fetch_and_add((uint64_t *)src->ptr, 0);
         do {
-            b = __sync_bool_compare_and_swap((uint64_t *)tval->value, old, value);
+            b = __sync_bool_compare_and_swap((uint64_t *)src->ptr, old, value);
         } while (!b);
         return old;
     }
     return 0;
 }
 
+shardcache_sharded_counters_t *
+shardcache_sharded_counters_create(int num_counters)
+{
+    shardcache_sharded_counters_t *sc = calloc(1, sizeof(shardcache_sharded_counters_t));
+    if (!sc)
+        return NULL;
+
+    sc->num_counters = num_counters;
+    sc->row_size = sizeof(uint64_t) * num_counters;
+    // round up to the cache line size so that no two slots share a cache line
+    if (sc->row_size % SHARDCACHE_COUNTERS_CACHE_LINE_SIZE)
+        sc->row_size += SHARDCACHE_COUNTERS_CACHE_LINE_SIZE - (sc->row_size % SHARDCACHE_COUNTERS_CACHE_LINE_SIZE);
+
+    void *rows = NULL;
+    size_t size = sc->row_size * SHARDCACHE_COUNTERS_SLOTS;
+    if (posix_memalign(&rows, SHARDCACHE_COUNTERS_CACHE_LINE_SIZE, size) != 0) {
+        free(sc);
+        return NULL;
+    }
+    memset(rows, 0, size);
+    sc->rows = rows;
+
+    return sc;
+}
+
+void
+shardcache_sharded_counters_destroy(shardcache_sharded_counters_t *sc)
+{
+    free(sc->rows);
+    free(sc);
+}
+
+static inline uint64_t *
+shardcache_sharded_counters_row(shardcache_sharded_counters_t *sc, int slot)
+{
+    return (uint64_t *)(sc->rows + sc->row_size * slot);
+}
+
+// the values accumulated in the row of a released slot are still part of
+// the counters, so the thread which gets the slot next keeps adding to them
+static void
+shardcache_sharded_counters_release_slot(void *value)
+{
+    int slot = (int)(intptr_t)value - 1;
+    pthread_mutex_lock(&shardcache_sharded_counters_slots_lock);
+    shardcache_sharded_counters_slot_threads[slot]--;
+    pthread_mutex_unlock(&shardcache_sharded_counters_slots_lock);
+}
+
+static void
+shardcache_sharded_counters_create_key()
+{
+    pthread_key_create(&shardcache_sharded_counters_key, shardcache_sharded_counters_release_slot);
+}
+
+int
+shardcache_counters_thread_slot()
+{
+    int slot = shardcache_sharded_counters_slot;
+    if (slot != -1)
+        return slot;
+
+    pthread_once(&shardcache_sharded_counters_key_once, shardcache_sharded_counters_create_key);
+
+    pthread_mutex_lock(&shardcache_sharded_counters_slots_lock);
+    int i;
+    slot = 0;
+    for (i = 1; i < SHARDCACHE_COUNTERS_SLOTS && shardcache_sharded_counters_slot_threads[slot]; i++) {
+        if (shardcache_sharded_counters_slot_threads[i] < shardcache_sharded_counters_slot_threads[slot])
+            slot = i;
+    }
+    shardcache_sharded_counters_slot_threads[slot]++;
+    pthread_mutex_unlock(&shardcache_sharded_counters_slots_lock);
+
+    // the value of the key must not be NULL for the destructor to be called
+    pthread_setspecific(shardcache_sharded_counters_key, (void *)(intptr_t)(slot + 1));
+    shardcache_sharded_counters_slot = slot;
+    return slot;
+}
+
+void
+shardcache_sharded_counter_add(shardcache_sharded_counters_t *sc, int index, int64_t value)
+{
+    int slot = shardcache_counters_thread_slot();
+    // the slot is shared only if there are more threads than slots,
+    // so the atomic add is almost always uncontended
+    __sync_fetch_and_add(&shardcache_sharded_counters_row(sc, slot)[index], value);
+}
+
+uint64_t
+shardcache_sharded_counter_get(shardcache_sharded_counters_t *sc, int index)
+{
+    int i;
+    uint64_t value = 0;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++)
+        value += __sync_fetch_and_add(&shardcache_sharded_counters_row(sc, i)[index], 0);
+    return value;
+}
+
+void
+shardcache_sharded_counter_set(shardcache_sharded_counters_t *sc, int index, uint64_t value)
+{
+    int i;
+    for (i = 1; i < SHARDCACHE_COUNTERS_SLOTS; i++)
+        __sync_lock_test_and_set(&shardcache_sharded_counters_row(sc, i)[index], 0);
+    __sync_lock_test_and_set(&shardcache_sharded_counters_row(sc, 0)[index], value);
+}
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
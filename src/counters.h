@@ -1,19 +1,116 @@
 #ifndef __SHARDCACHE_COUNTERS_H__
 #define __SHARDCACHE_COUNTERS_H__
 
+#include <stdint.h>
+
 typedef struct __shardcache_counters_s shardcache_counters_t;
 
 shardcache_counters_t *shardcache_init_counters();
 void shardcache_release_counters(shardcache_counters_t *counters);
 
 void shardcache_counter_add(shardcache_counters_t *counters, const char *name, const uint64_t *counter_ptr);
+
+typedef uint64_t (*shardcache_counter_callback_t)(void *priv);
+
+/*
+ * @brief Export a value computed by a callback each time the counters are read
+ * @note The callback is called while holding the lock of the counters,
+ *       so it must not add or remove counters
+ */
+void shardcache_counter_add_callback(shardcache_counters_t *counters,
+                                     const char *name,
+                                     shardcache_counter_callback_t cb,
+                                     void *priv);
 int shardcache_get_all_counters(shardcache_counters_t *counters, shardcache_counter_t **out);
+
+/*
+ * @brief Read all the counters into an array which can be reused among calls
+ * @param counters The counters instance
+ * @param out      A reference to the array (pointing to NULL the first time),
+ *                 reallocated only if there are more counters than *size
+ * @param size     A reference to the number of elements the array can hold
+ * @return The number of counters stored in the array
+ */
+int shardcache_read_counters(shardcache_counters_t *counters, shardcache_counter_t **out, int *size);
+
 void shardcache_counter_remove(shardcache_counters_t *counters, const char *name);
 
 int shardcache_counter_value_add(shardcache_counters_t *c, char *name, int value);
 int shardcache_counter_value_sub(shardcache_counters_t *c, char *name, int value);
 int shardcache_counter_value_set(shardcache_counters_t *c, char *name, int value);
 
+/*
+ * Sharded counters.
+ *
+ * Counters updated on every request by all the worker threads would make
+ * the cache line(s) holding them bounce among all the cores.
+ * A sharded counters instance holds one row of counters for each slot,
+ * each row being aligned (and padded) to the cache line size, and every
+ * thread gets assigned its own slot the first time it updates a counter
+ * (the slot is released, to be reused by the threads created later on,
+ * when the thread exits).
+ * Increments are then (almost always) uncontended and the actual value of
+ * a counter is computed only when it is read, by summing all the slots.
+ */
+
+#define SHARDCACHE_COUNTERS_CACHE_LINE_SIZE 64
+#define SHARDCACHE_COUNTERS_SLOTS 64 // live threads beyond this number share the slots
+
+typedef struct __shardcache_sharded_counters_s shardcache_sharded_counters_t;
+
+/*
+ * @brief Get the slot assigned to the calling thread
+ * @return The index of the slot (between 0 and SHARDCACHE_COUNTERS_SLOTS - 1)
+ * @note The slot is assigned to another thread once the calling one exits
+ */
+int shardcache_counters_thread_slot();
+
+/*
+ * @brief Create a new set of sharded counters
+ * @param num_counters The number of counters in the set
+ * @return A valid shardcache_sharded_counters_t structure, NULL in case of errors
+ */
+shardcache_sharded_counters_t *shardcache_sharded_counters_create(int num_counters);
+
+/*
+ * @brief Release all the resources used by a set of sharded counters
+ */
+void shardcache_sharded_counters_destroy(shardcache_sharded_counters_t *sc);
+
+/*
+ * @brief Add a value to a counter (in the slot owned by the calling thread)
+ * @param sc    A valid shardcache_sharded_counters_t structure
+ * @param index The index of the counter
+ * @param value The value to add (can be negative)
+ */
+void shardcache_sharded_counter_add(shardcache_sharded_counters_t *sc, int index, int64_t value);
+
+/*
+ * @brief Get the value of a counter by summing all the slots
+ * @param sc    A valid shardcache_sharded_counters_t structure
+ * @param index The index of the counter
+ * @return The value of the counter
+ */
+uint64_t shardcache_sharded_counter_get(shardcache_sharded_counters_t *sc, int index);
+
+/*
+ * @brief Set the value of a counter
+ * @param sc    A valid shardcache_sharded_counters_t structure
+ * @param index The index of the counter
+ * @param value The new value
+ * @note Increments happening concurrently in other slots might be lost
+ */
+void shardcache_sharded_counter_set(shardcache_sharded_counters_t *sc, int index, uint64_t value);
+
+/*
+ * @brief Export a sharded counter (as the sum of its slots)
+ *        together with the other counters
+ */
+void shardcache_counter_add_sharded(shardcache_counters_t *counters,
+                                    const char *name,
+                                    shardcache_sharded_counters_t *sc,
+                                    int index);
+
 #endif
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "shardcache.h"
+#include "counters.h"
+#include "histogram.h"
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[SHARDCACHE_HISTOGRAM_NUM_BUCKETS];
+} __attribute__((aligned(SHARDCACHE_COUNTERS_CACHE_LINE_SIZE))) shardcache_histogram_slot_t;
+
+struct __shardcache_histogram_s {
+    // one slot per thread (same assignment used by the sharded counters),
+    // allocated the first time a thread records a value
+    shardcache_histogram_slot_t *slots[SHARDCACHE_COUNTERS_SLOTS];
+};
+
+static inline int
+shardcache_histogram_bucket(uint64_t value)
+{
+    if (value > SHARDCACHE_HISTOGRAM_MAX_VALUE)
+        value = SHARDCACHE_HISTOGRAM_MAX_VALUE;
+
+    if (value < SHARDCACHE_HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SHARDCACHE_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * SHARDCACHE_HISTOGRAM_SUB_BUCKETS
+           + (int)((value >> shift) - SHARDCACHE_HISTOGRAM_SUB_BUCKETS);
+}
+
+// the highest value which falls in a bucket
+static inline uint64_t
+shardcache_histogram_bucket_value(int bucket)
+{
+    if (bucket < SHARDCACHE_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    int shift = bucket / SHARDCACHE_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t)(SHARDCACHE_HISTOGRAM_SUB_BUCKETS + bucket % SHARDCACHE_HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + (1ULL << shift) - 1;
+}
+
+shardcache_histogram_t *
+shardcache_histogram_create()
+{
+    return calloc(1, sizeof(shardcache_histogram_t));
+}
+
+void
+shardcache_histogram_destroy(shardcache_histogram_t *h)
+{
+    int i;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++)
+        free(h->slots[i]);
+    free(h);
+}
+
+uint64_t
+shardcache_histogram_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static shardcache_histogram_slot_t *
+shardcache_histogram_slot(shardcache_histogram_t *h)
+{
+    int index = shardcache_counters_thread_slot();
+    shardcache_histogram_slot_t *slot = __sync_fetch_and_add(&h->slots[index], 0);
+    if (slot)
+        return slot;
+
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, SHARDCACHE_COUNTERS_CACHE_LINE_SIZE, sizeof(shardcache_histogram_slot_t)) != 0)
+        return NULL;
+    slot = ptr;
+    memset(slot, 0, sizeof(shardcache_histogram_slot_t));
+    slot->min = UINT64_MAX;
+
+    // the slot might be shared with other threads
+    // (if there are more threads than slots)
+    if (!__sync_bool_compare_and_swap(&h->slots[index], NULL, slot)) {
+        free(slot);
+        slot = h->slots[index];
+    }
+    return slot;
+}
+
+void
+shardcache_histogram_record(shardcache_histogram_t *h, uint64_t value)
+{
+    shardcache_histogram_slot_t *slot = shardcache_histogram_slot(h);
+    if (!slot)
+        return;
+
+    __sync_fetch_and_add(&slot->buckets[shardcache_histogram_bucket(value)], 1);
+    __sync_fetch_and_add(&slot->sum, value);
+    __sync_fetch_and_add(&slot->count, 1);
+
+    uint64_t min = slot->min;
+    while (value < min && !__sync_bool_compare_and_swap(&slot->min, min, value))
+        min = slot->min;
+
+    uint64_t max = slot->max;
+    while (value > max && !__sync_bool_compare_and_swap(&slot->max, max, value))
+        max = slot->max;
+}
+
+void
+shardcache_histogram_merge(shardcache_histogram_t *h, shardcache_histogram_snapshot_t *snapshot)
+{
+    int i, b;
+    memset(snapshot, 0, sizeof(shardcache_histogram_snapshot_t));
+    snapshot->min = UINT64_MAX;
+
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        shardcache_histogram_slot_t *slot = __sync_fetch_and_add(&h->slots[i], 0);
+        if (!slot)
+            continue;
+        for (b = 0; b < SHARDCACHE_HISTOGRAM_NUM_BUCKETS; b++)
+            snapshot->buckets[b] += slot->buckets[b];
+        snapshot->count += slot->count;
+        snapshot->sum += slot->sum;
+        if (slot->min < snapshot->min)
+            snapshot->min = slot->min;
+        if (slot->max > snapshot->max)
+            snapshot->max = slot->max;
+    }
+
+    if (!snapshot->count)
+        snapshot->min = 0;
+}
+
+uint64_t
+shardcache_histogram_percentile(shardcache_histogram_snapshot_t *snapshot, double percentile)
+{
+    int b;
+    uint64_t total = 0;
+    for (b = 0; b < SHARDCACHE_HISTOGRAM_NUM_BUCKETS; b++)
+        total += snapshot->buckets[b];
+
+    if (!total)
+        return 0;
+
+    // the rank of the requested value (at least the first one)
+    uint64_t rank = (uint64_t)((percentile / 100.0) * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (b = 0; b < SHARDCACHE_HISTOGRAM_NUM_BUCKETS; b++) {
+        seen += snapshot->buckets[b];
+        if (seen >= rank) {
+            uint64_t value = shardcache_histogram_bucket_value(b);
+            // no point in reporting more than the highest value recorded
+            return (snapshot->max && value > snapshot->max) ? snapshot->max : value;
+        }
+    }
+
+    return snapshot->max;
+}
+
+void
+shardcache_histogram_reset(shardcache_histogram_t *h)
+{
+    int i;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        shardcache_histogram_slot_t *slot = __sync_fetch_and_add(&h->slots[i], 0);
+        if (!slot)
+            continue;
+        memset(slot->buckets, 0, sizeof(slot->buckets));
+        __sync_lock_test_and_set(&slot->count, 0);
+        __sync_lock_test_and_set(&slot->sum, 0);
+        __sync_lock_test_and_set(&slot->min, UINT64_MAX);
+        __sync_lock_test_and_set(&slot->max, 0);
+    }
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
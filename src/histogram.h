@@ -0,0 +1,86 @@
+#ifndef __SHARDCACHE_HISTOGRAM_H__
+#define __SHARDCACHE_HISTOGRAM_H__
+
+#include <stdint.h>
+
+/* Log-linear latency histograms.
+ *
+ * Values (microseconds) are counted in buckets grouped by powers of two,
+ * each power of two being split in SHARDCACHE_HISTOGRAM_SUB_BUCKETS linear
+ * sub-buckets, so the error on any reported value is below 1/16th (6.25%)
+ * while the whole range (up to SHARDCACHE_HISTOGRAM_MAX_VALUE) fits in a
+ * few hundred buckets.
+ *
+ * Like the sharded counters, each thread records into its own slot
+ * (allocated the first time the thread records a value) and the slots
+ * are merged only when the histogram is read.
+ */
+
+#define SHARDCACHE_HISTOGRAM_SUB_BITS 4
+#define SHARDCACHE_HISTOGRAM_SUB_BUCKETS (1 << SHARDCACHE_HISTOGRAM_SUB_BITS)
+#define SHARDCACHE_HISTOGRAM_MAX_BITS 36 // larger values (~19 hours) are clamped
+#define SHARDCACHE_HISTOGRAM_MAX_VALUE ((1ULL << SHARDCACHE_HISTOGRAM_MAX_BITS) - 1)
+#define SHARDCACHE_HISTOGRAM_NUM_BUCKETS \
+    ((SHARDCACHE_HISTOGRAM_MAX_BITS - SHARDCACHE_HISTOGRAM_SUB_BITS + 1) * SHARDCACHE_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct __shardcache_histogram_s shardcache_histogram_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[SHARDCACHE_HISTOGRAM_NUM_BUCKETS];
+} shardcache_histogram_snapshot_t;
+
+/*
+ * @brief Create a new histogram
+ * @return A valid shardcache_histogram_t structure, NULL in case of errors
+ */
+shardcache_histogram_t *shardcache_histogram_create();
+
+/*
+ * @brief Release all the resources used by a histogram
+ */
+void shardcache_histogram_destroy(shardcache_histogram_t *h);
+
+/*
+ * @brief Get the current time (in microseconds) from a monotonic clock
+ * @note To be used to compute the values passed to shardcache_histogram_record()
+ */
+uint64_t shardcache_histogram_now();
+
+/*
+ * @brief Record a value (in the slot owned by the calling thread)
+ * @param h     A valid shardcache_histogram_t structure
+ * @param value The value (microseconds)
+ */
+void shardcache_histogram_record(shardcache_histogram_t *h, uint64_t value);
+
+/*
+ * @brief Merge all the slots of a histogram
+ * @param h        A valid shardcache_histogram_t structure
+ * @param snapshot The structure which will hold the merged histogram
+ * @note Values recorded while merging might or might not be included
+ */
+void shardcache_histogram_merge(shardcache_histogram_t *h, shardcache_histogram_snapshot_t *snapshot);
+
+/*
+ * @brief Get the value at a given percentile
+ * @param snapshot   A merged histogram
+ * @param percentile The percentile (between 0 and 100)
+ * @return The highest value which could have been counted in the bucket
+ *         holding the requested percentile (0 if the histogram is empty)
+ */
+uint64_t shardcache_histogram_percentile(shardcache_histogram_snapshot_t *snapshot, double percentile);
+
+/*
+ * @brief Discard all the recorded values
+ * @note Values recorded concurrently by other threads might be lost
+ */
+void shardcache_histogram_reset(shardcache_histogram_t *h);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
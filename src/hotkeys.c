@@ -0,0 +1,493 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <atomic_defs.h>
+
+#include "shardcache.h"
+#include "histogram.h"
+#include "counters.h"
+#include "hotkeys.h"
+
+#define SHARDCACHE_HOTKEYS_BY_REQUESTS 0
+#define SHARDCACHE_HOTKEYS_BY_BYTES    1
+
+// open addressing (linear probing), kept at most half full
+#define SHARDCACHE_HOTKEYS_INDEX_SIZE (SHARDCACHE_HOTKEYS_CAPACITY * 2)
+#define SHARDCACHE_HOTKEYS_INDEX_MASK (SHARDCACHE_HOTKEYS_INDEX_SIZE - 1)
+
+typedef struct {
+    uint64_t hash;     // the hash of the whole key
+    char key[SHARDCACHE_HOTKEY_MAXLEN];
+    size_t klen;
+    uint64_t count;    // the (sampled) value the sketch ranks the key by
+    uint64_t error;    // the count inherited from the evicted key
+    uint64_t requests; // sampled requests since the key is tracked
+    uint64_t bytes;    // sampled bytes since the key is tracked
+    int pos;           // the position of the entry in the heap
+                       // (the slot it comes from, once copied by a reader)
+} shardcache_hotkeys_entry_t;
+
+typedef struct {
+    shardcache_hotkeys_entry_t entries[SHARDCACHE_HOTKEYS_CAPACITY];
+    int heap[SHARDCACHE_HOTKEYS_CAPACITY];              // the entries as a min-heap on the count
+    uint16_t index[SHARDCACHE_HOTKEYS_INDEX_SIZE];      // hash -> entry + 1 (0 if empty)
+    int used;
+} shardcache_hotkeys_sketch_t;
+
+// each thread updates the sketches of its own slot, so the lock
+// is contended only by the readers (or by the threads sharing the slot)
+typedef struct {
+    pthread_mutex_t lock;
+    int epoch; // the number of decays already applied to the counts
+    shardcache_hotkeys_sketch_t sketches[2];
+} shardcache_hotkeys_slot_t;
+
+struct __shardcache_hotkeys_s {
+    int sample_rate;
+    pthread_mutex_t lock;  // serializes the decays, the resets and the readers
+    shardcache_hotkeys_slot_t *slots[SHARDCACHE_COUNTERS_SLOTS]; // allocated on the first sample
+    int epoch;             // incremented each time the counts are halved
+    uint64_t window;       // the (decayed) observation window up to last_decay (usecs)
+    uint64_t last_decay;   // when the counts have been last halved (usecs)
+};
+
+static __thread uint64_t shardcache_hotkeys_seed = 0;
+
+// xorshift64*, cheap enough to be called for each request
+static inline uint64_t
+shardcache_hotkeys_random()
+{
+    uint64_t x = shardcache_hotkeys_seed;
+    if (!x)
+        x = (uint64_t)(uintptr_t)&shardcache_hotkeys_seed ^ shardcache_histogram_now();
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    shardcache_hotkeys_seed = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// FNV-1a
+static inline uint64_t
+shardcache_hotkeys_hash(void *key, size_t klen)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned char *p = (unsigned char *)key;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+shardcache_hotkeys_t *
+shardcache_hotkeys_create(int sample_rate)
+{
+    shardcache_hotkeys_t *hk = calloc(1, sizeof(shardcache_hotkeys_t));
+    if (!hk)
+        return NULL;
+    hk->sample_rate = sample_rate;
+    hk->last_decay = shardcache_histogram_now();
+    pthread_mutex_init(&hk->lock, NULL);
+    return hk;
+}
+
+void
+shardcache_hotkeys_destroy(shardcache_hotkeys_t *hk)
+{
+    int i;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        if (hk->slots[i]) {
+            pthread_mutex_destroy(&hk->slots[i]->lock);
+            free(hk->slots[i]);
+        }
+    }
+    pthread_mutex_destroy(&hk->lock);
+    free(hk);
+}
+
+static inline void
+shardcache_hotkeys_heap_swap(shardcache_hotkeys_sketch_t *sketch, int a, int b)
+{
+    int ea = sketch->heap[a];
+    int eb = sketch->heap[b];
+    sketch->heap[a] = eb;
+    sketch->heap[b] = ea;
+    sketch->entries[eb].pos = a;
+    sketch->entries[ea].pos = b;
+}
+
+#define HEAP_COUNT(__s, __p) ((__s)->entries[(__s)->heap[(__p)]].count)
+
+static void
+shardcache_hotkeys_heap_up(shardcache_hotkeys_sketch_t *sketch, int pos)
+{
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (HEAP_COUNT(sketch, parent) <= HEAP_COUNT(sketch, pos))
+            break;
+        shardcache_hotkeys_heap_swap(sketch, pos, parent);
+        pos = parent;
+    }
+}
+
+static void
+shardcache_hotkeys_heap_down(shardcache_hotkeys_sketch_t *sketch, int pos)
+{
+    for (;;) {
+        int left = pos * 2 + 1;
+        int right = left + 1;
+        int min = pos;
+        if (left < sketch->used && HEAP_COUNT(sketch, left) < HEAP_COUNT(sketch, min))
+            min = left;
+        if (right < sketch->used && HEAP_COUNT(sketch, right) < HEAP_COUNT(sketch, min))
+            min = right;
+        if (min == pos)
+            break;
+        shardcache_hotkeys_heap_swap(sketch, pos, min);
+        pos = min;
+    }
+}
+
+static int
+shardcache_hotkeys_index_find(shardcache_hotkeys_sketch_t *sketch, uint64_t hash, size_t klen)
+{
+    int i = hash & SHARDCACHE_HOTKEYS_INDEX_MASK;
+    while (sketch->index[i]) {
+        shardcache_hotkeys_entry_t *entry = &sketch->entries[sketch->index[i] - 1];
+        if (entry->hash == hash && entry->klen == klen)
+            return sketch->index[i] - 1;
+        i = (i + 1) & SHARDCACHE_HOTKEYS_INDEX_MASK;
+    }
+    return -1;
+}
+
+static void
+shardcache_hotkeys_index_add(shardcache_hotkeys_sketch_t *sketch, uint64_t hash, int n)
+{
+    int i = hash & SHARDCACHE_HOTKEYS_INDEX_MASK;
+    while (sketch->index[i])
+        i = (i + 1) & SHARDCACHE_HOTKEYS_INDEX_MASK;
+    sketch->index[i] = n + 1;
+}
+
+static void
+shardcache_hotkeys_index_remove(shardcache_hotkeys_sketch_t *sketch, uint64_t hash, int n)
+{
+    int i = hash & SHARDCACHE_HOTKEYS_INDEX_MASK;
+    while (sketch->index[i] != n + 1)
+        i = (i + 1) & SHARDCACHE_HOTKEYS_INDEX_MASK;
+    sketch->index[i] = 0;
+
+    // move back the entries following the hole which can't
+    // be found anymore by probing from their home position
+    int j = i;
+    for (;;) {
+        j = (j + 1) & SHARDCACHE_HOTKEYS_INDEX_MASK;
+        if (!sketch->index[j])
+            break;
+        int home = sketch->entries[sketch->index[j] - 1].hash & SHARDCACHE_HOTKEYS_INDEX_MASK;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            sketch->index[i] = sketch->index[j];
+            sketch->index[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static void
+shardcache_hotkeys_sketch_update(shardcache_hotkeys_sketch_t *sketch,
+                                 uint64_t hash,
+                                 void *key,
+                                 size_t klen,
+                                 uint64_t weight,
+                                 size_t bytes)
+{
+    shardcache_hotkeys_entry_t *entry;
+    int n = shardcache_hotkeys_index_find(sketch, hash, klen);
+    if (n >= 0) {
+        entry = &sketch->entries[n];
+    } else {
+        if (sketch->used < SHARDCACHE_HOTKEYS_CAPACITY) {
+            n = sketch->used;
+            entry = &sketch->entries[n];
+            entry->count = 0;
+            entry->error = 0;
+            entry->pos = sketch->used++;
+            sketch->heap[entry->pos] = n;
+            shardcache_hotkeys_heap_up(sketch, entry->pos);
+        } else {
+            // replace the key with the lowest count
+            n = sketch->heap[0];
+            entry = &sketch->entries[n];
+            shardcache_hotkeys_index_remove(sketch, entry->hash, n);
+            entry->error = entry->count;
+        }
+        entry->hash = hash;
+        entry->klen = klen;
+        memcpy(entry->key, key, klen < sizeof(entry->key) ? klen : sizeof(entry->key));
+        entry->requests = 0;
+        entry->bytes = 0;
+        shardcache_hotkeys_index_add(sketch, hash, n);
+    }
+
+    entry->count += weight;
+    entry->requests++;
+    entry->bytes += bytes;
+    shardcache_hotkeys_heap_down(sketch, entry->pos);
+}
+
+// applies the decays which happened since the slot has been last updated
+// (halving all the counts preserves the order of the heap)
+static void
+shardcache_hotkeys_slot_decay(shardcache_hotkeys_slot_t *slot, int epoch)
+{
+    int shift = epoch - slot->epoch;
+    if (!shift)
+        return;
+    if (shift > 63)
+        shift = 63;
+
+    int s, i;
+    for (s = 0; s < 2; s++) {
+        shardcache_hotkeys_sketch_t *sketch = &slot->sketches[s];
+        for (i = 0; i < sketch->used; i++) {
+            shardcache_hotkeys_entry_t *entry = &sketch->entries[i];
+            entry->count >>= shift;
+            entry->error >>= shift;
+            entry->requests >>= shift;
+            entry->bytes >>= shift;
+        }
+    }
+    slot->epoch = epoch;
+}
+
+static shardcache_hotkeys_slot_t *
+shardcache_hotkeys_slot(shardcache_hotkeys_t *hk)
+{
+    int index = shardcache_counters_thread_slot();
+    shardcache_hotkeys_slot_t *slot = ATOMIC_READ(hk->slots[index]);
+    if (slot)
+        return slot;
+
+    slot = calloc(1, sizeof(shardcache_hotkeys_slot_t));
+    if (!slot)
+        return NULL;
+    pthread_mutex_init(&slot->lock, NULL);
+    slot->epoch = ATOMIC_READ(hk->epoch);
+    if (!ATOMIC_CAS(hk->slots[index], NULL, slot)) {
+        // another thread sharing the slot got there first
+        pthread_mutex_destroy(&slot->lock);
+        free(slot);
+        slot = ATOMIC_READ(hk->slots[index]);
+    }
+    return slot;
+}
+
+void
+shardcache_hotkeys_sample(shardcache_hotkeys_t *hk, void *key, size_t klen, size_t bytes)
+{
+    int sample_rate = ATOMIC_READ(hk->sample_rate);
+    if (!sample_rate || (sample_rate > 1 && shardcache_hotkeys_random() % sample_rate != 0))
+        return;
+
+    uint64_t now = shardcache_histogram_now();
+    if (now - ATOMIC_READ(hk->last_decay) >= (uint64_t)SHARDCACHE_HOTKEYS_DECAY_INTERVAL * 1000000) {
+        pthread_mutex_lock(&hk->lock);
+        if (now - hk->last_decay >= (uint64_t)SHARDCACHE_HOTKEYS_DECAY_INTERVAL * 1000000) {
+            // the slots halve their counts lazily (on their next update or read)
+            hk->window = (hk->window + (now - hk->last_decay)) / 2;
+            ATOMIC_SET(hk->last_decay, now);
+            ATOMIC_INCREMENT(hk->epoch);
+        }
+        pthread_mutex_unlock(&hk->lock);
+    }
+
+    shardcache_hotkeys_slot_t *slot = shardcache_hotkeys_slot(hk);
+    if (!slot)
+        return;
+
+    uint64_t hash = shardcache_hotkeys_hash(key, klen);
+
+    pthread_mutex_lock(&slot->lock);
+
+    shardcache_hotkeys_slot_decay(slot, ATOMIC_READ(hk->epoch));
+
+    shardcache_hotkeys_sketch_update(&slot->sketches[SHARDCACHE_HOTKEYS_BY_REQUESTS],
+                                     hash, key, klen, 1, bytes);
+    // a request without bytes would only make the bytes sketch evict keys
+    if (bytes)
+        shardcache_hotkeys_sketch_update(&slot->sketches[SHARDCACHE_HOTKEYS_BY_BYTES],
+                                         hash, key, klen, bytes, bytes);
+
+    pthread_mutex_unlock(&slot->lock);
+}
+
+// must be called holding hk->lock
+static void
+shardcache_hotkeys_clear(shardcache_hotkeys_t *hk)
+{
+    int i;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        shardcache_hotkeys_slot_t *slot = ATOMIC_READ(hk->slots[i]);
+        if (!slot)
+            continue;
+        pthread_mutex_lock(&slot->lock);
+        memset(slot->sketches, 0, sizeof(slot->sketches));
+        pthread_mutex_unlock(&slot->lock);
+    }
+    hk->window = 0;
+    ATOMIC_SET(hk->last_decay, shardcache_histogram_now());
+}
+
+int
+shardcache_hotkeys_set_sample_rate(shardcache_hotkeys_t *hk, int new_value)
+{
+    int old_value = ATOMIC_READ(hk->sample_rate);
+    if (new_value >= 0 && new_value != old_value) {
+        // counts sampled at different rates can't be compared
+        pthread_mutex_lock(&hk->lock);
+        ATOMIC_SET(hk->sample_rate, new_value);
+        shardcache_hotkeys_clear(hk);
+        pthread_mutex_unlock(&hk->lock);
+    }
+    return old_value;
+}
+
+static int
+shardcache_hotkeys_entry_cmp_key(const void *a, const void *b)
+{
+    const shardcache_hotkeys_entry_t *ea = (const shardcache_hotkeys_entry_t *)a;
+    const shardcache_hotkeys_entry_t *eb = (const shardcache_hotkeys_entry_t *)b;
+    if (ea->hash != eb->hash)
+        return (ea->hash < eb->hash) ? -1 : 1;
+    return (ea->klen < eb->klen) ? -1 : (ea->klen > eb->klen) ? 1 : 0;
+}
+
+static int
+shardcache_hotkeys_entry_cmp(const void *a, const void *b)
+{
+    const shardcache_hotkeys_entry_t *ea = (const shardcache_hotkeys_entry_t *)a;
+    const shardcache_hotkeys_entry_t *eb = (const shardcache_hotkeys_entry_t *)b;
+    return (ea->count < eb->count) ? 1 : (ea->count > eb->count) ? -1 : 0;
+}
+
+// merges the entries of the same key coming from different slots.
+// A full sketch not tracking a key might have seen it up to its lowest
+// count times, so (as when merging Space-Saving sketches) the lowest counts
+// of those sketches are added to both the count and the error of the key
+static int
+shardcache_hotkeys_merge(shardcache_hotkeys_entry_t *entries, int num_entries, uint64_t *min_counts)
+{
+    uint64_t total_min = 0;
+    int i, n;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++)
+        total_min += min_counts[i];
+
+    qsort(entries, num_entries, sizeof(shardcache_hotkeys_entry_t), shardcache_hotkeys_entry_cmp_key);
+
+    int merged = 0;
+    for (i = 0; i < num_entries; i = n) {
+        shardcache_hotkeys_entry_t *entry = &entries[merged++];
+        if (entry != &entries[i])
+            memcpy(entry, &entries[i], sizeof(shardcache_hotkeys_entry_t));
+        uint64_t tracked_min = min_counts[entries[i].pos];
+        for (n = i + 1; n < num_entries && shardcache_hotkeys_entry_cmp_key(&entries[i], &entries[n]) == 0; n++) {
+            entry->count += entries[n].count;
+            entry->error += entries[n].error;
+            entry->requests += entries[n].requests;
+            entry->bytes += entries[n].bytes;
+            tracked_min += min_counts[entries[n].pos];
+        }
+        entry->count += total_min - tracked_min;
+        entry->error += total_min - tracked_min;
+    }
+    return merged;
+}
+
+int
+shardcache_hotkeys_top(shardcache_hotkeys_t *hk, int by_bytes, shardcache_hotkey_t *out, int max)
+{
+    int s = by_bytes ? SHARDCACHE_HOTKEYS_BY_BYTES : SHARDCACHE_HOTKEYS_BY_REQUESTS;
+    int i, num_slots = 0;
+
+    pthread_mutex_lock(&hk->lock);
+
+    // the slots allocated in the meanwhile (by the sampling threads)
+    // are left out, the entries array can't hold them
+    shardcache_hotkeys_slot_t *slots[SHARDCACHE_COUNTERS_SLOTS];
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        slots[i] = ATOMIC_READ(hk->slots[i]);
+        if (slots[i])
+            num_slots++;
+    }
+
+    shardcache_hotkeys_entry_t *entries = NULL;
+    if (num_slots) {
+        entries = malloc(sizeof(shardcache_hotkeys_entry_t) * SHARDCACHE_HOTKEYS_CAPACITY * num_slots);
+        if (!entries) {
+            pthread_mutex_unlock(&hk->lock);
+            return 0;
+        }
+    }
+
+    uint64_t min_counts[SHARDCACHE_COUNTERS_SLOTS];
+    int num_entries = 0;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        shardcache_hotkeys_slot_t *slot = slots[i];
+        min_counts[i] = 0;
+        if (!slot)
+            continue;
+        pthread_mutex_lock(&slot->lock);
+        shardcache_hotkeys_slot_decay(slot, ATOMIC_READ(hk->epoch));
+        shardcache_hotkeys_sketch_t *sketch = &slot->sketches[s];
+        if (sketch->used == SHARDCACHE_HOTKEYS_CAPACITY)
+            min_counts[i] = HEAP_COUNT(sketch, 0);
+        int n;
+        for (n = 0; n < sketch->used; n++) {
+            memcpy(&entries[num_entries], &sketch->entries[n], sizeof(shardcache_hotkeys_entry_t));
+            entries[num_entries++].pos = i;
+        }
+        pthread_mutex_unlock(&slot->lock);
+    }
+
+    uint64_t window = hk->window + (shardcache_histogram_now() - hk->last_decay);
+    uint64_t sample_rate = ATOMIC_READ(hk->sample_rate);
+    pthread_mutex_unlock(&hk->lock);
+
+    if (!sample_rate)
+        sample_rate = 1;
+
+    num_entries = shardcache_hotkeys_merge(entries, num_entries, min_counts);
+    qsort(entries, num_entries, sizeof(shardcache_hotkeys_entry_t), shardcache_hotkeys_entry_cmp);
+
+    for (i = 0; i < num_entries && i < max; i++) {
+        shardcache_hotkeys_entry_t *entry = &entries[i];
+        shardcache_hotkey_t *hot = &out[i];
+        memcpy(hot->key, entry->key, entry->klen < sizeof(hot->key) ? entry->klen : sizeof(hot->key));
+        hot->klen = entry->klen;
+        // the ranking value comes from the sketch (an upper bound),
+        // the other one is what has been seen since the key is tracked
+        hot->requests = (by_bytes ? entry->requests : entry->count) * sample_rate;
+        hot->bytes = (by_bytes ? entry->count : entry->bytes) * sample_rate;
+        hot->error = entry->error * sample_rate;
+        hot->rate = window ? (uint64_t)((double)entry->count * sample_rate * 1000000 / window) : 0;
+    }
+
+    free(entries);
+    return i;
+}
+
+void
+shardcache_hotkeys_reset(shardcache_hotkeys_t *hk)
+{
+    pthread_mutex_lock(&hk->lock);
+    shardcache_hotkeys_clear(hk);
+    pthread_mutex_unlock(&hk->lock);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,83 @@
+#ifndef __SHARDCACHE_HOTKEYS_H__
+#define __SHARDCACHE_HOTKEYS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "shardcache.h"
+
+/* Heavy-hitters (hot keys) tracking.
+ *
+ * Two Space-Saving sketches hold the keys requested most often and the keys
+ * moving most bytes. Each sketch tracks at most SHARDCACHE_HOTKEYS_CAPACITY
+ * keys: a key not yet tracked replaces the one with the lowest count and
+ * inherits its count (which becomes the error bound of the new key).
+ *
+ * Only one request out of sample_rate (picked randomly by each thread) is
+ * looked at. Each thread updates the sketches of its own slot (see
+ * shardcache_counters_thread_slot()), found through a hashed index and
+ * kept as a min-heap on the counts, so a sampled request costs a lookup and
+ * a few swaps under a lock which only the readers contend. The readers
+ * merge the sketches of all the slots, adding to the error of a key the
+ * lowest counts of the full sketches which don't track it. The reported
+ * values are scaled back by the sample rate.
+ *
+ * The counts are halved every SHARDCACHE_HOTKEYS_DECAY_INTERVAL seconds, so
+ * the ranking follows the recent traffic. The rates are computed over the
+ * same (decayed) observation window.
+ */
+
+#define SHARDCACHE_HOTKEYS_CAPACITY 128
+#define SHARDCACHE_HOTKEYS_DECAY_INTERVAL 60
+
+typedef struct __shardcache_hotkeys_s shardcache_hotkeys_t;
+
+/*
+ * @brief Create a new hot keys tracker
+ * @param sample_rate Look at one request out of sample_rate (0 disables the tracker)
+ * @return A valid shardcache_hotkeys_t structure, NULL in case of errors
+ */
+shardcache_hotkeys_t *shardcache_hotkeys_create(int sample_rate);
+
+/*
+ * @brief Release all the resources used by a hot keys tracker
+ */
+void shardcache_hotkeys_destroy(shardcache_hotkeys_t *hk);
+
+/*
+ * @brief Account a request
+ * @param hk    A valid shardcache_hotkeys_t structure
+ * @param key   The key
+ * @param klen  The length of the key
+ * @param bytes The size of the value read or written (0 if unknown)
+ * @note Cheap for the requests which are not sampled (most of them)
+ */
+void shardcache_hotkeys_sample(shardcache_hotkeys_t *hk, void *key, size_t klen, size_t bytes);
+
+/*
+ * @brief Get/Set the sample rate
+ * @param new_value The new sample rate (-1 to leave it unchanged)
+ * @return The previous sample rate
+ * @note Changing the sample rate resets the tracker
+ */
+int shardcache_hotkeys_set_sample_rate(shardcache_hotkeys_t *hk, int new_value);
+
+/*
+ * @brief Get the hottest keys
+ * @param hk       A valid shardcache_hotkeys_t structure
+ * @param by_bytes If true rank the keys by bytes instead of by requests
+ * @param out      The array which will hold the keys (hottest first)
+ * @param max      The size of the out array
+ * @return The number of keys stored in the out array
+ */
+int shardcache_hotkeys_top(shardcache_hotkeys_t *hk, int by_bytes, shardcache_hotkey_t *out, int max);
+
+/*
+ * @brief Forget all the keys tracked so far
+ */
+void shardcache_hotkeys_reset(shardcache_hotkeys_t *hk);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
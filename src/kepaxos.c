@@ -4,16 +4,30 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <arpa/inet.h>
 
 #include "shardcache.h" // for SHC_DEBUG*()
-#include "shardcache_internal.h" // for KEY2STR()
+#include "shardcache_internal.h" // for KEYFMT()
+
+#ifndef HAVE_UINT64_T
+#define HAVE_UINT64_T
+#endif
+#include <siphash.h>
 
 #define MAX(a, b) ( (a) > (b) ? (a) : (b) )
 #define MIN(a, b) ( (a) < (b) ? (a) : (b) )
 
 #define KEPAXOS_CMD_TTL 30 // default to 30 seconds
 
+#define KEPAXOS_KEY_LOCKS 256 // number of stripes the per-key locks are spread over
+
+#define KEPAXOS_EXPIRE_INTERVAL 50 // milliseconds between two runs of the expirer
+
+// backoff between the attempts to reopen the log after a failed write (milliseconds)
+#define KEPAXOS_LOG_RETRY_MIN 100
+#define KEPAXOS_LOG_RETRY_MAX 10000
+
 #define BALLOT2NODE(__k, __b) (__k)->peers[ (__b) & 0x00000000000000FF ]
 #define BALLOT2NODEINDEX(__b) (__b) & 0x00000000000000FF
 #define IS_MY_BALLOT(__k, __b) ((__k)->my_index == ((__b) & 0x00000000000000FF))
@@ -88,13 +102,25 @@ struct __kepaxos_s {
     int num_peers;
     unsigned char my_index;
     kepaxos_callbacks_t callbacks;
-    pthread_mutex_t lock;
+    pthread_mutex_t lock; // protects the context-wide state (the ballot reset)
+    // commands on different keys can proceed in parallel,
+    // only the commands on keys mapped to the same stripe are serialized
+    pthread_mutex_t key_locks[KEPAXOS_KEY_LOCKS];
     uint64_t ballot;
     pthread_t expirer;
     int quit;
     int timeout;
 };
 
+static unsigned char kepaxos_key_lock_seed[16] = "kepaxos_keylock0";
+
+static inline pthread_mutex_t *
+kepaxos_key_lock(kepaxos_t *ke, void *key, size_t klen)
+{
+    uint64_t hash = sip_hash24(kepaxos_key_lock_seed, key, klen);
+    return &ke->key_locks[hash % KEPAXOS_KEY_LOCKS];
+}
+
 static void
 kepaxos_command_destroy(kepaxos_cmd_t *c)
 {
@@ -144,13 +170,46 @@ kepaxos_expire_command(hashtable_t *table,
     return 1;
 }
 
+// a failed write leaves the log unusable (all the commits fail) until it's reopened.
+// The first attempt is immediate, the following ones back off exponentially and the
+// backoff is reset only once the log stayed writable for as long as the last delay
+// (so that a disk which keeps failing doesn't make us reopen the log in a tight loop)
+static void
+kepaxos_recover_log(kepaxos_t *ke, int *delay, int *wait)
+{
+    int err = kepaxos_log_error(ke->log);
+
+    if (*wait > 0) {
+        *wait -= KEPAXOS_EXPIRE_INTERVAL;
+        return;
+    }
+
+    if (!err) {
+        *delay = 0;
+        return;
+    }
+
+    *delay = *delay ? MIN(*delay * 2, KEPAXOS_LOG_RETRY_MAX) : KEPAXOS_LOG_RETRY_MIN;
+    *wait = *delay;
+
+    if (kepaxos_log_reopen(ke->log) == 0) {
+        SHC_NOTICE("Reopened the replica log after a failed write (%s)", strerror(err));
+    } else {
+        SHC_ERROR("Can't reopen the replica log after a failed write (%s), retrying in %d ms",
+                  strerror(err), *delay);
+    }
+}
+
 static void *
 kepaxos_expire_commands(void *priv)
 {
     kepaxos_t *ke = (kepaxos_t *)priv;
+    int delay = 0;
+    int wait = 0;
     while (!ATOMIC_READ(ke->quit)) {
         ht_foreach_pair(ke->commands, kepaxos_expire_command, ke);
-        usleep(50000);
+        kepaxos_recover_log(ke, &delay, &wait);
+        usleep(KEPAXOS_EXPIRE_INTERVAL * 1000);
     }
     return NULL;
 }
@@ -219,6 +278,8 @@ kepaxos_context_create(char *dbfile,
               ke->num_peers, ke->ballot);
 
     MUTEX_INIT(&ke->lock);
+    for (i = 0; i < KEPAXOS_KEY_LOCKS; i++)
+        MUTEX_INIT(&ke->key_locks[i]);
 
     if (pthread_create(&ke->expirer, NULL, kepaxos_expire_commands, ke) != 0) {
         kepaxos_log_destroy(ke->log);
@@ -227,6 +288,8 @@ kepaxos_context_create(char *dbfile,
         free(ke->peers);
         ht_destroy(ke->commands);
         MUTEX_DESTROY(&ke->lock);
+        for (i = 0; i < KEPAXOS_KEY_LOCKS; i++)
+            MUTEX_DESTROY(&ke->key_locks[i]);
         free(ke->dbfile);
         free(ke);
         return NULL;
@@ -250,6 +313,8 @@ kepaxos_context_destroy(kepaxos_t *ke)
     ht_destroy(ke->commands);
 
     MUTEX_DESTROY(&ke->lock);
+    for (i = 0; i < KEPAXOS_KEY_LOCKS; i++)
+        MUTEX_DESTROY(&ke->key_locks[i]);
 
     free(ke->dbfile);
     free(ke);
@@ -344,12 +409,8 @@ kepaxos_send_preaccept(kepaxos_t *ke, uint64_t ballot, void *key, size_t klen, u
                                           0, ballot, key, klen, NULL, 0, seq, 0);
     int rc = ke->callbacks.send(receivers, ke->num_peers-1, (void *)msg, msglen, ke->callbacks.priv);
     free(msg);
-    if (shardcache_log_level() >= LOG_DEBUG) {
-        char keystr[1024];
-        KEY2STR(key, klen, keystr, sizeof(keystr));
-        SHC_DEBUG("pre_accept sent to %d peers for key %s (cmd: %02x, seq: %lu, ballot: %lu)",
-                  n, keystr, seq, ballot);
-    }
+    SHC_DEBUG("pre_accept sent to %d peers for key %.*s (seq: %lu, ballot: %lu)",
+              n, KEYFMT(key, klen), seq, ballot);
 
     return rc;
 }
@@ -408,26 +469,24 @@ kepaxos_run_command(kepaxos_t *ke,
                     void *data,
                     size_t dlen)
 {
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, key, klen);
+
     // Replica R1 receives a new set/del/evict request for key K
-    MUTEX_LOCK(&ke->lock);
+    MUTEX_LOCK(klock);
     uint64_t last_seq = kepaxos_last_seq_for_key(ke->log, key, klen, NULL);
 
     kepaxos_cmd_t *cmd = kepaxos_command_create(ke, last_seq, type, key, klen, data, dlen);
 
     uint64_t seq = cmd->seq;
     uint64_t ballot = cmd->ballot;
-    MUTEX_UNLOCK(&ke->lock);
+    MUTEX_UNLOCK(klock);
 
-    if (shardcache_log_level() >= LOG_DEBUG) {
-        char keystr[1024];
-        KEY2STR(key, klen, keystr, sizeof(keystr));
-        SHC_DEBUG("New kepaxos command for key %s (cmd: %02x, seq: %lu, ballot: %lu)",
-                  keystr, type, seq, ballot);
-    }
+    SHC_DEBUG("New kepaxos command for key %.*s (cmd: %02x, seq: %lu, ballot: %lu)",
+              KEYFMT(key, klen), type, seq, ballot);
 
     int rc = kepaxos_send_preaccept(ke, ballot, key, klen, seq);
 
-    MUTEX_LOCK(&ke->lock);
+    MUTEX_LOCK(klock);
 
     if (rc >= 0) {
         kepaxos_cmd_t *now_cmd = (kepaxos_cmd_t *)ht_get(ke->commands, key, klen, NULL);
@@ -436,10 +495,10 @@ kepaxos_run_command(kepaxos_t *ke,
             // let's wait for its completion (either success or failure)
             MUTEX_LOCK(&cmd->lock);
             cmd->waiting = 1;
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             pthread_cond_wait(&cmd->condition, &cmd->lock);
             MUTEX_UNLOCK(&cmd->lock);
-            MUTEX_LOCK(&ke->lock);
+            MUTEX_LOCK(klock);
             kepaxos_command_free(cmd);
         }
     }
@@ -448,7 +507,7 @@ kepaxos_run_command(kepaxos_t *ke,
     // equal or greater than the seq we tried to commit
     uint64_t current_seq = kepaxos_last_seq_for_key(ke->log, key, klen, NULL);
 
-    MUTEX_UNLOCK(&ke->lock);
+    MUTEX_UNLOCK(klock);
 
     return (current_seq >= seq) ? 0 : -1;
 }
@@ -477,15 +536,23 @@ kepaxos_send_commit(kepaxos_t *ke, kepaxos_cmd_t *cmd)
 static inline int
 kepaxos_commit(kepaxos_t *ke, kepaxos_cmd_t *cmd)
 {
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, cmd->key, cmd->klen);
+
     int rc = ke->callbacks.commit(cmd->type, cmd->key, cmd->klen, cmd->data, cmd->dlen, 1, ke->callbacks.priv);
     if (rc == 0) {
-        MUTEX_LOCK(&ke->lock);
-        kepaxos_set_last_seq_for_key(ke->log, cmd->key, cmd->klen, cmd->ballot, cmd->seq);
-        MUTEX_UNLOCK(&ke->lock);
-        rc = kepaxos_send_commit(ke, cmd);
+        MUTEX_LOCK(klock);
+        rc = kepaxos_set_last_seq_for_key(ke->log, cmd->key, cmd->klen, cmd->ballot, cmd->seq);
+        MUTEX_UNLOCK(klock);
+        if (rc == 0) {
+            rc = kepaxos_send_commit(ke, cmd);
+        } else {
+            // the seq hasn't been recorded hence kepaxos_run_command() fails
+            // and the commit is not propagated, the expirer reopens the log
+            SHC_ERROR("Can't record the commit for key %.*s (seq: %lu, ballot: %lu)",
+                      KEYFMT(cmd->key, cmd->klen), cmd->seq, cmd->ballot);
+        }
     }
     kepaxos_command_destroy(cmd);
-    // TODO - recovery if commit failed? try again?
     return rc;
 }
 
@@ -581,14 +648,16 @@ kepaxos_parse_message(char *msg,
 static inline int
 kepaxos_handle_preaccept(kepaxos_t *ke, kepaxos_msg_t *msg, void **response, size_t *response_len)
 {
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, msg->key, msg->klen);
+
     // Any replica R receiving a PRE_ACCEPT(BALLOT, K, SEQ) from R1
-    MUTEX_LOCK(&ke->lock);
+    MUTEX_LOCK(klock);
     uint64_t local_ballot = 0;
     uint64_t local_seq = kepaxos_last_seq_for_key(ke->log, msg->key, msg->klen, &local_ballot);
 
     if (local_seq == msg->seq && local_ballot == msg->ballot) {
         // ignore this message ... we already have committed this command
-        MUTEX_UNLOCK(&ke->lock);
+        MUTEX_UNLOCK(klock);
         return -1;
     }
 
@@ -597,7 +666,7 @@ kepaxos_handle_preaccept(kepaxos_t *ke, kepaxos_msg_t *msg, void **response, siz
     if (cmd) {
         if (msg->ballot < cmd->ballot) {
             // ignore this message ... the ballot is too old
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return -1;
         }
         MUTEX_LOCK(&cmd->lock);
@@ -630,7 +699,7 @@ kepaxos_handle_preaccept(kepaxos_t *ke, kepaxos_msg_t *msg, void **response, siz
     }
     int committed = (max_seq == local_seq);
     uint64_t ballot = cmd->ballot;
-    MUTEX_UNLOCK(&ke->lock);
+    MUTEX_UNLOCK(klock);
 
     *response_len = kepaxos_build_message((char **)response, ke->peers[ke->my_index], KEPAXOS_MSG_TYPE_PRE_ACCEPT_RESPONSE,
                                           0, ballot, msg->key, msg->klen, NULL, 0, max_seq, committed);
@@ -640,15 +709,17 @@ kepaxos_handle_preaccept(kepaxos_t *ke, kepaxos_msg_t *msg, void **response, siz
 static inline int
 kepaxos_handle_preaccept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
 {
-    MUTEX_LOCK(&ke->lock);
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, msg->key, msg->klen);
+
+    MUTEX_LOCK(klock);
     kepaxos_cmd_t *cmd = (kepaxos_cmd_t *)ht_get(ke->commands, msg->key, msg->klen, NULL);
     if (cmd) {
         if (msg->ballot < cmd->ballot) {
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return -1;
         }
         if (cmd->status != KEPAXOS_CMD_STATUS_PRE_ACCEPTED) {
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return -1;
         }
         MUTEX_LOCK(&cmd->lock);
@@ -670,7 +741,7 @@ kepaxos_handle_preaccept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
         MUTEX_UNLOCK(&cmd->lock);
 
         if (cmd->num_votes < ke->num_peers/2) {
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return 0; // we don't have a quorum yet
         }
         if (cmd->seq > cmd->max_seq || (cmd->seq == cmd->max_seq && !cmd->max_seq_committed))
@@ -678,7 +749,7 @@ kepaxos_handle_preaccept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
             // commit (short path)
             void *cmd_ptr = NULL;
             ht_delete(ke->commands, msg->key, msg->klen, &cmd_ptr, NULL);
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             if (cmd_ptr == cmd)
                 return kepaxos_commit(ke, cmd);
             return -1;
@@ -696,21 +767,23 @@ kepaxos_handle_preaccept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
             uint64_t new_seq = cmd->seq;
             cmd->status = KEPAXOS_CMD_STATUS_ACCEPTED;
             MUTEX_UNLOCK(&cmd->lock);
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return kepaxos_send_accept(ke, ballot, msg->key, msg->klen, new_seq);
         }
     }
-    MUTEX_UNLOCK(&ke->lock);
+    MUTEX_UNLOCK(klock);
     return 0;
 }
 
 static inline int
 kepaxos_handle_accept(kepaxos_t *ke, kepaxos_msg_t *msg, void *response, size_t *response_len)
 {
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, msg->key, msg->klen);
+
     // Any replica R receiving an ACCEPT(BALLOT, K, SEQ) from R1
     uint64_t accepted_ballot = msg->ballot;
     uint64_t accepted_seq = msg->seq;
-    MUTEX_LOCK(&ke->lock);
+    MUTEX_LOCK(klock);
 
     uint64_t local_ballot = 0;
     uint64_t local_seq = kepaxos_last_seq_for_key(ke->log, msg->key, msg->klen, &local_ballot);
@@ -719,7 +792,7 @@ kepaxos_handle_accept(kepaxos_t *ke, kepaxos_msg_t *msg, void *response, size_t
     if (cmd) {
         if (msg->ballot < cmd->ballot) {
             // ignore this message
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return 0;
         }
         if (msg->seq < cmd->seq) {
@@ -746,13 +819,11 @@ kepaxos_handle_accept(kepaxos_t *ke, kepaxos_msg_t *msg, void *response, size_t
     }
     // inform the sender if we have already committed this seq
     int committed = (accepted_seq == local_seq);
-    MUTEX_UNLOCK(&ke->lock);
-    if (shardcache_log_level() >= LOG_DEBUG && msg->key) {
-        char keystr[1024];
-        KEY2STR(msg->key, msg->klen, keystr, sizeof(keystr));
-        SHC_DEBUG("%s accepted %llu (%d) ballot: %llu for key %s to peer %s\n",
-                  ke->peers[ke->my_index], accepted_seq, committed, accepted_ballot, keystr, msg->peer);
-    }
+    MUTEX_UNLOCK(klock);
+    if (msg->key)
+        SHC_DEBUG("%s accepted %llu (%d) ballot: %llu for key %.*s to peer %s\n",
+                  ke->peers[ke->my_index], accepted_seq, committed, accepted_ballot,
+                  KEYFMT(msg->key, msg->klen), msg->peer);
     *response_len = kepaxos_build_message((char **)response, ke->peers[ke->my_index], KEPAXOS_MSG_TYPE_ACCEPT_RESPONSE,
                                           0, accepted_ballot, msg->key, msg->klen, NULL, 0, accepted_seq, committed);
     return 0;
@@ -761,22 +832,21 @@ kepaxos_handle_accept(kepaxos_t *ke, kepaxos_msg_t *msg, void *response, size_t
 static inline int
 kepaxos_handle_accept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
 {
-    if (shardcache_log_level() >= LOG_DEBUG && msg->key) {
-        char keystr[1024];
-        KEY2STR(msg->key, msg->klen, keystr, sizeof(keystr));
-        SHC_DEBUG("pre_accept response received for key %s (seq: %lu, ballot: %lu)",
-                  keystr, msg->seq, msg->ballot);
-    }
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, msg->key, msg->klen);
 
-    MUTEX_LOCK(&ke->lock);
+    if (msg->key)
+        SHC_DEBUG("pre_accept response received for key %.*s (seq: %lu, ballot: %lu)",
+                  KEYFMT(msg->key, msg->klen), msg->seq, msg->ballot);
+
+    MUTEX_LOCK(klock);
     kepaxos_cmd_t *cmd = (kepaxos_cmd_t *)ht_get(ke->commands, msg->key, msg->klen, NULL);
     if (cmd) {
         if (msg->ballot < cmd->ballot) {
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return -1;
         }
         if (cmd->status != KEPAXOS_CMD_STATUS_ACCEPTED) {
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return -1;
         }
 
@@ -794,7 +864,7 @@ kepaxos_handle_accept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
             cmd->max_voter = NULL;
             MUTEX_UNLOCK(&cmd->lock);
             uint64_t new_seq = cmd->seq;
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return kepaxos_send_accept(ke, new_ballot, msg->key, msg->klen, new_seq);
         }
 
@@ -831,11 +901,11 @@ kepaxos_handle_accept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
                 cmd->max_voter = NULL;
                 uint64_t new_seq = cmd->seq;
                 MUTEX_UNLOCK(&cmd->lock);
-                MUTEX_UNLOCK(&ke->lock);
+                MUTEX_UNLOCK(klock);
                 return kepaxos_send_accept(ke, new_ballot, msg->key, msg->klen, new_seq);
             }
             MUTEX_UNLOCK(&cmd->lock);
-            MUTEX_UNLOCK(&ke->lock);
+            MUTEX_UNLOCK(klock);
             return 0; // we don't have a quorum yet
         }
 
@@ -843,52 +913,48 @@ kepaxos_handle_accept_response(kepaxos_t *ke, kepaxos_msg_t *msg)
         // the command has been accepted by a quorum
         void *cmd_ptr = NULL;
         ht_delete(ke->commands, msg->key, msg->klen, &cmd_ptr, NULL);
-        MUTEX_UNLOCK(&ke->lock);
+        MUTEX_UNLOCK(klock);
         if (cmd == cmd_ptr)
             return kepaxos_commit(ke, cmd);
         return -1;
     }
-    MUTEX_UNLOCK(&ke->lock);
+    MUTEX_UNLOCK(klock);
     return 0;
 }
 
 static inline int
 kepaxos_handle_commit(kepaxos_t *ke, kepaxos_msg_t *msg)
 {
-    MUTEX_LOCK(&ke->lock);
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, msg->key, msg->klen);
+
+    MUTEX_LOCK(klock);
     // Any replica R on receiving a COMMIT(BALLOT, K, SEQ, CMD, DATA) message
     kepaxos_cmd_t *cmd = (kepaxos_cmd_t *)ht_get(ke->commands, msg->key, msg->klen, NULL);
     if (cmd && cmd->seq == msg->seq && cmd->ballot > msg->ballot) {
         // ignore this message ... the ballot is too old
         SHC_DEBUG("Ignoring commit message, ballot too old: (%lld -- %lld)",
                   cmd->ballot, msg->ballot);
-        MUTEX_UNLOCK(&ke->lock);
+        MUTEX_UNLOCK(klock);
         return -1;
     }
     uint64_t last_recorded_seq = kepaxos_last_seq_for_key(ke->log, msg->key, msg->klen, NULL);
     if (msg->seq < last_recorded_seq) {
         // ignore this commit message (it's too old)
-        if (shardcache_log_level() >= LOG_DEBUG && msg->key) {
-            char keystr[1024];
-            KEY2STR(msg->key, msg->klen, keystr, sizeof(keystr));
-            SHC_DEBUG("Ignoring commit message, seq too old for key %s: (%lld -- %lld)",
-                      keystr, msg->seq, last_recorded_seq);
-        }
-        MUTEX_UNLOCK(&ke->lock);
+        if (msg->key)
+            SHC_DEBUG("Ignoring commit message, seq too old for key %.*s: (%lld -- %lld)",
+                      KEYFMT(msg->key, msg->klen), msg->seq, last_recorded_seq);
+        MUTEX_UNLOCK(klock);
         return 0;
     }
 
-    if (shardcache_log_level() >= LOG_DEBUG && msg->key) {
-        char keystr[1024];
-        KEY2STR(msg->key, msg->klen, keystr, sizeof(keystr));
-        SHC_DEBUG("Committing key %s (seq: %llu, ballot: %llu)\n",
-                  keystr, msg->seq, msg->ballot);
-    }
+    if (msg->key)
+        SHC_DEBUG("Committing key %.*s (seq: %llu, ballot: %llu)\n",
+                  KEYFMT(msg->key, msg->klen), msg->seq, msg->ballot);
 
     ke->callbacks.commit(msg->ctype, msg->key, msg->klen,
                          msg->data, msg->dlen, 0, ke->callbacks.priv);
 
-    kepaxos_set_last_seq_for_key(ke->log, msg->key, msg->klen, msg->ballot, msg->seq);
+    int rc = kepaxos_set_last_seq_for_key(ke->log, msg->key, msg->klen, msg->ballot, msg->seq);
 
     if (cmd && cmd->seq <= msg->seq) {
         int waiting = cmd->waiting;
@@ -896,8 +962,8 @@ kepaxos_handle_commit(kepaxos_t *ke, kepaxos_msg_t *msg)
         if (!waiting)
             kepaxos_command_free(cmd);
     }
-    MUTEX_UNLOCK(&ke->lock);
-    return 0;
+    MUTEX_UNLOCK(klock);
+    return rc;
 }
 
 int
@@ -961,15 +1027,15 @@ kepaxos_received_command(kepaxos_t *ke,
 
 int kepaxos_recovered(kepaxos_t *ke, void *key, size_t klen, uint64_t ballot, uint64_t seq)
 {
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, key, klen);
+
     int ret = -1;
-    MUTEX_LOCK(&ke->lock);
+    MUTEX_LOCK(klock);
     uint64_t last_ballot = 0;
     uint64_t last_seq = kepaxos_last_seq_for_key(ke->log, key, klen, &last_ballot);
-    if (seq >= last_seq && ballot >= last_ballot) {
-        kepaxos_set_last_seq_for_key(ke->log, key, klen, ballot, seq);
-        ret = 0;
-    }
-    MUTEX_UNLOCK(&ke->lock);
+    if (seq >= last_seq && ballot >= last_ballot)
+        ret = kepaxos_set_last_seq_for_key(ke->log, key, klen, ballot, seq);
+    MUTEX_UNLOCK(klock);
     return ret;
 }
 
@@ -978,27 +1044,21 @@ uint64_t kepaxos_ballot(kepaxos_t *ke)
     return ATOMIC_READ(ke->ballot);
 }
 
+void kepaxos_update_ballot(kepaxos_t *ke, uint64_t ballot)
+{
+    update_ballot(ke, ballot);
+}
+
 int kepaxos_get_diff(kepaxos_t *ke,
                      uint64_t ballot,
                      kepaxos_diff_item_t **items,
                      int *num_items)
 {
-    MUTEX_LOCK(&ke->lock);
-
-    if (BALLOT_VALUE(ballot) >= BALLOT_VALUE(kepaxos_max_ballot(ke->log))) {
-        MUTEX_UNLOCK(&ke->lock);
+    // NOTE: the log is protected by its own lock
+    if (BALLOT_VALUE(ballot) >= BALLOT_VALUE(kepaxos_max_ballot(ke->log)))
         return -1;
-    }
-
-    /*
-    uint64_t ballots[256];
-    uint64_t seq[256];
-    */
 
-    int rc = kepaxos_diff_from_ballot(ke->log, ballot, items, num_items);
-
-    MUTEX_UNLOCK(&ke->lock);
-    return rc;
+    return kepaxos_diff_from_ballot(ke->log, ballot, items, num_items);
 }
 
 void
@@ -1009,9 +1069,26 @@ kepaxos_diff_release(kepaxos_diff_item_t *items, int num_items)
 
 uint64_t kepaxos_seq(kepaxos_t *ke, void *key, size_t klen)
 {
-    MUTEX_LOCK(&ke->lock);
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, key, klen);
+
+    MUTEX_LOCK(klock);
     uint64_t seq = kepaxos_last_seq_for_key(ke->log, key, klen, NULL);
-    MUTEX_UNLOCK(&ke->lock);
+    MUTEX_UNLOCK(klock);
+    return seq;
+}
+
+void kepaxos_set_durability(kepaxos_t *ke, kepaxos_log_durability_t mode, int group_window)
+{
+    kepaxos_log_set_durability(ke->log, mode, group_window);
+}
+
+uint64_t kepaxos_seq_ballot(kepaxos_t *ke, void *key, size_t klen, uint64_t *ballot)
+{
+    pthread_mutex_t *klock = kepaxos_key_lock(ke, key, klen);
+
+    MUTEX_LOCK(klock);
+    uint64_t seq = kepaxos_last_seq_for_key(ke->log, key, klen, ballot);
+    MUTEX_UNLOCK(klock);
     return seq;
 }
 
@@ -81,8 +81,17 @@ void kepaxos_diff_release(kepaxos_diff_item_t *items, int num_items);
 
 uint64_t kepaxos_ballot(kepaxos_t *ke); // returns the current ballot
 
+// moves the current ballot past the provided one (if not already there)
+void kepaxos_update_ballot(kepaxos_t *ke, uint64_t ballot);
+
 uint64_t kepaxos_seq(kepaxos_t *ke, void *key, size_t klen);
 
+// sets the durability mode of the log (see kepaxos_log_durability_t)
+void kepaxos_set_durability(kepaxos_t *ke, kepaxos_log_durability_t mode, int group_window);
+
+// returns the last seq for a key and stores its ballot in *ballot
+uint64_t kepaxos_seq_ballot(kepaxos_t *ke, void *key, size_t klen, uint64_t *ballot);
+
 #endif
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
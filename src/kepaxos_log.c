@@ -1,5 +1,6 @@
 #include "kepaxos_log.h"
 #include "shardcache.h"
+#include "shardcache_internal.h" // for MUTEX_*()
 
 #ifndef HAVE_UINT64_T
 #define HAVE_UINT64_T
@@ -8,26 +9,521 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-#include <dirent.h>
 #include <stdio.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#ifdef __MACH__
+#define fdatasync fsync
+#endif
+
+/*
+ * The log is kept in memory in an open-addressing table indexed by the
+ * hashes of the keys and backed by an append-only segment file (<dbpath>/log).
+ * Each update of a key is appended to the segment as a single record :
+ *
+ *   [ checksum (4 bytes) ][ klen (4 bytes) ][ ballot (8 bytes) ][ seq (8 bytes) ][ key (klen bytes) ]
+ *
+ * where the checksum covers everything after itself. When the log is opened
+ * the segment is replayed to rebuild the table and any truncated/corrupted
+ * tail (left by an interrupted write) is discarded.
+ * Once the segment contains too many stale records it gets compacted by
+ * writing only the live ones to a new segment which replaces the old one.
+ *
+ * Depending on the durability mode the records are either left to the
+ * page cache (KEPAXOS_LOG_DURABILITY_NONE), synced to disk one by one
+ * (KEPAXOS_LOG_DURABILITY_SYNC) or group-committed
+ * (KEPAXOS_LOG_DURABILITY_BATCHED) : the records are queued in a pending
+ * buffer and the first thread finding no flush in progress becomes the
+ * leader, writing and syncing all the queued records at once, while the
+ * others wait for a flush covering their records to complete.
+ * A record is reported as durable only once it has been written and synced.
+ * If a write or a sync fails, the records it covered fail, and so does
+ * every record after them until the segment is reopened
+ * (see kepaxos_log_reopen()).
+ *
+ * The log used to be a tree of directories, one per key
+ * (<dbpath>/<prefix>/<hashes>/{key,seq,ballot}). If such a tree is found
+ * when there is no segment yet, its keys are imported into a new segment
+ * (which atomically replaces the missing one) before replaying it.
+ */
+
+#define KEPAXOS_LOG_MAGIC "KPXLOG01"
+#define KEPAXOS_LOG_MAGIC_LEN 8
+
+#define KEPAXOS_LOG_TABLE_SIZE_MIN 1024
+#define KEPAXOS_LOG_COMPACT_MIN_RECORDS 65536
+
+typedef struct __attribute__((packed)) {
+    uint32_t checksum;
+    uint32_t klen;
+    uint64_t ballot;
+    uint64_t seq;
+} kepaxos_log_record_hdr_t;
+
+typedef struct {
+    uint64_t hash1;
+    uint64_t hash2;
+    uint64_t ballot;
+    uint64_t seq;
+    void *key;   // NULL if the slot is empty
+    size_t klen;
+} kepaxos_log_entry_t;
 
 struct __kepaxos_log_s {
     char *dbpath;
+    char *segment_path;
+    int fd;                       // the segment (opened in append mode)
     uint64_t max_ballot;
-    FILE *bfile;
+    kepaxos_log_entry_t *table;
+    size_t size;                  // the number of slots in the table (power of 2)
+    size_t count;                 // the number of keys in the table
+    uint64_t num_records;         // the number of records in the segment
+
+    pthread_mutex_t lock;         // protects all the members
+    kepaxos_log_durability_t durability;
+    int group_window;             // usecs the leader waits for more records
+                                  // before flushing (BATCHED mode only)
+    char *pending;                // records waiting to be flushed
+    size_t pending_len;
+    size_t pending_size;
+    uint64_t queued;              // the ticket of the last queued record
+    uint64_t durable;             // the ticket of the last flushed record
+    int flushing;                 // true while a leader is flushing
+    pthread_cond_t flushed;       // signaled when a flush completes
+    int error;                    // the errno of the last failed write/sync
+                                  // (sticky until the segment is reopened)
+    uint64_t failed;              // the ticket of the last record which failed
 };
 
-kepaxos_log_t *
-kepaxos_log_create(char *dbpath)
+static unsigned char kepaxos_log_checksum_seed[16] = "kepaxos_log_crc0";
+
+static inline void
+kepaxos_compute_key_hashes(void *key, size_t klen, uint64_t *hash1, uint64_t *hash2)
+{
+    unsigned char auth1[16] = "0123456789ABCDEF";
+    unsigned char auth2[16] = "ABCDEF0987654321";
+
+    *hash1 = sip_hash24(auth1, key, klen);
+    *hash2 = sip_hash24(auth2, key, klen);
+}
+
+static inline uint32_t
+kepaxos_log_checksum(void *record, size_t len)
+{
+    // skip the checksum itself
+    return (uint32_t)sip_hash24(kepaxos_log_checksum_seed,
+                                (char *)record + sizeof(uint32_t),
+                                len - sizeof(uint32_t));
+}
+
+static kepaxos_log_entry_t *
+kepaxos_log_lookup(kepaxos_log_entry_t *table,
+                   size_t size,
+                   void *key,
+                   size_t klen,
+                   uint64_t hash1,
+                   uint64_t hash2)
+{
+    size_t mask = size - 1;
+    size_t i = hash1 & mask;
+    for (;;) {
+        kepaxos_log_entry_t *entry = &table[i];
+        if (!entry->key)
+            return entry;
+        if (entry->hash1 == hash1 && entry->hash2 == hash2 &&
+            entry->klen == klen && memcmp(entry->key, key, klen) == 0)
+        {
+            return entry;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void
+kepaxos_log_grow(kepaxos_log_t *log)
+{
+    size_t new_size = log->size * 2;
+    kepaxos_log_entry_t *new_table = calloc(new_size, sizeof(kepaxos_log_entry_t));
+    size_t i;
+    for (i = 0; i < log->size; i++) {
+        kepaxos_log_entry_t *entry = &log->table[i];
+        if (!entry->key)
+            continue;
+        kepaxos_log_entry_t *slot = kepaxos_log_lookup(new_table, new_size,
+                                                       entry->key, entry->klen,
+                                                       entry->hash1, entry->hash2);
+        memcpy(slot, entry, sizeof(kepaxos_log_entry_t));
+    }
+    free(log->table);
+    log->table = new_table;
+    log->size = new_size;
+}
+
+// updates the in-memory table (doesn't touch the segment)
+static void
+kepaxos_log_update(kepaxos_log_t *log, void *key, size_t klen, uint64_t ballot, uint64_t seq)
+{
+    uint64_t hash1, hash2;
+    kepaxos_compute_key_hashes(key, klen, &hash1, &hash2);
+
+    kepaxos_log_entry_t *entry = kepaxos_log_lookup(log->table, log->size, key, klen, hash1, hash2);
+    if (!entry->key) {
+        // keep the load factor below 0.75
+        if ((log->count + 1) * 4 > log->size * 3) {
+            kepaxos_log_grow(log);
+            entry = kepaxos_log_lookup(log->table, log->size, key, klen, hash1, hash2);
+        }
+        entry->key = malloc(klen);
+        memcpy(entry->key, key, klen);
+        entry->klen = klen;
+        entry->hash1 = hash1;
+        entry->hash2 = hash2;
+        log->count++;
+    }
+    entry->ballot = ballot;
+    entry->seq = seq;
+
+    if (ballot > log->max_ballot)
+        log->max_ballot = ballot;
+}
+
+static int
+kepaxos_log_write_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len) {
+        ssize_t wb = write(fd, p, len);
+        if (wb == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += wb;
+        len -= wb;
+    }
+    return 0;
+}
+
+// encodes a record into the provided buffer
+// which must be at least sizeof(kepaxos_log_record_hdr_t) + klen bytes long
+static size_t
+kepaxos_log_encode(char *record, void *key, size_t klen, uint64_t ballot, uint64_t seq)
+{
+    size_t rlen = sizeof(kepaxos_log_record_hdr_t) + klen;
+    kepaxos_log_record_hdr_t *hdr = (kepaxos_log_record_hdr_t *)record;
+    hdr->klen = klen;
+    hdr->ballot = ballot;
+    hdr->seq = seq;
+    memcpy(record + sizeof(kepaxos_log_record_hdr_t), key, klen);
+    hdr->checksum = kepaxos_log_checksum(record, rlen);
+    return rlen;
+}
+
+static int
+kepaxos_log_append(int fd, void *key, size_t klen, uint64_t ballot, uint64_t seq)
+{
+    char record[sizeof(kepaxos_log_record_hdr_t) + klen];
+    size_t rlen = kepaxos_log_encode(record, key, klen, ballot, seq);
+    return kepaxos_log_write_all(fd, record, rlen);
+}
+
+// replays the segment and returns the offset of the end of the last valid record
+// (or -1 if the segment can't be read)
+static off_t
+kepaxos_log_replay(kepaxos_log_t *log, FILE *in)
+{
+    char magic[KEPAXOS_LOG_MAGIC_LEN];
+    if (fread(magic, 1, KEPAXOS_LOG_MAGIC_LEN, in) != KEPAXOS_LOG_MAGIC_LEN)
+        return 0; // empty (or just created) segment
+
+    if (memcmp(magic, KEPAXOS_LOG_MAGIC, KEPAXOS_LOG_MAGIC_LEN) != 0) {
+        SHC_ERROR("%s is not a valid kepaxos log segment", log->segment_path);
+        return -1;
+    }
+
+    off_t offset = KEPAXOS_LOG_MAGIC_LEN;
+    char *record = NULL;
+    size_t record_size = 0;
+    for (;;) {
+        kepaxos_log_record_hdr_t hdr;
+        if (fread(&hdr, sizeof(hdr), 1, in) != 1)
+            break;
+
+        size_t rlen = sizeof(hdr) + hdr.klen;
+        if (rlen > record_size) {
+            char *new_record = realloc(record, rlen);
+            if (!new_record)
+                break;
+            record = new_record;
+            record_size = rlen;
+        }
+        memcpy(record, &hdr, sizeof(hdr));
+        if (hdr.klen && fread(record + sizeof(hdr), hdr.klen, 1, in) != 1)
+            break;
+
+        if (kepaxos_log_checksum(record, rlen) != hdr.checksum)
+            break;
+
+        kepaxos_log_update(log, record + sizeof(hdr), hdr.klen, hdr.ballot, hdr.seq);
+        log->num_records++;
+        offset += rlen;
+    }
+    free(record);
+    return offset;
+}
+
+static int
+kepaxos_log_open_segment(kepaxos_log_t *log)
 {
+    FILE *in = fopen(log->segment_path, "r");
+    off_t end = 0;
+    if (in) {
+        end = kepaxos_log_replay(log, in);
+        fclose(in);
+        if (end == -1)
+            return -1;
+    }
+
+    log->fd = open(log->segment_path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+    if (log->fd == -1) {
+        SHC_ERROR("Can't open the log segment %s: %s", log->segment_path, strerror(errno));
+        return -1;
+    }
 
     struct stat st;
-    size_t ballots_path_len = strlen(dbpath) + 10;
+    if (fstat(log->fd, &st) != 0) {
+        SHC_ERROR("Can't stat the log segment %s: %s", log->segment_path, strerror(errno));
+        return -1;
+    }
+
+    if (end == 0) {
+        // new segment
+        if (ftruncate(log->fd, 0) != 0 ||
+            kepaxos_log_write_all(log->fd, KEPAXOS_LOG_MAGIC, KEPAXOS_LOG_MAGIC_LEN) != 0)
+        {
+            SHC_ERROR("Can't initialize the log segment %s: %s", log->segment_path, strerror(errno));
+            return -1;
+        }
+    } else if (st.st_size > end) {
+        // an interrupted write left a partial record at the end of the segment
+        SHC_WARNING("Discarding %lld bytes at the end of the log segment %s",
+                    (long long)(st.st_size - end), log->segment_path);
+        if (ftruncate(log->fd, end) != 0) {
+            SHC_ERROR("Can't truncate the log segment %s: %s", log->segment_path, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// rewrites the segment keeping only the last record for each key
+static int
+kepaxos_log_compact(kepaxos_log_t *log)
+{
+    size_t tmp_path_len = strlen(log->segment_path) + 9;
+    char tmp_path[tmp_path_len];
+    snprintf(tmp_path, tmp_path_len, "%s.compact", log->segment_path);
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600);
+    if (fd == -1) {
+        SHC_ERROR("Can't create the log segment %s: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    int rc = kepaxos_log_write_all(fd, KEPAXOS_LOG_MAGIC, KEPAXOS_LOG_MAGIC_LEN);
+    size_t i;
+    for (i = 0; rc == 0 && i < log->size; i++) {
+        kepaxos_log_entry_t *entry = &log->table[i];
+        if (entry->key)
+            rc = kepaxos_log_append(fd, entry->key, entry->klen, entry->ballot, entry->seq);
+    }
+
+    if (rc == 0)
+        rc = fsync(fd);
+
+    if (rc != 0 || rename(tmp_path, log->segment_path) != 0) {
+        SHC_ERROR("Can't compact the log segment %s: %s", log->segment_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    close(log->fd);
+    log->fd = fd;
+    log->num_records = log->count;
+    return 0;
+}
+
+// reads the whole content of a file of the old directory-based log
+// returns -1 if the file doesn't exist or can't be read
+static int
+kepaxos_log_read_legacy_file(char *path, char **data, size_t *len)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    FILE *in = fopen(path, "r");
+    if (!in)
+        return -1;
+
+    *len = st.st_size;
+    *data = malloc(*len ? *len : 1);
+    if (*len && fread(*data, *len, 1, in) != 1) {
+        free(*data);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    return 0;
+}
+
+// appends the key stored in a directory of the old log to the segment being imported,
+// returns 1 if imported, 0 if skipped (no committed seq) and -1 in case of errors
+static int
+kepaxos_log_import_legacy_key(int fd, char *kpath)
+{
+    size_t path_len = strlen(kpath) + 8;
+    char path[path_len];
+
+    char *seq = NULL;
+    size_t seq_len = 0;
+    snprintf(path, path_len, "%s/seq", kpath);
+    if (kepaxos_log_read_legacy_file(path, &seq, &seq_len) != 0 || seq_len != sizeof(uint64_t)) {
+        // the old log created the directory before writing the seq,
+        // a key without a seq had never been committed
+        free(seq);
+        return 0;
+    }
+
+    // the ballot was written after the seq
+    uint64_t ballot = 0;
+    char *ballot_data = NULL;
+    size_t ballot_len = 0;
+    snprintf(path, path_len, "%s/ballot", kpath);
+    if (kepaxos_log_read_legacy_file(path, &ballot_data, &ballot_len) == 0 && ballot_len == sizeof(uint64_t))
+        ballot = *((uint64_t *)ballot_data);
+    else
+        SHC_WARNING("The old log entry %s has no ballot, importing it with ballot 0", kpath);
+    free(ballot_data);
+
+    char *key = NULL;
+    size_t klen = 0;
+    snprintf(path, path_len, "%s/key", kpath);
+    if (kepaxos_log_read_legacy_file(path, &key, &klen) != 0 || !klen) {
+        // the key was written before the seq
+        SHC_ERROR("Can't read the key of the old log entry %s", kpath);
+        free(seq);
+        free(key);
+        return -1;
+    }
+
+    int rc = kepaxos_log_append(fd, key, klen, ballot, *((uint64_t *)seq));
+    free(seq);
+    free(key);
+    return (rc == 0) ? 1 : -1;
+}
+
+// imports the old directory-based log (if any) into a new segment.
+// The segment is written aside and renamed only once complete, so an
+// interrupted import is just started over. Returns -1 in case of errors
+// (the state of the keys must never be silently reset)
+static int
+kepaxos_log_import_legacy(kepaxos_log_t *log)
+{
+    // the old log always had a ballots directory
+    struct stat st;
+    size_t ballots_path_len = strlen(log->dbpath) + 9;
     char ballots_path[ballots_path_len];
-    snprintf(ballots_path, ballots_path_len, "%s/ballots", dbpath);
+    snprintf(ballots_path, ballots_path_len, "%s/ballots", log->dbpath);
+    if (stat(ballots_path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return 0;
+
+    DIR *dbdir = opendir(log->dbpath);
+    if (!dbdir) {
+        SHC_ERROR("Can't open the dbpath %s: %s", log->dbpath, strerror(errno));
+        return -1;
+    }
+
+    size_t tmp_path_len = strlen(log->segment_path) + 8;
+    char tmp_path[tmp_path_len];
+    snprintf(tmp_path, tmp_path_len, "%s.import", log->segment_path);
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600);
+    if (fd == -1) {
+        SHC_ERROR("Can't create the log segment %s: %s", tmp_path, strerror(errno));
+        closedir(dbdir);
+        return -1;
+    }
+
+    int rc = kepaxos_log_write_all(fd, KEPAXOS_LOG_MAGIC, KEPAXOS_LOG_MAGIC_LEN);
+    int imported = 0;
+    struct dirent *prefix;
+    while (rc == 0 && (prefix = readdir(dbdir))) {
+        // the keys are grouped in a directory per prefix,
+        // everything else in the dbpath is a file (or the ballots directory)
+        if (prefix->d_name[0] == '.' || strcmp(prefix->d_name, "ballots") == 0)
+            continue;
+
+        size_t prefix_path_len = strlen(log->dbpath) + strlen(prefix->d_name) + 2;
+        char prefix_path[prefix_path_len];
+        snprintf(prefix_path, prefix_path_len, "%s/%s", log->dbpath, prefix->d_name);
+        if (stat(prefix_path, &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+
+        DIR *prefix_dir = opendir(prefix_path);
+        if (!prefix_dir) {
+            SHC_ERROR("Can't open the old log directory %s: %s", prefix_path, strerror(errno));
+            rc = -1;
+            break;
+        }
+
+        struct dirent *entry;
+        while (rc == 0 && (entry = readdir(prefix_dir))) {
+            if (entry->d_name[0] == '.')
+                continue;
+            size_t kpath_len = prefix_path_len + strlen(entry->d_name) + 1;
+            char kpath[kpath_len];
+            snprintf(kpath, kpath_len, "%s/%s", prefix_path, entry->d_name);
+            if (stat(kpath, &st) != 0 || !S_ISDIR(st.st_mode))
+                continue;
+            int ret = kepaxos_log_import_legacy_key(fd, kpath);
+            if (ret == -1)
+                rc = -1;
+            else
+                imported += ret;
+        }
+        closedir(prefix_dir);
+    }
+    closedir(dbdir);
+
+    if (rc == 0)
+        rc = fsync(fd);
+
+    if (rc != 0 || rename(tmp_path, log->segment_path) != 0) {
+        SHC_ERROR("Can't import the old log in %s into the segment %s",
+                  log->dbpath, log->segment_path);
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    SHC_NOTICE("Imported %d keys from the old log in %s (the old directories can now be removed)",
+               imported, log->dbpath);
+    return 0;
+}
+
+kepaxos_log_t *
+kepaxos_log_create(char *dbpath)
+{
+    struct stat st;
 
     if (stat(dbpath, &st) != 0) {
         if (mkdir(dbpath, 0700) != 0) {
@@ -38,353 +534,365 @@ kepaxos_log_create(char *dbpath)
             SHC_ERROR("Can't stat the dbpath %s: %s", dbpath, strerror(errno));
             return NULL;
         }
-        mkdir(ballots_path, 0700);
     }
-    if (stat(ballots_path, &st) != 0) {
-        if (mkdir(ballots_path, 0700) != 0) {
-            SHC_ERROR("Can't create the ballots path %s: %s", ballots_path, strerror(errno));
-            return NULL;
-        }
-    }
-    
+
     if (!S_ISDIR(st.st_mode)) {
         SHC_ERROR("%s is not a directory", dbpath);
         return NULL;
     }
 
-    /*
-    DIR *dbdir = NULL;
-    dbdir = opendir(dbpath);
-    if (!dbdir) {
-        SHC_ERROR("Can't open the dbpath %s: %s", dbpath, strerror(errno));
-        return NULL;
+    kepaxos_log_t *log = calloc(1, sizeof(kepaxos_log_t));
+    log->dbpath = strdup(dbpath);
+    size_t segment_path_len = strlen(dbpath) + 5;
+    log->segment_path = malloc(segment_path_len);
+    snprintf(log->segment_path, segment_path_len, "%s/log", dbpath);
+    log->size = KEPAXOS_LOG_TABLE_SIZE_MIN;
+    log->table = calloc(log->size, sizeof(kepaxos_log_entry_t));
+    log->fd = -1;
+    log->durability = KEPAXOS_LOG_DURABILITY_NONE;
+    MUTEX_INIT(&log->lock);
+    CONDITION_INIT(&log->flushed);
+
+    // the max ballot stored by the old directory-based log
+    // is still honoured so that ballots never go backwards
+    size_t ballot_path_len = strlen(dbpath) + 8;
+    char ballot_path[ballot_path_len];
+    snprintf(ballot_path, ballot_path_len, "%s/ballot", dbpath);
+    FILE *ballot_file = fopen(ballot_path, "r");
+    if (ballot_file) {
+        uint64_t ballot = 0;
+        if (fread(&ballot, sizeof(ballot), 1, ballot_file) == 1)
+            log->max_ballot = ballot;
+        fclose(ballot_file);
     }
-    */
-
-    int ballot_path_size = strlen(dbpath) + 8;
-    char ballot_path[ballot_path_size];
-    snprintf(ballot_path, ballot_path_size, "%s/ballot", dbpath);
 
-    FILE *ballot_file = fopen(ballot_path, "r+");
-    if (!ballot_file) {
-        ballot_file = fopen(ballot_path, "w+");
-        if (!ballot_file) {
-            SHC_ERROR("Can't open/create the ballot_file %s: %s", ballot_path, strerror(errno));
-            //closedir(dbdir);
-            return NULL;
-        }
+    if (stat(log->segment_path, &st) != 0 && kepaxos_log_import_legacy(log) != 0) {
+        SHC_ERROR("Refusing to open the log in %s, the old log couldn't be imported", dbpath);
+        kepaxos_log_destroy(log);
+        return NULL;
     }
 
-    uint64_t ballot = 0;
-    size_t nitems = fread(&ballot, sizeof(ballot), 1, ballot_file);
-    if (nitems < 1 && ferror(ballot_file)) {
-        SHC_ERROR("Error reading the ballot_file %s: %s", ballot_path, strerror(errno));
-        //closedir(dbdir);
-        fclose(ballot_file);
+    if (kepaxos_log_open_segment(log) != 0) {
+        kepaxos_log_destroy(log);
         return NULL;
     }
 
-    kepaxos_log_t *log = calloc(1, sizeof(kepaxos_log_t));
-    log->dbpath = strdup(dbpath);
-    log->bfile = ballot_file;
-    log->max_ballot = ballot;
-
     return log;
 }
 
 void
 kepaxos_log_destroy(kepaxos_log_t *log)
 {
-    //closedir(log->dbdir);
+    MUTEX_LOCK(&log->lock);
+    while (log->flushing)
+        pthread_cond_wait(&log->flushed, &log->lock);
+    if (log->pending_len && log->fd >= 0 && !log->error &&
+        kepaxos_log_write_all(log->fd, log->pending, log->pending_len) != 0)
+    {
+        SHC_ERROR("Can't flush the log segment %s: %s", log->segment_path, strerror(errno));
+    }
+    MUTEX_UNLOCK(&log->lock);
+
+    if (log->fd >= 0) {
+        if (log->durability != KEPAXOS_LOG_DURABILITY_NONE)
+            fdatasync(log->fd);
+        close(log->fd);
+    }
+    free(log->pending);
+    MUTEX_DESTROY(&log->lock);
+    CONDITION_DESTROY(&log->flushed);
+    size_t i;
+    for (i = 0; i < log->size; i++)
+        free(log->table[i].key);
+    free(log->table);
+    free(log->segment_path);
     free(log->dbpath);
-    fclose(log->bfile);
     free(log);
 }
 
-static inline void
-kepaxos_compute_key_hashes(void *key, size_t klen, uint64_t *hash1, uint64_t *hash2)
+void
+kepaxos_log_set_durability(kepaxos_log_t *log, kepaxos_log_durability_t mode, int group_window)
 {
-    unsigned char auth1[16] = "0123456789ABCDEF";
-    unsigned char auth2[16] = "ABCDEF0987654321";
+    MUTEX_LOCK(&log->lock);
+    log->durability = mode;
+    log->group_window = group_window > 0 ? group_window : 0;
+    MUTEX_UNLOCK(&log->lock);
+}
 
-    *hash1 = sip_hash24(auth1, key, klen);
-    *hash2 = sip_hash24(auth2, key, klen);
+kepaxos_log_durability_t
+kepaxos_log_durability(kepaxos_log_t *log)
+{
+    MUTEX_LOCK(&log->lock);
+    kepaxos_log_durability_t mode = log->durability;
+    MUTEX_UNLOCK(&log->lock);
+    return mode;
 }
 
 uint64_t
 kepaxos_max_ballot(kepaxos_log_t *log)
 {
-    return log->max_ballot;
+    MUTEX_LOCK(&log->lock);
+    uint64_t max_ballot = log->max_ballot;
+    MUTEX_UNLOCK(&log->lock);
+    return max_ballot;
 }
 
 uint64_t
 kepaxos_last_seq_for_key(kepaxos_log_t *log, void *key, size_t klen, uint64_t *ballot)
 {
     uint64_t keyhash1, keyhash2;
-    uint64_t seq = 0;
-
     kepaxos_compute_key_hashes(key, klen, &keyhash1, &keyhash2);
-    char kstr[35]; // 32 + 0x + null-terminator
-    snprintf(kstr, sizeof(kstr), "%s%s",
-             shardcache_hex_escape((char *)&keyhash1, sizeof(keyhash1), 16, 0),
-             shardcache_hex_escape((char *)&keyhash2, sizeof(keyhash2), 16, 0));
-
 
-    struct stat st;
-    size_t kprefix_path_len = strlen(log->dbpath) + 6;
-    char kprefix_path[kprefix_path_len];
-    snprintf(kprefix_path, kprefix_path_len, "%s/%02x%02x", log->dbpath, ((char *)key)[0], ((char *)key)[klen-1]);
-
-    size_t kpath_len = kprefix_path_len + 1 + strlen(kstr) + 1;
-    char kpath[kpath_len];
-    snprintf(kpath, sizeof(kpath), "%s/%s", kprefix_path, kstr);
-    
-    if (stat(kprefix_path, &st) != 0 || !S_ISDIR(st.st_mode))
-        return 0;
-    
-    if (stat(kpath, &st) != 0 || !S_ISDIR(st.st_mode))
-        return 0;
+    MUTEX_LOCK(&log->lock);
+    kepaxos_log_entry_t *entry = kepaxos_log_lookup(log->table, log->size, key, klen, keyhash1, keyhash2);
+    uint64_t seq = 0;
+    if (entry->key) {
+        if (ballot)
+            *ballot = entry->ballot;
+        seq = entry->seq;
+    }
+    MUTEX_UNLOCK(&log->lock);
 
-    char seq_path[kpath_len + 5]; // kpath_len + / + "seq" + null-terminator
-    snprintf(seq_path, sizeof(seq_path), "%s/seq", kpath);
+    return seq;
+}
 
-    FILE *seq_file = fopen(seq_path, "r");
-    if (!seq_file)
-        return 0;
+// NOTE: must be called with the lock held and no flush in progress
+static inline void
+kepaxos_log_maybe_compact(kepaxos_log_t *log)
+{
+    if (!log->pending_len && !log->error &&
+        log->num_records > KEPAXOS_LOG_COMPACT_MIN_RECORDS &&
+        log->num_records > log->count * 2)
+    {
+        kepaxos_log_compact(log);
+    }
+}
 
-    size_t nitems = fread(&seq, sizeof(seq), 1, seq_file);
+// makes the segment unusable until it's reopened
+// NOTE: must be called with the lock held
+static void
+kepaxos_log_fail(kepaxos_log_t *log, int err)
+{
+    SHC_ERROR("Can't write to the log segment %s: %s", log->segment_path, strerror(err));
+    log->error = err ? err : EIO;
+    log->failed = log->queued;
+}
 
+// restores the ballot and seq the key had before a record which failed to be written
+// (unless the key has been updated again in the meanwhile or the table has been
+// rebuilt by kepaxos_log_reopen()). The max ballot is left untouched, it only
+// needs to never go backwards.
+// NOTE: must be called with the lock held
+static void
+kepaxos_log_rollback(kepaxos_log_t *log,
+                     void *key,
+                     size_t klen,
+                     uint64_t ballot,
+                     uint64_t seq,
+                     uint64_t prev_ballot,
+                     uint64_t prev_seq)
+{
+    uint64_t hash1, hash2;
+    kepaxos_compute_key_hashes(key, klen, &hash1, &hash2);
+    kepaxos_log_entry_t *entry = kepaxos_log_lookup(log->table, log->size, key, klen, hash1, hash2);
+    if (entry->key && entry->ballot == ballot && entry->seq == seq) {
+        entry->ballot = prev_ballot;
+        entry->seq = prev_seq;
+    }
+}
 
-    if (nitems < 1 && ferror(seq_file))
-        SHC_ERROR("Error reading the seq_file %s: %s", seq_path, strerror(errno));
+// waits until a flush covering the given ticket completes,
+// becoming the leader (and flushing all the pending records) if none is in progress.
+// Returns -1 if the flush covering the ticket failed
+// NOTE: must be called with the lock held
+static int
+kepaxos_log_group_commit(kepaxos_log_t *log, uint64_t ticket)
+{
+    while (log->durable < ticket) {
+        if (ticket <= log->failed)
+            return -1;
 
-    fclose(seq_file);
+        if (log->flushing) {
+            pthread_cond_wait(&log->flushed, &log->lock);
+            continue;
+        }
 
-    if (ballot) {
-        char ballot_path[kpath_len + 8];
-        snprintf(ballot_path, sizeof(ballot_path), "%s/ballot", kpath);
+        log->flushing = 1;
 
-        FILE *ballot_file = fopen(ballot_path, "r");
-        if (ballot_file) {
-            nitems = fread(ballot, sizeof(*ballot), 1, ballot_file);
-            if (nitems < 1 && ferror(ballot_file))
-                SHC_ERROR("Error reading the ballot_file %s: %s", ballot_path, strerror(errno));
-            fclose(ballot_file);
-        } else {
-            SHC_ERROR("Error reading the ballot_file %s: %s", ballot_path, strerror(errno));
+        if (log->group_window) {
+            // give the other writers a chance to join this group
+            MUTEX_UNLOCK(&log->lock);
+            usleep(log->group_window);
+            MUTEX_LOCK(&log->lock);
         }
-    }
 
-    return seq;
+        char *buf = log->pending;
+        size_t len = log->pending_len;
+        uint64_t last = log->queued;
+        log->pending = NULL;
+        log->pending_len = 0;
+        log->pending_size = 0;
+
+        MUTEX_UNLOCK(&log->lock);
+        int rc = kepaxos_log_write_all(log->fd, buf, len);
+        if (rc == 0)
+            rc = fdatasync(log->fd);
+        int err = errno;
+        free(buf);
+        MUTEX_LOCK(&log->lock);
+
+        // the records queued in the meanwhile fail as well
+        // (they would follow a hole in the segment)
+        if (rc == 0)
+            log->durable = last;
+        else
+            kepaxos_log_fail(log, err);
+        log->flushing = 0;
+        kepaxos_log_maybe_compact(log);
+        pthread_cond_broadcast(&log->flushed);
+    }
+    return 0;
 }
 
-void
+int
 kepaxos_set_last_seq_for_key(kepaxos_log_t *log, void *key, size_t klen, uint64_t ballot, uint64_t seq)
 {
-    // let's compute the path where this key should be stored in the log
-    uint64_t keyhash1, keyhash2;
-    kepaxos_compute_key_hashes(key, klen, &keyhash1, &keyhash2);
-    char kstr[35]; // 32 + 0x + null-terminator
-    snprintf(kstr, sizeof(kstr), "%s%s",
-             shardcache_hex_escape((char *)&keyhash1, sizeof(keyhash1), 16, 0),
-             shardcache_hex_escape((char *)&keyhash2, sizeof(keyhash2), 16, 0));
+    MUTEX_LOCK(&log->lock);
 
-
-    struct stat st;
-    size_t kprefix_path_len = strlen(log->dbpath) + 6;
-    char kprefix_path[kprefix_path_len];
-    snprintf(kprefix_path, kprefix_path_len, "%s/%02x%02x", log->dbpath, ((char *)key)[0], ((char *)key)[klen-1]);
-
-    size_t kpath_len = kprefix_path_len + 1 + strlen(kstr) + 1;
-    char kpath[kpath_len];
-    snprintf(kpath, sizeof(kpath), "%s/%s", kprefix_path, kstr);
-    
-    // if the directory doesn't exist we must create it
-    if (stat(kprefix_path, &st) != 0 && mkdir(kprefix_path, 0700) != 0) {
-        SHC_ERROR("Can't create the key_prefix_path %s: %s", kprefix_path, strerror(errno));
-        return;
-    }
-
-    if (stat(kpath, &st) != 0 || !S_ISDIR(st.st_mode)) {
-        if (mkdir(kpath, 0700) != 0) {
-            SHC_ERROR("Can't create the key_path %s: %s", kpath, strerror(errno));
-            return;
-        }
+    if (log->durability != KEPAXOS_LOG_DURABILITY_BATCHED) {
+        // don't interleave with a group commit (if the mode has just been changed)
+        while (log->flushing)
+            pthread_cond_wait(&log->flushed, &log->lock);
     }
 
-    // first store the complete key
-    size_t kfile_path_len = kpath_len + 5;
-    char kfile_path[kfile_path_len];
-    snprintf(kfile_path, sizeof(kfile_path), "%s/key", kpath);
-
-    if (stat(kfile_path, &st) != 0 || !S_ISREG(st.st_mode)) {
-        FILE *key_file = fopen(kfile_path, "w");
-        if (key_file) {
-            if (fwrite(key, klen, 1, key_file) != 1)
-                SHC_ERROR("Can't update the key file %s: %s", kfile_path, strerror(errno));
-            fclose(key_file);
-        }
+    if (log->error) {
+        MUTEX_UNLOCK(&log->lock);
+        errno = log->error;
+        return -1;
     }
 
-    // store the seq
-    char seq_path[kpath_len + 5];
-    snprintf(seq_path, sizeof(seq_path), "%s/seq", kpath);
-
-    FILE *seq_file = fopen(seq_path, "w");
-    if (!seq_file) {
-        SHC_ERROR("Can't open the seq_file %s for writing: %s", seq_path, strerror(errno));
-        return;
+    if (log->durability == KEPAXOS_LOG_DURABILITY_BATCHED) {
+        // the table is updated right away so that a compaction run by the
+        // group-commit leader keeps the record, it's rolled back if the flush fails
+        uint64_t hash1, hash2;
+        kepaxos_compute_key_hashes(key, klen, &hash1, &hash2);
+        kepaxos_log_entry_t *entry = kepaxos_log_lookup(log->table, log->size, key, klen, hash1, hash2);
+        uint64_t prev_ballot = entry->key ? entry->ballot : 0;
+        uint64_t prev_seq = entry->key ? entry->seq : 0;
+
+        kepaxos_log_update(log, key, klen, ballot, seq);
+        log->num_records++;
+
+        size_t rlen = sizeof(kepaxos_log_record_hdr_t) + klen;
+        if (log->pending_len + rlen > log->pending_size) {
+            size_t new_size = log->pending_size ? log->pending_size * 2 : 4096;
+            while (new_size < log->pending_len + rlen)
+                new_size *= 2;
+            log->pending = realloc(log->pending, new_size);
+            log->pending_size = new_size;
+        }
+        log->pending_len += kepaxos_log_encode(log->pending + log->pending_len, key, klen, ballot, seq);
+        int rc = kepaxos_log_group_commit(log, ++log->queued);
+        if (rc != 0)
+            kepaxos_log_rollback(log, key, klen, ballot, seq, prev_ballot, prev_seq);
+        int err = log->error;
+        MUTEX_UNLOCK(&log->lock);
+        if (rc != 0)
+            errno = err;
+        return rc;
     }
 
-    size_t nitems = fwrite(&seq, sizeof(seq), 1, seq_file);
-    if (nitems < 1) {
-        SHC_ERROR("Error updating the seq_file %s: %s", seq_path, strerror(errno));
-        return;
+    int rc = 0;
+    if (log->pending_len) {
+        rc = kepaxos_log_write_all(log->fd, log->pending, log->pending_len);
+        if (rc == 0) {
+            log->pending_len = 0;
+            log->durable = log->queued;
+        }
     }
-    fclose(seq_file);
 
-    // store the ballot to the key directory
-    // note that we also need to remove the symlink to the previous ballot
-    char ballot_path[kpath_len + 8];
-    snprintf(ballot_path, sizeof(ballot_path), "%s/ballot", kpath);
+    if (rc == 0)
+        rc = kepaxos_log_append(log->fd, key, klen, ballot, seq);
+    if (rc == 0 && log->durability == KEPAXOS_LOG_DURABILITY_SYNC)
+        rc = fdatasync(log->fd);
 
-    size_t ballot_link_path_len = strlen(log->dbpath) + 10;
-    char ballot_link_path[ballot_link_path_len]; 
-    snprintf(ballot_link_path, sizeof(ballot_link_path), "%s/ballots", log->dbpath);
-
-    FILE *ballot_file = fopen(ballot_path, "r+");
-    if (ballot_file) {
-        // if a previous symlink exists, let's get it out of the way
-        uint64_t old_ballot = 0;
-        if (fread(&old_ballot, sizeof(old_ballot), 1, ballot_file) != 1) {
-            SHC_ERROR("Can't read the ballot file %s: %s", ballot_path, strerror(errno));
-        }
-        if (old_ballot) {
-            char old_ballot_path[ballot_link_path_len + 64];
-            snprintf(old_ballot_path, sizeof(old_ballot_path), "%s/%" PRIu64, ballot_link_path, old_ballot);
-            if (unlink(old_ballot_path) != 0)
-                SHC_ERROR("Can't remove ballot symlink %s: %s", old_ballot_path, strerror(errno));
-        }
-        rewind(ballot_file);
+    if (rc == 0) {
+        // the table only reflects the records which made it to the segment
+        kepaxos_log_update(log, key, klen, ballot, seq);
+        log->num_records++;
+        kepaxos_log_maybe_compact(log);
     } else {
-        ballot_file = fopen(ballot_path, "w");
+        kepaxos_log_fail(log, errno);
     }
 
-    if (ballot_file) {
-        nitems = fwrite(&ballot, sizeof(ballot), 1, ballot_file);
-        if (nitems == 1) {
-            char new_ballot_path[ballot_link_path_len + 64];
-            snprintf(new_ballot_path, sizeof(new_ballot_path), "%s/%" PRIu64, ballot_link_path, ballot);
-            if (symlink(kpath, new_ballot_path) != 0) {
-                SHC_ERROR("Error creating the ballot_file link %s (%s): %s", new_ballot_path, ballot_path, strerror(errno));
-            }
-        } else {
-            SHC_ERROR("Error updating the ballot_file %s: %s", ballot_path, strerror(errno));
-        }
-        fclose(ballot_file);
-    } else {
-        SHC_ERROR("Error updating the ballot_file %s: %s", ballot_path, strerror(errno));
-    }
+    int err = log->error;
+    MUTEX_UNLOCK(&log->lock);
+    if (rc != 0)
+        errno = err;
+    return rc;
+}
 
-    // and finally update the stored max_ballot if necessary (it should always be true)
-    if (ballot > log->max_ballot) {
-        rewind(log->bfile);
-        size_t nitems = fwrite(&ballot, sizeof(ballot), 1, log->bfile);
-        if (nitems < 1 && ferror(ballot_file))
-            SHC_ERROR("Error updating the max_ballot file in the dbpath %s: %s", log->dbpath, strerror(errno));
-        log->max_ballot = ballot;
-    }
+int
+kepaxos_log_error(kepaxos_log_t *log)
+{
+    MUTEX_LOCK(&log->lock);
+    int err = log->error;
+    MUTEX_UNLOCK(&log->lock);
+    return err;
 }
 
+int
+kepaxos_log_reopen(kepaxos_log_t *log)
+{
+    MUTEX_LOCK(&log->lock);
+    while (log->flushing)
+        pthread_cond_wait(&log->flushed, &log->lock);
+
+    // the records which are still pending have already failed
+    if (log->error)
+        log->pending_len = 0;
+
+    if (log->fd >= 0)
+        close(log->fd);
+    log->fd = -1;
+
+    // rebuild the table from what actually made it to the segment
+    size_t i;
+    for (i = 0; i < log->size; i++)
+        free(log->table[i].key);
+    memset(log->table, 0, log->size * sizeof(kepaxos_log_entry_t));
+    log->count = 0;
+    log->num_records = 0;
+
+    int rc = kepaxos_log_open_segment(log);
+    if (rc == 0)
+        log->error = 0;
+    else if (!log->error)
+        log->error = errno ? errno : EIO;
+    MUTEX_UNLOCK(&log->lock);
+    return rc;
+}
 
-int 
+int
 kepaxos_diff_from_ballot(kepaxos_log_t *log, uint64_t ballot, kepaxos_log_item_t **items, int *num_items)
 {
-
-    // access the directory where we store the symlinks to all the keys in the log
-    // indexed by their ballot, for easy comparison and access when calculating the diff
-    size_t ballots_path_len = strlen(log->dbpath) + 9;
-    char ballots_path[ballots_path_len];
-    snprintf(ballots_path, strlen(ballots_path), "%s/ballots", log->dbpath);
-    DIR *ballots_dir = opendir(ballots_path);
-    if (!ballots_dir) {
-        SHC_ERROR("Can't open the ballots dir %s: %s", ballots_path, strerror(errno));
-        return -1;
-    }
-
+    MUTEX_LOCK(&log->lock);
     int nitems = 0;
-    kepaxos_log_item_t *itms = NULL;
-    struct dirent item, *result;
-    while (readdir_r(ballots_dir, &item, &result) == 0) {
-        if (!result)
-            break;
-        if (item.d_name[0] != '.' && item.d_type == DT_LNK) {
-            uint64_t b = strtoll(item.d_name, NULL, 10);
-            if (b && b > ballot) {
-                struct stat st;
-
-                // compute the path to this key in the replica log
-                size_t kpath_len = ballots_path_len + 1 + strlen(item.d_name) + 1;
-                char kpath[kpath_len];
-                snprintf(kpath, sizeof(kpath), "%s/%s", ballots_path, item.d_name);
-
-                // get the key
-                size_t kfile_path_len = kpath_len + 5;
-                char kfile_path[kfile_path_len];
-                snprintf(kfile_path, sizeof(kfile_path), "%s/key", kpath);
-                if (stat(kfile_path, &st) != 0 || !S_ISREG(st.st_mode)) {
-                    SHC_ERROR("Can't stat the key file %s: %s", kfile_path, strerror(errno));
-                    continue;
-                }
-                FILE *kfile = fopen(kfile_path, "r");
-                if (!kfile) {
-                    SHC_ERROR("Can't open the key file %s: %s", kfile_path, strerror(errno));
-                    continue;
-                }
-
-                // we got a key
-                char *key = malloc(st.st_size);
-                if (fread(key, st.st_size, 1, kfile) != st.st_size) {
-                    SHC_ERROR("Can't read the key file %s: %s", kfile_path, strerror(errno));
-                    free(key);
-                    fclose(kfile);
-                    continue;
-
-                }
-                fclose(kfile);
- 
-                // get the seq
-                size_t sfile_path_len = kpath_len + 5;
-                char sfile_path[sfile_path_len];
-                snprintf(sfile_path, sizeof(sfile_path), "%s/seq", kpath);
-                FILE *sfile = fopen(sfile_path, "r");
-                if (!sfile) {
-                    SHC_ERROR("Can't read the key file %s: %s", kfile_path, strerror(errno));
-                    free(key);
-                    fclose(kfile);
-                    continue;
-                }
-                uint64_t seq = 0;
-                if (fread(&seq, sizeof(seq), 1, sfile) != sizeof(seq)) {
-                    SHC_ERROR("Can't read the key file %s: %s", kfile_path, strerror(errno));
-                    free(key);
-                    fclose(kfile);
-                    fclose(sfile);
-                    continue;
-                }
-                fclose(sfile);
-
-                // now that we have everything we can fill in the item to return
-                itms = realloc(itms, sizeof(kepaxos_log_item_t) * (nitems + 1));
-                kepaxos_log_item_t *kitem = &itms[nitems++];
-                kitem->ballot = b;
-                kitem->seq = seq;
-                kitem->klen = st.st_size;
-                kitem->key = key;
-            }
-        }
+    kepaxos_log_item_t *itms = log->count ? malloc(sizeof(kepaxos_log_item_t) * log->count) : NULL;
+    size_t i;
+    for (i = 0; i < log->size; i++) {
+        kepaxos_log_entry_t *entry = &log->table[i];
+        if (!entry->key || entry->ballot <= ballot)
+            continue;
+
+        kepaxos_log_item_t *kitem = &itms[nitems++];
+        kitem->ballot = entry->ballot;
+        kitem->seq = entry->seq;
+        kitem->klen = entry->klen;
+        kitem->key = malloc(entry->klen);
+        memcpy(kitem->key, entry->key, entry->klen);
     }
-    closedir(ballots_dir);
+    MUTEX_UNLOCK(&log->lock);
     *items = itms;
     *num_items = nitems;
 
@@ -11,9 +11,29 @@ void kepaxos_log_destroy(kepaxos_log_t *log);
 
 
 uint64_t kepaxos_last_seq_for_key(kepaxos_log_t *log, void *key, size_t klen, uint64_t *ballot);
-void kepaxos_set_last_seq_for_key(kepaxos_log_t *log, void *key, size_t klen, uint64_t ballot, uint64_t seq);
+// returns 0 once the record is durable (according to the durability mode),
+// -1 if it couldn't be written (errno is set). After a failure all the
+// records fail until the segment is reopened using kepaxos_log_reopen()
+int kepaxos_set_last_seq_for_key(kepaxos_log_t *log, void *key, size_t klen, uint64_t ballot, uint64_t seq);
 uint64_t kepaxos_max_ballot(kepaxos_log_t *log);
 
+typedef enum {
+    KEPAXOS_LOG_DURABILITY_NONE = 0,    // leave the records to the page cache
+    KEPAXOS_LOG_DURABILITY_BATCHED = 1, // group-commit concurrent records (one write + one fdatasync)
+    KEPAXOS_LOG_DURABILITY_SYNC = 2     // fdatasync after each record
+} kepaxos_log_durability_t;
+
+// group_window is the number of microseconds a group-commit leader waits
+// for more records before flushing (0 == flush immediately)
+void kepaxos_log_set_durability(kepaxos_log_t *log, kepaxos_log_durability_t mode, int group_window);
+kepaxos_log_durability_t kepaxos_log_durability(kepaxos_log_t *log);
+
+// reopens the segment (discarding the records which failed to be written)
+// and clears the error left by a failed write
+int kepaxos_log_reopen(kepaxos_log_t *log);
+// returns the error left by a failed write (0 if the segment is writable)
+int kepaxos_log_error(kepaxos_log_t *log);
+
 typedef struct {
     void *key;
     size_t klen;
@@ -1,11 +1,49 @@
 #include "shardcache.h"
 
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic_defs.h>
+
 #define SHC_ESCAPE_BUFFER_SIZE_MAX (1<<16)
 
+#define SHC_LOG_MESSAGE_MAXLEN 1024 // longer messages are truncated
+#define SHC_LOG_RING_SIZE 4096      // messages queued at most (must be a power of 2)
+#define SHC_LOG_IDLE_SLEEP 1000     // microsecs the logger thread sleeps when there is nothing to log
+
 unsigned int shardcache_loglevel = 0;
 
 int shardcache_log_initialized = 0;
 
+/*
+ * Asynchronous logging.
+ *
+ * The messages are formatted by the caller into a slot of a bounded ring buffer
+ * and emitted by the logger thread. Each slot holds a sequence number telling
+ * if it can be written (seq == position) or read (seq == position + 1), so the
+ * producers only need to CAS the head position to reserve a slot and the
+ * (single) consumer never takes a lock. A full ring makes the producer drop
+ * its message instead of waiting.
+ * The producers are counted while using the ring, so that when disabling
+ * the asynchronous mode the logger thread is stopped (and the ring drained
+ * for the last time) only once all the messages queued have been published.
+ */
+typedef struct {
+    uint64_t seq;
+    int prio;
+    char msg[SHC_LOG_MESSAGE_MAXLEN];
+} shardcache_log_slot_t;
+
+static shardcache_log_slot_t *shardcache_log_ring = NULL;
+static uint64_t shardcache_log_head = 0;    // the next slot to write
+static uint64_t shardcache_log_tail = 0;    // the next slot to read (only the logger thread)
+static uint64_t shardcache_log_dropped_messages = 0;
+static int shardcache_log_async_enabled = 0;
+static int shardcache_log_async_producers = 0; // the producers which might be using the ring
+static int shardcache_log_async_quit = 0;
+static pthread_t shardcache_log_th;
+static pthread_mutex_t shardcache_log_async_lock = PTHREAD_MUTEX_INITIALIZER;
+
 unsigned long shardcache_byte_escape(char ch,
                              char esc,
                              char *buffer,
@@ -93,63 +131,190 @@ unsigned int shardcache_log_level()
     return shardcache_loglevel;
 }
 
-void shardcache_log_message(int prio, int dbglevel, const char *fmt, ...)
+static const char *
+shardcache_log_prefix(int prio, int dbglevel)
 {
-    char *newfmt = NULL;
-    const char *prefix = NULL;
-
     switch (prio) {
         case LOG_ERR:
-            prefix = "[ERROR]: ";
-            break;
+            return "[ERROR]: ";
         case LOG_WARNING:
-            prefix = "[WARNING]: ";
-            break;
+            return "[WARNING]: ";
         case LOG_NOTICE:
-            prefix = "[NOTICE]: ";
-            break;
+            return "[NOTICE]: ";
         case LOG_INFO:
-            prefix = "[INFO]: ";
-            break;
+            return "[INFO]: ";
         case LOG_DEBUG:
             switch (dbglevel) {
                 case 1:
-                    prefix = "[DBG]: ";
-                    break;
+                    return "[DBG]: ";
                 case 2:
-                    prefix = "[DBG2]: ";
-                    break;
+                    return "[DBG2]: ";
                 case 3:
-                    prefix = "[DBG3]: ";
-                    break;
+                    return "[DBG3]: ";
                 case 4:
-                    prefix = "[DBG4]: ";
-                    break;
+                    return "[DBG4]: ";
                 case 5:
-                    prefix = "[DBG5]: ";
-                    break;
+                    return "[DBG5]: ";
                 default:
-                    prefix = "[DBGX]: ";
-                    break;
+                    return "[DBGX]: ";
             }
-            break;
         default:
-            prefix = "[UNKNOWN]: ";
             break;
     }
+    return "[UNKNOWN]: ";
+}
 
-    // ensure the user passed a valid 'fmt' pointer before proceeding
-    if (prefix && fmt) { 
-        newfmt = (char *)calloc(1, strlen(fmt)+strlen(prefix)+1);
-        if (newfmt) { // safety belts in case we are out of memory
-            sprintf(newfmt, "%s%s", prefix, fmt);
-            va_list arg;
-            va_start(arg, fmt);
-            vsyslog(prio, newfmt, arg);
-            va_end(arg);
-            free(newfmt);
+static void
+shardcache_log_format(char *out, const char *prefix, const char *fmt, va_list arg)
+{
+    size_t plen = strlen(prefix);
+    memcpy(out, prefix, plen);
+    vsnprintf(out + plen, SHC_LOG_MESSAGE_MAXLEN - plen, fmt, arg);
+}
+
+static int
+shardcache_log_enqueue(int prio, const char *prefix, const char *fmt, va_list arg)
+{
+    shardcache_log_slot_t *slot;
+    uint64_t pos = ATOMIC_READ(shardcache_log_head);
+    for (;;) {
+        slot = &shardcache_log_ring[pos & (SHC_LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)ATOMIC_READ(slot->seq) - (int64_t)pos;
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&shardcache_log_head, pos, pos + 1))
+                break;
+            pos = ATOMIC_READ(shardcache_log_head);
+        } else if (diff < 0) {
+            // the logger thread is behind by a whole ring
+            ATOMIC_INCREMENT(shardcache_log_dropped_messages);
+            return -1;
+        } else {
+            // another producer took the slot in the meanwhile
+            pos = ATOMIC_READ(shardcache_log_head);
+        }
+    }
+
+    slot->prio = prio;
+    shardcache_log_format(slot->msg, prefix, fmt, arg);
+    // publish the message to the logger thread
+    __sync_synchronize();
+    ATOMIC_SET(slot->seq, pos + 1);
+    return 0;
+}
+
+// emits the queued messages, returns the number of messages emitted
+static int
+shardcache_log_drain()
+{
+    int count = 0;
+    for (;;) {
+        shardcache_log_slot_t *slot = &shardcache_log_ring[shardcache_log_tail & (SHC_LOG_RING_SIZE - 1)];
+        if (ATOMIC_READ(slot->seq) != shardcache_log_tail + 1)
+            break;
+        syslog(slot->prio, "%s", slot->msg);
+        // the slot can be written again in the next round of the ring
+        ATOMIC_SET(slot->seq, shardcache_log_tail + SHC_LOG_RING_SIZE);
+        shardcache_log_tail++;
+        count++;
+    }
+    return count;
+}
+
+static void *
+shardcache_log_thread(void *priv)
+{
+    while (!ATOMIC_READ(shardcache_log_async_quit)) {
+        if (!shardcache_log_drain())
+            usleep(SHC_LOG_IDLE_SLEEP);
+    }
+    // emit whatever has been queued before stopping
+    shardcache_log_drain();
+    return NULL;
+}
+
+static void
+shardcache_log_async_atexit()
+{
+    shardcache_log_async(0);
+}
+
+int
+shardcache_log_async(int enable)
+{
+    static int atexit_registered = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&shardcache_log_async_lock);
+
+    if (enable && !ATOMIC_READ(shardcache_log_async_enabled)) {
+        // the ring is never released, since a producer might
+        // still be using it right after the thread is stopped
+        if (!shardcache_log_ring) {
+            shardcache_log_ring = calloc(SHC_LOG_RING_SIZE, sizeof(shardcache_log_slot_t));
+            if (!shardcache_log_ring) {
+                pthread_mutex_unlock(&shardcache_log_async_lock);
+                return -1;
+            }
+            int i;
+            for (i = 0; i < SHC_LOG_RING_SIZE; i++)
+                shardcache_log_ring[i].seq = i;
+        }
+        ATOMIC_SET(shardcache_log_async_quit, 0);
+        if (pthread_create(&shardcache_log_th, NULL, shardcache_log_thread, NULL) == 0) {
+            ATOMIC_SET(shardcache_log_async_enabled, 1);
+            if (!atexit_registered++)
+                atexit(shardcache_log_async_atexit);
+        } else {
+            rc = -1;
         }
+    } else if (!enable && ATOMIC_READ(shardcache_log_async_enabled)) {
+        ATOMIC_SET(shardcache_log_async_enabled, 0);
+        // the producers which still saw the asynchronous mode enabled
+        // must publish their messages before the final drain
+        while (ATOMIC_READ(shardcache_log_async_producers))
+            sched_yield();
+        ATOMIC_SET(shardcache_log_async_quit, 1);
+        pthread_join(shardcache_log_th, NULL);
+    }
+
+    pthread_mutex_unlock(&shardcache_log_async_lock);
+    return rc;
+}
+
+uint64_t
+shardcache_log_dropped()
+{
+    return ATOMIC_READ(shardcache_log_dropped_messages);
+}
+
+void shardcache_log_message(int prio, int dbglevel, const char *fmt, ...)
+{
+    // ensure the user passed a valid 'fmt' pointer before proceeding
+    if (!fmt)
+        return;
+
+    // don't bother formatting messages which syslog would discard
+    if (shardcache_log_initialized && prio > (int)shardcache_loglevel)
+        return;
+
+    const char *prefix = shardcache_log_prefix(prio, dbglevel);
+
+    va_list arg;
+    va_start(arg, fmt);
+    // the producer is accounted before checking if the asynchronous mode
+    // is enabled, so that shardcache_log_async(0) either waits for it or
+    // has already disabled the mode (and the message is emitted synchronously)
+    ATOMIC_INCREMENT(shardcache_log_async_producers);
+    int async = ATOMIC_READ(shardcache_log_async_enabled);
+    if (async)
+        shardcache_log_enqueue(prio, prefix, fmt, arg);
+    ATOMIC_DECREMENT(shardcache_log_async_producers);
+    if (!async) {
+        char msg[SHC_LOG_MESSAGE_MAXLEN];
+        shardcache_log_format(msg, prefix, fmt, arg);
+        syslog(prio, "%s", msg);
     }
+    va_end(arg);
 }
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
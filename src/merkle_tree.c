@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef HAVE_UINT64_T
+#define HAVE_UINT64_T
+#endif
+#include <siphash.h>
+
+#include "merkle_tree.h"
+
+struct __merkle_tree_s {
+    int depth;
+    uint64_t *levels[MERKLE_TREE_MAX_DEPTH + 1]; // the hashes of the nodes, level by level
+};
+
+// NOTE: these seeds are part of the replica protocol,
+//       replicas using different seeds will never agree
+static unsigned char merkle_leaf_seed[16]   = "shc_merkle_leaf0";
+static unsigned char merkle_digest_seed[16] = "shc_merkle_item0";
+
+merkle_tree_t *
+merkle_tree_create(int depth)
+{
+    if (depth < 1 || depth > MERKLE_TREE_MAX_DEPTH)
+        return NULL;
+
+    merkle_tree_t *tree = calloc(1, sizeof(merkle_tree_t));
+    tree->depth = depth;
+
+    int i;
+    uint32_t num_nodes = 1;
+    for (i = 0; i <= depth; i++) {
+        tree->levels[i] = calloc(num_nodes, sizeof(uint64_t));
+        if (!tree->levels[i]) {
+            merkle_tree_destroy(tree);
+            return NULL;
+        }
+        num_nodes *= MERKLE_TREE_FANOUT;
+    }
+
+    return tree;
+}
+
+void
+merkle_tree_destroy(merkle_tree_t *tree)
+{
+    int i;
+    for (i = 0; i <= tree->depth; i++)
+        free(tree->levels[i]);
+    free(tree);
+}
+
+int
+merkle_tree_depth(merkle_tree_t *tree)
+{
+    return tree->depth;
+}
+
+uint32_t
+merkle_tree_num_nodes(merkle_tree_t *tree, int level)
+{
+    if (level < 0 || level > tree->depth)
+        return 0;
+
+    uint32_t num_nodes = 1;
+    while (level--)
+        num_nodes *= MERKLE_TREE_FANOUT;
+    return num_nodes;
+}
+
+uint32_t
+merkle_tree_leaf(merkle_tree_t *tree, void *key, size_t klen)
+{
+    uint64_t hash = sip_hash24(merkle_leaf_seed, key, klen);
+    return hash % merkle_tree_num_nodes(tree, tree->depth);
+}
+
+uint64_t
+merkle_tree_digest(void *key, size_t klen, void *value, size_t vlen)
+{
+    // the value is hashed using a seed derived from the key
+    // so that the digest depends on both
+    uint64_t khash = sip_hash24(merkle_digest_seed, key, klen);
+    unsigned char seed[16];
+    memcpy(seed, &khash, sizeof(khash));
+    memcpy(seed + sizeof(khash), merkle_digest_seed + sizeof(khash), sizeof(seed) - sizeof(khash));
+    return sip_hash24(seed, value, vlen);
+}
+
+void
+merkle_tree_add(merkle_tree_t *tree, void *key, size_t klen, uint64_t digest)
+{
+    uint32_t index = merkle_tree_leaf(tree, key, klen);
+    int level;
+    for (level = tree->depth; level >= 0; level--) {
+        tree->levels[level][index] ^= digest;
+        index /= MERKLE_TREE_FANOUT;
+    }
+}
+
+uint64_t
+merkle_tree_hash(merkle_tree_t *tree, int level, uint32_t index)
+{
+    if (index >= merkle_tree_num_nodes(tree, level))
+        return 0;
+    return tree->levels[level][index];
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,96 @@
+#ifndef __SHARDCACHE_MERKLE_TREE_H__
+#define __SHARDCACHE_MERKLE_TREE_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* Hash tree summarizing the content of the storage.
+ *
+ * The key space is split into MERKLE_TREE_FANOUT^depth ranges (the leaves)
+ * according to the hash of the keys. Each node holds a 64bit hash of all the
+ * items (key + value) falling into its subtree, so two replicas can find out
+ * which ranges differ by comparing the root and descending only into the
+ * subtrees whose hashes don't match.
+ *
+ * The hash of a node is the xor of the digests of the items in its subtree,
+ * which makes it independent from the order in which the items are added.
+ */
+
+#define MERKLE_TREE_FANOUT 16
+#define MERKLE_TREE_MAX_DEPTH 6
+
+typedef struct __merkle_tree_s merkle_tree_t;
+
+/*
+ * @brief Create a new (empty) tree
+ * @param depth The number of levels below the root (1 to MERKLE_TREE_MAX_DEPTH)
+ * @return A valid merkle_tree_t structure, NULL in case of errors
+ */
+merkle_tree_t *merkle_tree_create(int depth);
+
+/*
+ * @brief Release all the resources used by a tree
+ * @param tree A valid merkle_tree_t structure
+ */
+void merkle_tree_destroy(merkle_tree_t *tree);
+
+/*
+ * @brief Get the depth of a tree
+ * @param tree A valid merkle_tree_t structure
+ * @return The number of levels below the root
+ */
+int merkle_tree_depth(merkle_tree_t *tree);
+
+/*
+ * @brief Get the number of nodes at a given level
+ * @param tree  A valid merkle_tree_t structure
+ * @param level The level (0 == root)
+ * @return The number of nodes at the given level, 0 if the level is not valid
+ */
+uint32_t merkle_tree_num_nodes(merkle_tree_t *tree, int level);
+
+/*
+ * @brief Get the leaf a key belongs to
+ * @param tree A valid merkle_tree_t structure
+ * @param key  The key
+ * @param klen The length of the key
+ * @return The index of the leaf
+ */
+uint32_t merkle_tree_leaf(merkle_tree_t *tree, void *key, size_t klen);
+
+/*
+ * @brief Compute the digest of an item
+ * @param key   The key
+ * @param klen  The length of the key
+ * @param value The value
+ * @param vlen  The length of the value
+ * @return The 64bit digest of the item
+ */
+uint64_t merkle_tree_digest(void *key, size_t klen, void *value, size_t vlen);
+
+/*
+ * @brief Add an item to the tree
+ * @param tree   A valid merkle_tree_t structure
+ * @param key    The key
+ * @param klen   The length of the key
+ * @param digest The digest of the item (as returned by merkle_tree_digest())
+ * @note Adding the same item twice removes it
+ */
+void merkle_tree_add(merkle_tree_t *tree, void *key, size_t klen, uint64_t digest);
+
+/*
+ * @brief Get the hash of a node
+ * @param tree  A valid merkle_tree_t structure
+ * @param level The level of the node (0 == root)
+ * @param index The index of the node in its level
+ * @return The hash of the node (0 if the node doesn't exist)
+ * @note The children of the node at index N are the nodes
+ *       from N * MERKLE_TREE_FANOUT to (N + 1) * MERKLE_TREE_FANOUT - 1
+ *       in the next level
+ */
+uint64_t merkle_tree_hash(merkle_tree_t *tree, int level, uint32_t index);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
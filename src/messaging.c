@@ -16,6 +16,7 @@
 
 #include "messaging.h"
 #include "connections.h"
+#include "metrics.h"
 #include "shardcache.h"
 
 #include <atomic_defs.h>
@@ -445,6 +446,8 @@ read_async_timeout(iomux_t *iomux, int fd, void *priv)
         getpeername(fd, (struct sockaddr *)&saddr, &addr_len);
         SHC_WARNING("Timeout while waiting for data from %s (timeout: %d milliseconds)",
                     inet_ntoa(saddr.sin_addr), tcp_timeout);
+        // the callbacks run from iomux_close() can tell the error was a timeout
+        errno = ETIMEDOUT;
         iomux_close(iomux, fd);
     } else { 
         iomux_set_timeout(iomux, fd, &maxwait);
@@ -573,6 +576,7 @@ fetch_from_peer_async(char *peer,
                       size_t klen,
                       size_t offset,
                       size_t len,
+                      uint64_t trace_id,
                       fetch_from_peer_async_cb cb,
                       void *priv,
                       int fd,
@@ -587,8 +591,9 @@ fetch_from_peer_async(char *peer,
 
     uint32_t offset_nbo = htonl(offset);
     uint32_t len_nbo = htonl(len);
+    uint32_t trace_id_nbo[2] = { htonl(trace_id >> 32), htonl(trace_id & 0xffffffff) };
     if (fd >= 0) {
-        shardcache_record_t record[3] = {
+        shardcache_record_t record[4] = {
             {
                 .v = key,
                 .l = klen
@@ -600,13 +605,22 @@ fetch_from_peer_async(char *peer,
             {
                 .v = &len_nbo,
                 .l = sizeof(uint32_t)
+            },
+            {
+                .v = trace_id_nbo,
+                .l = sizeof(trace_id_nbo)
             }
         };
 
-        if (!offset && !len)
-            rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_ASYNC, &record[0], 1);
-        else
-            rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_OFFSET, record, 3);
+        // the trace id (if any) is sent as the last record
+        // (peers not supporting the tracing just ignore it)
+        if (!offset && !len) {
+            if (trace_id)
+                record[1] = record[3];
+            rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_ASYNC, record, trace_id ? 2 : 1);
+        } else {
+            rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_OFFSET, record, trace_id ? 4 : 3);
+        }
 
         if (rc == 0) {
             fetch_from_peer_helper_arg_t *arg = calloc(1, sizeof(fetch_from_peer_helper_arg_t));
@@ -767,12 +781,18 @@ read_message(int fd,
                 hdr != SHC_HDR_MIGRATION_END &&
                 hdr != SHC_HDR_CHECK &&
                 hdr != SHC_HDR_STATS &&
+                hdr != SHC_HDR_HOTKEYS &&
+                hdr != SHC_HDR_TRACES &&
                 hdr != SHC_HDR_GET_INDEX &&
                 hdr != SHC_HDR_INDEX_RESPONSE &&
                 hdr != SHC_HDR_REPLICA_COMMAND &&
                 hdr != SHC_HDR_REPLICA_RESPONSE &&
                 hdr != SHC_HDR_REPLICA_PING &&
                 hdr != SHC_HDR_REPLICA_ACK &&
+                hdr != SHC_HDR_REPLICA_BATCH &&
+                hdr != SHC_HDR_REPLICA_BATCH_RESPONSE &&
+                hdr != SHC_HDR_REPLICA_TREE &&
+                hdr != SHC_HDR_REPLICA_TREE_RESPONSE &&
                 hdr != SHC_HDR_RESPONSE)
             {
                 if (shash)
@@ -1311,10 +1331,8 @@ fetch_from_peer(char *peer,
             int num_records = read_message(fd, auth, &out, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 if (fbuf_used(out)) {
-                    char keystr[1024];
-                    memcpy(keystr, key, len < 1024 ? len : 1024);
-                    keystr[len] = 0;
-                    SHC_DEBUG2("Got new data from peer %s : %s => %s", peer, keystr,
+                    SHC_DEBUG2("Got new data from peer %s : %.*s => %s", peer,
+                              (int)(len < 1024 ? len : 1024), (char *)key,
                               shardcache_hex_escape(fbuf_data(out), fbuf_used(out), DEBUG_DUMP_MAXSIZE, 0));
                 }
                 if (should_close)
@@ -1372,10 +1390,8 @@ offset_from_peer(char *peer,
             int num_records = read_message(fd, auth, &out, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 if (fbuf_used(out)) {
-                    char keystr[1024];
-                    memcpy(keystr, key, len < 1024 ? len : 1024);
-                    keystr[len] = 0;
-                    SHC_DEBUG2("Got new data from peer %s : %s => %s", peer, keystr,
+                    SHC_DEBUG2("Got new data from peer %s : %.*s => %s", peer,
+                              (int)(len < 1024 ? len : 1024), (char *)key,
                               shardcache_hex_escape(fbuf_data(out), fbuf_used(out), DEBUG_DUMP_MAXSIZE, 0));
                 }
                 if (should_close)
@@ -1517,13 +1533,16 @@ touch_on_peer(char *peer,
 }
 
 
-int
-stats_from_peer(char *peer,
-                char *auth,
-                unsigned char sig_hdr,
-                char **out,
-                size_t *len,
-                int fd)
+// send an administrative command and read back its (textual) response
+static int
+admin_command_to_peer(char *peer,
+                      char *auth,
+                      unsigned char sig_hdr,
+                      shardcache_hdr_t cmd,
+                      shardcache_record_t *record,
+                      char **out,
+                      size_t *len,
+                      int fd)
 {
     int should_close = 0;
     if (fd < 0) {
@@ -1531,9 +1550,9 @@ stats_from_peer(char *peer,
         should_close = 1;
     }
 
+    int ret = -1;
     if (fd >= 0) {
-        int rc = write_message(fd, auth, sig_hdr,
-                SHC_HDR_STATS, NULL, 0);
+        int rc = write_message(fd, auth, sig_hdr, cmd, record, record ? 1 : 0);
         if (rc == 0) {
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
@@ -1547,17 +1566,103 @@ stats_from_peer(char *peer,
                     *out = malloc(l);
                     memcpy(*out, fbuf_data(&resp), l-1);
                     (*out)[l-1] = 0;
-                    if (should_close)
-                        close(fd);
                 }
-                return 0;
+                ret = 0;
             }
             fbuf_destroy(&resp);
         }
         if (should_close)
             close(fd);
     }
-    return -1;
+    return ret;
+}
+
+int
+stats_from_peer(char *peer,
+                char *auth,
+                unsigned char sig_hdr,
+                char **out,
+                size_t *len,
+                int fd)
+{
+    return admin_command_to_peer(peer, auth, sig_hdr, SHC_HDR_STATS, NULL, out, len, fd);
+}
+
+int
+metrics_from_peer(char *peer,
+                  char *auth,
+                  unsigned char sig_hdr,
+                  char **out,
+                  size_t *len,
+                  int fd)
+{
+    shardcache_record_t record = {
+        .v = SHARDCACHE_METRICS_FORMAT,
+        .l = strlen(SHARDCACHE_METRICS_FORMAT)
+    };
+    return admin_command_to_peer(peer, auth, sig_hdr, SHC_HDR_STATS, &record, out, len, fd);
+}
+
+int
+hotkeys_from_peer(char *peer,
+                  char *auth,
+                  unsigned char sig_hdr,
+                  char **out,
+                  size_t *len,
+                  int fd)
+{
+    return admin_command_to_peer(peer, auth, sig_hdr, SHC_HDR_HOTKEYS, NULL, out, len, fd);
+}
+
+int
+traces_from_peer(char *peer,
+                 char *auth,
+                 unsigned char sig_hdr,
+                 uint32_t min_usecs,
+                 char **out,
+                 size_t *len,
+                 int fd)
+{
+    uint32_t min_usecs_nbo = htonl(min_usecs);
+    shardcache_record_t record = {
+        .v = &min_usecs_nbo,
+        .l = sizeof(uint32_t)
+    };
+    return admin_command_to_peer(peer, auth, sig_hdr, SHC_HDR_TRACES, &record, out, len, fd);
+}
+
+int
+replica_tree_from_peer(char *peer,
+                       char *auth,
+                       unsigned char sig_hdr,
+                       void *req,
+                       size_t reqlen,
+                       fbuf_t *out,
+                       int fd)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    int rc = -1;
+    if (fd >= 0) {
+        shardcache_record_t record = {
+            .v = req,
+            .l = reqlen
+        };
+        rc = write_message(fd, auth, sig_hdr, SHC_HDR_REPLICA_TREE, &record, 1);
+        if (rc == 0) {
+            shardcache_hdr_t hdr = 0;
+            int num_records = read_message(fd, auth, &out, 1, &hdr, 0);
+            if (hdr != SHC_HDR_REPLICA_TREE_RESPONSE || num_records != 1)
+                rc = -1;
+        }
+        if (should_close)
+            close(fd);
+    }
+    return rc;
 }
 
 int
@@ -1597,11 +1702,66 @@ check_peer(char *peer,
     return -1;
 }
 
-shardcache_storage_index_t *
-index_from_peer(char *peer,
-                char *auth,
-                unsigned char sig_hdr,
-                int fd)
+typedef struct {
+    fbuf_t buf;            // holds the incomplete item (if any)
+    index_from_peer_cb cb;
+    void *priv;
+    int count;
+    int done;
+    int stop;
+} index_from_peer_helper_arg_t;
+
+static int
+index_from_peer_helper(void *data, size_t len, int idx, void *priv)
+{
+    index_from_peer_helper_arg_t *arg = (index_from_peer_helper_arg_t *)priv;
+
+    if (idx != 0 || !len || arg->done)
+        return (idx >= -1) ? 0 : -1;
+
+    fbuf_add_binary(&arg->buf, data, len);
+
+    char *items = fbuf_data(&arg->buf);
+    int used = fbuf_used(&arg->buf);
+    int ofx = 0;
+    while (ofx + sizeof(uint32_t) <= used) {
+        uint32_t klen;
+        memcpy(&klen, items + ofx, sizeof(klen));
+        klen = ntohl(klen);
+        if (klen == 0) {
+            // the index has ended
+            arg->done = 1;
+            ofx = used;
+            break;
+        }
+        if (ofx + klen + 2 * sizeof(uint32_t) > used)
+            break; // wait for more data
+
+        uint32_t vlen;
+        memcpy(&vlen, items + ofx + sizeof(uint32_t) + klen, sizeof(vlen));
+        vlen = ntohl(vlen);
+
+        // NOTE: if the callback asks to stop we still need to consume
+        //       the whole message to keep the connection usable
+        if (!arg->stop) {
+            if (arg->cb(items + ofx + sizeof(uint32_t), klen, vlen, arg->priv) != 0)
+                arg->stop = 1;
+            else
+                arg->count++;
+        }
+        ofx += klen + 2 * sizeof(uint32_t);
+    }
+    fbuf_remove(&arg->buf, ofx);
+    return 0;
+}
+
+int
+index_from_peer_foreach(char *peer,
+                        char *auth,
+                        unsigned char sig_hdr,
+                        index_from_peer_cb cb,
+                        void *priv,
+                        int fd)
 {
     int should_close = 0;
     if (fd < 0) {
@@ -1609,46 +1769,102 @@ index_from_peer(char *peer,
         should_close = 1;
     }
 
-    shardcache_storage_index_t *index = calloc(1, sizeof(shardcache_storage_index_t));
-    if (fd >= 0) {
-        int rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_INDEX, NULL, 0);
-        if (rc == 0) {
-            fbuf_t resp = FBUF_STATIC_INITIALIZER;
-            fbuf_t *respp = &resp;
-            shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 1);
-            if (hdr == SHC_HDR_INDEX_RESPONSE && num_records == 1) {
-                char *data = fbuf_data(&resp);
-                int len = fbuf_used(&resp);
-                int ofx = 0;
-                while (ofx < len) {
-                    uint32_t *nklen = (uint32_t *)(data+ofx);
-                    uint32_t klen = ntohl(*nklen);
-                    if (klen == 0) {
-                        // the index has ended
-                        break;
-                    } else if (ofx + klen + 8 > len) {
-                        // TODO - Error messages (truncated?)
-                        break;
-                    }
-                    ofx += 4;
-                    void *key = malloc(klen);
-                    memcpy(key, data+ofx, klen);
-                    ofx += klen;
-                    uint32_t *nvlen = (uint32_t *)(data+ofx);
-                    uint32_t vlen = ntohl(*nvlen);
-                    ofx += 4;
-                    index->items = realloc(index->items, (index->size + 1) * sizeof(shardcache_storage_index_item_t));
-                    index->items[index->size].key = key;
-                    index->items[index->size].klen = klen;
-                    index->items[index->size].vlen = vlen;
-                    index->size++;
-                }
-            }
-            fbuf_destroy(&resp);
-        }
+    if (fd < 0)
+        return -1;
+
+    if (write_message(fd, auth, sig_hdr, SHC_HDR_GET_INDEX, NULL, 0) != 0) {
         if (should_close)
             close(fd);
+        return -1;
+    }
+
+    index_from_peer_helper_arg_t arg = {
+        .buf = FBUF_STATIC_INITIALIZER,
+        .cb = cb,
+        .priv = priv,
+        .count = 0,
+        .done = 0,
+        .stop = 0
+    };
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    // the items are handed to the callback while the response is being
+    // received, so only the last (incomplete) item is buffered
+    async_read_ctx_t *ctx = async_read_context_create(auth, index_from_peer_helper, &arg);
+    async_read_context_state_t state = SHC_STATE_READING_NONE;
+    char buf[1<<16];
+    while (state != SHC_STATE_READING_DONE &&
+           state != SHC_STATE_READING_ERR &&
+           state != SHC_STATE_AUTH_ERR)
+    {
+        int rb = read(fd, buf, sizeof(buf));
+        if (rb == -1 && (errno == EINTR || errno == EAGAIN)) {
+            // ignore the timeout, the peer might be still walking its storage
+            continue;
+        } else if (rb <= 0) {
+            state = SHC_STATE_READING_ERR;
+            break;
+        }
+
+        int ofx = 0;
+        while (ofx < rb) {
+            int processed = 0;
+            state = async_read_context_input_data(ctx, buf + ofx, rb - ofx, &processed);
+            if (state == SHC_STATE_READING_DONE ||
+                state == SHC_STATE_READING_ERR ||
+                state == SHC_STATE_AUTH_ERR)
+            {
+                break;
+            }
+            if (!processed) {
+                state = SHC_STATE_READING_ERR;
+                break;
+            }
+            ofx += processed;
+        }
+    }
+
+    int rc = -1;
+    if (state == SHC_STATE_READING_DONE && async_read_context_hdr(ctx) == SHC_HDR_INDEX_RESPONSE)
+        rc = arg.count;
+
+    async_read_context_destroy(ctx);
+    fbuf_destroy(&arg.buf);
+
+    if (should_close)
+        close(fd);
+
+    return rc;
+}
+
+static int
+index_from_peer_collect(void *key, size_t klen, size_t vlen, void *priv)
+{
+    shardcache_storage_index_t *index = (shardcache_storage_index_t *)priv;
+    index->items = realloc(index->items, (index->size + 1) * sizeof(shardcache_storage_index_item_t));
+    index->items[index->size].key = malloc(klen);
+    memcpy(index->items[index->size].key, key, klen);
+    index->items[index->size].klen = klen;
+    index->items[index->size].vlen = vlen;
+    index->size++;
+    return 0;
+}
+
+shardcache_storage_index_t *
+index_from_peer(char *peer,
+                char *auth,
+                unsigned char sig_hdr,
+                int fd)
+{
+    shardcache_storage_index_t *index = calloc(1, sizeof(shardcache_storage_index_t));
+    if (index_from_peer_foreach(peer, auth, sig_hdr, index_from_peer_collect, index, fd) == -1) {
+        int i;
+        for (i = 0; i < index->size; i++)
+            free(index->items[i].key);
+        free(index->items);
+        free(index);
+        return NULL;
     }
     return index;
 }
@@ -1748,5 +1964,14 @@ connect_to_peer(char *address_string, unsigned int timeout)
     return fd;
 }
 
+int
+connect_to_peer_nonblocking(char *address_string)
+{
+    int fd = open_connection_nonblocking(address_string, SHARDCACHE_PORT_DEFAULT);
+    if (fd < 0 && errno != EMFILE)
+        SHC_DEBUG("Can't connect to %s", address_string);
+    return fd;
+}
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
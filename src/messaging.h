@@ -39,6 +39,8 @@ typedef enum {
     // administrative commands
     SHC_HDR_CHECK            = 0x31,
     SHC_HDR_STATS            = 0x32,
+    SHC_HDR_HOTKEYS          = 0x33,
+    SHC_HDR_TRACES           = 0x34,
 
     // index-related commands
     SHC_HDR_GET_INDEX        = 0x41,
@@ -54,6 +56,10 @@ typedef enum {
     SHC_HDR_REPLICA_RESPONSE = 0xA1,
     SHC_HDR_REPLICA_PING     = 0xA2,
     SHC_HDR_REPLICA_ACK      = 0xA3,
+    SHC_HDR_REPLICA_BATCH    = 0xA4,
+    SHC_HDR_REPLICA_BATCH_RESPONSE = 0xA5,
+    SHC_HDR_REPLICA_TREE     = 0xA6,
+    SHC_HDR_REPLICA_TREE_RESPONSE = 0xA7,
 
     // signature headers
     SHC_HDR_SIGNATURE_SIP    = 0xF0,
@@ -196,6 +202,31 @@ int stats_from_peer(char *peer,
                     size_t *len,
                     int fd);
 
+// retrieve all the stats from a peer in the OpenMetrics text format
+int metrics_from_peer(char *peer,
+                      char *auth,
+                      unsigned char sig_hdr,
+                      char **out,
+                      size_t *len,
+                      int fd);
+
+// retrieve the hottest keys served by a peer
+int hotkeys_from_peer(char *peer,
+                      char *auth,
+                      unsigned char sig_hdr,
+                      char **out,
+                      size_t *len,
+                      int fd);
+
+// retrieve the slowest of the recent traced requests served by a peer
+int traces_from_peer(char *peer,
+                     char *auth,
+                     unsigned char sig_hdr,
+                     uint32_t min_usecs,
+                     char **out,
+                     size_t *len,
+                     int fd);
+
 // check if a peer is alive (using the CHK command)
 int check_peer(char *peer,
                char *auth,
@@ -213,18 +244,50 @@ int migrate_peer(char *peer,
 // abort migration
 int abort_migrate_peer(char *peer, char *auth, unsigned char sig_hdr, int fd);
 
+// send a REPLICA_TREE request to a peer and read the response
+int replica_tree_from_peer(char *peer,
+                           char *auth,
+                           unsigned char sig_hdr,
+                           void *req,
+                           size_t reqlen,
+                           fbuf_t *out,
+                           int fd);
+
 
 // connect to a given peer and return the opened filedescriptor
 int connect_to_peer(char *address_string, unsigned int timeout);
 
+// start connecting to a given peer without waiting for the connection
+// to be established and return the (non-blocking) filedescriptor
+int connect_to_peer_nonblocking(char *address_string);
+
 // retrieve the index of keys stored in a given peer
 // NOTE: caller must use shardcache_free_index() to release memory used
 //       by the returned shardcache_storage_index_t pointer
+//       (NULL is returned in case of errors)
 shardcache_storage_index_t *index_from_peer(char *peer,
                                             char *auth,
                                             unsigned char sig_hdr,
                                             int fd);
 
+// called for each item received by index_from_peer_foreach(),
+// the key is valid only until the callback returns.
+// returning a value other than 0 stops the iteration
+typedef int (*index_from_peer_cb)(void *key,
+                                  size_t klen,
+                                  size_t vlen,
+                                  void *priv);
+
+// stream the index from a peer without holding it in memory.
+// returns the number of items passed to the callback, -1 in case of errors
+// NOTE: in case of errors the filedescriptor (if provided) should not be reused
+int index_from_peer_foreach(char *peer,
+                            char *auth,
+                            unsigned char sig_hdr,
+                            index_from_peer_cb cb,
+                            void *priv,
+                            int fd);
+
 // idx = -1 , data == NULL, len = 0 when finished
 // idx = -2 , data == NULL, len = 0 if an error occurred
 typedef int (*async_read_callback_t)(void *data,
@@ -284,6 +347,8 @@ typedef struct {
 } async_read_wrk_t;
 #pragma pack(pop)
 
+// NOTE: a non-zero trace_id is sent to the peer together with the request
+//       so that the peer records its spans under the same trace (see tracing.h)
 int fetch_from_peer_async(char *peer,
                           char *auth,
                           unsigned char sig_hdr,
@@ -291,6 +356,7 @@ int fetch_from_peer_async(char *peer,
                           size_t klen,
                           size_t offset,
                           size_t len,
+                          uint64_t trace_id,
                           fetch_from_peer_async_cb cb,
                           void *priv,
                           int fd,
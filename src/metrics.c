@@ -0,0 +1,514 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <fbuf.h>
+#include <atomic_defs.h>
+
+#include "shardcache.h"
+#include "shardcache_internal.h"
+#include "connections.h"
+#include "metrics.h"
+
+#define SHARDCACHE_METRICS_PREFIX "shardcache_"
+#define SHARDCACHE_METRICS_HTTP_TIMEOUT 1     // seconds to read the whole request (and to write the whole response)
+#define SHARDCACHE_METRICS_HTTP_POLL_INTERVAL 500 // millisecs between two checks of the quit flag
+
+struct __shardcache_metrics_s {
+    shardcache_t *cache;
+    pthread_mutex_t lock;           // serializes the scrapes
+    fbuf_t buf;                     // the rendered text (reused by all the scrapes)
+    shardcache_counter_t *counters; // the counters read by the last scrape (reused as well)
+    int counters_size;
+    shardcache_histogram_snapshot_t snapshot;
+
+    pthread_mutex_t listener_lock;  // serializes the start/stop of the listener
+    pthread_t listener_th;
+    int listening;
+    int sock;
+    int quit;
+    fbuf_t http_buf;                // a copy of the text being sent to an http client
+};
+
+// the counters which only grow (until they are reset),
+// all the other ones are exported as gauges
+static const char *shardcache_metrics_monotonic[] = {
+    "migrated_items", "migrated_bytes", "scanned_items", "migration_errors",
+    "replica_commits", "replica_commit_fails", "replica_dispached",
+    "replica_responses", "replica_commands", "replica_acks", "replica_batches",
+    "replica_tree_syncs", "replica_tree_keys", "log_dropped", NULL
+};
+
+static const char *shardcache_metrics_arc_lists[] = { "mru", "mfu", "mrug", "mfug", NULL };
+
+static const char *shardcache_metrics_worker_stats[] = { "numfds", "pruning", NULL };
+
+shardcache_metrics_t *
+shardcache_metrics_create(shardcache_t *cache)
+{
+    shardcache_metrics_t *m = calloc(1, sizeof(shardcache_metrics_t));
+    if (!m)
+        return NULL;
+    m->cache = cache;
+    m->sock = -1;
+    FBUF_STATIC_INITIALIZER_POINTER(&m->buf, FBUF_MAXLEN_NONE, 4096, 4096, 1024);
+    FBUF_STATIC_INITIALIZER_POINTER(&m->http_buf, FBUF_MAXLEN_NONE, 4096, 4096, 1024);
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_mutex_init(&m->listener_lock, NULL);
+    return m;
+}
+
+void
+shardcache_metrics_destroy(shardcache_metrics_t *m)
+{
+    shardcache_metrics_http_listen(m, NULL);
+    pthread_mutex_destroy(&m->listener_lock);
+    pthread_mutex_destroy(&m->lock);
+    fbuf_destroy(&m->http_buf);
+    fbuf_destroy(&m->buf);
+    free(m->counters);
+    free(m);
+}
+
+// metric names can contain only letters, digits and underscores
+static void
+shardcache_metrics_add_name(fbuf_t *buf, const char *name, const char *suffix)
+{
+    fbuf_add(buf, SHARDCACHE_METRICS_PREFIX);
+    const char *p;
+    for (p = name; *p; p++) {
+        char c = *p;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+            c = '_';
+        fbuf_add_binary(buf, &c, 1);
+    }
+    if (suffix)
+        fbuf_add(buf, suffix);
+}
+
+static void
+shardcache_metrics_add_label_value(fbuf_t *buf, const char *value, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len && value[i]; i++) {
+        switch(value[i]) {
+            case '\\':
+                fbuf_add(buf, "\\\\");
+                break;
+            case '"':
+                fbuf_add(buf, "\\\"");
+                break;
+            case '\n':
+                fbuf_add(buf, "\\n");
+                break;
+            default:
+                fbuf_add_binary(buf, (char *)&value[i], 1);
+                break;
+        }
+    }
+}
+
+static void
+shardcache_metrics_add_family(fbuf_t *buf, const char *name, const char *type)
+{
+    fbuf_add(buf, "# TYPE ");
+    shardcache_metrics_add_name(buf, name, NULL);
+    fbuf_printf(buf, " %s\n", type);
+}
+
+// a sample carrying a single label (if label_name is not NULL)
+static void
+shardcache_metrics_add_sample(fbuf_t *buf,
+                              const char *name,
+                              int monotonic,
+                              const char *label_name,
+                              const char *label_value,
+                              size_t label_len,
+                              uint64_t value)
+{
+    shardcache_metrics_add_name(buf, name, monotonic ? "_total" : NULL);
+    if (label_name) {
+        fbuf_printf(buf, "{%s=\"", label_name);
+        shardcache_metrics_add_label_value(buf, label_value, label_len);
+        fbuf_add(buf, "\"}");
+    }
+    fbuf_printf(buf, " %llu\n", (unsigned long long)value);
+}
+
+static int
+shardcache_metrics_is_monotonic(const char *name)
+{
+    static const char *counters_names[SHARDCACHE_NUM_COUNTERS] = SHARDCACHE_COUNTER_LABELS_ARRAY;
+    int i;
+    for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i++) {
+        if (strcmp(name, counters_names[i]) == 0)
+            return !SHARDCACHE_COUNTER_IS_GAUGE(i);
+    }
+    for (i = 0; shardcache_metrics_monotonic[i]; i++) {
+        if (strcmp(name, shardcache_metrics_monotonic[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// "mru_size" -> "mru"
+static int
+shardcache_metrics_arc_list(const char *name)
+{
+    int i;
+    for (i = 0; shardcache_metrics_arc_lists[i]; i++) {
+        size_t len = strlen(shardcache_metrics_arc_lists[i]);
+        if (strncmp(name, shardcache_metrics_arc_lists[i], len) == 0 && strcmp(name + len, "_size") == 0)
+            return i;
+    }
+    return -1;
+}
+
+// "worker[3].numfds" -> "3" (returns the length of the index)
+static int
+shardcache_metrics_worker(const char *name, const char *stat, const char **index)
+{
+    if (strncmp(name, "worker[", 7) != 0)
+        return 0;
+    const char *end = strchr(name + 7, ']');
+    if (!end || end[1] != '.' || (stat && strcmp(end + 2, stat) != 0))
+        return 0;
+    *index = name + 7;
+    return end - *index;
+}
+
+// "peer_<label>_<stat>" -> "<label>" (returns the length of the label)
+static int
+shardcache_metrics_peer(const char *name, const char *stat, const char **label)
+{
+    if (strncmp(name, "peer_", 5) != 0)
+        return 0;
+    size_t len = strlen(name);
+    size_t stat_len = strlen(stat);
+    if (len <= 5 + stat_len + 1 ||
+        name[len - stat_len - 1] != '_' ||
+        strcmp(name + len - stat_len, stat) != 0)
+    {
+        return 0;
+    }
+    *label = name + 5;
+    return len - stat_len - 1 - 5;
+}
+
+static int
+shardcache_metrics_is_peer(const char *name)
+{
+    static const char *peer_stats[] = SHARDCACHE_PEER_STATS_LABELS_ARRAY;
+    const char *label;
+    int i;
+    for (i = 0; i < SHARDCACHE_PEER_NUM_EXPORTED_STATS; i++) {
+        if (shardcache_metrics_peer(name, peer_stats[i], &label))
+            return 1;
+    }
+    return 0;
+}
+
+static void
+shardcache_metrics_render_counters(shardcache_metrics_t *m, int num_counters)
+{
+    static const char *peer_stats[] = SHARDCACHE_PEER_STATS_LABELS_ARRAY;
+    fbuf_t *buf = &m->buf;
+    int i, s;
+
+    // the samples of a family must be contiguous, while the per-worker
+    // and the per-peer counters are interleaved, so each family of labeled
+    // counters is collected with a separate pass over the counters
+    for (i = 0; i < num_counters; i++) {
+        shardcache_counter_t *counter = &m->counters[i];
+        const char *label;
+        if (shardcache_metrics_arc_list(counter->name) >= 0 ||
+            shardcache_metrics_worker(counter->name, NULL, &label) ||
+            shardcache_metrics_is_peer(counter->name))
+        {
+            continue;
+        }
+        int monotonic = shardcache_metrics_is_monotonic(counter->name);
+        shardcache_metrics_add_family(buf, counter->name, monotonic ? "counter" : "gauge");
+        shardcache_metrics_add_sample(buf, counter->name, monotonic, NULL, NULL, 0, counter->value);
+    }
+
+    int found = 0;
+    for (i = 0; i < num_counters; i++) {
+        shardcache_counter_t *counter = &m->counters[i];
+        int list = shardcache_metrics_arc_list(counter->name);
+        if (list < 0)
+            continue;
+        if (!found++)
+            shardcache_metrics_add_family(buf, "arc_list_size", "gauge");
+        shardcache_metrics_add_sample(buf, "arc_list_size", 0, "list", shardcache_metrics_arc_lists[list],
+                                      strlen(shardcache_metrics_arc_lists[list]), counter->value);
+    }
+
+    for (s = 0; shardcache_metrics_worker_stats[s]; s++) {
+        char family[64];
+        snprintf(family, sizeof(family), "worker_%s", shardcache_metrics_worker_stats[s]);
+        found = 0;
+        for (i = 0; i < num_counters; i++) {
+            shardcache_counter_t *counter = &m->counters[i];
+            const char *index;
+            int len = shardcache_metrics_worker(counter->name, shardcache_metrics_worker_stats[s], &index);
+            if (!len)
+                continue;
+            if (!found++)
+                shardcache_metrics_add_family(buf, family, "gauge");
+            shardcache_metrics_add_sample(buf, family, 0, "worker", index, len, counter->value);
+        }
+    }
+
+    for (s = 0; s < SHARDCACHE_PEER_NUM_EXPORTED_STATS; s++) {
+        char family[64];
+        snprintf(family, sizeof(family), "peer_%s", peer_stats[s]);
+        // the statistics up to the connections count only grow,
+        // the following ones are gauges
+        int monotonic = (s <= SHARDCACHE_PEER_STAT_CONNECTS);
+        found = 0;
+        for (i = 0; i < num_counters; i++) {
+            shardcache_counter_t *counter = &m->counters[i];
+            const char *label;
+            int len = shardcache_metrics_peer(counter->name, peer_stats[s], &label);
+            if (!len)
+                continue;
+            if (!found++)
+                shardcache_metrics_add_family(buf, family, monotonic ? "counter" : "gauge");
+            shardcache_metrics_add_sample(buf, family, monotonic, "peer", label, len, counter->value);
+        }
+    }
+}
+
+static void
+shardcache_metrics_render_latencies(shardcache_metrics_t *m)
+{
+    static const char *latencies_names[SHARDCACHE_NUM_LATENCIES] = SHARDCACHE_LATENCY_LABELS_ARRAY;
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    fbuf_t *buf = &m->buf;
+    int i, q;
+
+    fbuf_add(buf, "# TYPE " SHARDCACHE_METRICS_PREFIX "latency_microseconds summary\n"
+                  "# UNIT " SHARDCACHE_METRICS_PREFIX "latency_microseconds microseconds\n");
+    for (i = 0; i < SHARDCACHE_NUM_LATENCIES; i++) {
+        shardcache_histogram_merge(m->cache->latencies[i], &m->snapshot);
+        // skip the code paths which have never been hit
+        if (!m->snapshot.count)
+            continue;
+        for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            fbuf_printf(buf, SHARDCACHE_METRICS_PREFIX "latency_microseconds{path=\"%s\",quantile=\"%g\"} %llu\n",
+                        latencies_names[i], quantiles[q],
+                        (unsigned long long)shardcache_histogram_percentile(&m->snapshot, quantiles[q] * 100));
+        }
+        fbuf_printf(buf, SHARDCACHE_METRICS_PREFIX "latency_microseconds_sum{path=\"%s\"} %llu\n"
+                         SHARDCACHE_METRICS_PREFIX "latency_microseconds_count{path=\"%s\"} %llu\n",
+                    latencies_names[i], (unsigned long long)m->snapshot.sum,
+                    latencies_names[i], (unsigned long long)m->snapshot.count);
+    }
+}
+
+void
+shardcache_metrics_render(shardcache_metrics_t *m, shardcache_metrics_callback_t cb, void *priv)
+{
+    pthread_mutex_lock(&m->lock);
+
+    fbuf_clear(&m->buf);
+    int num_counters = shardcache_read_counters(m->cache->counters, &m->counters, &m->counters_size);
+    shardcache_metrics_render_counters(m, num_counters);
+    shardcache_metrics_render_latencies(m);
+    fbuf_add(&m->buf, "# EOF\n");
+
+    cb(fbuf_data(&m->buf), fbuf_used(&m->buf), priv);
+
+    pthread_mutex_unlock(&m->lock);
+}
+
+static void
+shardcache_metrics_http_copy(char *data, size_t len, void *priv)
+{
+    fbuf_t *buf = (fbuf_t *)priv;
+    fbuf_add_binary(buf, data, len);
+}
+
+// the listener serves one client at a time, so a client can't take
+// longer than the deadline (rather than a timeout for each read or write,
+// which a client trickling a byte at a time would never hit)
+static void
+shardcache_metrics_http_deadline(struct timeval *deadline)
+{
+    struct timeval timeout = { SHARDCACHE_METRICS_HTTP_TIMEOUT, 0 };
+    gettimeofday(deadline, NULL);
+    timeradd(deadline, &timeout, deadline);
+}
+
+// sets the timeouts of the socket to the time left before the deadline
+// (returns 0 if the deadline has already passed)
+static int
+shardcache_metrics_http_timeout(int fd, struct timeval *deadline)
+{
+    struct timeval now, left;
+    gettimeofday(&now, NULL);
+    if (!timercmp(&now, deadline, <))
+        return 0;
+    timersub(deadline, &now, &left);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &left, sizeof(left));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &left, sizeof(left));
+    return 1;
+}
+
+// unlike write_socket() gives up once the send timeout expires
+static int
+shardcache_metrics_http_write(int fd, char *data, size_t len, struct timeval *deadline)
+{
+    size_t written = 0;
+    while (written < len) {
+        if (!shardcache_metrics_http_timeout(fd, deadline))
+            return -1;
+        ssize_t wb = write(fd, data + written, len - written);
+        if (wb < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += wb;
+    }
+    return 0;
+}
+
+static void
+shardcache_metrics_http_reply(int fd, char *status, char *content_type, char *body, size_t len)
+{
+    struct timeval deadline;
+    shardcache_metrics_http_deadline(&deadline);
+
+    char header[256];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: %s\r\n"
+                        "Content-Length: %lu\r\n"
+                        "Connection: close\r\n\r\n",
+                        status, content_type, (unsigned long)len);
+    if (shardcache_metrics_http_write(fd, header, hlen, &deadline) == 0 && len)
+        shardcache_metrics_http_write(fd, body, len, &deadline);
+}
+
+static void
+shardcache_metrics_http_serve(shardcache_metrics_t *m, int fd)
+{
+    struct timeval deadline;
+    shardcache_metrics_http_deadline(&deadline);
+
+    // only the request line matters, the headers are read (up to the
+    // size of the buffer) just to not reset the connection on the client
+    char request[2048];
+    size_t used = 0;
+    while (used < sizeof(request) - 1) {
+        if (!shardcache_metrics_http_timeout(fd, &deadline))
+            return;
+        int rb = read_socket(fd, request + used, sizeof(request) - 1 - used, 0);
+        if (rb == -1) // timed out (or failed) before getting the whole request
+            return;
+        if (rb == 0)
+            break;
+        used += rb;
+        request[used] = 0;
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+    request[used] = 0;
+
+    if (strncmp(request, "GET ", 4) != 0) {
+        shardcache_metrics_http_reply(fd, "405 Method Not Allowed", "text/plain", NULL, 0);
+        return;
+    }
+
+    char *path = request + 4;
+    size_t path_len = strcspn(path, " ?\r\n");
+    if (!((path_len == 8 && strncmp(path, "/metrics", 8) == 0) || (path_len == 1 && *path == '/'))) {
+        shardcache_metrics_http_reply(fd, "404 Not Found", "text/plain", NULL, 0);
+        return;
+    }
+
+    // the text is sent from a copy, so that a slow client
+    // doesn't hold the scrapes coming from the STATS command
+    fbuf_clear(&m->http_buf);
+    shardcache_metrics_render(m, shardcache_metrics_http_copy, &m->http_buf);
+    shardcache_metrics_http_reply(fd, "200 OK", SHARDCACHE_METRICS_CONTENT_TYPE,
+                                  fbuf_data(&m->http_buf), fbuf_used(&m->http_buf));
+}
+
+static void *
+shardcache_metrics_http_listener(void *priv)
+{
+    shardcache_metrics_t *m = (shardcache_metrics_t *)priv;
+    while (!ATOMIC_READ(m->quit)) {
+        struct pollfd pfd = { .fd = m->sock, .events = POLLIN };
+        if (poll(&pfd, 1, SHARDCACHE_METRICS_HTTP_POLL_INTERVAL) <= 0)
+            continue;
+        int fd = accept(m->sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                SHC_WARNING("Can't accept connections on the metrics listener: %s", strerror(errno));
+            continue;
+        }
+        shardcache_metrics_http_serve(m, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int
+shardcache_metrics_http_listen(shardcache_metrics_t *m, char *address)
+{
+    pthread_mutex_lock(&m->listener_lock);
+
+    if (m->listening) {
+        ATOMIC_SET(m->quit, 1);
+        pthread_join(m->listener_th, NULL);
+        close(m->sock);
+        m->sock = -1;
+        m->listening = 0;
+    }
+
+    if (!address) {
+        pthread_mutex_unlock(&m->listener_lock);
+        return 0;
+    }
+
+    char *brkt = NULL;
+    char *addr = strdup(address); // we need a temporary copy to be used by strtok
+    char *host = strtok_r(addr, ":", &brkt);
+    char *port_string = strtok_r(NULL, ":", &brkt);
+    int port = port_string ? atoi(port_string) : 0;
+
+    m->sock = port ? open_socket(host, port) : -1;
+    free(addr);
+    if (m->sock == -1) {
+        SHC_ERROR("Can't open the metrics listener on %s: %s", address, strerror(errno));
+        pthread_mutex_unlock(&m->listener_lock);
+        return -1;
+    }
+
+    ATOMIC_SET(m->quit, 0);
+    if (pthread_create(&m->listener_th, NULL, shardcache_metrics_http_listener, m) != 0) {
+        SHC_ERROR("Can't start the metrics listener thread");
+        close(m->sock);
+        m->sock = -1;
+        pthread_mutex_unlock(&m->listener_lock);
+        return -1;
+    }
+    m->listening = 1;
+
+    SHC_NOTICE("Serving the metrics on http://%s/metrics", address);
+    pthread_mutex_unlock(&m->listener_lock);
+    return 0;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,70 @@
+#ifndef __SHARDCACHE_METRICS_H__
+#define __SHARDCACHE_METRICS_H__
+
+#include <sys/types.h>
+
+#include "shardcache.h"
+
+/* OpenMetrics (Prometheus) exposition of the node statistics.
+ *
+ * All the exported counters are rendered as metric families named
+ * "shardcache_<name>": the per-worker and per-peer statistics and the sizes
+ * of the ARC lists are grouped in a single family each, carrying the
+ * worker index, the peer label or the list name as a label, and the
+ * latency histograms are rendered as summaries.
+ *
+ * The text is rendered in a buffer owned by the exporter and reused by all
+ * the scrapes (as well as the array the counters are read into), so once
+ * warmed up a scrape doesn't allocate memory.
+ *
+ * Besides being returned by the STATS command (when the "openmetrics"
+ * format is requested) the text can be served over HTTP by a dedicated
+ * thread (see shardcache_metrics_http_listen()).
+ */
+
+#define SHARDCACHE_METRICS_FORMAT "openmetrics"
+#define SHARDCACHE_METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+typedef struct __shardcache_metrics_s shardcache_metrics_t;
+
+/*
+ * @brief Callback receiving the rendered text
+ * @note The text is valid only until the callback returns
+ *       (and no other scrape can happen in the meanwhile)
+ */
+typedef void (*shardcache_metrics_callback_t)(char *data, size_t len, void *priv);
+
+/*
+ * @brief Create a new exporter
+ * @param cache The shardcache instance whose statistics are exported
+ * @return A valid shardcache_metrics_t structure, NULL in case of errors
+ */
+shardcache_metrics_t *shardcache_metrics_create(shardcache_t *cache);
+
+/*
+ * @brief Stop the HTTP listener (if any) and release all the resources
+ *        used by the exporter
+ */
+void shardcache_metrics_destroy(shardcache_metrics_t *m);
+
+/*
+ * @brief Render all the statistics in the OpenMetrics text format
+ * @param m   A valid shardcache_metrics_t structure
+ * @param cb  The callback receiving the rendered text
+ * @param priv A private pointer passed to the callback
+ */
+void shardcache_metrics_render(shardcache_metrics_t *m, shardcache_metrics_callback_t cb, void *priv);
+
+/*
+ * @brief Start (or stop) the HTTP listener
+ * @param m       A valid shardcache_metrics_t structure
+ * @param address The address to listen on ("host:port"), NULL stops the listener
+ * @return 0 on success, -1 if the address can't be bound
+ * @note A running listener is stopped before starting the new one
+ */
+int shardcache_metrics_http_listen(shardcache_metrics_t *m, char *address);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
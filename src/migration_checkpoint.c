@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <linklist.h>
+
+#include "migration_checkpoint.h"
+#include "shardcache.h"
+
+#define MIGRATION_CHECKPOINT_MAGIC "shardcache-migration-checkpoint 1"
+
+struct __migration_checkpoint_s {
+    char *path;             // the state file
+    char *target;           // the target continuum
+    uint64_t offset;        // the offset loaded from an existing checkpoint
+    int resumed;            // true if an existing checkpoint has been loaded
+    linked_list_t *peers;   // the peers which acknowledged the migration
+    pthread_mutex_t lock;
+};
+
+static int
+migration_checkpoint_load(migration_checkpoint_t *cp)
+{
+    FILE *in = fopen(cp->path, "r");
+    if (!in)
+        return -1;
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int valid = 0;
+    int lineno = 0;
+
+    while ((len = getline(&line, &size, in)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = 0;
+
+        if (lineno++ == 0) {
+            if (strcmp(line, MIGRATION_CHECKPOINT_MAGIC) != 0)
+                break;
+        } else if (strncmp(line, "target ", 7) == 0) {
+            if (strcmp(line + 7, cp->target) != 0)
+                break;
+            valid = 1;
+        } else if (strncmp(line, "offset ", 7) == 0) {
+            cp->offset = strtoull(line + 7, NULL, 10);
+        } else if (strncmp(line, "peer ", 5) == 0) {
+            list_push_value(cp->peers, strdup(line + 5));
+        }
+    }
+
+    free(line);
+    fclose(in);
+
+    if (!valid) {
+        cp->offset = 0;
+        list_clear(cp->peers);
+        return -1;
+    }
+
+    return 0;
+}
+
+migration_checkpoint_t *
+migration_checkpoint_create(char *path, char *target)
+{
+    migration_checkpoint_t *cp = calloc(1, sizeof(migration_checkpoint_t));
+    cp->path = strdup(path);
+    cp->target = strdup(target);
+    cp->peers = list_create();
+    list_set_free_value_callback(cp->peers, free);
+    pthread_mutex_init(&cp->lock, NULL);
+
+    if (migration_checkpoint_load(cp) == 0) {
+        cp->resumed = 1;
+        SHC_NOTICE("Resuming the migration from the checkpoint %s (offset: %"PRIu64")",
+                   cp->path, cp->offset);
+    } else if (access(cp->path, F_OK) == 0) {
+        SHC_WARNING("Discarding the checkpoint %s (it refers to a different migration)", cp->path);
+    }
+
+    if (!cp->resumed && migration_checkpoint_save(cp, 0) != 0) {
+        migration_checkpoint_destroy(cp, 0);
+        return NULL;
+    }
+
+    return cp;
+}
+
+void
+migration_checkpoint_destroy(migration_checkpoint_t *cp, int remove)
+{
+    if (remove)
+        unlink(cp->path);
+    list_destroy(cp->peers);
+    pthread_mutex_destroy(&cp->lock);
+    free(cp->path);
+    free(cp->target);
+    free(cp);
+}
+
+int
+migration_checkpoint_resumed(migration_checkpoint_t *cp)
+{
+    return cp->resumed;
+}
+
+uint64_t
+migration_checkpoint_offset(migration_checkpoint_t *cp)
+{
+    return cp->offset;
+}
+
+static int
+migration_checkpoint_write_peer(void *item, uint32_t idx, void *user)
+{
+    fprintf((FILE *)user, "peer %s\n", (char *)item);
+    return 1;
+}
+
+int
+migration_checkpoint_save(migration_checkpoint_t *cp, uint64_t offset)
+{
+    size_t tlen = strlen(cp->path) + 5;
+    char tmp_path[tlen];
+    snprintf(tmp_path, tlen, "%s.tmp", cp->path);
+
+    pthread_mutex_lock(&cp->lock);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        SHC_ERROR("Can't create the checkpoint %s: %s", tmp_path, strerror(errno));
+        pthread_mutex_unlock(&cp->lock);
+        return -1;
+    }
+
+    fprintf(out, "%s\ntarget %s\noffset %"PRIu64"\n", MIGRATION_CHECKPOINT_MAGIC, cp->target, offset);
+    list_foreach_value(cp->peers, migration_checkpoint_write_peer, out);
+
+    int rc = 0;
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+        rc = -1;
+    fclose(out);
+
+    if (rc == 0 && rename(tmp_path, cp->path) != 0)
+        rc = -1;
+
+    pthread_mutex_unlock(&cp->lock);
+
+    if (rc != 0) {
+        SHC_ERROR("Can't save the checkpoint %s: %s", cp->path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    return rc;
+}
+
+void
+migration_checkpoint_add_peer(migration_checkpoint_t *cp, char *label)
+{
+    if (migration_checkpoint_has_peer(cp, label))
+        return;
+    pthread_mutex_lock(&cp->lock);
+    list_push_value(cp->peers, strdup(label));
+    pthread_mutex_unlock(&cp->lock);
+}
+
+int
+migration_checkpoint_has_peer(migration_checkpoint_t *cp, char *label)
+{
+    int found = 0;
+    int i;
+    pthread_mutex_lock(&cp->lock);
+    for (i = 0; i < list_count(cp->peers); i++) {
+        if (strcmp((char *)list_pick_value(cp->peers, i), label) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cp->lock);
+    return found;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
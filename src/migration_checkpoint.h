@@ -0,0 +1,90 @@
+#ifndef __SHARDCACHE_MIGRATION_CHECKPOINT_H__
+#define __SHARDCACHE_MIGRATION_CHECKPOINT_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* On-disk checkpoint of a running migration.
+ *
+ * The file at <path> holds the state of the migration (the target continuum,
+ * the number of keys from the index which have been completely processed
+ * and the peers which acknowledged the migration).
+ * It's rewritten atomically (write to <path>.tmp + rename) each time
+ * migration_checkpoint_save() is called.
+ *
+ * The keys copied to their new owner are removed from the local storage
+ * right away, so there is nothing else to track.
+ *
+ * If a checkpoint for the same target continuum is found when creating a new
+ * one, its state is loaded so that the migration can be resumed from where
+ * it was interrupted.
+ *
+ * The offset is a position in the index, hence it's honoured only if the
+ * storage declares a stable order of the index (index_stable), otherwise
+ * the resumed migration rescans the whole index.
+ */
+
+typedef struct __migration_checkpoint_s migration_checkpoint_t;
+
+/*
+ * @brief Open (or create) the checkpoint for a migration
+ * @param path   The path of the checkpoint file
+ * @param target A string identifying the target continuum
+ * @return A valid migration_checkpoint_t structure, NULL in case of errors
+ * @note If an existing checkpoint refers to a different target it will be discarded
+ */
+migration_checkpoint_t *migration_checkpoint_create(char *path, char *target);
+
+/*
+ * @brief Release all the resources used by a checkpoint
+ * @param cp     A valid migration_checkpoint_t structure
+ * @param remove If true the checkpoint file will be removed
+ *               (the migration either completed or has been aborted)
+ */
+void migration_checkpoint_destroy(migration_checkpoint_t *cp, int remove);
+
+/*
+ * @brief Check if the checkpoint has been loaded from a previous run
+ * @param cp A valid migration_checkpoint_t structure
+ * @return 1 if resuming a previous migration, 0 otherwise
+ */
+int migration_checkpoint_resumed(migration_checkpoint_t *cp);
+
+/*
+ * @brief Get the number of keys from the index which had been
+ *        completely processed (and not removed from the storage)
+ *        when the checkpoint was saved
+ * @param cp A valid migration_checkpoint_t structure
+ * @return The offset in the index where to resume the scan
+ */
+uint64_t migration_checkpoint_offset(migration_checkpoint_t *cp);
+
+/*
+ * @brief Save the state of the migration
+ * @param cp     A valid migration_checkpoint_t structure
+ * @param offset The number of keys from the index which have been completely processed
+ *               (and not removed from the storage)
+ * @return 0 on success, -1 otherwise
+ */
+int migration_checkpoint_save(migration_checkpoint_t *cp, uint64_t offset);
+
+/*
+ * @brief Record that a peer acknowledged the migration
+ * @param cp    A valid migration_checkpoint_t structure
+ * @param label The label of the peer
+ * @note The peer will be persisted with the next migration_checkpoint_save()
+ */
+void migration_checkpoint_add_peer(migration_checkpoint_t *cp, char *label);
+
+/*
+ * @brief Check if a peer already acknowledged the migration
+ * @param cp    A valid migration_checkpoint_t structure
+ * @param label The label of the peer
+ * @return 1 if the peer acknowledged the migration, 0 otherwise
+ */
+int migration_checkpoint_has_peer(migration_checkpoint_t *cp, char *label);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <hashtable.h>
+#include <atomic_defs.h>
+
+#include "shardcache.h"
+#include "shardcache_node.h"
+#include "peer_stats.h"
+
+struct __shardcache_peer_stats_s {
+    char *label;
+    char **addresses;  // the known addresses of the peer
+    int num_addresses; // (protected by the registry lock)
+    uint64_t values[SHARDCACHE_PEER_NUM_STATS];
+    char *names[SHARDCACHE_PEER_NUM_EXPORTED_STATS]; // the names of the exported counters
+    shardcache_peers_stats_t *peers;
+};
+
+struct __shardcache_peers_stats_s {
+    shardcache_counters_t *counters;
+    connections_pool_t *pool;
+    char *me;
+    hashtable_t *labels;    // label -> shardcache_peer_stats_t
+    hashtable_t *addresses; // address -> shardcache_peer_stats_t
+    pthread_mutex_t lock;
+};
+
+static void
+shardcache_peer_stats_destroy(shardcache_peer_stats_t *stats)
+{
+    int i;
+    shardcache_counters_t *counters = stats->peers->counters;
+    for (i = 0; i < SHARDCACHE_PEER_NUM_EXPORTED_STATS; i++) {
+        if (stats->names[i]) {
+            shardcache_counter_remove(counters, stats->names[i]);
+            free(stats->names[i]);
+        }
+    }
+    for (i = 0; i < stats->num_addresses; i++)
+        free(stats->addresses[i]);
+    free(stats->addresses);
+    free(stats->label);
+    free(stats);
+}
+
+shardcache_peers_stats_t *
+shardcache_peers_stats_create(shardcache_counters_t *counters, connections_pool_t *pool, char *me)
+{
+    shardcache_peers_stats_t *peers = calloc(1, sizeof(shardcache_peers_stats_t));
+    if (!peers)
+        return NULL;
+
+    peers->counters = counters;
+    peers->pool = pool;
+    peers->me = me ? strdup(me) : NULL;
+    peers->labels = ht_create(32, 0, (ht_free_item_callback_t)shardcache_peer_stats_destroy);
+    peers->addresses = ht_create(32, 0, NULL);
+    pthread_mutex_init(&peers->lock, NULL);
+    return peers;
+}
+
+void
+shardcache_peers_stats_destroy(shardcache_peers_stats_t *peers)
+{
+    ht_destroy(peers->addresses);
+    ht_destroy(peers->labels);
+    pthread_mutex_destroy(&peers->lock);
+    free(peers->me);
+    free(peers);
+}
+
+static uint64_t
+shardcache_peer_stats_idle(void *priv)
+{
+    shardcache_peer_stats_t *stats = (shardcache_peer_stats_t *)priv;
+    shardcache_peers_stats_t *peers = stats->peers;
+    uint64_t idle = 0;
+    int i;
+    pthread_mutex_lock(&peers->lock);
+    for (i = 0; i < stats->num_addresses; i++)
+        idle += connections_pool_idle(peers->pool, stats->addresses[i]);
+    pthread_mutex_unlock(&peers->lock);
+    return idle;
+}
+
+static uint64_t
+shardcache_peer_stats_pooled(void *priv)
+{
+    shardcache_peer_stats_t *stats = (shardcache_peer_stats_t *)priv;
+    return shardcache_peer_stats_idle(priv) +
+           ATOMIC_READ(stats->values[SHARDCACHE_PEER_STAT_CONNECTIONS_IN_USE]);
+}
+
+static void
+shardcache_peer_stats_export(shardcache_peers_stats_t *peers, shardcache_peer_stats_t *stats)
+{
+    static const char *labels[] = SHARDCACHE_PEER_STATS_LABELS_ARRAY;
+    int i;
+    for (i = 0; i < SHARDCACHE_PEER_NUM_EXPORTED_STATS; i++) {
+        char name[256];
+        snprintf(name, sizeof(name), "peer_%s_%s", stats->label, labels[i]);
+        stats->names[i] = strdup(name);
+        switch(i) {
+            case SHARDCACHE_PEER_STAT_CONNECTIONS_IDLE:
+                shardcache_counter_add_callback(peers->counters, stats->names[i],
+                                                shardcache_peer_stats_idle, stats);
+                break;
+            case SHARDCACHE_PEER_STAT_CONNECTIONS_POOLED:
+                shardcache_counter_add_callback(peers->counters, stats->names[i],
+                                                shardcache_peer_stats_pooled, stats);
+                break;
+            default:
+                shardcache_counter_add(peers->counters, stats->names[i], &stats->values[i]);
+                break;
+        }
+    }
+}
+
+void
+shardcache_peers_stats_register(shardcache_peers_stats_t *peers, shardcache_node_t *node)
+{
+    char *label = shardcache_node_get_label(node);
+    int num_addresses = shardcache_node_num_addresses(node);
+    char *addresses[num_addresses];
+    shardcache_node_get_all_addresses(node, addresses, num_addresses);
+
+    pthread_mutex_lock(&peers->lock);
+
+    int i;
+    shardcache_peer_stats_t *created = NULL;
+    shardcache_peer_stats_t *stats = ht_get(peers->labels, label, strlen(label), NULL);
+    for (i = 0; i < num_addresses; i++) {
+        char *addr = addresses[i];
+        if ((peers->me && strcmp(addr, peers->me) == 0) ||
+            ht_exists(peers->addresses, addr, strlen(addr)))
+        {
+            continue;
+        }
+
+        if (!stats) {
+            stats = calloc(1, sizeof(shardcache_peer_stats_t));
+            stats->label = strdup(label);
+            stats->peers = peers;
+            ht_set(peers->labels, label, strlen(label), stats, sizeof(shardcache_peer_stats_t));
+            created = stats;
+        }
+
+        stats->addresses = realloc(stats->addresses, sizeof(char *) * (stats->num_addresses + 1));
+        stats->addresses[stats->num_addresses++] = strdup(addr);
+        ht_set(peers->addresses, addr, strlen(addr), stats, sizeof(shardcache_peer_stats_t));
+    }
+
+    pthread_mutex_unlock(&peers->lock);
+
+    // the idle connections are counted (by the counters) holding the registry lock,
+    // so the counters must be registered after releasing it
+    if (created)
+        shardcache_peer_stats_export(peers, created);
+}
+
+static int
+shardcache_peer_stats_reset(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    shardcache_peer_stats_t *stats = (shardcache_peer_stats_t *)value;
+    int i;
+    for (i = 0; i < SHARDCACHE_PEER_NUM_STATS; i++) {
+        if (i == SHARDCACHE_PEER_STAT_CONNECTIONS_IN_USE || i == SHARDCACHE_PEER_STAT_FETCHES_IN_FLIGHT)
+            continue;
+        ATOMIC_SET(stats->values[i], 0);
+    }
+    return 1;
+}
+
+void
+shardcache_peers_stats_reset(shardcache_peers_stats_t *peers)
+{
+    ht_foreach_value(peers->labels, shardcache_peer_stats_reset, NULL);
+}
+
+shardcache_peer_stats_t *
+shardcache_peers_stats_lookup(shardcache_peers_stats_t *peers, char *addr)
+{
+    if (!peers || !addr)
+        return NULL;
+    return ht_get(peers->addresses, addr, strlen(addr), NULL);
+}
+
+void
+shardcache_peer_stats_add(shardcache_peer_stats_t *stats, int stat, int64_t value)
+{
+    if (stats)
+        __sync_fetch_and_add(&stats->values[stat], value);
+}
+
+void
+shardcache_peer_stats_request(shardcache_peer_stats_t *stats, size_t bytes_out)
+{
+    if (!stats)
+        return;
+    ATOMIC_INCREMENT(stats->values[SHARDCACHE_PEER_STAT_REQUESTS]);
+    ATOMIC_INCREASE(stats->values[SHARDCACHE_PEER_STAT_BYTES_OUT], bytes_out);
+}
+
+void
+shardcache_peer_stats_connect(shardcache_peer_stats_t *stats, uint64_t usecs)
+{
+    if (!stats)
+        return;
+    ATOMIC_INCREMENT(stats->values[SHARDCACHE_PEER_STAT_CONNECTS]);
+    // exponentially weighted moving average (alpha = 1/8)
+    // (same as the latency of the node addresses)
+    uint64_t avg = ATOMIC_READ(stats->values[SHARDCACHE_PEER_STAT_CONNECT_TIME]);
+    ATOMIC_SET(stats->values[SHARDCACHE_PEER_STAT_CONNECT_TIME], avg ? avg - (avg >> 3) + (usecs >> 3) : usecs);
+}
+
+void
+shardcache_peer_stats_error(shardcache_peer_stats_t *stats, int error)
+{
+    if (!stats)
+        return;
+    ATOMIC_INCREMENT(stats->values[SHARDCACHE_PEER_STAT_ERRORS]);
+    if (error == ETIMEDOUT || error == EAGAIN || error == EWOULDBLOCK)
+        ATOMIC_INCREMENT(stats->values[SHARDCACHE_PEER_STAT_TIMEOUTS]);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
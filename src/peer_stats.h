@@ -0,0 +1,121 @@
+#ifndef __SHARDCACHE_PEER_STATS_H__
+#define __SHARDCACHE_PEER_STATS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "shardcache.h"
+#include "counters.h"
+#include "connections_pool.h"
+
+/* Per-peer traffic and health statistics.
+ *
+ * One set of statistics is kept for each peer (node label), collecting the
+ * traffic sent through all the addresses of the node. Each statistic is
+ * exported as a counter named "peer_<label>_<stat>", so they show up in the
+ * STATS output (and in shardcache_client_stats()) together with the other
+ * counters.
+ */
+
+#define SHARDCACHE_PEER_STATS_LABELS_ARRAY \
+        { "requests", "bytes_out", "bytes_in", "errors", "timeouts", \
+          "connects", "connect_time", "connections_in_use", "fetches_in_flight", \
+          "connections_idle", "connections_pooled" }
+
+#define SHARDCACHE_PEER_STAT_REQUESTS           0 // commands sent to the peer
+#define SHARDCACHE_PEER_STAT_BYTES_OUT          1 // keys and values sent to the peer
+#define SHARDCACHE_PEER_STAT_BYTES_IN           2 // values received from the peer
+#define SHARDCACHE_PEER_STAT_ERRORS             3 // failed connections and commands
+#define SHARDCACHE_PEER_STAT_TIMEOUTS           4 // errors due to a timeout
+#define SHARDCACHE_PEER_STAT_CONNECTS           5 // new connections established
+#define SHARDCACHE_PEER_STAT_CONNECT_TIME       6 // moving average of the time needed
+                                                  // to establish a connection (microsecs)
+#define SHARDCACHE_PEER_STAT_CONNECTIONS_IN_USE 7 // connections currently taken from the pool
+#define SHARDCACHE_PEER_STAT_FETCHES_IN_FLIGHT  8 // fetches sent and not yet completed
+#define SHARDCACHE_PEER_NUM_STATS               9
+
+// computed from the connections pool when the counters are read
+#define SHARDCACHE_PEER_STAT_CONNECTIONS_IDLE   9
+#define SHARDCACHE_PEER_STAT_CONNECTIONS_POOLED 10
+#define SHARDCACHE_PEER_NUM_EXPORTED_STATS      11
+
+typedef struct __shardcache_peer_stats_s shardcache_peer_stats_t;
+
+typedef struct __shardcache_peers_stats_s shardcache_peers_stats_t;
+
+/*
+ * @brief Create the registry holding the statistics for all the peers
+ * @param counters The counters instance the statistics will be exported to
+ * @param pool     The connections pool the idle connections are counted from
+ * @param me       The address of the local node (never tracked)
+ * @return A valid shardcache_peers_stats_t structure, NULL in case of errors
+ */
+shardcache_peers_stats_t *shardcache_peers_stats_create(shardcache_counters_t *counters,
+                                                        connections_pool_t *pool,
+                                                        char *me);
+
+/*
+ * @brief Remove the exported counters and release all the resources
+ *        used by the registry
+ */
+void shardcache_peers_stats_destroy(shardcache_peers_stats_t *peers);
+
+/*
+ * @brief Start tracking the statistics for a node
+ * @param peers A valid shardcache_peers_stats_t structure
+ * @param node  The node
+ * @note Registering again a known node only adds its new addresses (if any).
+ *       The statistics are kept until the registry is destroyed, even if the
+ *       node leaves the cluster (so that pointers obtained through
+ *       shardcache_peers_stats_lookup() never become invalid)
+ */
+void shardcache_peers_stats_register(shardcache_peers_stats_t *peers, shardcache_node_t *node);
+
+/*
+ * @brief Reset the statistics of all the peers
+ * @note The gauges (connections in use, fetches in flight) are preserved
+ */
+void shardcache_peers_stats_reset(shardcache_peers_stats_t *peers);
+
+/*
+ * @brief Get the statistics of the peer owning a given address
+ * @param peers A valid shardcache_peers_stats_t structure
+ * @param addr  The address
+ * @return The statistics of the peer, NULL if the address is unknown
+ */
+shardcache_peer_stats_t *shardcache_peers_stats_lookup(shardcache_peers_stats_t *peers, char *addr);
+
+/*
+ * @brief Add a value to one of the statistics of a peer
+ * @param stats The statistics of the peer (NULL is allowed and ignored)
+ * @param stat  The statistic (one of SHARDCACHE_PEER_STAT_*)
+ * @param value The value to add (can be negative)
+ */
+void shardcache_peer_stats_add(shardcache_peer_stats_t *stats, int stat, int64_t value);
+
+/*
+ * @brief Account a command sent to a peer
+ * @param stats     The statistics of the peer (NULL is allowed and ignored)
+ * @param bytes_out The size of the payload (key and value) sent to the peer
+ */
+void shardcache_peer_stats_request(shardcache_peer_stats_t *stats, size_t bytes_out);
+
+/*
+ * @brief Account a newly established connection
+ * @param stats The statistics of the peer (NULL is allowed and ignored)
+ * @param usecs The time needed to establish the connection (in microseconds)
+ */
+void shardcache_peer_stats_connect(shardcache_peer_stats_t *stats, uint64_t usecs);
+
+/*
+ * @brief Account a failure
+ * @param stats The statistics of the peer (NULL is allowed and ignored)
+ * @param error The errno value of the failure (ETIMEDOUT, EAGAIN and
+ *              EWOULDBLOCK count also as timeouts)
+ */
+void shardcache_peer_stats_error(shardcache_peer_stats_t *stats, int error);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -79,6 +79,12 @@ typedef struct __shardcache_request_s {
     int copied;
     int done;
     fbuf_t fetch_accumulator;
+    shardcache_index_cursor_t *index_cursor; // the cursor used to stream the index
+                                            // (only for GET_INDEX requests)
+    uint64_t start; // when the request has been read (for the latency histograms)
+    uint64_t read_start;  // when the first chunk of the request has been received
+    uint64_t write_start; // when the first chunk of the response has been produced
+    uint64_t trace_id;    // the trace the request belongs to (0 if not traced)
     TAILQ_ENTRY(__shardcache_request_s) next;
 } shardcache_request_t;
 
@@ -100,6 +106,8 @@ struct __shardcache_connection_context_s {
     shardcache_worker_context_t *worker;
     int closed;
     struct timeval in_prune_since;
+    uint64_t read_start; // when the first chunk of the request
+                         // being read has been received
 };
 #pragma pack(pop)
 
@@ -142,6 +150,50 @@ shardcache_connection_context_create(shardcache_serving_t *serv, int fd)
     return ctx;
 }
 
+static int
+shardcache_request_latency_index(shardcache_hdr_t hdr)
+{
+    switch(hdr) {
+        case SHC_HDR_GET:
+        case SHC_HDR_GET_ASYNC:
+            return SHARDCACHE_LATENCY_CMD_GET;
+        case SHC_HDR_GET_OFFSET:
+            return SHARDCACHE_LATENCY_CMD_GET_OFFSET;
+        case SHC_HDR_SET:
+            return SHARDCACHE_LATENCY_CMD_SET;
+        case SHC_HDR_ADD:
+            return SHARDCACHE_LATENCY_CMD_ADD;
+        case SHC_HDR_EXISTS:
+            return SHARDCACHE_LATENCY_CMD_EXISTS;
+        case SHC_HDR_TOUCH:
+            return SHARDCACHE_LATENCY_CMD_TOUCH;
+        case SHC_HDR_DELETE:
+            return SHARDCACHE_LATENCY_CMD_DELETE;
+        case SHC_HDR_EVICT:
+            return SHARDCACHE_LATENCY_CMD_EVICT;
+        case SHC_HDR_STATS:
+        case SHC_HDR_HOTKEYS:
+        case SHC_HDR_TRACES:
+            return SHARDCACHE_LATENCY_CMD_STATS;
+        case SHC_HDR_GET_INDEX:
+            return SHARDCACHE_LATENCY_CMD_INDEX;
+        case SHC_HDR_MIGRATION_BEGIN:
+        case SHC_HDR_MIGRATION_ABORT:
+        case SHC_HDR_MIGRATION_END:
+            return SHARDCACHE_LATENCY_CMD_MIGRATION;
+        case SHC_HDR_REPLICA_COMMAND:
+        case SHC_HDR_REPLICA_BATCH:
+        case SHC_HDR_REPLICA_TREE:
+        case SHC_HDR_REPLICA_PING:
+            return SHARDCACHE_LATENCY_CMD_REPLICA;
+        case SHC_HDR_CHECK:
+            return SHARDCACHE_LATENCY_CMD_CHECK;
+        default:
+            break;
+    }
+    return -1;
+}
+
 static void
 shardcache_request_destroy(shardcache_request_t *req)
 {
@@ -154,6 +206,8 @@ shardcache_request_destroy(shardcache_request_t *req)
     if (req->fetch_shash)
         sip_hash_free(req->fetch_shash);
     fbuf_destroy(&req->fetch_accumulator);
+    if (req->index_cursor)
+        shardcache_index_cursor_close(req->index_cursor);
     free(req);
 }
 
@@ -260,7 +314,9 @@ write_status(shardcache_request_t *req, int rc, char mode)
 static inline int
 send_async_data_response_preamble(shardcache_request_t *req)
 {
-    shardcache_hdr_t hdr = SHC_HDR_RESPONSE;
+    shardcache_hdr_t hdr = (req->hdr == SHC_HDR_GET_INDEX)
+                         ? SHC_HDR_INDEX_RESPONSE
+                         : SHC_HDR_RESPONSE;
 
     uint32_t magic = htonl(SHC_MAGIC);
 
@@ -279,6 +335,9 @@ send_async_data_response_preamble(shardcache_request_t *req)
         fbuf_add_binary(&output, (void *)&req->sig_hdr, 1);
     }
 
+    if (req->trace_id)
+        req->write_start = shardcache_histogram_now();
+
     fbuf_add_binary(&output, (void *)&hdr, 1);
 
     if (req->ctx->serv->cache->auth && req->fetch_shash) {
@@ -490,6 +549,49 @@ get_async_data_handler(void *key,
     return 0;
 }
 
+static void
+send_index_batch(shardcache_request_t *req)
+{
+    fbuf_t buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    size_t count = 0;
+
+    if (req->index_cursor) {
+        shardcache_storage_index_item_t items[SHARDCACHE_INDEX_BATCH_SIZE];
+        count = shardcache_index_cursor_next(req->index_cursor, items, SHARDCACHE_INDEX_BATCH_SIZE);
+        int i;
+        for (i = 0; i < count; i++) {
+            uint32_t klen = (uint32_t)items[i].klen;
+            uint32_t vlen = (uint32_t)items[i].vlen;
+            uint32_t nklen = htonl(klen);
+            uint32_t nvlen = htonl(vlen);
+            fbuf_add_binary(&buf, (char *)&nklen, sizeof(nklen));
+            fbuf_add_binary(&buf, items[i].key, klen);
+            fbuf_add_binary(&buf, (char *)&nvlen, sizeof(nvlen));
+            free(items[i].key);
+        }
+    }
+
+    if (count) {
+        // get_async_data_handler() takes care of splitting the data
+        // in chunks and of signing them (if necessary)
+        get_async_data_handler(NULL, 0, fbuf_data(&buf), fbuf_used(&buf), 0, NULL, req);
+    } else {
+        if (req->index_cursor) {
+            shardcache_index_cursor_close(req->index_cursor);
+            req->index_cursor = NULL;
+        }
+        size_t zero = 0;
+        // no klen terminates the list
+        fbuf_add_binary(&buf, (char *)&zero, sizeof(zero));
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        get_async_data_handler(NULL, 0, fbuf_data(&buf), fbuf_used(&buf),
+                               req->copied + fbuf_used(&buf), &now, req);
+        SHC_DEBUG("Index response sent (%d)", req->copied);
+    }
+    fbuf_destroy(&buf);
+}
+
 static int
 get_async_data(shardcache_t *cache,
                void *key,
@@ -533,6 +635,98 @@ shardcache_async_command_response(void *key, size_t klen, int ret, void *priv)
                              : WRITE_STATUS_MODE_SIMPLE);
 }
 
+// builds the STATS response straight into the output buffer of the request
+// (which is handed as it is to the iomux) instead of building it in a
+// temporary buffer and copying it over
+static void
+write_stats(shardcache_request_t *req, char *data, size_t len)
+{
+    shardcache_record_t record = {
+        .v = data,
+        .l = len
+    };
+
+    SPIN_LOCK(&req->output_lock);
+    unsigned int initial_len = fbuf_used(&req->output);
+    int rc = build_message((char *)req->ctx->serv->cache->auth,
+                           req->sig_hdr,
+                           SHC_HDR_RESPONSE,
+                           &record, 1, &req->output);
+    if (rc != 0)
+        fbuf_set_used(&req->output, initial_len);
+    SPIN_UNLOCK(&req->output_lock);
+
+    if (rc == 0) {
+        ATOMIC_INCREMENT(req->done);
+    } else {
+        SHC_ERROR("Can't build the STATS response");
+        write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+    }
+}
+
+static void
+write_metrics(char *data, size_t len, void *priv)
+{
+    write_stats((shardcache_request_t *)priv, data, len);
+}
+
+// one line per key: requests;bytes;error;rate;key
+// (the key is escaped since it can hold any byte)
+static void
+write_hotkeys(shardcache_t *cache, int by_bytes, fbuf_t *buf)
+{
+    shardcache_hotkey_t *hotkeys = NULL;
+    int i, num_keys = shardcache_get_hotkeys(cache, by_bytes, &hotkeys);
+
+    fbuf_printf(buf, "%s;%d\r\n", by_bytes ? "by_bytes" : "by_requests", num_keys);
+    for (i = 0; i < num_keys; i++) {
+        shardcache_hotkey_t *hot = &hotkeys[i];
+        fbuf_printf(buf, "%llu;%llu;%llu;%llu;",
+                    (unsigned long long)hot->requests, (unsigned long long)hot->bytes,
+                    (unsigned long long)hot->error, (unsigned long long)hot->rate);
+        size_t klen = hot->klen < sizeof(hot->key) ? hot->klen : sizeof(hot->key);
+        size_t k;
+        for (k = 0; k < klen; k++) {
+            unsigned char c = (unsigned char)hot->key[k];
+            if (c < 0x20 || c > 0x7e || c == '\\')
+                fbuf_printf(buf, "\\x%02x", c);
+            else
+                fbuf_add_binary(buf, (char *)&c, 1);
+        }
+        if (klen < hot->klen)
+            fbuf_add(buf, "...");
+        fbuf_add(buf, "\r\n");
+    }
+    free(hotkeys);
+}
+
+// the peer (or the client) which sent the request might have sent the
+// trace id as the last record, otherwise a new trace might be started
+static uint64_t
+shardcache_request_trace_id(shardcache_t *cache, shardcache_request_t *req)
+{
+    fbuf_t *record = &req->records[(req->hdr == SHC_HDR_GET_OFFSET) ? 3 : 1];
+    if (fbuf_used(record) == 2 * sizeof(uint32_t)) {
+        uint32_t trace_id_nbo[2];
+        memcpy(trace_id_nbo, fbuf_data(record), sizeof(trace_id_nbo));
+        uint64_t trace_id = ((uint64_t)ntohl(trace_id_nbo[0]) << 32) | ntohl(trace_id_nbo[1]);
+        if (trace_id)
+            return trace_id;
+    }
+    return shardcache_tracer_sample(cache->tracer);
+}
+
+static void
+shardcache_request_trace_end(shardcache_t *cache, shardcache_request_t *req)
+{
+    uint64_t now = shardcache_histogram_now();
+    if (req->write_start)
+        shardcache_tracer_span(cache->tracer, req->trace_id, SHARDCACHE_TRACE_SPAN_WRITE,
+                               req->write_start, now, NULL, 0);
+    shardcache_tracer_span(cache->tracer, req->trace_id, SHARDCACHE_TRACE_SPAN_REQUEST,
+                           req->read_start, now, fbuf_data(&req->records[0]), fbuf_used(&req->records[0]));
+}
+
 static void
 process_request(shardcache_request_t *req)
 {
@@ -562,7 +756,18 @@ process_request(shardcache_request_t *req)
                 }
             }
 
+            req->trace_id = shardcache_request_trace_id(cache, req);
+            if (req->trace_id) {
+                shardcache_tracer_span(cache->tracer, req->trace_id, SHARDCACHE_TRACE_SPAN_PARSE,
+                                       req->read_start, req->start, NULL, 0);
+                // the stages executed by this thread pick the trace id from here
+                shardcache_trace_set_current(req->trace_id);
+            }
+
             get_async_data(cache, key, klen, get_async_data_handler, req);
+
+            if (req->trace_id)
+                shardcache_trace_set_current(0);
             break;
         }
         case SHC_HDR_ADD:
@@ -612,11 +817,13 @@ process_request(shardcache_request_t *req)
             while (s && *s) {
                 char *tok = strsep(&s, ",");
                 if(tok) {
-                    char *label = strsep(&tok, ":");
-                    char *addr = tok;
+                    shardcache_node_t *node = shardcache_node_create_from_string(tok);
+                    if (!node) {
+                        SHC_WARNING("Bad node string in the migration request: %s", tok);
+                        continue;
+                    }
                     size_t size = (num_shards + 1) * sizeof(shardcache_node_t *);
                     nodes = realloc(nodes, size);
-                    shardcache_node_t *node = shardcache_node_create(label, &addr, 1);
                     nodes[num_shards++] = node;
                 }
             }
@@ -654,6 +861,20 @@ process_request(shardcache_request_t *req)
         }
         case SHC_HDR_STATS:
         {
+            // a record (if any) selects the format of the response
+            if (fbuf_used(&req->records[0])) {
+                if (fbuf_used(&req->records[0]) == strlen(SHARDCACHE_METRICS_FORMAT) &&
+                    memcmp(fbuf_data(&req->records[0]), SHARDCACHE_METRICS_FORMAT,
+                           strlen(SHARDCACHE_METRICS_FORMAT)) == 0)
+                {
+                    shardcache_metrics_render(cache->metrics, write_metrics, req);
+                } else {
+                    SHC_DEBUG("Unknown STATS format");
+                    write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                }
+                break;
+            }
+
             fbuf_t buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
 
             shardcache_counter_t *counters = NULL;
@@ -678,77 +899,114 @@ process_request(shardcache_request_t *req)
                                 counters[i].name, counters[i].value);
                 }
 
-                fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
-                shardcache_record_t record = {
-                    .v = fbuf_data(&buf),
-                    .l = fbuf_used(&buf)
-                };
-                if (build_message((char *)req->ctx->serv->cache->auth,
-                                  req->sig_hdr,
-                                  SHC_HDR_RESPONSE,
-                                  &record, 1, &out) == 0)
-                {
-                    send_data(req, &out);
-                    ATOMIC_INCREMENT(req->done);
-                } else {
-                    SHC_ERROR("Can't build the STATS response");
-                    write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                shardcache_latency_t *latencies = NULL;
+                int nlatencies = shardcache_get_latencies(cache, &latencies);
+                for (i = 0; i < nlatencies; i++) {
+                    // skip the code paths which have never been hit
+                    if (!latencies[i].count)
+                        continue;
+                    fbuf_printf(&buf, "latency_%s_count;%llu\r\n"
+                                      "latency_%s_min;%llu\r\n"
+                                      "latency_%s_mean;%llu\r\n"
+                                      "latency_%s_p50;%llu\r\n"
+                                      "latency_%s_p90;%llu\r\n"
+                                      "latency_%s_p99;%llu\r\n"
+                                      "latency_%s_p999;%llu\r\n"
+                                      "latency_%s_max;%llu\r\n",
+                                latencies[i].name, latencies[i].count,
+                                latencies[i].name, latencies[i].min,
+                                latencies[i].name, latencies[i].mean,
+                                latencies[i].name, latencies[i].p50,
+                                latencies[i].name, latencies[i].p90,
+                                latencies[i].name, latencies[i].p99,
+                                latencies[i].name, latencies[i].p999,
+                                latencies[i].name, latencies[i].max);
                 }
-                fbuf_destroy(&out);
+                free(latencies);
+
+                write_stats(req, fbuf_data(&buf), fbuf_used(&buf));
                 free(counters);
             }
             fbuf_destroy(&buf);
             break;
         }
-        case SHC_HDR_GET_INDEX:
+        case SHC_HDR_HOTKEYS:
         {
-            fbuf_t buf = FBUF_STATIC_INITIALIZER;
-            fbuf_t out = FBUF_STATIC_INITIALIZER;
-            SHC_DEBUG("Fetching index");
-            shardcache_storage_index_t *index = shardcache_get_index(cache);
-            SHC_DEBUG("Index got");
-            if (index) {
-                int i;
-                for (i = 0; i < index->size; i++) {
-                    uint32_t klen = (uint32_t)index->items[i].klen;
-                    uint32_t vlen = (uint32_t)index->items[i].vlen;
-                    void *key = index->items[i].key;
-                    uint32_t nklen = htonl(klen);
-                    uint32_t nvlen = htonl(vlen);
-                    fbuf_add_binary(&buf, (char *)&nklen, sizeof(nklen));
-                    fbuf_add_binary(&buf, key, klen);
-                    fbuf_add_binary(&buf, (char *)&nvlen, sizeof(nvlen));
-                }
-                size_t zero = 0;
-                // no klen terminates the list
-                fbuf_add_binary(&buf, (char *)&zero, sizeof(zero));
+            fbuf_t buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+
+            fbuf_printf(&buf, "sample_rate;%d\r\n", shardcache_hotkeys_sample_rate(cache, -1));
+            write_hotkeys(cache, 0, &buf);
+            write_hotkeys(cache, 1, &buf);
 
-                shardcache_free_index(index);
+            fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+            shardcache_record_t record = {
+                .v = fbuf_data(&buf),
+                .l = fbuf_used(&buf)
+            };
+            if (build_message((char *)req->ctx->serv->cache->auth,
+                              req->sig_hdr,
+                              SHC_HDR_RESPONSE,
+                              &record, 1, &out) == 0)
+            {
+                send_data(req, &out);
+                ATOMIC_INCREMENT(req->done);
+            } else {
+                SHC_ERROR("Can't build the HOTKEYS response");
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
             }
+            fbuf_destroy(&out);
+            fbuf_destroy(&buf);
+            break;
+        }
+        case SHC_HDR_TRACES:
+        {
+            // a record (if any) holds the minimum duration of the traces to dump
+            uint32_t min_usecs = 0;
+            if (fbuf_used(&req->records[0]) == sizeof(uint32_t)) {
+                memcpy(&min_usecs, fbuf_data(&req->records[0]), sizeof(uint32_t));
+                min_usecs = ntohl(min_usecs);
+            }
+
+            fbuf_t buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
 
-            // chunkize the data and build an actual message
+            fbuf_printf(&buf, "sample_rate;%d\r\n", shardcache_tracing_sample_rate(cache, -1));
+            shardcache_tracer_dump(cache->tracer, min_usecs, &buf);
+
+            fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
             shardcache_record_t record = {
                 .v = fbuf_data(&buf),
                 .l = fbuf_used(&buf)
             };
             if (build_message((char *)req->ctx->serv->cache->auth,
                               req->sig_hdr,
-                              SHC_HDR_INDEX_RESPONSE,
+                              SHC_HDR_RESPONSE,
                               &record, 1, &out) == 0)
             {
-                // destroy it early ... since we still need one more copy
-                SHC_DEBUG("Index response sent (%d)", fbuf_used(&out));
                 send_data(req, &out);
                 ATOMIC_INCREMENT(req->done);
             } else {
+                SHC_ERROR("Can't build the TRACES response");
                 write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
-                SHC_ERROR("Can't build the index response");
             }
             fbuf_destroy(&out);
             fbuf_destroy(&buf);
             break;
         }
+        case SHC_HDR_GET_INDEX:
+        {
+            SHC_DEBUG("Streaming index");
+            req->copied = 0;
+            req->skipped = 0;
+            // the first batch is sent right away, the following ones
+            // will be sent by the output handler as soon as the
+            // previous ones have been flushed to the socket
+            req->index_cursor = shardcache_index_cursor_open(cache);
+            send_index_batch(req);
+            break;
+        }
         case SHC_HDR_REPLICA_COMMAND:
+        case SHC_HDR_REPLICA_BATCH:
+        case SHC_HDR_REPLICA_TREE:
         case SHC_HDR_REPLICA_PING:
         {
             void *response = NULL;
@@ -820,6 +1078,11 @@ shardcache_request_create(shardcache_connection_context_t *ctx)
     req->hdr = async_read_context_hdr(ctx->reader_ctx);
     req->sig_hdr = async_read_context_sig_hdr(ctx->reader_ctx);
     req->ctx = ctx;
+    req->start = shardcache_histogram_now();
+    // pipelined requests already read together with the previous one
+    // don't have their own read_start
+    req->read_start = ctx->read_start ? ctx->read_start : req->start;
+    ctx->read_start = 0;
     SPIN_INIT(&req->output_lock);
 
     int i;
@@ -899,9 +1162,20 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
             *len = fbuf_detach(&req->output, (char **)out, NULL);
         SPIN_UNLOCK(&req->output_lock);
 
+        // if streaming the index, produce the next batch only
+        // once the previous one has been handed to the iomux
+        if (!done && !*len && req->hdr == SHC_HDR_GET_INDEX)
+            send_index_batch(req);
+
         if (done) {
             TAILQ_REMOVE(&ctx->requests, req, next);
             ctx->num_requests--;
+            // the response has been completely handed to the iomux
+            int latency_index = shardcache_request_latency_index(req->hdr);
+            if (latency_index >= 0)
+                SHARDCACHE_LATENCY_RECORD(ctx->serv->cache, latency_index, req->start);
+            if (req->trace_id)
+                shardcache_request_trace_end(ctx->serv->cache, req);
             shardcache_request_destroy(req);
             // if we have pending input data this is time
             // to process it and move to the next request
@@ -944,6 +1218,9 @@ shardcache_input_handler(iomux_t *iomux,
             return 0;
         }
 
+        if (!ctx->read_start)
+            ctx->read_start = shardcache_histogram_now();
+
         async_read_context_state_t state =
             async_read_context_input_data(ctx->reader_ctx, data, len, &processed);
 
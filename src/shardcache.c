@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -16,6 +17,8 @@
 
 #include "shardcache.h"
 #include "shardcache_internal.h"
+#include "continuum.h"
+#include "migration_checkpoint.h"
 #include "arc_ops.h"
 #include "connections.h"
 #include "messaging.h"
@@ -46,7 +49,8 @@ shardcache_test_ownership_internal(shardcache_t *cache,
 
     SPIN_LOCK(&cache->migration_lock);
 
-    chash_t *continuum = NULL;
+    shardcache_continuum_t *continuum = NULL;
+    shardcache_node_t **shards = NULL;
     if (cache->migration && cache->migration_done) { 
         shardcache_migration_end(cache);
     } 
@@ -54,15 +58,27 @@ shardcache_test_ownership_internal(shardcache_t *cache,
     if (migration) {
         if (cache->migration) {
             continuum = cache->migration;
+            shards = cache->migration_shards;
         } else {
             SPIN_UNLOCK(&cache->migration_lock);
             return -1;
         }
     } else {
-        continuum = cache->chash;
+        continuum = cache->continuum;
+        shards = cache->shards;
     }
 
-    chash_lookup(continuum, key, klen, &node_name, &name_len);
+    int index = shardcache_continuum_lookup(continuum, key, klen);
+    if (index < 0) {
+        SPIN_UNLOCK(&cache->migration_lock);
+        return -1;
+    }
+
+    node_name = shardcache_node_get_label(shards[index]);
+    name_len = strlen(node_name);
+
+    int is_mine = (strcmp(node_name, cache->me) == 0);
+
     if (owner) {
         if (len && name_len + 1 > *len)
             name_len = *len - 1;
@@ -73,7 +89,7 @@ shardcache_test_ownership_internal(shardcache_t *cache,
         *len = name_len;
 
     SPIN_UNLOCK(&cache->migration_lock);
-    return (strcmp(owner, cache->me) == 0);
+    return is_mine;
 }
 
 int
@@ -100,12 +116,49 @@ shardcache_test_ownership(shardcache_t *cache,
 int
 shardcache_get_connection_for_peer(shardcache_t *cache, char *peer)
 {
-    if (!ATOMIC_READ(cache->use_persistent_connections))
-        return connect_to_peer(peer, cache->tcp_timeout);
+    shardcache_peer_stats_t *stats = shardcache_peers_stats_lookup(cache->peers_stats, peer);
+    uint64_t start = shardcache_histogram_now();
+    int connected = 1;
+    int fd;
+
+    if (!ATOMIC_READ(cache->use_persistent_connections)) {
+        fd = connect_to_peer(peer, cache->tcp_timeout);
+    } else {
+        // this will reuse an available filedescriptor already connected to peer
+        // or create a new connection if there isn't any available
+        fd = connections_pool_get_ext(cache->connections_pool, peer, &connected);
+    }
+
+    if (fd < 0) {
+        shardcache_peer_stats_error(stats, errno);
+        return fd;
+    }
+
+    if (connected)
+        shardcache_peer_stats_connect(stats, shardcache_histogram_now() - start);
+    shardcache_peer_stats_add(stats, SHARDCACHE_PEER_STAT_CONNECTIONS_IN_USE, 1);
+    return fd;
+}
+
+int
+shardcache_get_connection_for_peer_nonblocking(shardcache_t *cache, char *peer)
+{
+    // an idle connection from the pool doesn't need to connect
+    if (ATOMIC_READ(cache->use_persistent_connections) &&
+        connections_pool_idle(cache->connections_pool, peer) > 0)
+    {
+        return shardcache_get_connection_for_peer(cache, peer);
+    }
+
+    shardcache_peer_stats_t *stats = shardcache_peers_stats_lookup(cache->peers_stats, peer);
+    int fd = connect_to_peer_nonblocking(peer);
+    if (fd < 0) {
+        shardcache_peer_stats_error(stats, errno);
+        return fd;
+    }
 
-    // this will reuse an available filedescriptor already connected to peer
-    // or create a new connection if there isn't any available
-    return connections_pool_get(cache->connections_pool, peer);
+    shardcache_peer_stats_add(stats, SHARDCACHE_PEER_STAT_CONNECTIONS_IN_USE, 1);
+    return fd;
 }
 
 void
@@ -114,6 +167,9 @@ shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd)
     if (fd < 0)
         return;
 
+    shardcache_peer_stats_add(shardcache_peers_stats_lookup(cache->peers_stats, peer),
+                              SHARDCACHE_PEER_STAT_CONNECTIONS_IN_USE, -1);
+
     if (!ATOMIC_READ(cache->use_persistent_connections)) {
         close(fd);
         return;
@@ -122,6 +178,23 @@ shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd)
     connections_pool_add(cache->connections_pool, peer, fd);
 }
 
+void
+shardcache_discard_connection_for_peer(shardcache_t *cache, char *peer, int fd, int error)
+{
+    // grab errno before close() has a chance to change it
+    int err = errno;
+
+    if (fd < 0)
+        return;
+
+    shardcache_peer_stats_t *stats = shardcache_peers_stats_lookup(cache->peers_stats, peer);
+    shardcache_peer_stats_add(stats, SHARDCACHE_PEER_STAT_CONNECTIONS_IN_USE, -1);
+    if (error)
+        shardcache_peer_stats_error(stats, err);
+
+    close(fd);
+}
+
 static void
 shardcache_do_nothing(int sig)
 {
@@ -198,12 +271,7 @@ evictor(void *priv)
         shardcache_evictor_job_t *job = NULL;
         ht_foreach_value(jobs, evict_key, &job);
         if (job) {
-            char keystr[1024] = { 0 };
-
-            if (shardcache_loglevel >= LOG_DEBUG)
-                KEY2STR(job->key, job->klen, keystr, sizeof(keystr));
-
-            SHC_DEBUG2("Eviction job for key '%s' started", keystr);
+            SHC_DEBUG2("Eviction job for key '%.*s' started", KEYFMT(job->key, job->klen));
 
             int i;
             for (i = 0; i < cache->num_shards; i++) {
@@ -212,9 +280,14 @@ evictor(void *priv)
                     SHC_DEBUG3("Sending Eviction command to %s", peer);
                     int rindex = random()%shardcache_node_num_addresses(cache->shards[i]);
                     char *addr = shardcache_node_get_address_at_index(cache->shards[i], rindex);
+                    // NOTE: the evictor uses its own connections, so only the traffic
+                    //       (not the connections) is accounted in the peer statistics
+                    shardcache_peer_stats_t *stats = shardcache_peers_stats_lookup(cache->peers_stats, addr);
                     int fd = connections_pool_get(connections, addr);
-                    if (fd < 0)
+                    if (fd < 0) {
+                        shardcache_peer_stats_error(stats, errno);
                         break;
+                    }
 
                     int retries = 0;
                     for (;;) {
@@ -249,17 +322,19 @@ evictor(void *priv)
                         break;
                     }
 
+                    shardcache_peer_stats_request(stats, job->klen);
                     int rc = evict_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, job->key, job->klen, fd, 0);
                     if (rc == 0) {
                         connections_pool_add(connections, addr, fd);
                     } else {
+                        shardcache_peer_stats_error(stats, errno);
                         SHC_WARNING("evict_from_peer return %d for peer %s", rc, peer);
                         close(fd);
                     }
                 }
             }
 
-            SHC_DEBUG2("Eviction job for key '%s' completed", keystr);
+            SHC_DEBUG2("Eviction job for key '%.*s' completed", KEYFMT(job->key, job->klen));
             destroy_evictor_job(job);
         }
 
@@ -283,12 +358,55 @@ evictor(void *priv)
     return NULL;
 }
 
+/*
+ * Volatile storage eviction
+ *
+ * The budget covers the whole memory taken by the volatile keys (the keys,
+ * the values and the per-key overhead, see volatile_storage_used()).
+ * Once exceeded, the expirer thread evicts keys (the ones closest to their
+ * expiration time first) until the size drops below the low watermark, so
+ * that the sets don't pay for the eviction. The writers evict by themselves
+ * only if they outpace the expirer and push the storage past the high
+ * watermark. Evicting down to the low watermark (instead of the limit)
+ * avoids sampling again on each set.
+ */
+#define SHARDCACHE_VOLATILE_EVICTION_SLACK 10 // percentage of the max size
+
 static void
-destroy_volatile(volatile_object_t *obj)
+shardcache_volatile_evicted(void *key, size_t klen, size_t vlen, uint32_t expire, void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+    if (expire)
+        shardcache_unschedule_expiration(cache, key, klen, 1);
+    ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
+    arc_remove(cache->arc, (const void *)key, klen);
+    SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_VOLATILE_EVICTIONS);
+}
+
+void
+shardcache_evict_volatile(shardcache_t *cache)
+{
+    uint64_t max_size = (uint64_t)ATOMIC_READ(cache->volatile_max_size) << 20;
+    if (!max_size || volatile_storage_used(cache->volatile_storage) <= max_size)
+        return;
+
+    // only one thread at a time does the eviction
+    if (!ATOMIC_CAS(cache->volatile_evicting, 0, 1))
+        return;
+
+    uint64_t low_watermark = max_size - (max_size / 100) * SHARDCACHE_VOLATILE_EVICTION_SLACK;
+    volatile_storage_evict(cache->volatile_storage, low_watermark, shardcache_volatile_evicted, cache);
+
+    ATOMIC_SET(cache->volatile_evicting, 0);
+}
+
+static inline void
+shardcache_check_volatile_size(shardcache_t *cache)
 {
-    if (obj->data)
-        free(obj->data);
-    free(obj);
+    uint64_t max_size = (uint64_t)ATOMIC_READ(cache->volatile_max_size) << 20;
+    uint64_t high_watermark = max_size + (max_size / 100) * SHARDCACHE_VOLATILE_EVICTION_SLACK;
+    if (max_size && volatile_storage_used(cache->volatile_storage) > high_watermark)
+        shardcache_evict_volatile(cache);
 }
 
 static void
@@ -302,12 +420,11 @@ shardcache_expire_key_cb(iomux_t *iomux, void *priv)
             return;
 
         free(ptr);
-        ht_delete(ctx->cache->volatile_storage, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (ptr) {
-            volatile_object_t *prev = (volatile_object_t *)ptr;
-            ATOMIC_DECREASE(ctx->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                            prev->dlen);
-            destroy_volatile(prev);
+        size_t prev_len = 0;
+        if (volatile_storage_delete(ctx->cache->volatile_storage,
+                                    ctx->item.key, ctx->item.klen, &prev_len, NULL) == 0)
+        {
+            ATOMIC_DECREASE(ctx->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev_len);
         }
     } else {
         ht_delete(ctx->cache->cache_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
@@ -315,7 +432,7 @@ shardcache_expire_key_cb(iomux_t *iomux, void *priv)
             return;
         free(ptr);
     }
-    ATOMIC_INCREMENT(ctx->cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
+    SHARDCACHE_COUNTER_INCREMENT(ctx->cache, SHARDCACHE_COUNTER_EXPIRES);
     arc_remove(ctx->cache->arc, (const void *)ctx->item.key, ctx->item.klen);
 }
 
@@ -406,6 +523,7 @@ shardcache_expire_keys(void *priv)
 
         struct timeval tv = { 1, 0 };
         iomux_run(cache->expirer_mux, &tv);
+        shardcache_evict_volatile(cache);
         shardcache_update_size_counters(cache);
     }
     return NULL;
@@ -454,6 +572,13 @@ shardcache_run_async(void *priv)
     return NULL;
 }
 
+// messages dropped by the asynchronous logger
+static uint64_t
+shardcache_log_dropped_counter(void *priv)
+{
+    return shardcache_log_dropped();
+}
+
 shardcache_t *
 shardcache_create(char *me,
                   shardcache_node_t **nodes,
@@ -465,8 +590,6 @@ shardcache_create(char *me,
                   size_t cache_size)
 {
     int i, n;
-    size_t shard_lens[nnodes];
-    char *shard_names[nnodes];
 
     shardcache_t *cache = calloc(1, sizeof(shardcache_t));
 
@@ -477,6 +600,9 @@ shardcache_create(char *me,
     cache->serving_look_ahead = SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT;
     cache->iomux_run_timeout_low = SHARDCACHE_IOMUX_RUN_TIMEOUT_LOW;
     cache->iomux_run_timeout_high = SHARDCACHE_IOMUX_RUN_TIMEOUT_HIGH;
+    cache->migration_workers = SHARDCACHE_MIGRATION_WORKERS_DEFAULT;
+    cache->migration_batch_size = SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT;
+    cache->migration_checkpoint_interval = SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL_DEFAULT;
     if (num_async > 0)
         cache->num_async = num_async;
     else if (num_async < 0)
@@ -513,12 +639,8 @@ shardcache_create(char *me,
     int me_found = 0;
     int my_index = -1;
     for (i = 0; i < nnodes; i++) {
-        shard_names[i] = shardcache_node_get_label(nodes[i]);
-        shard_lens[i] = strlen(shard_names[i]);
         int num_replicas = shardcache_node_num_addresses(nodes[i]);
-        char *replicas[num_replicas];
-        shardcache_node_get_all_addresses(nodes[i], replicas, num_replicas);
-        cache->shards[i] = shardcache_node_create(shard_names[i], replicas, num_replicas);
+        cache->shards[i] = shardcache_node_copy(nodes[i]);
         char *label = shardcache_node_get_label(nodes[i]);
         if (strcmp(label, me) == 0) {
             me_found = 1;
@@ -550,7 +672,15 @@ shardcache_create(char *me,
 
     cache->num_shards = nnodes;
 
-    cache->chash = chash_create((const char **)shard_names, shard_lens, cache->num_shards, 200);
+    cache->continuum_mode = SHARDCACHE_CONTINUUM_MODE_CHASH;
+    cache->continuum = shardcache_continuum_create(cache->shards,
+                                                   cache->num_shards,
+                                                   cache->continuum_mode);
+    if (!cache->continuum) {
+        SHC_ERROR("Can't create the continuum");
+        shardcache_destroy(cache);
+        return NULL;
+    }
 
     // we need to tell the arc subsystem how big are the cached objects (well ... at least the container struct
     // which is attached to each cached object to encapsulate its actual data and extra flags/members
@@ -582,16 +712,38 @@ shardcache_create(char *me,
     const char *counters_names[SHARDCACHE_NUM_COUNTERS] = SHARDCACHE_COUNTER_LABELS_ARRAY;
 
     cache->counters = shardcache_init_counters();
+    cache->sharded_counters = shardcache_sharded_counters_create(SHARDCACHE_NUM_COUNTERS);
+
+    for (i = 0; i < SHARDCACHE_NUM_LATENCIES; i++)
+        cache->latencies[i] = shardcache_histogram_create();
 
     for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i ++) {
         cache->cnt[i].name = counters_names[i];
-        shardcache_counter_add(cache->counters, cache->cnt[i].name, &cache->cnt[i].value); 
+        if (SHARDCACHE_COUNTER_IS_GAUGE(i))
+            shardcache_counter_add(cache->counters, cache->cnt[i].name, &cache->cnt[i].value); 
+        else
+            shardcache_counter_add_sharded(cache->counters, cache->cnt[i].name, cache->sharded_counters, i);
     }
 
     shardcache_counter_add(cache->counters, "mru_size", (uint64_t *)cache->arc_lists_size[0]);
     shardcache_counter_add(cache->counters, "mfu_size", (uint64_t *)cache->arc_lists_size[1]);
     shardcache_counter_add(cache->counters, "mrug_size", (uint64_t *)cache->arc_lists_size[2]);
     shardcache_counter_add(cache->counters, "mfug_size", (uint64_t *)cache->arc_lists_size[3]);
+    shardcache_counter_add_callback(cache->counters, "log_dropped", shardcache_log_dropped_counter, NULL);
+
+    cache->connections_pool = connections_pool_create(cache->tcp_timeout,
+                                                      SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
+                                                      (num_workers/2)+ 1);
+
+    cache->peers_stats = shardcache_peers_stats_create(cache->counters, cache->connections_pool, cache->addr);
+    for (i = 0; i < cache->num_shards; i++)
+        shardcache_peers_stats_register(cache->peers_stats, cache->shards[i]);
+
+    cache->hotkeys = shardcache_hotkeys_create(SHARDCACHE_HOTKEYS_SAMPLE_RATE_DEFAULT);
+
+    cache->tracer = shardcache_tracer_create(SHARDCACHE_TRACING_SAMPLE_RATE_DEFAULT);
+
+    cache->metrics = shardcache_metrics_create(cache);
 
     if (ATOMIC_READ(cache->evict_on_delete)) {
         MUTEX_INIT(&cache->evictor_lock);
@@ -604,11 +756,7 @@ shardcache_create(char *me,
     gettimeofday(&tv, NULL);
     srandom((unsigned)tv.tv_usec);
 
-    cache->volatile_storage = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)destroy_volatile);
-
-    cache->connections_pool = connections_pool_create(cache->tcp_timeout,
-                                                      SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
-                                                      (num_workers/2)+ 1);
+    cache->volatile_storage = volatile_storage_create();
 
     global_tcp_timeout(ATOMIC_READ(cache->tcp_timeout));
 
@@ -677,6 +825,10 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->serv)
         stop_serving(cache->serv);
 
+    // stops the http listener (if any)
+    if (cache->metrics)
+        shardcache_metrics_destroy(cache->metrics);
+
     if (cache->async_context) {
         // NOTE : should be destroyed only after
         //        the serving subsystem has been stopped
@@ -712,10 +864,12 @@ shardcache_destroy(shardcache_t *cache)
     }
 
     SPIN_LOCK(&cache->migration_lock);
-    if (cache->migration) {
-        shardcache_migration_abort(cache);    
-    }
+    int migrating = (cache->migration != NULL);
     SPIN_UNLOCK(&cache->migration_lock);
+    // NOTE: since quit is set the migrator (if running) will leave
+    //       its checkpoint on disk so that the migration can be resumed
+    if (migrating)
+        shardcache_migration_abort(cache);
     SPIN_DESTROY(&cache->migration_lock);
 
     if (cache->expirer_th) {
@@ -724,9 +878,22 @@ shardcache_destroy(shardcache_t *cache)
         SHC_DEBUG2("Expirer thread stopped");
     }
 
+    // nothing can change the volatile storage or the cache anymore
+    if (cache->snapshot_path && cache->volatile_storage && cache->arc)
+        shardcache_snapshot_save(cache, cache->snapshot_path);
+
     if (cache->replica)
         shardcache_replica_destroy(cache->replica);
 
+    if (cache->peers_stats)
+        shardcache_peers_stats_destroy(cache->peers_stats);
+
+    if (cache->hotkeys)
+        shardcache_hotkeys_destroy(cache->hotkeys);
+
+    if (cache->tracer)
+        shardcache_tracer_destroy(cache->tracer);
+
     if (cache->counters) {
         for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i ++) {
             shardcache_counter_remove(cache->counters, cache->cnt[i].name);
@@ -735,11 +902,20 @@ shardcache_destroy(shardcache_t *cache)
         shardcache_counter_remove(cache->counters, "mfu_size");
         shardcache_counter_remove(cache->counters, "mrug_size");
         shardcache_counter_remove(cache->counters, "mfug_size");
+        shardcache_counter_remove(cache->counters, "log_dropped");
         shardcache_release_counters(cache->counters);
     }
 
+    if (cache->sharded_counters)
+        shardcache_sharded_counters_destroy(cache->sharded_counters);
+
+    for (i = 0; i < SHARDCACHE_NUM_LATENCIES; i++) {
+        if (cache->latencies[i])
+            shardcache_histogram_destroy(cache->latencies[i]);
+    }
+
     if (cache->volatile_storage)
-        ht_destroy(cache->volatile_storage);
+        volatile_storage_destroy(cache->volatile_storage);
 
     if (cache->auth)
         free((void *)cache->auth);
@@ -747,8 +923,8 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->arc)
         arc_destroy(cache->arc);
 
-    if (cache->chash)
-        chash_free(cache->chash);
+    if (cache->continuum)
+        shardcache_continuum_destroy(cache->continuum);
 
     if (cache->expirer_mux)
         iomux_destroy(cache->expirer_mux);
@@ -772,6 +948,9 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->me)
         free(cache->me);
 
+    free(cache->migration_checkpoint_path);
+    free(cache->snapshot_path);
+
     if (cache->addr)
         free(cache->addr);
 
@@ -795,6 +974,7 @@ typedef struct {
     arc_resource_t res;
     shardcache_get_async_callback_t cb;
     void *priv;
+    int hotkeys; // sample the request once the size of the value is known
 } shardcache_get_async_helper_arg_t;
 
 static int
@@ -840,6 +1020,8 @@ shardcache_get_async_helper(void *key,
     int error = (!dlen && !total_size);
     if (rc != 0 || error) { // error
         ATOMIC_SET(arg->stat, -1);
+        if (arg->hotkeys)
+            shardcache_hotkeys_sample(arg->cache->hotkeys, key, klen, 0);
         if (error)
             arg->cb(key, klen, NULL, 0, 0, timestamp, arg->priv);
         arc_release_resource(arc, arg->res);
@@ -850,6 +1032,8 @@ shardcache_get_async_helper(void *key,
     arg->dlen += dlen;
 
     if (total_size || timestamp) {
+        if (arg->hotkeys)
+            shardcache_hotkeys_sample(arg->cache->hotkeys, key, klen, total_size);
         arc_release_resource(arc, arg->res);
         free(arg);
     }
@@ -871,10 +1055,17 @@ shardcache_get_offset_async(shardcache_t *cache,
     }
 
     if (offset == 0)
-        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+        SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_GETS);
 
+    // the lookup includes the fetch (from the storage or from a peer)
+    // if the object is not in the cache yet
+    uint64_t trace_id = shardcache_trace_current();
+    uint64_t lookup_start = trace_id ? shardcache_histogram_now() : 0;
     void *obj_ptr = NULL;
     arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 1);
+    if (trace_id)
+        shardcache_tracer_span(cache->tracer, trace_id, SHARDCACHE_TRACE_SPAN_ARC_LOOKUP,
+                               lookup_start, shardcache_histogram_now(), NULL, 0);
     if (!res) {
         return -1;
     }
@@ -924,7 +1115,7 @@ shardcache_get_offset_async(shardcache_t *cache,
             MUTEX_UNLOCK(&obj->lock);
             arc_drop_resource(cache->arc, res);
             free(data);
-            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
+            SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_EXPIRES);
             return shardcache_get_offset_async(cache, key, klen, offset, length, cb, priv);
         } else {
             cb(key, klen, data, dlen, dlen, &obj->ts, priv);
@@ -985,7 +1176,7 @@ size_t shardcache_get_offset(shardcache_t *cache,
         return 0;
 
     if (offset == 0)
-        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+        SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_GETS);
 
     void *obj_ptr = NULL;
     arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 0);
@@ -1024,16 +1215,17 @@ shardcache_get_async(shardcache_t *cache,
     if (!key)
         return -1;
 
-    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+    SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_GETS);
 
-    if (UNLIKELY(shardcache_loglevel > LOG_DEBUG+3)) {
-        char keystr[1024];
-        KEY2STR(key, klen, keystr, sizeof(keystr));
-        SHC_DEBUG4("Getting value for key: %s", keystr);
-    }
+    SHC_DEBUG4("Getting value for key: %.*s", KEYFMT(key, klen));
 
+    uint64_t trace_id = shardcache_trace_current();
+    uint64_t lookup_start = trace_id ? shardcache_histogram_now() : 0;
     void *obj_ptr = NULL;
     arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 1);
+    if (trace_id)
+        shardcache_tracer_span(cache->tracer, trace_id, SHARDCACHE_TRACE_SPAN_ARC_LOOKUP,
+                               lookup_start, shardcache_histogram_now(), NULL, 0);
     if (!res)
         return -1;
 
@@ -1084,10 +1276,11 @@ shardcache_get_async(shardcache_t *cache,
         {
             MUTEX_UNLOCK(&obj->lock);
             arc_drop_resource(cache->arc, res);
-            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
+            SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_EXPIRES);
             return shardcache_get_async(cache, key, klen, cb, priv);
 
         } else {
+            shardcache_hotkeys_sample(cache->hotkeys, key, klen, obj->dlen);
             cb(key, klen, obj->data, obj->dlen, obj->dlen, &obj->ts, priv);
             MUTEX_UNLOCK(&obj->lock);
             arc_release_resource(cache->arc, res);
@@ -1101,6 +1294,8 @@ shardcache_get_async(shardcache_t *cache,
         arg->priv = priv;
         arg->cache = cache;
         arg->res = res;
+        // the size of the value is known only once it has been fetched
+        arg->hotkeys = 1;
 
         shardcache_get_listener_t *listener = malloc(sizeof(shardcache_get_listener_t));
         listener->cb = shardcache_get_async_helper;
@@ -1177,9 +1372,6 @@ shardcache_get(shardcache_t *cache,
     memset(&arg->data, 0, sizeof(arg->data));
     arg->complete = 0;
 
-    char keystr[1024];
-    KEY2STR(key, klen, keystr, sizeof(keystr));
-
     int rc = shardcache_get_async(cache, key, klen, shardcache_get_helper, arg);
 
     if (rc == 0) {
@@ -1210,7 +1402,7 @@ shardcache_get(shardcache_t *cache,
         free(arg);
 
         if (stat != 0 && !ATOMIC_READ(cache->async_quit)) {
-            SHC_ERROR("Error trying to get key: %s", keystr);
+            SHC_ERROR("Error trying to get key: %.*s", KEYFMT(key, klen));
             if (value)
                 free(value);
             return NULL;
@@ -1220,7 +1412,7 @@ shardcache_get(shardcache_t *cache,
             *vlen = len;
 
         if (!value)
-            SHC_DEBUG("No value for key: %s", keystr);
+            SHC_DEBUG("No value for key: %.*s", KEYFMT(key, klen));
 
         return value;
     }
@@ -1242,7 +1434,7 @@ shardcache_head(shardcache_t *cache,
     if (!key)
         return 0;
 
-    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_HEADS].value);
+    SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_HEADS);
 
     size_t rlen = hlen;
     size_t remainder =  shardcache_get_offset(cache, key, len, head, &rlen, 0, timestamp);
@@ -1305,10 +1497,12 @@ static int shardcache_async_command_helper(void *data,
             arg->cb(arg->key, arg->klen, -1, arg->priv);
     } else if (idx == -2) {
         arg->error = 1;
+        // errno tells if the read timed out only at this point
+        shardcache_peer_stats_error(shardcache_peers_stats_lookup(arg->cache->peers_stats, arg->addr), errno);
     } else if (idx == -3) {
         if (arg->fd >= 0) {
             if (arg->error)
-                close(arg->fd);
+                shardcache_discard_connection_for_peer(arg->cache, arg->addr, arg->fd, 0);
             else
                 shardcache_release_connection_for_peer(arg->cache, arg->addr, arg->fd);
         }
@@ -1342,7 +1536,7 @@ shardcache_exists_async(shardcache_t *cache,
     if (is_mine == 1)
     {
         // TODO - clean this bunch of nested conditions
-        if (!ht_exists(cache->volatile_storage, key, klen)) {
+        if (!volatile_storage_exists(cache->volatile_storage, key, klen)) {
             if (cache->use_persistent_storage && cache->storage.exist) {
                 if (!cache->storage.exist(key, klen, cache->storage.priv)) {
                     rc = 0;
@@ -1369,6 +1563,7 @@ shardcache_exists_async(shardcache_t *cache,
         }
         char *addr = shardcache_node_get_address(peer);
         int fd = shardcache_get_connection_for_peer(cache, addr);
+        shardcache_peer_stats_request(shardcache_peers_stats_lookup(cache->peers_stats, addr), klen);
         if (cb) {
             rc = exists_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 0);
             if (rc == 0) {
@@ -1386,13 +1581,23 @@ shardcache_exists_async(shardcache_t *cache,
                 rc = read_message_async(fd, (char *)cache->auth, shardcache_async_command_helper, arg, &wrk);
                 if (rc == 0 && wrk) {
                     shardcache_queue_async_read_wrk(cache, wrk);
+                } else {
+                    free(arg->key);
+                    free(arg);
+                    shardcache_discard_connection_for_peer(cache, addr, fd, 1);
+                    cb(key, klen, -1, priv);
+                    rc = -1;
                 }
             } else {
+                shardcache_discard_connection_for_peer(cache, addr, fd, 1);
                 cb(key, klen, -1, priv);
             }
         } else {
             rc = exists_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
-            shardcache_release_connection_for_peer(cache, addr, fd);
+            if (rc == -1)
+                shardcache_discard_connection_for_peer(cache, addr, fd, 1);
+            else
+                shardcache_release_connection_for_peer(cache, addr, fd);
         }
     }
 
@@ -1441,8 +1646,12 @@ shardcache_touch(shardcache_t *cache, void *key, size_t klen)
         }
         char *addr = shardcache_node_get_address(peer);
         int fd = shardcache_get_connection_for_peer(cache, addr);
+        shardcache_peer_stats_request(shardcache_peers_stats_lookup(cache->peers_stats, addr), klen);
         int rc = touch_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd);
-        shardcache_release_connection_for_peer(cache, addr, fd);
+        if (rc == 0)
+            shardcache_release_connection_for_peer(cache, addr, fd);
+        else
+            shardcache_discard_connection_for_peer(cache, addr, fd, 1);
         return rc;
     }
 
@@ -1454,9 +1663,7 @@ shardcache_commence_eviction(shardcache_t *cache, void *key, size_t klen)
 {
     shardcache_evictor_job_t *job = create_evictor_job(key, klen);
 
-    char keystr[1024];
-    KEY2STR(key, klen, keystr, sizeof(keystr));
-    SHC_DEBUG2("Adding evictor job for key %s", keystr);
+    SHC_DEBUG2("Adding evictor job for key %.*s", KEYFMT(key, klen));
 
     int rc = ht_set_if_not_exists(cache->evictor_jobs, key, klen, job, sizeof(shardcache_evictor_job_t));
 
@@ -1518,20 +1725,19 @@ shardcache_store(shardcache_t *cache,
                  int replica)
 
 {
-    void *prev_ptr = NULL;
     if (inx) {
-        if (ht_exists(cache->volatile_storage, key, klen) == 1)
+        if (volatile_storage_exists(cache->volatile_storage, key, klen))
             return 1;
     } else {
         // remove this key from the volatile storage (if present)
         // it's going to be eventually persistent now (depending on the storage type)
-        ht_delete(cache->volatile_storage, key, klen, prev_ptr, NULL);
-    }
-
-    if (prev_ptr) {
-        volatile_object_t *prev = (volatile_object_t *)prev_ptr;
-        ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev->dlen);
-        destroy_volatile(prev);
+        size_t prev_len = 0;
+        uint32_t prev_expire = 0;
+        if (volatile_storage_delete(cache->volatile_storage, key, klen, &prev_len, &prev_expire) == 0) {
+            if (prev_expire)
+                shardcache_unschedule_expiration(cache, key, klen, 1);
+            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev_len);
+        }
     }
 
     if (inx && cache->storage.exist &&
@@ -1540,7 +1746,9 @@ shardcache_store(shardcache_t *cache,
         return 1;
     }
 
+    uint64_t start = shardcache_histogram_now();
     int rc = cache->storage.store(key, klen, value, vlen, cache->storage.priv);
+    SHARDCACHE_LATENCY_RECORD(cache, SHARDCACHE_LATENCY_STORAGE_STORE, start);
 
     if (cache->cache_on_set)
         arc_load(cache->arc, (const void *)key, klen, value, vlen);
@@ -1574,9 +1782,11 @@ shardcache_set_internal(shardcache_t *cache,
         return rc;
     }
 
-    char keystr[1024];
-    KEY2STR(key, klen, keystr, sizeof(keystr));
-    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_SETS].value);
+    SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_SETS);
+
+    // updates coming from the other replicas are accounted where they originated
+    if (!replica)
+        shardcache_hotkeys_sample(cache->hotkeys, key, klen, vlen);
 
     char node_name[1024];
     size_t node_len = sizeof(node_name);
@@ -1589,56 +1799,44 @@ shardcache_set_internal(shardcache_t *cache,
 
     if (is_mine == 1)
     {
-        SHC_DEBUG2("Storing value %s (%d) for key %s",
+        SHC_DEBUG2("Storing value %s (%d) for key %.*s",
                    shardcache_hex_escape(value, vlen, DEBUG_DUMP_MAXSIZE, 0),
-                   (int)vlen, keystr);
+                   (int)vlen, KEYFMT(key, klen));
 
         if (!cache->use_persistent_storage || expire)
         {
-            volatile_object_t *prev = NULL;
             // ensure removing this key from the persistent storage (if present)
             // since it's now going to be a volatile item
             if (cache->use_persistent_storage && cache->storage.remove)
                 cache->storage.remove(key, klen, cache->storage.priv);
 
-            if (inx && ht_exists(cache->volatile_storage, key, klen)) {
-                SHC_DEBUG("A volatile value already exists for key %s", keystr);
+            time_t now = time(NULL);
+            uint32_t real_expire = expire ? now + expire : 0;
+
+            SHC_DEBUG2("Setting volatile item %.*s to expire %d (now: %d)", 
+                KEYFMT(key, klen), real_expire, (int)now);
+
+            size_t prev_len = 0;
+            int ret = volatile_storage_set(cache->volatile_storage, key, klen,
+                                           value, vlen, real_expire, inx, &prev_len);
+
+            if (ret == VOLATILE_STORAGE_EXISTS) {
+                SHC_DEBUG("A volatile value already exists for key %.*s", KEYFMT(key, klen));
                 if (cb)
                     cb(key, klen, 1, priv);
                 return 1;
             }
 
-            volatile_object_t *obj = malloc(sizeof(volatile_object_t));
-            obj->data = malloc(vlen);
-            memcpy(obj->data, value, vlen);
-            obj->dlen = vlen;
-            time_t now = time(NULL);
-            time_t real_expire = expire ? time(NULL) + expire : 0;
-            obj->expire = real_expire;
-
-            SHC_DEBUG2("Setting volatile item %s to expire %d (now: %d)", 
-                keystr, obj->expire, (int)now);
+            rc = (ret == -1) ? -1 : 0;
 
-            void *prev_ptr = NULL;
-            if (inx) {
-                rc = ht_set(cache->volatile_storage, key, klen,
-                             obj, sizeof(volatile_object_t));
-            } else {
-                rc = ht_get_and_set(cache->volatile_storage, key, klen,
-                                     obj, sizeof(volatile_object_t),
-                                     &prev_ptr, NULL);
-            }
-
-            if (prev_ptr) {
-                prev = (volatile_object_t *)prev_ptr;
-                if (vlen > prev->dlen) {
+            if (ret == VOLATILE_STORAGE_REPLACED) {
+                if (vlen > prev_len) {
                     ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                                    vlen - prev->dlen);
+                                    vlen - prev_len);
                 } else {
                     ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                                    prev->dlen - vlen);
+                                    prev_len - vlen);
                 }
-                destroy_volatile(prev); 
                 if (cache->cache_on_set)
                     arc_load(cache->arc, (const void *)key, klen, value, vlen);
                 else
@@ -1647,12 +1845,14 @@ shardcache_set_internal(shardcache_t *cache,
                 if (!replica)
                     shardcache_commence_eviction(cache, key, klen);
 
-            } else {
+            } else if (ret == VOLATILE_STORAGE_STORED) {
                 ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
             }
 
-            if (obj->expire)
+            if (rc == 0 && real_expire)
                 shardcache_schedule_expiration(cache, key, klen, expire, 1);
+
+            shardcache_check_volatile_size(cache);
         }
         else if (cache->use_persistent_storage && cache->storage.store)
         {
@@ -1661,8 +1861,8 @@ shardcache_set_internal(shardcache_t *cache,
     }
     else if (node_len)
     {
-        SHC_DEBUG2("Forwarding set command %s => %s (%d) to %s",
-                keystr, shardcache_hex_escape(value, vlen, DEBUG_DUMP_MAXSIZE, 0),
+        SHC_DEBUG2("Forwarding set command %.*s => %s (%d) to %s",
+                KEYFMT(key, klen), shardcache_hex_escape(value, vlen, DEBUG_DUMP_MAXSIZE, 0),
                 (int)vlen, node_name);
 
         shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
@@ -1679,6 +1879,7 @@ shardcache_set_internal(shardcache_t *cache,
         char *addr = shardcache_node_get_address(peer);
 
         int fd = shardcache_get_connection_for_peer(cache, addr);
+        shardcache_peer_stats_request(shardcache_peers_stats_lookup(cache->peers_stats, addr), klen + vlen);
 
         if (inx) {
             if (cb) {
@@ -1702,8 +1903,11 @@ shardcache_set_internal(shardcache_t *cache,
                     } else {
                         free(arg->key);
                         free(arg);
+                        shardcache_discard_connection_for_peer(cache, addr, fd, 1);
+                        rc = -1;
                     }
                 } else {
+                    shardcache_discard_connection_for_peer(cache, addr, fd, 1);
                     if (cache->use_persistent_storage && cache->storage.global)
                         rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
                 }
@@ -1712,7 +1916,7 @@ shardcache_set_internal(shardcache_t *cache,
                 if (rc == 0) {
                     shardcache_release_connection_for_peer(cache, addr, fd);
                 } else {
-                    close(fd);
+                    shardcache_discard_connection_for_peer(cache, addr, fd, 1);
                     if (cache->use_persistent_storage && cache->storage.global)
                         rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
                 }
@@ -1738,16 +1942,20 @@ shardcache_set_internal(shardcache_t *cache,
                 } else {
                     free(arg->key);
                     free(arg);
+                    shardcache_discard_connection_for_peer(cache, addr, fd, 1);
+                    rc = -1;
                 }
-            } else if (cache->use_persistent_storage && cache->storage.global) {
-                rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
+            } else {
+                shardcache_discard_connection_for_peer(cache, addr, fd, 1);
+                if (cache->use_persistent_storage && cache->storage.global)
+                    rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
             }
         } else {
             rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 1);
             if (rc == 0) {
                 shardcache_release_connection_for_peer(cache, addr, fd);
             } else {
-                close(fd);
+                shardcache_discard_connection_for_peer(cache, addr, fd, 1);
                 if (cache->use_persistent_storage && cache->storage.global)
                     rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
             }
@@ -1878,7 +2086,7 @@ shardcache_del_internal(shardcache_t *cache,
         return rc;
     }
 
-    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_DELS].value);
+    SHARDCACHE_COUNTER_INCREMENT(cache, SHARDCACHE_COUNTER_DELS);
 
     // if we are not the owner try propagating the command to the responsible peer
     char node_name[1024];
@@ -1891,8 +2099,8 @@ shardcache_del_internal(shardcache_t *cache,
 
     if (is_mine == 1)
     {
-        void *prev_ptr;
-        rc = ht_delete(cache->volatile_storage, key, klen, &prev_ptr, NULL);
+        size_t prev_len = 0;
+        rc = volatile_storage_delete(cache->volatile_storage, key, klen, &prev_len, NULL);
 
         if (rc != 0) {
             if (cache->use_persistent_storage) {
@@ -1907,12 +2115,9 @@ shardcache_del_internal(shardcache_t *cache,
                     rc = 0;
                 }
             }
-        } else if (prev_ptr) {
+        } else {
             shardcache_unschedule_expiration(cache, key, klen, 1);
-            volatile_object_t *prev_item = (volatile_object_t *)prev_ptr;
-            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                            prev_item->dlen);
-            destroy_volatile(prev_item);
+            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev_len);
         }
 
         if (ATOMIC_READ(cache->evict_on_delete))
@@ -1936,6 +2141,7 @@ shardcache_del_internal(shardcache_t *cache,
         }
         char *addr = shardcache_node_get_address(peer);
         int fd = shardcache_get_connection_for_peer(cache, addr);
+        shardcache_peer_stats_request(shardcache_peers_stats_lookup(cache->peers_stats, addr), klen);
         int rc = -1;
         if (cb) {
             rc = delete_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 0);
@@ -1957,9 +2163,12 @@ shardcache_del_internal(shardcache_t *cache,
                 } else {
                     free(arg->key);
                     free(arg);
+                    shardcache_discard_connection_for_peer(cache, addr, fd, 1);
                     cb(key, klen, -1, priv);
+                    rc = -1;
                 }
             } else {
+                shardcache_discard_connection_for_peer(cache, addr, fd, 1);
                 cb(key, klen, -1, priv);
             }
         } else {
@@ -1967,7 +2176,7 @@ shardcache_del_internal(shardcache_t *cache,
             if (rc == 0)
                 shardcache_release_connection_for_peer(cache, addr, fd);
             else
-                close(fd);
+                shardcache_discard_connection_for_peer(cache, addr, fd, 1);
         }
     }
 
@@ -2030,14 +2239,8 @@ shardcache_get_nodes(shardcache_t *cache, int *num_nodes)
     if (num_nodes)
         *num_nodes = num;
     shardcache_node_t **list = malloc(sizeof(shardcache_node_t *) * num);
-    for (i = 0; i < num; i++) {
-        shardcache_node_t *orig = cache->shards[i];
-        char *label = shardcache_node_get_label(orig);
-        int num_replicas = shardcache_node_num_addresses(orig);
-        char *addresses[num_replicas];
-        shardcache_node_get_all_addresses(orig, addresses, num_replicas);
-        list[i] = shardcache_node_create(label, addresses, num_replicas);
-    }
+    for (i = 0; i < num; i++)
+        list[i] = shardcache_node_copy(cache->shards[i]);
     SPIN_UNLOCK(&cache->migration_lock);
     return list;
 }
@@ -2061,8 +2264,115 @@ void
 shardcache_clear_counters(shardcache_t *cache)
 {
     int i;
-    for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i++)
-        ATOMIC_SET(cache->cnt[i].value, 0);
+    for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i++) {
+        // the size of the volatile storage is not a counter but
+        // a gauge which the eviction of volatile keys relies on
+        if (i == SHARDCACHE_COUNTER_TABLE_SIZE)
+            continue;
+        if (SHARDCACHE_COUNTER_IS_GAUGE(i))
+            ATOMIC_SET(cache->cnt[i].value, 0);
+        else
+            shardcache_sharded_counter_set(cache->sharded_counters, i, 0);
+    }
+
+    for (i = 0; i < SHARDCACHE_NUM_LATENCIES; i++)
+        shardcache_histogram_reset(cache->latencies[i]);
+
+    shardcache_peers_stats_reset(cache->peers_stats);
+
+    shardcache_hotkeys_reset(cache->hotkeys);
+}
+
+int
+shardcache_get_hotkeys(shardcache_t *cache, int by_bytes, shardcache_hotkey_t **hotkeys)
+{
+    shardcache_hotkey_t *out = calloc(SHARDCACHE_HOTKEYS_CAPACITY, sizeof(shardcache_hotkey_t));
+    if (!out)
+        return 0;
+    int num_keys = shardcache_hotkeys_top(cache->hotkeys, by_bytes, out, SHARDCACHE_HOTKEYS_CAPACITY);
+    *hotkeys = out;
+    return num_keys;
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+} shardcache_get_metrics_arg_t;
+
+static void
+shardcache_get_metrics_helper(char *data, size_t len, void *priv)
+{
+    shardcache_get_metrics_arg_t *arg = (shardcache_get_metrics_arg_t *)priv;
+    arg->data = malloc(len + 1);
+    if (arg->data) {
+        memcpy(arg->data, data, len);
+        arg->data[len] = 0;
+        arg->len = len;
+    }
+}
+
+int
+shardcache_get_metrics(shardcache_t *cache, char **out, size_t *len)
+{
+    shardcache_get_metrics_arg_t arg = { NULL, 0 };
+    shardcache_metrics_render(cache->metrics, shardcache_get_metrics_helper, &arg);
+    if (!arg.data)
+        return -1;
+    *out = arg.data;
+    if (len)
+        *len = arg.len;
+    return 0;
+}
+
+int
+shardcache_metrics_listen(shardcache_t *cache, char *address)
+{
+    return shardcache_metrics_http_listen(cache->metrics, address);
+}
+
+int
+shardcache_get_traces(shardcache_t *cache, uint64_t min_usecs, char **out, size_t *len)
+{
+    fbuf_t buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    int num_traces = shardcache_tracer_dump(cache->tracer, min_usecs, &buf);
+    *out = malloc(fbuf_used(&buf) + 1);
+    if (!*out) {
+        fbuf_destroy(&buf);
+        return 0;
+    }
+    if (fbuf_used(&buf))
+        memcpy(*out, fbuf_data(&buf), fbuf_used(&buf));
+    (*out)[fbuf_used(&buf)] = 0;
+    if (len)
+        *len = fbuf_used(&buf);
+    fbuf_destroy(&buf);
+    return num_traces;
+}
+
+int
+shardcache_get_latencies(shardcache_t *cache, shardcache_latency_t **latencies)
+{
+    const char *latencies_names[SHARDCACHE_NUM_LATENCIES] = SHARDCACHE_LATENCY_LABELS_ARRAY;
+    shardcache_latency_t *out = calloc(SHARDCACHE_NUM_LATENCIES, sizeof(shardcache_latency_t));
+    shardcache_histogram_snapshot_t *snapshot = malloc(sizeof(shardcache_histogram_snapshot_t));
+
+    int i;
+    for (i = 0; i < SHARDCACHE_NUM_LATENCIES; i++) {
+        shardcache_histogram_merge(cache->latencies[i], snapshot);
+        snprintf(out[i].name, sizeof(out[i].name), "%s", latencies_names[i]);
+        out[i].count = snapshot->count;
+        out[i].min = snapshot->min;
+        out[i].mean = snapshot->count ? snapshot->sum / snapshot->count : 0;
+        out[i].p50 = shardcache_histogram_percentile(snapshot, 50);
+        out[i].p90 = shardcache_histogram_percentile(snapshot, 90);
+        out[i].p99 = shardcache_histogram_percentile(snapshot, 99);
+        out[i].p999 = shardcache_histogram_percentile(snapshot, 99.9);
+        out[i].max = snapshot->max;
+    }
+
+    free(snapshot);
+    *latencies = out;
+    return SHARDCACHE_NUM_LATENCIES;
 }
 
 shardcache_storage_index_t *
@@ -2080,6 +2390,26 @@ shardcache_get_index(shardcache_t *cache)
         if (cache->storage.index) {
             items = calloc(sizeof(shardcache_storage_index_item_t), isize);
             count = cache->storage.index(items, isize, cache->storage.priv);
+        } else if (cache->storage.index_open) {
+            // the storage can only be walked using a cursor,
+            // let's collect all the batches in a single array
+            void *cursor = cache->storage.index_open(cache->storage.priv);
+            if (cursor) {
+                size_t n;
+                if (isize == 0)
+                    isize = SHARDCACHE_INDEX_BATCH_SIZE;
+                items = calloc(sizeof(shardcache_storage_index_item_t), isize);
+                while ((n = cache->storage.index_next(cursor, &items[count],
+                                                      isize - count, cache->storage.priv)) > 0)
+                {
+                    count += n;
+                    if (count == isize) {
+                        isize *= 2;
+                        items = realloc(items, sizeof(shardcache_storage_index_item_t) * isize);
+                    }
+                }
+                cache->storage.index_close(cursor, cache->storage.priv);
+            }
         }
         index = calloc(1, sizeof(shardcache_storage_index_t));
         index->items = items;
@@ -2102,11 +2432,88 @@ shardcache_free_index(shardcache_storage_index_t *index)
     free(index);
 }
 
+struct __shardcache_index_cursor_s {
+    shardcache_t *cache;
+    void *cursor;                       // the cursor returned by the storage
+    shardcache_storage_index_t *index;  // the whole index if the storage doesn't
+                                        // support cursors
+    size_t offset;                      // the next item to return from the index
+    size_t count;                       // the (estimated) number of items
+};
+
+shardcache_index_cursor_t *
+shardcache_index_cursor_open(shardcache_t *cache)
+{
+    if (!cache->use_persistent_storage)
+        return NULL;
+
+    shardcache_index_cursor_t *cursor = calloc(1, sizeof(shardcache_index_cursor_t));
+    cursor->cache = cache;
+
+    if (cache->storage.index_open) {
+        cursor->cursor = cache->storage.index_open(cache->storage.priv);
+        if (!cursor->cursor) {
+            SHC_ERROR("Can't open a cursor on the storage index");
+            free(cursor);
+            return NULL;
+        }
+        if (cache->storage.count)
+            cursor->count = cache->storage.count(cache->storage.priv);
+    } else {
+        // fallback to the full index
+        cursor->index = shardcache_get_index(cache);
+        if (!cursor->index) {
+            free(cursor);
+            return NULL;
+        }
+        cursor->count = cursor->index->size;
+    }
+
+    return cursor;
+}
+
+size_t
+shardcache_index_cursor_next(shardcache_index_cursor_t *cursor,
+                             shardcache_storage_index_item_t *items,
+                             size_t isize)
+{
+    shardcache_t *cache = cursor->cache;
+
+    if (cursor->cursor)
+        return cache->storage.index_next(cursor->cursor, items, isize, cache->storage.priv);
+
+    size_t n = 0;
+    while (n < isize && cursor->offset < cursor->index->size) {
+        items[n] = cursor->index->items[cursor->offset];
+        // the ownership of the key is transferred to the caller
+        cursor->index->items[cursor->offset].key = NULL;
+        cursor->offset++;
+        n++;
+    }
+    return n;
+}
+
+size_t
+shardcache_index_cursor_count(shardcache_index_cursor_t *cursor)
+{
+    return cursor->count;
+}
+
+void
+shardcache_index_cursor_close(shardcache_index_cursor_t *cursor)
+{
+    shardcache_t *cache = cursor->cache;
+    if (cursor->cursor)
+        cache->storage.index_close(cursor->cursor, cache->storage.priv);
+    if (cursor->index)
+        shardcache_free_index(cursor->index);
+    free(cursor);
+}
+
 static int
-expire_migrated(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+expire_migrated(void *key, size_t klen, void *value, size_t vlen, uint32_t *expire, void *user)
 {
     shardcache_t *cache = (shardcache_t *)user;
-    volatile_object_t *v = (volatile_object_t *)value;
 
     char node_name[1024];
     size_t node_len = sizeof(node_name);
@@ -2116,141 +2523,633 @@ expire_migrated(hashtable_t *table, void *key, size_t klen, void *value, size_t
         SHC_WARNING("expire_migrated running while no migration continuum present ... aborting");
         return 0;
     } else if (!is_mine) {
-        char keystr[1024];
-        KEY2STR(key, klen, keystr, sizeof(keystr));
-        SHC_DEBUG("Forcing Key %s to expire because not owned anymore", keystr);
+        SHC_DEBUG("Forcing Key %.*s to expire because not owned anymore", KEYFMT(key, klen));
 
-        v->expire = 0;
+        *expire = 0;
     }
     return 1;
 }
 
 
-void *
-migrate(void *priv)
+/*
+ * Migration engine
+ *
+ * The migrator thread opens a cursor on the storage index and starts
+ * migration_workers worker threads. Each worker pulls the next batch of keys
+ * from the cursor, checks their ownership and queues the ones not owned
+ * anymore in a per-peer batch. When a batch is
+ * full (or the worker has scanned all its keys) the SET commands for the whole
+ * batch are pipelined on a single connection and only afterwards the responses
+ * are collected. Both the keys and the bytes sent per second can be limited
+ * (using a token bucket shared by all the workers) to protect the live traffic.
+ * The keys acknowledged by their new owner are removed from the local storage
+ * as soon as their batch has been flushed, so nothing but the batches is held
+ * in memory for the whole migration.
+ */
+
+typedef struct {
+    pthread_mutex_t lock;
+    double tokens;
+    struct timeval last;
+} migration_bucket_t;
+
+typedef struct {
+    shardcache_t *cache;
+    shardcache_index_cursor_t *cursor;
+    pthread_mutex_t cursor_lock;
+    uint64_t cursor_offset;     // the number of keys pulled from the cursor so far
+    migration_checkpoint_t *checkpoint;
+    linked_list_t *chunks;      // the chunks completed after the checkpoint watermark
+    uint64_t removed_items;     // the number of keys before the watermark
+                                // which have been removed from the storage
+    int num_workers;
+    int batch_size;
+    int aborted;
+    int running_workers;
+    migration_bucket_t keys_bucket;
+    migration_bucket_t bytes_bucket;
+    uint64_t migrated_items;
+    uint64_t migrated_bytes;
+    uint64_t scanned_items;
+    uint64_t errors;
+    uint64_t total_items;
+    uint64_t keys_per_sec;
+    uint64_t bytes_per_sec;
+    uint64_t eta;
+} migration_ctx_t;
+
+typedef struct {
+    shardcache_storage_index_item_t item;
+    void *value;
+    size_t vlen;
+    uint64_t offset;           // the position of the key in the index
+} migration_item_t;
+
+typedef struct {
+    char *addr;
+    migration_item_t *items;
+    int num_items;
+} migration_batch_t;
+
+// the keys removed from the storage shift the position of the ones following
+// them in the index, so the checkpoint needs to know how many keys have been
+// removed before its watermark
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t removed;          // the keys removed from the storage
+    uint64_t failed_offset;    // the first key which couldn't be migrated
+    uint64_t removed_before;   // the keys removed before failed_offset
+} migration_chunk_t;
+
+typedef struct {
+    migration_ctx_t *ctx;
+    int id;
+    pthread_t th;
+    hashtable_t *batches;      // peer label -> migration_batch_t
+    uint64_t chunk_offset;     // the offset of the keys being processed
+                               // (MIGRATION_NO_CHUNK if none)
+    size_t chunk_count;        // the number of keys being processed
+    uint64_t chunk_failed;     // the offset of the first key in the chunk
+                               // which couldn't be migrated
+    char chunk_removed[SHARDCACHE_INDEX_BATCH_SIZE]; // the keys in the chunk
+                                                     // removed from the storage
+    uint64_t failed_offset;    // the offset of the first key which couldn't
+                               // be migrated (MIGRATION_NO_CHUNK if none)
+} migration_worker_t;
+
+#define MIGRATION_NO_CHUNK UINT64_MAX
+
+// the checkpoint must never move past a key which couldn't be migrated,
+// so that it will be retried when resuming the migration
+static void
+migration_item_failed(migration_worker_t *worker, uint64_t offset)
 {
-    shardcache_t *cache = (shardcache_t *)priv;
+    migration_ctx_t *ctx = worker->ctx;
+    ATOMIC_INCREMENT(ctx->errors);
+    MUTEX_LOCK(&ctx->cursor_lock);
+    if (offset < worker->failed_offset)
+        worker->failed_offset = offset;
+    MUTEX_UNLOCK(&ctx->cursor_lock);
+    if (offset < worker->chunk_failed)
+        worker->chunk_failed = offset;
+}
 
-    shardcache_storage_index_t *index = shardcache_get_index(cache);
-    int aborted = 0;
-    linked_list_t *to_delete = list_create();
+static void
+migration_throttle(migration_bucket_t *bucket, int rate, size_t amount)
+{
+    if (rate <= 0)
+        return;
 
-    uint64_t migrated_items = 0;
-    uint64_t scanned_items = 0;
-    uint64_t errors = 0;
-    uint64_t total_items = 0;
+    struct timeval now;
+    gettimeofday(&now, NULL);
 
-    shardcache_thread_init(cache);
+    MUTEX_LOCK(&bucket->lock);
+    if (bucket->last.tv_sec == 0) {
+        bucket->tokens = rate;
+    } else {
+        struct timeval diff;
+        timersub(&now, &bucket->last, &diff);
+        bucket->tokens += (diff.tv_sec + (double)diff.tv_usec / 1000000) * rate;
+        // allow bursts of at most one second worth of traffic
+        if (bucket->tokens > rate)
+            bucket->tokens = rate;
+    }
+    bucket->last = now;
+    bucket->tokens -= amount;
+    // the bucket is allowed to go in debt, the caller will wait
+    // for as long as needed to pay it back
+    double wait = (bucket->tokens < 0) ? -bucket->tokens / rate : 0;
+    MUTEX_UNLOCK(&bucket->lock);
+
+    if (wait > 0)
+        usleep(wait * 1000000);
+}
+
+static void
+migration_batch_destroy(migration_batch_t *batch)
+{
+    int i;
+    for (i = 0; i < batch->num_items; i++) {
+        free(batch->items[i].item.key);
+        free(batch->items[i].value);
+    }
+    free(batch->items);
+    free(batch->addr);
+    free(batch);
+}
 
-    if (index) {
-        total_items = index->size;
+static void
+migration_batch_flush(migration_worker_t *worker, migration_batch_t *batch)
+{
+    migration_ctx_t *ctx = worker->ctx;
+    shardcache_t *cache = ctx->cache;
+    int sent = 0;
+    int acked = 0;
 
-        shardcache_counter_add(cache->counters, "migrated_items", &migrated_items);
-        shardcache_counter_add(cache->counters, "scanned_items", &scanned_items);
-        shardcache_counter_add(cache->counters, "total_items", &total_items);
-        shardcache_counter_add(cache->counters, "migration_errors", &errors);
+    if (!batch->num_items)
+        return;
 
-        SHC_INFO("Migrator starting (%d items to precess)", total_items);
+    SHC_DEBUG("Migrator worker %d sending %d items to peer %s",
+              worker->id, batch->num_items, batch->addr);
+
+    shardcache_peer_stats_t *stats = shardcache_peers_stats_lookup(cache->peers_stats, batch->addr);
+    int fd = shardcache_get_connection_for_peer(cache, batch->addr);
+    if (fd >= 0) {
+        // pipeline all the SET commands first ...
+        for (sent = 0; sent < batch->num_items; sent++) {
+            migration_item_t *mitem = &batch->items[sent];
+            shardcache_peer_stats_request(stats, mitem->item.klen + mitem->vlen);
+            int rc = send_to_peer(batch->addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP,
+                                  mitem->item.key, mitem->item.klen,
+                                  mitem->value, mitem->vlen, 0, fd, 0);
+            if (rc != 0)
+                break;
+        }
 
+        // ... and only then collect the responses
+        for (acked = 0; acked < sent; acked++) {
+            migration_item_t *mitem = &batch->items[acked];
+            shardcache_hdr_t hdr = 0;
+            fbuf_t resp = FBUF_STATIC_INITIALIZER;
+            fbuf_t *respp = &resp;
+            int num_records = read_message(fd, (char *)cache->auth, &respp, 1, &hdr, 0);
+            if (num_records == -1) {
+                fbuf_destroy(&resp);
+                break;
+            }
+            char *res = fbuf_data(&resp);
+            if (hdr == SHC_HDR_RESPONSE && num_records == 1 && res && *res == SHC_RES_OK) {
+                // the new owner has the key, it's not needed here anymore
+                // (the cursor is still open, the storage guarantees that
+                // removing a key doesn't make it skip the other ones)
+                if (cache->storage.remove)
+                    cache->storage.remove(mitem->item.key, mitem->item.klen, cache->storage.priv);
+                SHC_DEBUG2("removed item %.*s", KEYFMT(mitem->item.key, mitem->item.klen));
+                if (mitem->offset >= worker->chunk_offset &&
+                    mitem->offset < worker->chunk_offset + worker->chunk_count)
+                {
+                    worker->chunk_removed[mitem->offset - worker->chunk_offset] = 1;
+                }
+                ATOMIC_INCREMENT(ctx->migrated_items);
+                ATOMIC_INCREASE(ctx->migrated_bytes, mitem->vlen);
+            } else {
+                SHC_WARNING("Errors copying %.*s to peer %s",
+                            KEYFMT(mitem->item.key, mitem->item.klen), batch->addr);
+                migration_item_failed(worker, mitem->offset);
+            }
+            fbuf_destroy(&resp);
+        }
+    }
+
+    if (fd >= 0 && acked == batch->num_items) {
+        shardcache_release_connection_for_peer(cache, batch->addr, fd);
+    } else {
+        SHC_WARNING("Errors sending a batch of %d items to peer %s (%d sent, %d acknowledged)",
+                    batch->num_items, batch->addr, sent, acked);
         int i;
-        for (i = 0; i < index->size; i++) {
-            size_t klen = index->items[i].klen;
-            void *key = index->items[i].key;
+        for (i = acked; i < batch->num_items; i++)
+            migration_item_failed(worker, batch->items[i].offset);
+        shardcache_discard_connection_for_peer(cache, batch->addr, fd, 1);
+    }
+
+    int i;
+    for (i = 0; i < batch->num_items; i++) {
+        free(batch->items[i].item.key);
+        free(batch->items[i].value);
+    }
+    batch->num_items = 0;
+}
+
+static int
+migration_batch_flush_helper(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    migration_batch_flush((migration_worker_t *)user, (migration_batch_t *)value);
+    return 1;
+}
 
-            char node_name[1024];
-            size_t node_len = sizeof(node_name);
-            memset(node_name, 0, node_len);
+static int
+migration_process_item(migration_worker_t *worker, shardcache_storage_index_item_t *item, uint64_t offset)
+{
+    migration_ctx_t *ctx = worker->ctx;
+    shardcache_t *cache = ctx->cache;
+    size_t klen = item->klen;
+    void *key = item->key;
 
-            char keystr[1024];
-            KEY2STR(key, klen, keystr, sizeof(keystr));
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    memset(node_name, 0, node_len);
 
-            SHC_DEBUG("Migrator processign key %s", keystr);
+    SHC_DEBUG("Migrator processign key %.*s", KEYFMT(key, klen));
 
-            int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
+    int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
 
-            int rc = 0;
-            
-            if (is_mine == -1) {
-                SHC_WARNING("Migrator running while no migration continuum present ... aborting");
-                ATOMIC_INCREMENT(errors);
-                aborted = 1;
-                break;
-            } else if (!is_mine) {
-                // if we are not the owner try asking our peer responsible for this data
-                void *value = NULL;
-                size_t vlen = 0;
-                if (cache->storage.fetch) {
-                    rc = cache->storage.fetch(key, klen, &value, &vlen, cache->storage.priv);
-                    if (rc == -1) {
-                        SHC_ERROR("Fetch storage callback retunrned an error during migration (%d)", rc);
-                        ATOMIC_INCREMENT(errors);
-                        ATOMIC_INCREMENT(scanned_items);
+    if (is_mine == -1) {
+        SHC_WARNING("Migrator running while no migration continuum present ... aborting");
+        ATOMIC_INCREMENT(ctx->errors);
+        ATOMIC_SET(ctx->aborted, 1);
+        return -1;
+    } else if (!is_mine) {
+        // if we are not the owner try asking our peer responsible for this data
+        void *value = NULL;
+        size_t vlen = 0;
+        if (cache->storage.fetch) {
+            uint64_t start = shardcache_histogram_now();
+            int rc = cache->storage.fetch(key, klen, &value, &vlen, cache->storage.priv);
+            SHARDCACHE_LATENCY_RECORD(cache, SHARDCACHE_LATENCY_STORAGE_FETCH, start);
+            if (rc == -1) {
+                SHC_ERROR("Fetch storage callback retunrned an error during migration (%d)", rc);
+                migration_item_failed(worker, offset);
+                ATOMIC_INCREMENT(ctx->scanned_items);
+                return 0;
+            }
+        }
+        if (value) {
+            migration_batch_t *batch = ht_get(worker->batches, node_name, node_len, NULL);
+            if (!batch) {
+                shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
+                if (peer) {
+                    batch = calloc(1, sizeof(migration_batch_t));
+                    batch->addr = strdup(shardcache_node_get_address(peer));
+                    batch->items = calloc(ctx->batch_size, sizeof(migration_item_t));
+                    ht_set(worker->batches, node_name, node_len, batch, sizeof(migration_batch_t));
+                }
+            }
+            if (batch) {
+                migration_throttle(&ctx->keys_bucket,
+                                   ATOMIC_READ(cache->migration_max_keys_per_sec), 1);
+                migration_throttle(&ctx->bytes_bucket,
+                                   ATOMIC_READ(cache->migration_max_bytes_per_sec), klen + vlen);
+
+                SHC_DEBUG("Migrator copying %.*s to peer %s (%s)", KEYFMT(key, klen), node_name, batch->addr);
+                migration_item_t *mitem = &batch->items[batch->num_items++];
+                // the batch takes ownership of the key
+                mitem->item = *item;
+                item->key = NULL;
+                mitem->value = value;
+                mitem->vlen = vlen;
+                mitem->offset = offset;
+                if (batch->num_items == ctx->batch_size)
+                    migration_batch_flush(worker, batch);
+            } else {
+                SHC_ERROR("Can't find address for peer %s (me : %s)", node_name, cache->me);
+                migration_item_failed(worker, offset);
+                free(value);
+            }
+        }
+    }
+    ATOMIC_INCREMENT(ctx->scanned_items);
+    return 0;
+}
+
+static void *
+migration_worker(void *priv)
+{
+    migration_worker_t *worker = (migration_worker_t *)priv;
+    migration_ctx_t *ctx = worker->ctx;
+    shardcache_t *cache = ctx->cache;
+
+    shardcache_thread_init(cache);
+
+    // only one batch of keys per worker is held in memory at any given time
+    shardcache_storage_index_item_t *items =
+        malloc(sizeof(shardcache_storage_index_item_t) * SHARDCACHE_INDEX_BATCH_SIZE);
+
+    while (!ATOMIC_READ(ctx->aborted)) {
+        if (ATOMIC_READ(cache->quit)) {
+            ATOMIC_SET(ctx->aborted, 1);
+            break;
+        }
+
+        MUTEX_LOCK(&ctx->cursor_lock);
+        size_t count = shardcache_index_cursor_next(ctx->cursor, items, SHARDCACHE_INDEX_BATCH_SIZE);
+        worker->chunk_offset = ctx->cursor_offset;
+        ctx->cursor_offset += count;
+        MUTEX_UNLOCK(&ctx->cursor_lock);
+
+        if (!count)
+            break;
+
+        worker->chunk_count = count;
+        worker->chunk_failed = MIGRATION_NO_CHUNK;
+        memset(worker->chunk_removed, 0, count);
+
+        int i;
+        for (i = 0; i < count; i++) {
+            if (!ATOMIC_READ(ctx->aborted)) {
+                uint64_t start = shardcache_histogram_now();
+                migration_process_item(worker, &items[i], worker->chunk_offset + i);
+                SHARDCACHE_LATENCY_RECORD(cache, SHARDCACHE_LATENCY_MIGRATION_KEY, start);
+            }
+            free(items[i].key);
+        }
+
+        if (ctx->checkpoint && !ATOMIC_READ(ctx->aborted)) {
+            // the keys in this chunk can be considered done (and skipped
+            // when resuming) only once they have been acknowledged by their
+            // new owners, so we can't wait for the batches to fill up
+            ht_foreach_pair(worker->batches, migration_batch_flush_helper, worker);
+        }
+
+        // NOTE: if aborted the chunk stays in progress, so that
+        //       the checkpoint will not move past it
+        if (!ATOMIC_READ(ctx->aborted)) {
+            migration_chunk_t *chunk = NULL;
+            if (ctx->checkpoint) {
+                chunk = calloc(1, sizeof(migration_chunk_t));
+                chunk->offset = worker->chunk_offset;
+                chunk->count = count;
+                chunk->failed_offset = worker->chunk_failed;
+                for (i = 0; i < count; i++) {
+                    if (!worker->chunk_removed[i])
                         continue;
-                    }
+                    chunk->removed++;
+                    if (chunk->offset + i < chunk->failed_offset)
+                        chunk->removed_before++;
                 }
-                if (value) {
-                    shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
-                    if (peer) {
-                        char *addr = shardcache_node_get_address(peer);
-                        SHC_DEBUG("Migrator copying %s to peer %s (%s)", keystr, node_name, addr);
-                        int fd = shardcache_get_connection_for_peer(cache, addr);
-                        rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, 0, fd, 1);
-                        if (rc == 0) {
-                            shardcache_release_connection_for_peer(cache, addr, fd);
-                            ATOMIC_INCREMENT(migrated_items);
-                            list_push_value(to_delete, &index->items[i]);
-                        } else {
-                            close(fd);
-                            SHC_WARNING("Errors copying %s to peer %s (%s)", keystr, node_name, addr);
-                            ATOMIC_INCREMENT(errors);
-                        }
-                    } else {
-                        SHC_ERROR("Can't find address for peer %s (me : %s)", node_name, cache->me);
-                        ATOMIC_INCREMENT(errors);
-                    }
+            }
+            MUTEX_LOCK(&ctx->cursor_lock);
+            if (chunk)
+                list_push_value(ctx->chunks, chunk);
+            worker->chunk_offset = MIGRATION_NO_CHUNK;
+            MUTEX_UNLOCK(&ctx->cursor_lock);
+        }
+    }
+
+    free(items);
+
+    // send out whatever is left in the batches
+    if (!ATOMIC_READ(ctx->aborted))
+        ht_foreach_pair(worker->batches, migration_batch_flush_helper, worker);
+
+    ATOMIC_DECREMENT(ctx->running_workers);
+    shardcache_thread_end(cache);
+    return NULL;
+}
+
+static void
+migration_update_progress(migration_ctx_t *ctx, struct timeval *start)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    double elapsed = diff.tv_sec + (double)diff.tv_usec / 1000000;
+    if (elapsed <= 0)
+        return;
+
+    uint64_t scanned = ATOMIC_READ(ctx->scanned_items);
+    ATOMIC_SET(ctx->keys_per_sec, ATOMIC_READ(ctx->migrated_items) / elapsed);
+    ATOMIC_SET(ctx->bytes_per_sec, ATOMIC_READ(ctx->migrated_bytes) / elapsed);
+    // the total is only an estimate (if known at all) when using a cursor
+    if (scanned && ctx->total_items > scanned)
+        ATOMIC_SET(ctx->eta, (ctx->total_items - scanned) * (elapsed / scanned));
+}
+
+// returns the number of keys which have been completely processed,
+// which is the offset of the oldest chunk still being processed
+// (or of the first key which couldn't be migrated, if before it)
+// or the number of keys pulled from the cursor if none is in progress,
+// minus the keys before it which have been removed from the storage
+static uint64_t
+migration_checkpoint_watermark(migration_ctx_t *ctx, migration_worker_t *workers)
+{
+    MUTEX_LOCK(&ctx->cursor_lock);
+    uint64_t offset = ctx->cursor_offset;
+    int i;
+    for (i = 0; i < ctx->num_workers; i++) {
+        if (workers[i].chunk_offset < offset)
+            offset = workers[i].chunk_offset;
+        if (workers[i].failed_offset < offset)
+            offset = workers[i].failed_offset;
+    }
+
+    // the watermark never moves back, so the chunks entirely before it
+    // can be accounted once and released
+    uint64_t removed_before = 0;
+    i = 0;
+    while (i < list_count(ctx->chunks)) {
+        migration_chunk_t *chunk = list_pick_value(ctx->chunks, i);
+        if (chunk->offset + chunk->count <= offset) {
+            ctx->removed_items += chunk->removed;
+            free(list_fetch_value(ctx->chunks, i));
+            continue;
+        }
+        // the watermark can fall within a completed chunk
+        // only if held by a key which couldn't be migrated
+        if (chunk->offset < offset && chunk->failed_offset == offset)
+            removed_before = chunk->removed_before;
+        i++;
+    }
+    offset -= ctx->removed_items + removed_before;
+    MUTEX_UNLOCK(&ctx->cursor_lock);
+    return offset;
+}
+
+void *
+migrate(void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+
+    shardcache_thread_init(cache);
+
+    shardcache_index_cursor_t *cursor = shardcache_index_cursor_open(cache);
+
+    migration_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cache = cache;
+    ctx.cursor = cursor;
+    ctx.num_workers = ATOMIC_READ(cache->migration_workers);
+    if (ctx.num_workers <= 0)
+        ctx.num_workers = SHARDCACHE_MIGRATION_WORKERS_DEFAULT;
+    ctx.batch_size = ATOMIC_READ(cache->migration_batch_size);
+    if (ctx.batch_size <= 0)
+        ctx.batch_size = SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT;
+    MUTEX_INIT(&ctx.cursor_lock);
+    ctx.chunks = list_create();
+    list_set_free_value_callback(ctx.chunks, free);
+    MUTEX_INIT(&ctx.keys_bucket.lock);
+    MUTEX_INIT(&ctx.bytes_bucket.lock);
+
+    SPIN_LOCK(&cache->migration_lock);
+    ctx.checkpoint = cache->migration_checkpoint;
+    SPIN_UNLOCK(&cache->migration_lock);
+
+    migration_worker_t *workers = NULL;
+
+    if (cursor) {
+        ctx.total_items = shardcache_index_cursor_count(cursor);
+
+        shardcache_counter_add(cache->counters, "migrated_items", &ctx.migrated_items);
+        shardcache_counter_add(cache->counters, "migrated_bytes", &ctx.migrated_bytes);
+        shardcache_counter_add(cache->counters, "scanned_items", &ctx.scanned_items);
+        shardcache_counter_add(cache->counters, "total_items", &ctx.total_items);
+        shardcache_counter_add(cache->counters, "migration_errors", &ctx.errors);
+        shardcache_counter_add(cache->counters, "migration_keys_per_sec", &ctx.keys_per_sec);
+        shardcache_counter_add(cache->counters, "migration_bytes_per_sec", &ctx.bytes_per_sec);
+        shardcache_counter_add(cache->counters, "migration_eta", &ctx.eta);
+
+        SHC_INFO("Migrator starting (%d items to precess, %d workers)", ctx.total_items, ctx.num_workers);
+
+        struct timeval start;
+        gettimeofday(&start, NULL);
+
+        workers = calloc(ctx.num_workers, sizeof(migration_worker_t));
+        int i;
+        for (i = 0; i < ctx.num_workers; i++) {
+            workers[i].ctx = &ctx;
+            workers[i].id = i;
+            workers[i].batches = ht_create(128, 65535, (ht_free_item_callback_t)migration_batch_destroy);
+            workers[i].chunk_offset = MIGRATION_NO_CHUNK;
+            workers[i].failed_offset = MIGRATION_NO_CHUNK;
+        }
+
+        int resumed = (ctx.checkpoint && migration_checkpoint_resumed(ctx.checkpoint));
+        if (resumed && !cache->storage.index_stable) {
+            // the offset is meaningless if the index can be listed in a different order
+            SHC_NOTICE("Migrator resuming with a full rescan "
+                       "(the storage doesn't guarantee a stable order of the index)");
+        } else if (resumed) {
+            // the keys completely processed (and still in the storage) can be skipped
+            uint64_t offset = migration_checkpoint_offset(ctx.checkpoint);
+            shardcache_storage_index_item_t items[SHARDCACHE_INDEX_BATCH_SIZE];
+            while (ctx.cursor_offset < offset) {
+                size_t isize = offset - ctx.cursor_offset;
+                if (isize > SHARDCACHE_INDEX_BATCH_SIZE)
+                    isize = SHARDCACHE_INDEX_BATCH_SIZE;
+                size_t count = shardcache_index_cursor_next(cursor, items, isize);
+                if (!count)
+                    break;
+                int n;
+                for (n = 0; n < count; n++)
+                    free(items[n].key);
+                ctx.cursor_offset += count;
+            }
+            ctx.scanned_items = ctx.cursor_offset;
+            SHC_NOTICE("Migrator resuming after %"PRIu64" items", ctx.cursor_offset);
+        }
+
+        struct timeval last_checkpoint;
+        gettimeofday(&last_checkpoint, NULL);
+
+        for (i = 0; i < ctx.num_workers; i++) {
+            ATOMIC_INCREMENT(ctx.running_workers);
+            if (pthread_create(&workers[i].th, NULL, migration_worker, &workers[i]) != 0) {
+                SHC_ERROR("Can't create migration worker %d", i);
+                ATOMIC_DECREMENT(ctx.running_workers);
+                ATOMIC_SET(ctx.aborted, 1);
+                workers[i].th = 0;
+            }
+        }
+
+        while (ATOMIC_READ(ctx.running_workers) > 0) {
+            migration_update_progress(&ctx, &start);
+            if (ctx.checkpoint) {
+                struct timeval now, diff;
+                gettimeofday(&now, NULL);
+                timersub(&now, &last_checkpoint, &diff);
+                if (diff.tv_sec >= ATOMIC_READ(cache->migration_checkpoint_interval)) {
+                    migration_checkpoint_save(ctx.checkpoint,
+                                              migration_checkpoint_watermark(&ctx, workers));
+                    last_checkpoint = now;
                 }
             }
-            ATOMIC_INCREMENT(scanned_items);
+            usleep(100000);
+        }
+        migration_update_progress(&ctx, &start);
+
+        if (ctx.checkpoint)
+            migration_checkpoint_save(ctx.checkpoint, migration_checkpoint_watermark(&ctx, workers));
+
+        for (i = 0; i < ctx.num_workers; i++) {
+            if (workers[i].th)
+                pthread_join(workers[i].th, NULL);
+            ht_destroy(workers[i].batches);
         }
 
         shardcache_counter_remove(cache->counters, "migrated_items");
+        shardcache_counter_remove(cache->counters, "migrated_bytes");
         shardcache_counter_remove(cache->counters, "scanned_items");
         shardcache_counter_remove(cache->counters, "total_items");
         shardcache_counter_remove(cache->counters, "migration_errors");
+        shardcache_counter_remove(cache->counters, "migration_keys_per_sec");
+        shardcache_counter_remove(cache->counters, "migration_bytes_per_sec");
+        shardcache_counter_remove(cache->counters, "migration_eta");
     }
 
-    if (!aborted) {
-            SHC_INFO("Migration completed, now removing not-owned  items");
-        shardcache_storage_index_item_t *item = list_shift_value(to_delete);
-        while (item) {
-            if (cache->storage.remove)
-                cache->storage.remove(item->key, item->klen, cache->storage.priv);
-
-            char ikeystr[1024];
-            KEY2STR(item->key, item->klen, ikeystr, sizeof(ikeystr));
-            SHC_DEBUG2("removed item %s", ikeystr);
-
-            item = list_shift_value(to_delete);
-        }
-
-        // and now let's expire all the volatile keys that don't belong to us anymore
-        ht_foreach_pair(cache->volatile_storage, expire_migrated, cache);
+    if (!ctx.aborted) {
+        SHC_INFO("Migration completed, now expiring not-owned volatile items");
+        // the persistent keys have been removed as soon as copied,
+        // now let's expire all the volatile keys that don't belong to us anymore
+        volatile_storage_foreach(cache->volatile_storage, expire_migrated, cache);
         //ATOMIC_SET(cache->next_expire, 0);
     }
 
-    list_destroy(to_delete);
+    free(workers);
+
+    list_destroy(ctx.chunks);
+    MUTEX_DESTROY(&ctx.cursor_lock);
+    MUTEX_DESTROY(&ctx.keys_bucket.lock);
+    MUTEX_DESTROY(&ctx.bytes_bucket.lock);
+
+    int quitting = ATOMIC_READ(cache->quit);
 
     SPIN_LOCK(&cache->migration_lock);
-    cache->migration_done = 1;
+    if (cache->migration_checkpoint) {
+        // keep the checkpoint if we are shutting down, so that the
+        // migration can be resumed once restarted, otherwise the migration
+        // either completed or has been explicitly aborted
+        migration_checkpoint_destroy(cache->migration_checkpoint, !quitting);
+        cache->migration_checkpoint = NULL;
+    }
+    if (!quitting)
+        cache->migration_done = 1;
     SPIN_UNLOCK(&cache->migration_lock);
-    if (index) {
-        SHC_INFO("Migrator ended: processed %d items, migrated %d, errors %d",
-                total_items, migrated_items, errors);
+    if (cursor) {
+        SHC_INFO("Migrator ended: processed %d items, migrated %d (%d bytes), errors %d",
+                ctx.scanned_items, ctx.migrated_items, ctx.migrated_bytes, ctx.errors);
+        shardcache_index_cursor_close(cursor);
     }
 
-    if (index)
-        shardcache_free_index(index);
-
     shardcache_thread_end(cache);
     return NULL;
 }
@@ -2273,7 +3172,9 @@ shardcache_check_migration_continuum(shardcache_t *cache,
             for (n = 0; n < num_nodes; n++) {
                 char *label1 = shardcache_node_get_label(nodes[i]);
                 char *label2 = shardcache_node_get_label(cache->shards[n]);
-                if (*label1 == *label2 && strcmp(label1, label2) == 0) {
+                if (*label1 == *label2 && strcmp(label1, label2) == 0 &&
+                    shardcache_node_get_weight(nodes[i]) == shardcache_node_get_weight(cache->shards[n]))
+                {
                     found = 1;
                     break;
                 }
@@ -2294,9 +3195,6 @@ shardcache_set_migration_continuum(shardcache_t *cache,
                                    shardcache_node_t **nodes,
                                    int num_nodes)
 {
-    size_t shard_lens[num_nodes];
-    char *shard_names[num_nodes];
-
     SPIN_LOCK(&cache->migration_lock);
 
     if (cache->migration) {
@@ -2314,25 +3212,61 @@ shardcache_set_migration_continuum(shardcache_t *cache,
     cache->migration_shards = malloc(sizeof(shardcache_node_t *) * num_nodes);
     cache->num_migration_shards = num_nodes;
     int i;
-    for (i = 0; i < cache->num_migration_shards; i++) {
-        shardcache_node_t *node = nodes[i];
-        shard_names[i] = shardcache_node_get_label(node);
-        int num_replicas = shardcache_node_num_addresses(node);
-        char *addresses[num_replicas];
-        shardcache_node_get_all_addresses(node, addresses, num_replicas);
-        cache->migration_shards[i] = shardcache_node_create(shard_names[i], addresses, num_replicas);
-        shard_lens[i] = strlen(shard_names[i]);
+    for (i = 0; i < cache->num_migration_shards; i++)
+        cache->migration_shards[i] = shardcache_node_copy(nodes[i]);
+
+    cache->migration = shardcache_continuum_create(cache->migration_shards,
+                                                   cache->num_migration_shards,
+                                                   cache->continuum_mode);
+    if (!cache->migration) {
+        shardcache_free_nodes(cache->migration_shards, cache->num_migration_shards);
+        cache->migration_shards = NULL;
+        cache->num_migration_shards = 0;
+        SPIN_UNLOCK(&cache->migration_lock);
+        return -1;
     }
 
-    cache->migration = chash_create((const char **)shard_names,
-                                    shard_lens,
-                                    num_nodes,
-                                    200);
-
     SPIN_UNLOCK(&cache->migration_lock);
+
+    // start tracking the nodes joining the cluster
+    for (i = 0; i < num_nodes; i++)
+        shardcache_peers_stats_register(cache->peers_stats, nodes[i]);
+
     return 0;
 }
 
+// builds the NODES_LIST used by the MIGRATION_BEGIN command
+// (see docs/protocol.txt), which carries the weight of each node
+static void
+shardcache_nodes_list_build(shardcache_node_t **nodes, int num_nodes, fbuf_t *out)
+{
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        if (i > 0)
+            fbuf_add(out, ",");
+        fbuf_add(out, shardcache_node_get_string(nodes[i]));
+    }
+}
+
+static int
+shardcache_node_string_cmp(const void *a, const void *b)
+{
+    return strcmp(shardcache_node_get_string(*(shardcache_node_t **)a),
+                  shardcache_node_get_string(*(shardcache_node_t **)b));
+}
+
+// builds the string identifying the target continuum of a migration,
+// which doesn't depend on the order of the nodes
+static void
+shardcache_migration_target_build(shardcache_t *cache, fbuf_t *out)
+{
+    shardcache_node_t *nodes[cache->num_migration_shards];
+    memcpy(nodes, cache->migration_shards, sizeof(nodes));
+    qsort(nodes, cache->num_migration_shards, sizeof(shardcache_node_t *), shardcache_node_string_cmp);
+    fbuf_printf(out, "%s:%d:", cache->me, cache->continuum_mode);
+    shardcache_nodes_list_build(nodes, cache->num_migration_shards, out);
+}
+
 static int
 shardcache_migration_begin_internal(shardcache_t *cache,
                                     shardcache_node_t **nodes,
@@ -2348,43 +3282,68 @@ shardcache_migration_begin_internal(shardcache_t *cache,
 
     SHC_NOTICE("Starting migration");
 
-    pthread_create(&cache->migrate_th, NULL, migrate, cache);
+    migration_checkpoint_t *checkpoint = NULL;
+    char *checkpoint_path = NULL;
+    fbuf_t target = FBUF_STATIC_INITIALIZER;
+    SPIN_LOCK(&cache->migration_lock);
+    if (cache->migration_checkpoint_path) {
+        checkpoint_path = strdup(cache->migration_checkpoint_path);
+        shardcache_migration_target_build(cache, &target);
+    }
+    SPIN_UNLOCK(&cache->migration_lock);
+
+    if (checkpoint_path) {
+        checkpoint = migration_checkpoint_create(checkpoint_path, fbuf_data(&target));
+        if (!checkpoint)
+            SHC_WARNING("Can't create the migration checkpoint, the migration won't be resumable");
+        free(checkpoint_path);
+    }
+    fbuf_destroy(&target);
+
+    SPIN_LOCK(&cache->migration_lock);
+    cache->migration_checkpoint = checkpoint;
+    SPIN_UNLOCK(&cache->migration_lock);
 
     if (forward) {
         fbuf_t mgb_message = FBUF_STATIC_INITIALIZER;
 
-        for (i = 0; i < num_nodes; i++) {
-            if (i > 0) 
-                fbuf_add(&mgb_message, ",");
-            int num_replicas = shardcache_node_num_addresses(nodes[i]);
-            char *label = shardcache_node_get_label(nodes[i]);
-            int rindex = random()%num_replicas;
-            char *addr = shardcache_node_get_address_at_index(nodes[i], rindex);
-            fbuf_printf(&mgb_message, "%s:%s", label, addr);
-        }
+        shardcache_nodes_list_build(nodes, num_nodes, &mgb_message);
 
         for (i = 0; i < cache->num_shards; i++) {
             if (strcmp(shardcache_node_get_label(cache->shards[i]), cache->me) != 0) {
-                int num_replicas = shardcache_node_num_addresses(nodes[i]);
-                char *label = shardcache_node_get_label(nodes[i]);
-                int rindex = random()%num_replicas;
-                char *addr = shardcache_node_get_address_at_index(nodes[i], rindex);
+                char *label = shardcache_node_get_label(cache->shards[i]);
+                char *addr = shardcache_node_get_address(cache->shards[i]);
+                if (checkpoint && migration_checkpoint_has_peer(checkpoint, label)) {
+                    SHC_DEBUG("Node %s (%s) already aknowledged the migration", label, addr);
+                    continue;
+                }
                 int fd = shardcache_get_connection_for_peer(cache, addr);
+                shardcache_peer_stats_request(shardcache_peers_stats_lookup(cache->peers_stats, addr),
+                                              fbuf_used(&mgb_message));
                 int rc = migrate_peer(addr,
                                       (char *)cache->auth,
                                       SHC_HDR_SIGNATURE_SIP,
                                       fbuf_data(&mgb_message),
                                       fbuf_used(&mgb_message), fd);
-                shardcache_release_connection_for_peer(cache, addr, fd);
+                if (rc == 0)
+                    shardcache_release_connection_for_peer(cache, addr, fd);
+                else
+                    shardcache_discard_connection_for_peer(cache, addr, fd, 1);
                 if (rc != 0) {
                     SHC_ERROR("Node %s (%s) didn't aknowledge the migration",
                               label, addr);
+                } else if (checkpoint) {
+                    migration_checkpoint_add_peer(checkpoint, label);
                 }
             }
         }
         fbuf_destroy(&mgb_message);
     }
 
+    // NOTE: the migrator is started only after the migration has been
+    //       forwarded because it owns the checkpoint and releases it once done
+    pthread_create(&cache->migrate_th, NULL, migrate, cache);
+
     return 0;
 }
 
@@ -2395,8 +3354,20 @@ shardcache_migration_begin(shardcache_t *cache,
                            int num_nodes,
                            int forward)
 {
-    if (cache->replica)
-        return shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_MIGRATION_BEGIN, NULL, 0, nodes, num_nodes, 0);
+    if (cache->replica) {
+        fbuf_t nodes_list = FBUF_STATIC_INITIALIZER;
+        shardcache_nodes_list_build(nodes, num_nodes, &nodes_list);
+        // include the terminating null byte
+        int rc = shardcache_replica_dispatch(cache->replica,
+                                             SHARDCACHE_REPLICA_OP_MIGRATION_BEGIN,
+                                             NULL,
+                                             0,
+                                             fbuf_data(&nodes_list),
+                                             fbuf_used(&nodes_list) + 1,
+                                             0);
+        fbuf_destroy(&nodes_list);
+        return rc;
+    }
     return shardcache_migration_begin_internal(cache, nodes, num_nodes, forward);
 }
 
@@ -2406,7 +3377,7 @@ shardcache_migration_abort_internal(shardcache_t *cache)
     int ret = -1;
     SPIN_LOCK(&cache->migration_lock);
     if (cache->migration) {
-        chash_free(cache->migration);
+        shardcache_continuum_destroy(cache->migration);
         free(cache->migration_shards);
         SHC_NOTICE("Migration aborted");
         ret = 0;
@@ -2434,9 +3405,9 @@ shardcache_migration_end_internal(shardcache_t *cache)
     int ret = -1;
     SPIN_LOCK(&cache->migration_lock);
     if (cache->migration) {
-        chash_free(cache->chash);
+        shardcache_continuum_destroy(cache->continuum);
         shardcache_free_nodes(cache->shards, cache->num_shards);
-        cache->chash = cache->migration;
+        cache->continuum = cache->migration;
         cache->shards = cache->migration_shards;
         cache->num_shards = cache->num_migration_shards;
         cache->migration = NULL;
@@ -2506,6 +3477,42 @@ shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value)
     return old_value;
 }
 
+int
+shardcache_continuum_mode(shardcache_t *cache, shardcache_continuum_mode_t new_value)
+{
+    SPIN_LOCK(&cache->migration_lock);
+    int old_value = cache->continuum_mode;
+    if ((int)new_value >= 0 && (int)new_value != old_value) {
+        shardcache_continuum_t *continuum = shardcache_continuum_create(cache->shards,
+                                                                        cache->num_shards,
+                                                                        new_value);
+        shardcache_continuum_t *migration = NULL;
+        if (continuum && cache->migration) {
+            migration = shardcache_continuum_create(cache->migration_shards,
+                                                    cache->num_migration_shards,
+                                                    new_value);
+            if (!migration) {
+                shardcache_continuum_destroy(continuum);
+                continuum = NULL;
+            }
+        }
+
+        if (continuum) {
+            shardcache_continuum_destroy(cache->continuum);
+            cache->continuum = continuum;
+            if (migration) {
+                shardcache_continuum_destroy(cache->migration);
+                cache->migration = migration;
+            }
+            cache->continuum_mode = new_value;
+        } else {
+            SHC_ERROR("Can't switch to continuum mode %d", new_value);
+        }
+    }
+    SPIN_UNLOCK(&cache->migration_lock);
+    return old_value;
+}
+
 int
 shardcache_cache_on_set(shardcache_t *cache, int new_value)
 {
@@ -2558,6 +3565,105 @@ shardcache_lazy_expiration(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->lazy_expiration, new_value);
 }
 
+int
+shardcache_migration_workers(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_MIGRATION_WORKERS_DEFAULT;
+    return shardcache_get_set_option(&cache->migration_workers, new_value);
+}
+
+int
+shardcache_migration_batch_size(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT;
+    return shardcache_get_set_option(&cache->migration_batch_size, new_value);
+}
+
+int
+shardcache_migration_max_keys_per_sec(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->migration_max_keys_per_sec, new_value);
+}
+
+int
+shardcache_migration_max_bytes_per_sec(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->migration_max_bytes_per_sec, new_value);
+}
+
+int
+shardcache_migration_checkpoint(shardcache_t *cache, char *path)
+{
+    SPIN_LOCK(&cache->migration_lock);
+    free(cache->migration_checkpoint_path);
+    cache->migration_checkpoint_path = path ? strdup(path) : NULL;
+    SPIN_UNLOCK(&cache->migration_lock);
+    return 0;
+}
+
+int
+shardcache_migration_checkpoint_interval(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL_DEFAULT;
+    return shardcache_get_set_option(&cache->migration_checkpoint_interval, new_value);
+}
+
+int
+shardcache_volatile_max_size(shardcache_t *cache, int new_value)
+{
+    int old_value = shardcache_get_set_option(&cache->volatile_max_size, new_value);
+    if (new_value > 0)
+        shardcache_evict_volatile(cache);
+    return old_value;
+}
+
+int
+shardcache_hotkeys_sample_rate(shardcache_t *cache, int new_value)
+{
+    return shardcache_hotkeys_set_sample_rate(cache->hotkeys, new_value);
+}
+
+int
+shardcache_tracing_sample_rate(shardcache_t *cache, int new_value)
+{
+    return shardcache_tracer_set_sample_rate(cache->tracer, new_value);
+}
+
+int
+shardcache_replica_durability(shardcache_t *cache, int new_value)
+{
+    if (new_value > SHARDCACHE_REPLICA_DURABILITY_SYNC)
+        return -1;
+    int old_value = shardcache_get_set_option(&cache->replica_durability, new_value);
+    if (new_value >= 0 && cache->replica)
+        shardcache_replica_set_durability(cache->replica, new_value);
+    return old_value;
+}
+
+int
+shardcache_replica_anti_entropy(shardcache_t *cache, int new_value)
+{
+    // the hash trees are built scanning the persistent storage
+    if (new_value > 0 && !cache->use_persistent_storage)
+        return -1;
+    int old_value = shardcache_get_set_option(&cache->replica_anti_entropy, new_value);
+    if (new_value >= 0 && cache->replica)
+        shardcache_replica_set_anti_entropy(cache->replica, new_value);
+    return old_value;
+}
+
+int
+shardcache_replica_batch_window(shardcache_t *cache, int new_value)
+{
+    int old_value = shardcache_get_set_option(&cache->replica_batch_window, new_value);
+    if (new_value >= 0 && cache->replica)
+        shardcache_replica_set_batch_window(cache->replica, new_value);
+    return old_value;
+}
+
 void shardcache_thread_init(shardcache_t *cache)
 {
     if (cache->storage.thread_start)
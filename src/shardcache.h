@@ -34,6 +34,20 @@ typedef struct __shardcache_s shardcache_t;
                                                      // requests to handle ahead
 #define SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT  1      // number of async i/o threads used
                                                      // for inter-node communication
+#define SHARDCACHE_MIGRATION_WORKERS_DEFAULT  4      // number of threads copying keys
+                                                     // to their new owners during a migration
+#define SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT 64   // number of SET commands pipelined
+                                                     // to a peer during a migration
+#define SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL_DEFAULT 5 // seconds between two migration checkpoints
+#define SHARDCACHE_REPLICA_DURABILITY_NONE    0      // the replica log is left to the page cache
+#define SHARDCACHE_REPLICA_DURABILITY_BATCHED 1      // concurrent updates of the replica log are
+                                                     // group-committed (one write + one fdatasync)
+#define SHARDCACHE_REPLICA_DURABILITY_SYNC    2      // each update of the replica log is synced
+#define SHARDCACHE_HOTKEYS_SAMPLE_RATE_DEFAULT 16    // one request out of 16 is looked
+                                                     // at by the hot keys tracker
+#define SHARDCACHE_TRACING_SAMPLE_RATE_DEFAULT 0     // no request is traced
+#define SHARDCACHE_INDEX_BATCH_SIZE           1024   // number of keys fetched at once
+                                                     // when walking the index
 extern const char *LIBSHARDCACHE_VERSION;
 
 /*
@@ -112,6 +126,32 @@ typedef enum {
 
 int shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value);
 
+/**
+ * @brief The engines which can be used to determine the owner of a key
+ */
+typedef enum {
+    //! The libchash consistent-hashing ring (default)
+    SHARDCACHE_CONTINUUM_MODE_CHASH = 0,
+    //! A dense lookup table precomputed out of the nodes list,
+    //  allowing O(1) lookups without scanning the ring
+    SHARDCACHE_CONTINUUM_MODE_TABLE = 1
+} shardcache_continuum_mode_t;
+
+/*
+ * @brief Allows to change the engine used to determine the owner of a key
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The new continuum mode.\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the continuum_mode setting
+ * @note All the nodes (and clients) taking part to the shardcache 'cloud'
+ *       MUST use the same continuum mode, otherwise they won't agree on
+ *       the owner of the keys
+ * @note defaults to SHARDCACHE_CONTINUUM_MODE_CHASH
+ */
+int shardcache_continuum_mode(shardcache_t *cache, shardcache_continuum_mode_t new_value);
+
 int shardcache_cache_on_set(shardcache_t *cache, int new_value);
 
 /*
@@ -245,6 +285,246 @@ int shardcache_serving_look_ahead(shardcache_t *cache, int new_value);
  */
 int shardcache_lazy_expiration(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Allows to change the number of worker threads used to copy
+ *        the keys to their new owners when a migration is started
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The number of worker threads.\n
+ *                  If 0 the default value (SHARDCACHE_MIGRATION_WORKERS_DEFAULT) will be used;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_workers setting
+ * @note the new value will be used starting from the next migration
+ * @note defaults to SHARDCACHE_MIGRATION_WORKERS_DEFAULT
+ */
+int shardcache_migration_workers(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the durability of the replica log
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value One of SHARDCACHE_REPLICA_DURABILITY_NONE,
+ *                  SHARDCACHE_REPLICA_DURABILITY_BATCHED or
+ *                  SHARDCACHE_REPLICA_DURABILITY_SYNC.\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the replica_durability setting
+ * @note In batched mode the updates received concurrently are coalesced
+ *       into a single write and a single fdatasync, while in sync mode
+ *       each update pays for its own fdatasync
+ * @note Has no effect if the node is not part of a replica set
+ * @note defaults to SHARDCACHE_REPLICA_DURABILITY_NONE
+ */
+int shardcache_replica_durability(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change how long (in microseconds) the replica messages
+ *        can be queued so that the ones addressed to the same peer
+ *        are sent together in a single REPLICA_BATCH frame
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The new batch window in microseconds (0 disables batching).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the replica_batch_window setting
+ * @note A batch is also sent as soon as it grows bigger than 64KB
+ * @note All the nodes in the replica set must understand REPLICA_BATCH
+ *       messages before batching is enabled on any of them
+ * @note Has no effect if the node is not part of a replica set
+ * @note defaults to 0 (disabled)
+ */
+int shardcache_replica_batch_window(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the number of items in the recovery diff above which
+ *        a replica compares its storage with the one of the peer using hash trees
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The max number of items in the diff (0 disables the hash trees).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the replica_anti_entropy setting,
+ *         -1 if the node has no persistent storage to build the hash trees from
+ * @note When a replica has been unreachable for long the diff of the updates it missed
+ *       can be huge. Above the threshold the replicas exchange the hashes of the key
+ *       ranges in their storage instead, descending only into the ranges which differ,
+ *       and the recovering replica fetches the differing keys in batches
+ * @note Has no effect if the node is not part of a replica set
+ * @note defaults to 0 (disabled)
+ */
+int shardcache_replica_anti_entropy(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the number of SET commands pipelined to a peer
+ *        before collecting the responses when copying keys during a migration
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The size of the batches.\n
+ *                  If 0 the default value (SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT) will be used;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_batch_size setting
+ * @note the new value will be used starting from the next migration
+ * @note defaults to SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT
+ */
+int shardcache_migration_batch_size(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to limit the number of keys copied per second during a migration
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The max number of keys per second (0 == unlimited).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_max_keys_per_sec setting
+ * @note the limit can be changed while a migration is in progress
+ * @note defaults to 0
+ */
+int shardcache_migration_max_keys_per_sec(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to limit the number of bytes copied per second during a migration
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The max number of bytes per second (0 == unlimited).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_max_bytes_per_sec setting
+ * @note the limit can be changed while a migration is in progress
+ * @note defaults to 0
+ */
+int shardcache_migration_max_bytes_per_sec(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to make migrations resumable by periodically checkpointing
+ *        their progress to disk
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param path  The path of the checkpoint file (NULL disables checkpointing)
+ * @return 0 on success, -1 otherwise
+ * @note When a migration begins and a checkpoint for the same target continuum
+ *       is found, the migration is resumed from where it was interrupted
+ *       (skipping the keys already processed and the peers which already
+ *       acknowledged it)
+ * @note the position in the index is saved as the number of keys already
+ *       processed (and still in the storage), so the storage is expected to
+ *       always walk its keys in the same order
+ * @note the position never moves past a key which couldn't be copied to its
+ *       new owner, so such keys are retried when the migration is resumed
+ */
+int shardcache_migration_checkpoint(shardcache_t *cache, char *path);
+
+/*
+ * @brief Allows to change the interval between two migration checkpoints
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The number of seconds between two checkpoints.\n
+ *                  If 0 the default value (SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL_DEFAULT) will be used;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_checkpoint_interval setting
+ * @note defaults to SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL_DEFAULT
+ */
+int shardcache_migration_checkpoint_interval(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to limit the memory used by the volatile storage
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The max size (in megabytes) of the volatile storage,
+ *                  including the keys and the per-key overhead (0 == unlimited).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the volatile_max_size setting
+ * @note When the limit is exceeded a sample of the volatile keys is taken and
+ *       the ones closest to their expiration time are evicted first (keys without
+ *       an expiration time are evicted last) until the size of the volatile
+ *       storage drops below the limit minus a 10% of slack.\n
+ *       Evicted keys are counted by the 'volatile_evictions' counter
+ * @note The eviction is done in background (at least once per second),
+ *       the sets evict keys by themselves only if the storage grows
+ *       past the limit plus a 10% of slack
+ * @note Evictions are local to the node, the other replicas (if any)
+ *       apply the limit independently
+ * @note defaults to 0 (unlimited)
+ */
+int shardcache_volatile_max_size(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Allows to control how many requests are looked at when tracking
+ *        the hot keys (see shardcache_get_hotkeys())
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value One request out of new_value is sampled (0 disables the tracking).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the hotkeys_sample_rate setting
+ * @note Changing the sample rate forgets the hot keys tracked so far
+ * @note defaults to SHARDCACHE_HOTKEYS_SAMPLE_RATE_DEFAULT
+ */
+int shardcache_hotkeys_sample_rate(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Allows to control how many GET requests are traced
+ *        (see shardcache_get_traces())
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value One request out of new_value is traced (0 disables the sampling).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the tracing_sample_rate setting
+ * @note The requests carrying a trace id (set by the peer or the client
+ *       which sent them) are always traced
+ * @note defaults to SHARDCACHE_TRACING_SAMPLE_RATE_DEFAULT
+ */
+int shardcache_tracing_sample_rate(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Start (or stop) serving the statistics of the node over HTTP
+ *        in the OpenMetrics (Prometheus) text format
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param address The address to listen on ("host:port", '*' as host listens
+ *                on all the interfaces). NULL stops the listener
+ * @return 0 on success, -1 if the address can't be bound
+ * @note The statistics (the same returned by shardcache_get_metrics()) are served
+ *       at the /metrics path by a dedicated thread, one request at a time
+ * @note The listener is stopped by shardcache_destroy()
+ */
+int shardcache_metrics_listen(shardcache_t *cache, char *address);
+
+/**
+ * @brief Enable the snapshots of the volatile keys and of the cached objects
+ *        and warm up the instance from an existing snapshot (if any)
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param path  The path of the snapshot file (NULL disables the snapshots)
+ * @return The number of items loaded from the snapshot (0 if there was none),
+ *         -1 if the snapshot exists but can't be read
+ * @note Should be called right after shardcache_create().\n
+ *       The snapshot is read sequentially and applied by a pool of loader
+ *       threads. Volatile keys already expired or not owned by this node
+ *       (if the shards changed in the meanwhile) are skipped, as well as the
+ *       keys which have been set while loading.\n
+ *       Cached objects keep their original timestamp, so they still honor
+ *       the global expire time. The copies of keys owned by other nodes are
+ *       restored only if the global expire time is set, since they might have
+ *       changed while the node was down.\n
+ *       Records with invalid lengths stop the load at the first one of them
+ * @note When the instance is destroyed by shardcache_destroy() a new snapshot
+ *       is saved to the same path
+ */
+int shardcache_snapshot(shardcache_t *cache, char *path);
+
+/**
+ * @brief Save a snapshot of the volatile keys and of the cached objects
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param path  The path of the snapshot file (if NULL the path configured
+ *              using shardcache_snapshot() will be used)
+ * @return The number of items saved, -1 in case of errors
+ * @note The snapshot is written to a temporary file which is renamed
+ *       once complete, so an existing snapshot is never left half-written
+ */
+int shardcache_snapshot_save(shardcache_t *cache, char *path);
+
 /**
  * @brief Release all the resources used by the shardcache instance
  * @param cache   the instance to release
@@ -629,6 +909,50 @@ shardcache_storage_index_t *shardcache_get_index(shardcache_t *cache);
  */
 void shardcache_free_index(shardcache_storage_index_t *index);
 
+/**
+ * @brief Opaque structure representing a cursor over the index of keys
+ * @see shardcache_index_cursor_open()
+ */
+typedef struct __shardcache_index_cursor_s shardcache_index_cursor_t;
+
+/**
+ * @brief Open a cursor to walk the index of keys managed by the specific
+ *        shardcache instance in batches
+ * @param cache A valid pointer to a shardcache_t structure
+ * @return A newly initialized cursor, NULL if there is no index available
+ * @note If the storage module doesn't implement the index_open()/index_next()/index_close()
+ *       callbacks, the whole index will be loaded when opening the cursor
+ *       (using shardcache_get_index())
+ * @note The caller MUST release the cursor using shardcache_index_cursor_close()
+ */
+shardcache_index_cursor_t *shardcache_index_cursor_open(shardcache_t *cache);
+
+/**
+ * @brief Fetch the next batch of keys from a cursor
+ * @param cursor A valid pointer to a shardcache_index_cursor_t structure
+ * @param items  An array of shardcache_storage_index_item_t structures
+ *               where to store the next batch of keys
+ * @param isize  The number of slots in the items array
+ * @return The number of items stored in the array, 0 if there are no more items
+ * @note The caller is responsible of releasing the memory used by the returned keys
+ */
+size_t shardcache_index_cursor_next(shardcache_index_cursor_t *cursor,
+                                    shardcache_storage_index_item_t *items,
+                                    size_t isize);
+
+/**
+ * @brief Get the (estimated) number of items which are going to be returned by a cursor
+ * @param cursor A valid pointer to a shardcache_index_cursor_t structure
+ * @return The estimated number of items, 0 if unknown
+ */
+size_t shardcache_index_cursor_count(shardcache_index_cursor_t *cursor);
+
+/**
+ * @brief Release all the resources used by a cursor
+ * @param cursor A valid pointer to a shardcache_index_cursor_t structure
+ */
+void shardcache_index_cursor_close(shardcache_index_cursor_t *cursor);
+
 /**
  * @brief   Start a migration process
  * @param cache     A valid pointer to a shardcache_t structure
@@ -649,6 +973,8 @@ int shardcache_migration_begin(shardcache_t *cache,
  * @return 0 on success, -1 in case of errors
  *         (for instance if no migration is in progress
  *         when this function is called)
+ * @note The keys already copied to their new owner have been removed
+ *       from the local storage and are not moved back
  */
 int shardcache_migration_abort(shardcache_t *cache);
 
@@ -6,8 +6,8 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sys/time.h>
 #include <limits.h>
-#include <chash.h>
 #include <fbuf.h>
 #include <rbuf.h>
 #include <linklist.h>
@@ -19,13 +19,14 @@
 #include "connections.h"
 #include "messaging.h"
 #include "connections_pool.h"
+#include "continuum.h"
 #include "shardcache_internal.h"
 #include "shardcache_client.h"
 
 #define SHC_PIPELINE_MAX_DEFAULT SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT
 
 struct shardcache_client_s {
-    chash_t *chash;
+    shardcache_continuum_t *continuum;
     shardcache_node_t **shards;
     connections_pool_t *connections;
     int num_shards;
@@ -62,6 +63,22 @@ shardcache_client_use_random_node(shardcache_client_t *c, int new_value)
     return old_value;
 }
 
+int
+shardcache_client_continuum_mode(shardcache_client_t *c, int new_value)
+{
+    int old_value = shardcache_continuum_mode_get(c->continuum);
+    if (new_value >= 0 && new_value != old_value) {
+        shardcache_continuum_t *continuum = shardcache_continuum_create(c->shards,
+                                                                        c->num_shards,
+                                                                        new_value);
+        if (continuum) {
+            shardcache_continuum_destroy(c->continuum);
+            c->continuum = continuum;
+        }
+    }
+    return old_value;
+}
+
 int
 shardcache_client_multi_command_max_wait(shardcache_client_t *c, int new_value)
 {
@@ -88,23 +105,26 @@ shardcache_client_create(shardcache_node_t **nodes, int num_nodes, char *auth)
         return NULL;
     }
     shardcache_client_t *c = calloc(1, sizeof(shardcache_client_t));
-    size_t shard_lens[num_nodes];
-    char *shard_names[num_nodes];
 
     c->shards = malloc(sizeof(shardcache_node_t *) * num_nodes);
     c->connections = connections_pool_create(SHARDCACHE_TCP_TIMEOUT_DEFAULT,
                                              SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
                                              1);
-    for (i = 0; i < num_nodes; i++) {
+    for (i = 0; i < num_nodes; i++)
         c->shards[i] = shardcache_node_copy(nodes[i]);
 
-        shard_names[i] = shardcache_node_get_label(c->shards[i]);
-        shard_lens[i] = strlen(shard_names[i]);
-    }
-
     c->num_shards = num_nodes;
 
-    c->chash = chash_create((const char **)shard_names, shard_lens, c->num_shards, 200);
+    c->continuum = shardcache_continuum_create(c->shards,
+                                               c->num_shards,
+                                               SHARDCACHE_CONTINUUM_MODE_CHASH);
+    if (!c->continuum) {
+        SHC_ERROR("Can't create the continuum for the shardcache client");
+        shardcache_free_nodes(c->shards, c->num_shards);
+        connections_pool_destroy(c->connections);
+        free(c);
+        return NULL;
+    }
 
     if (auth && *auth) {
         c->auth = calloc(1, 16);
@@ -121,12 +141,46 @@ shardcache_client_create(shardcache_node_t **nodes, int num_nodes, char *auth)
     return c;
 }
 
+// the replica a read request has been routed to
+typedef struct {
+    shardcache_node_t *node;
+    int index;
+    struct timeval start;
+} shc_read_route_t;
+
 static inline char *
-select_node(shardcache_client_t *c, void *key, size_t klen, int *fd)
+select_address(shardcache_node_t *node, shc_read_route_t *route)
+{
+    if (!route)
+        return shardcache_node_get_address(node);
+
+    // reads can be served by any of the replicas of the node,
+    // pick the one with the least outstanding requests
+    char *addr = shardcache_node_acquire_address(node, &route->index);
+    route->node = node;
+    gettimeofday(&route->start, NULL);
+    return addr;
+}
+
+static inline void
+release_address(shc_read_route_t *route, int error)
+{
+    if (!route || !route->node)
+        return;
+
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, &route->start, &diff);
+    shardcache_node_release_address(route->node,
+                                    route->index,
+                                    error,
+                                    diff.tv_sec * 1000000 + diff.tv_usec);
+    route->node = NULL;
+}
+
+static inline char *
+select_node(shardcache_client_t *c, void *key, size_t klen, int *fd, shc_read_route_t *route)
 {
-    const char *node_name;
-    size_t name_len = 0;
-    int i;
     char *addr = NULL;
     shardcache_node_t *node = NULL;
 
@@ -139,31 +193,32 @@ select_node(shardcache_client_t *c, void *key, size_t klen, int *fd)
             c->current_node = node;
         }
     } else {
-        chash_lookup(c->chash, key, klen, &node_name, &name_len);
-
-        for (i = 0; i < c->num_shards; i++) {
-            if (strncmp(node_name, shardcache_node_get_label(c->shards[i]), name_len) == 0)
-            {
-                node = c->shards[i];
-                c->current_node = node;
-                break;
-            }
+        int index = shardcache_continuum_lookup(c->continuum, key, klen);
+        if (index >= 0) {
+            node = c->shards[index];
+            c->current_node = node;
         }
     }
 
     if (node) {
-        addr = shardcache_node_get_address(node);
+        addr = select_address(node, route);
         if (fd) {
             int retries = 3;
             do {
                 *fd = connections_pool_get(c->connections, addr);
-                if (*fd < 0 && c->num_shards > 1) {
-                    shardcache_node_t *prev = node;
-                    do {
-                        node = c->shards[random()%c->num_shards];
-                    } while (node == prev);
-                    c->current_node = node;
-                    addr = shardcache_node_get_address(node);
+                if (*fd < 0) {
+                    release_address(route, 1);
+                    if (c->num_shards > 1) {
+                        shardcache_node_t *prev = node;
+                        do {
+                            node = c->shards[random()%c->num_shards];
+                        } while (node == prev);
+                        c->current_node = node;
+                    }
+                    // NOTE: if there is only one node, another of its
+                    //       replicas might be selected when routing a read
+                    if (retries && (route || c->num_shards > 1))
+                        addr = select_address(node, route);
                 }
             } while (*fd < 0 && retries--);
         }
@@ -176,7 +231,8 @@ size_t
 shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **data)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    shc_read_route_t route = { NULL, 0 };
+    char *node = select_node(c, key, klen, &fd, &route);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -185,6 +241,7 @@ shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **dat
 
     fbuf_t value = FBUF_STATIC_INITIALIZER;
     int rc = fetch_from_peer(node, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, &value, fd);
+    release_address(&route, (rc != 0));
     if (rc == 0) {
         size_t size = fbuf_used(&value);
         if (data)
@@ -210,7 +267,8 @@ size_t
 shardcache_client_offset(shardcache_client_t *c, void *key, size_t klen, uint32_t offset, void *data, uint32_t dlen)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    shc_read_route_t route = { NULL, 0 };
+    char *node = select_node(c, key, klen, &fd, &route);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -219,6 +277,7 @@ shardcache_client_offset(shardcache_client_t *c, void *key, size_t klen, uint32_
 
     fbuf_t value = FBUF_STATIC_INITIALIZER;
     int rc = offset_from_peer(node, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, offset, dlen, &value, fd);
+    release_address(&route, (rc != 0));
     if (rc == 0) {
         uint32_t to_copy = dlen > fbuf_used(&value) ? fbuf_used(&value) : dlen;
         if (data)
@@ -243,13 +302,15 @@ int
 shardcache_client_exists(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    shc_read_route_t route = { NULL, 0 };
+    char *node = select_node(c, key, klen, &fd, &route);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
         return -1;
     }
     int rc = exists_on_peer(node, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
+    release_address(&route, (rc == -1));
     if (rc == -1) {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
@@ -267,7 +328,7 @@ int
 shardcache_client_touch(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    char *node = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -291,7 +352,7 @@ static inline int
 shardcache_client_set_internal(shardcache_client_t *c, void *key, size_t klen, void *data, size_t dlen, uint32_t expire, int inx)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    char *node = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -332,7 +393,7 @@ int
 shardcache_client_del(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    char *node = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -355,7 +416,7 @@ int
 shardcache_client_evict(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    char *node = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -429,6 +490,117 @@ shardcache_client_stats(shardcache_client_t *c, char *node_name, char **buf, siz
     return rc;
 }
 
+int
+shardcache_client_metrics(shardcache_client_t *c, char *node_name, char **buf, size_t *len)
+{
+    shardcache_node_t *node = shardcache_get_node(c, node_name);
+    if (!node)
+        return -1;
+
+    char *addr = shardcache_node_get_address(node);
+    int fd = connections_pool_get(c->connections, addr);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
+    }
+
+    int rc = metrics_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, buf, len, fd);
+    if (rc != 0) {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr),
+                "Can't get the metrics from node '%s'", shardcache_node_get_label(node));
+    } else {
+        connections_pool_add(c->connections, addr, fd);
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+    }
+
+    return rc;
+}
+
+int
+shardcache_client_hotkeys(shardcache_client_t *c, char *node_name, char **buf, size_t *len)
+{
+    shardcache_node_t *node = shardcache_get_node(c, node_name);
+    if (!node)
+        return -1;
+
+    char *addr = shardcache_node_get_address(node);
+    int fd = connections_pool_get(c->connections, addr);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
+    }
+
+    int rc = hotkeys_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, buf, len, fd);
+    if (rc != 0) {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr),
+                "Can't get the hot keys from node '%s'", shardcache_node_get_label(node));
+    } else {
+        connections_pool_add(c->connections, addr, fd);
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+    }
+
+    return rc;
+}
+
+int
+shardcache_client_traces(shardcache_client_t *c, char *node_name, uint32_t min_usecs, char **buf, size_t *len)
+{
+    shardcache_node_t *node = shardcache_get_node(c, node_name);
+    if (!node)
+        return -1;
+
+    char *addr = shardcache_node_get_address(node);
+    int fd = connections_pool_get(c->connections, addr);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
+    }
+
+    int rc = traces_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, min_usecs, buf, len, fd);
+    if (rc != 0) {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr),
+                "Can't get the traces from node '%s'", shardcache_node_get_label(node));
+    } else {
+        connections_pool_add(c->connections, addr, fd);
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+    }
+
+    return rc;
+}
+
+int
+shardcache_client_address_stats(shardcache_client_t *c,
+                                char *node_name,
+                                int index,
+                                shardcache_node_address_stats_t *stats)
+{
+    shardcache_node_t *node = shardcache_get_node(c, node_name);
+    if (!node)
+        return -1;
+
+    if (shardcache_node_get_address_stats(node, index, stats) != 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_ARGS;
+        snprintf(c->errstr, sizeof(c->errstr), "Node '%s' has no address at index %d", node_name, index);
+        return -1;
+    }
+
+    c->errno = SHARDCACHE_CLIENT_OK;
+    c->errstr[0] = 0;
+    return 0;
+}
+
 int
 shardcache_client_check(shardcache_client_t *c, char *node_name) {
     shardcache_node_t *node = shardcache_get_node(c, node_name);
@@ -468,7 +640,7 @@ shardcache_client_destroy(shardcache_client_t *c)
         MUTEX_DESTROY(&c->wakeup_lock);
     }
     queue_destroy(c->async_jobs);
-    chash_free(c->chash);
+    shardcache_continuum_destroy(c->continuum);
     shardcache_free_nodes(c->shards, c->num_shards);
     if (c->auth)
         free((void *)c->auth);
@@ -518,6 +690,39 @@ shardcache_client_index(shardcache_client_t *c, char *node_name)
     return index;
 }
 
+int
+shardcache_client_index_foreach(shardcache_client_t *c,
+                                char *node_name,
+                                shardcache_client_index_item_cb cb,
+                                void *priv)
+{
+    shardcache_node_t *node = shardcache_get_node(c, node_name);
+    if (!node)
+        return -1;
+
+    char *addr = shardcache_node_get_address(node);
+    int fd = connections_pool_get(c->connections, addr);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
+    }
+
+    int rc = index_from_peer_foreach(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, cb, priv, fd);
+    if (rc == -1) {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr),
+                "Can't get index from node '%s'", shardcache_node_get_label(node));
+    } else {
+        connections_pool_add(c->connections, addr, fd);
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+    }
+
+    return rc;
+}
+
 int
 shardcache_client_migration_begin(shardcache_client_t *c, shardcache_node_t **nodes, int num_nodes)
 {
@@ -527,7 +732,7 @@ shardcache_client_migration_begin(shardcache_client_t *c, shardcache_node_t **no
     for (i = 0; i < num_nodes; i++) {
         if (i > 0)
             fbuf_add(&mgb_message, ",");
-        fbuf_printf(&mgb_message, "%s:%s", shardcache_node_get_string(nodes[i]));
+        fbuf_add(&mgb_message, shardcache_node_get_string(nodes[i]));
     }
 
     for (i = 0; i < c->num_shards; i++) {
@@ -641,7 +846,7 @@ shardcache_client_get_async(shardcache_client_t *c,
                             void *priv)
 {
     int fd = -1;
-    char *node = select_node(c, key, klen, &fd);
+    char *node = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -659,6 +864,7 @@ shardcache_client_get_async(shardcache_client_t *c,
                                  klen,
                                  0,
                                  0,
+                                 0,
                                  shardcache_client_get_async_data_helper,
                                  arg,
                                  fd,
@@ -702,7 +908,7 @@ shc_split_buckets(shardcache_client_t *c, shc_multi_item_t **items, int *num_ite
         shc_multi_item_t *item = items[i];
         item->idx = i;
 
-        char *node = select_node(c, item->key, item->klen, NULL);
+        char *node = select_node(c, item->key, item->klen, NULL, NULL);
 
         tagged_value_t *tval = list_get_tagged_value(pools, node);
         if (!tval || list_count((linked_list_t *)tval->value) > c->pipeline_max)
@@ -1341,7 +1547,7 @@ async_thread(void *priv)
                 case JOB_CMD_GET:
                 {
                     job->arg.single.fd = -1;
-                    char *node = select_node(c, job->arg.single.key, job->arg.single.klen, &job->arg.single.fd);
+                    char *node = select_node(c, job->arg.single.key, job->arg.single.klen, &job->arg.single.fd, NULL);
                     if (job->arg.single.fd < 0) {
                         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
                         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", node);
@@ -1357,6 +1563,7 @@ async_thread(void *priv)
                                                    job->arg.single.klen,
                                                    0,
                                                    0,
+                                                   0,
                                                    async_thread_get,
                                                    job,
                                                    job->arg.single.fd,
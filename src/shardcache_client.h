@@ -79,6 +79,19 @@ int shardcache_client_multi_command_max_wait(shardcache_client_t *c, int new_val
  */
 int shardcache_client_use_random_node(shardcache_client_t *c, int new_value);
 
+/**
+ * @brief Get and/or set the engine used to determine the owner of a key
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new continuum mode
+ *                  (see shardcache_continuum_mode_t) will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  the mode MUST match the one used by the shardcache nodes
+ * @return The previously configured continuum mode
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_continuum_mode(shardcache_client_t *c, int new_value);
+
 /**
  * @brief Get and/or set the maximum number of requests that can be pipelined
  *        on a single connection
@@ -268,6 +281,77 @@ int shardcache_client_evict(shardcache_client_t *c, void *key, size_t klen);
  */
 int shardcache_client_stats(shardcache_client_t *c, char *node_name, char **buf, size_t *len);
 
+/**
+ * @brief Get the stats from a shardcache node in the OpenMetrics (Prometheus) text format
+ * @param c     A valid pointer to a shardcache_client_t structure
+ * @param node_name  The name of the node we want to get stats from
+ * @param buf   A reference to the pointer which will be set to point to the memory
+ *              holding the retrieved stats
+ * @param len If not NULL, the size of memory pointed by *buf is stored in *len
+ * @return 0 on success, -1 otherwise and the internal errno is set
+ * @note The caller is responsible of releasing the memory eventually pointed by *buf
+ *       by using free()
+ * @note On success the internal errno will be set to SHARDCACHE_CLIENT_OK
+ * @see shardcache_client_errno()
+ * @see shardcache_client_errstr()
+ */
+int shardcache_client_metrics(shardcache_client_t *c, char *node_name, char **buf, size_t *len);
+
+/**
+ * @brief Get the hottest keys served by a shardcache node
+ * @param c     A valid pointer to a shardcache_client_t structure
+ * @param node_name  The name of the node we want to get the hot keys from
+ * @param buf   A reference to the pointer which will be set to point to the memory
+ *              holding the retrieved keys (as text, ranked both by requests
+ *              and by bytes, the hottest first)
+ * @param len If not NULL, the size of memory pointed by *buf is stored in *len
+ * @return 0 on success, -1 otherwise and the internal errno is set
+ * @note The caller is responsible of releasing the memory eventually pointed by *buf
+ *       by using free()
+ * @note On success the internal errno will be set to SHARDCACHE_CLIENT_OK
+ * @see shardcache_client_errno()
+ * @see shardcache_client_errstr()
+ */
+int shardcache_client_hotkeys(shardcache_client_t *c, char *node_name, char **buf, size_t *len);
+
+/**
+ * @brief Get the slowest of the recent traced requests served by a shardcache node
+ * @param c     A valid pointer to a shardcache_client_t structure
+ * @param node_name  The name of the node we want to get the traces from
+ * @param min_usecs  Only the requests which took at least min_usecs microseconds
+ *                   are returned
+ * @param buf   A reference to the pointer which will be set to point to the memory
+ *              holding the retrieved traces (as text, one line per trace followed
+ *              by one line per stage of the request, the slowest first)
+ * @param len If not NULL, the size of memory pointed by *buf is stored in *len
+ * @return 0 on success, -1 otherwise and the internal errno is set
+ * @note The trace ids are shared by the nodes involved in serving a request,
+ *       so the traces returned by different nodes can be matched
+ * @note The caller is responsible of releasing the memory eventually pointed by *buf
+ *       by using free()
+ * @note On success the internal errno will be set to SHARDCACHE_CLIENT_OK
+ * @see shardcache_client_errno()
+ * @see shardcache_client_errstr()
+ */
+int shardcache_client_traces(shardcache_client_t *c, char *node_name, uint32_t min_usecs, char **buf, size_t *len);
+
+/**
+ * @brief Get the read statistics collected by the client for one of the
+ *        addresses (replicas) of a node
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param node_name The name of the node
+ * @param index     The index of the address
+ * @param stats     A pointer to the shardcache_node_address_stats_t structure to fill in
+ * @return 0 on success, -1 otherwise and the internal errno is set
+ * @note Reads (get, offset and exists) are sent to the replica with the least
+ *       outstanding requests, skipping the ones which are failing
+ * @see shardcache_node_acquire_address()
+ */
+int shardcache_client_address_stats(shardcache_client_t *c,
+                                    char *node_name,
+                                    int index,
+                                    shardcache_node_address_stats_t *stats);
+
 /**
  * @brief Check the status of a shardcache node
  * @param c     A valid pointer to a shardcache_client_t structure
@@ -316,6 +400,33 @@ int shardcache_client_migration_abort(shardcache_client_t *c);
  */
 shardcache_storage_index_t *shardcache_client_index(shardcache_client_t *c, char *node_name);
 
+/**
+ * @brief Callback called for each item in the index by shardcache_client_index_foreach()
+ * @param key   The key (valid only until the callback returns)
+ * @param klen  The length of the key
+ * @param vlen  The length of the value
+ * @param priv  The priv pointer passed to shardcache_client_index_foreach()
+ * @return 0 to continue the iteration, any other value to stop it
+ */
+typedef int (*shardcache_client_index_item_cb)(void *key, size_t klen, size_t vlen, void *priv);
+
+/**
+ * @brief Walk the index of a shardcache node without holding it in memory
+ * @param c          A valid pointer to a shardcache_client_t structure
+ * @param node_name  The name of the node we want to get the index from
+ * @param cb         The callback to call for each item in the index
+ * @param priv       A pointer which will be passed to the callback
+ * @return The number of items passed to the callback, -1 in case of errors
+ * @note The items are handed to the callback while being received from the node
+ * @note On success the internal errno will be set to SHARDCACHE_CLIENT_OK
+ * @see shardcache_client_errno()
+ * @see shardcache_client_errstr()
+ */
+int shardcache_client_index_foreach(shardcache_client_t *c,
+                                    char *node_name,
+                                    shardcache_client_index_item_cb cb,
+                                    void *priv);
+
 /**
  * @brief Return the error code for the last operation performed by the shardcache client
  * @param c     A valid pointer to a shardcache_client_t structure
@@ -8,7 +8,6 @@
  */
 
 #include <linklist.h>
-#include <chash.h>
 #include <hashtable.h>
 #include <queue.h>
 #include <iomux.h>
@@ -18,17 +17,23 @@
 #include "arc.h"
 #include "serving.h"
 #include "counters.h"
+#include "histogram.h"
+#include "peer_stats.h"
+#include "hotkeys.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "continuum.h"
+#include "volatile_storage.h"
+#include "migration_checkpoint.h"
 #include "shardcache.h"
 #include "shardcache_replica.h"
 
 #define DEBUG_DUMP_MAXSIZE 128
 
-#define KEY2STR(__k, __l, __o, __ol) \
-{ \
-    size_t __s = (__l < __ol) ? __l : __ol; \
-    memcpy(__o, __k, __s); \
-    __o[__s] = 0; \
-}
+// keys are logged using the "%.*s" format, so they are formatted only if the
+// message is actually emitted:  SHC_DEBUG("key: %.*s", KEYFMT(key, klen));
+#define KEYFMT_MAXLEN 1023
+#define KEYFMT(__k, __l) (int)((__l) < KEYFMT_MAXLEN ? (__l) : KEYFMT_MAXLEN), (char *)(__k)
 
 #define LIKELY(__e) __builtin_expect((__e), 1)
 #define UNLIKELY(__e) __builtin_expect((__e), 0)
@@ -111,8 +116,6 @@
 }
 
 
-typedef struct chash_t chash_t;
-
 typedef struct {
     pthread_t io_th; // the thread taking care of spooling the asynchronous
                      // i/o operations
@@ -149,9 +152,11 @@ struct __shardcache_s {
     pthread_spinlock_t migration_lock;
 #endif
 
-    chash_t *chash;   // the internal chash instance
+    shardcache_continuum_t *continuum;   // the continuum used to determine the owner of a key
+    int continuum_mode;                  // the engine used by the continuum(s)
+                                         // (see shardcache_continuum_mode_t)
 
-    chash_t *migration;                  // the migration continuum
+    shardcache_continuum_t *migration;   // the migration continuum
     shardcache_node_t **migration_shards; // the new shards array after the migration
     int num_migration_shards;            // the new number of shards in the migration_shards array
     int migration_done;                  // boolean value indicating that the migration is complete
@@ -162,7 +167,12 @@ struct __shardcache_s {
 
     shardcache_storage_t storage;  // the structure holding the callbacks for the persistent storage 
 
-    hashtable_t *volatile_storage; // an hashtable used as volatile storage
+    volatile_storage_t *volatile_storage; // the storage for the volatile keys
+    int volatile_max_size;         // max size (in megabytes) of the volatile storage (0 == unlimited)
+    int volatile_evicting;         // boolean flag set while a thread is evicting volatile keys
+                                   // (to be accessed using the atomic builtins)
+    char *snapshot_path;           // where to save the snapshot when the instance is destroyed
+                                   // (NULL == disabled)
 
     hashtable_t *cache_timeouts; // hashtable holding the timeout_id of the expiration timers
                                  // for cached objects
@@ -211,6 +221,21 @@ struct __shardcache_s {
 
     pthread_t migrate_th; // the migration thread
 
+    int migration_workers;           // number of worker threads used by the migrator
+    int migration_batch_size;        // max number of SET commands pipelined to a peer
+                                     // before collecting the responses
+    int migration_max_keys_per_sec;  // max keys copied per second during a migration (0 == unlimited)
+    int migration_max_bytes_per_sec; // max bytes copied per second during a migration (0 == unlimited)
+    char *migration_checkpoint_path; // where to checkpoint the migrations (NULL == disabled)
+    int migration_checkpoint_interval; // seconds between two checkpoints
+
+    int replica_durability; // the durability mode of the replica log
+                            // (see SHARDCACHE_REPLICA_DURABILITY_*)
+    int replica_batch_window; // microsecs a replica message can be queued (0 == no batching)
+    int replica_anti_entropy; // diff size above which the replicas compare hash trees (0 == disabled)
+    migration_checkpoint_t *migration_checkpoint; // the checkpoint of the running migration
+                                                  // (protected by the migration_lock)
+
     pthread_t evictor_th; // the evictor thread
 
     pthread_cond_t evictor_cond;  // condition variable used by the evictor thread
@@ -225,7 +250,8 @@ struct __shardcache_s {
 #define SHARDCACHE_COUNTER_LABELS_ARRAY  \
         { "gets", "sets", "dels", "heads", "evicts", "expires", \
           "cache_misses", "fetch_remote", "fetch_local", "not_found", \
-          "volatile_table_size", "cache_size", "cached_items", "errors" }
+          "volatile_table_size", "cache_size", "cached_items", "errors", \
+          "volatile_evictions" }
 
 #define SHARDCACHE_COUNTER_GETS             0
 #define SHARDCACHE_COUNTER_SETS             1
@@ -241,12 +267,57 @@ struct __shardcache_s {
 #define SHARDCACHE_COUNTER_CACHE_SIZE       11
 #define SHARDCACHE_COUNTER_CACHED_ITEMS     12
 #define SHARDCACHE_COUNTER_ERRORS           13
-#define SHARDCACHE_NUM_COUNTERS             14
+#define SHARDCACHE_COUNTER_VOLATILE_EVICTIONS 14
+#define SHARDCACHE_NUM_COUNTERS             15
     struct {
         const char *name; // the exported label of the counter
         uint64_t value;   // the actual value (accessed using the atomic builtins)
+                          // NOTE: only used by the gauges, the other counters
+                          //       live in the sharded_counters
     } cnt[SHARDCACHE_NUM_COUNTERS]; // array holding the storage for the counters
                                     // exported as stats
+
+// gauges are read (and compared) on the hot path, so they can't be sharded
+#define SHARDCACHE_COUNTER_IS_GAUGE(__i) ((__i) == SHARDCACHE_COUNTER_TABLE_SIZE || \
+                                          (__i) == SHARDCACHE_COUNTER_CACHE_SIZE || \
+                                          (__i) == SHARDCACHE_COUNTER_CACHED_ITEMS)
+
+    shardcache_sharded_counters_t *sharded_counters; // per-thread storage for the counters
+                                                     // updated by the workers on each request
+
+#define SHARDCACHE_COUNTER_INCREMENT(__cache, __i) \
+    shardcache_sharded_counter_add((__cache)->sharded_counters, (__i), 1)
+
+#define SHARDCACHE_LATENCY_LABELS_ARRAY \
+        { "cmd_get", "cmd_get_offset", "cmd_set", "cmd_add", "cmd_exists", \
+          "cmd_touch", "cmd_delete", "cmd_evict", "cmd_stats", "cmd_index", \
+          "cmd_migration", "cmd_replica", "cmd_check", \
+          "storage_fetch", "storage_store", "peer_fetch", "migration_key" }
+
+#define SHARDCACHE_LATENCY_CMD_GET          0
+#define SHARDCACHE_LATENCY_CMD_GET_OFFSET   1
+#define SHARDCACHE_LATENCY_CMD_SET          2
+#define SHARDCACHE_LATENCY_CMD_ADD          3
+#define SHARDCACHE_LATENCY_CMD_EXISTS       4
+#define SHARDCACHE_LATENCY_CMD_TOUCH        5
+#define SHARDCACHE_LATENCY_CMD_DELETE       6
+#define SHARDCACHE_LATENCY_CMD_EVICT        7
+#define SHARDCACHE_LATENCY_CMD_STATS        8
+#define SHARDCACHE_LATENCY_CMD_INDEX        9
+#define SHARDCACHE_LATENCY_CMD_MIGRATION    10
+#define SHARDCACHE_LATENCY_CMD_REPLICA      11
+#define SHARDCACHE_LATENCY_CMD_CHECK        12
+#define SHARDCACHE_LATENCY_STORAGE_FETCH    13
+#define SHARDCACHE_LATENCY_STORAGE_STORE    14
+#define SHARDCACHE_LATENCY_PEER_FETCH       15
+#define SHARDCACHE_LATENCY_MIGRATION_KEY    16
+#define SHARDCACHE_NUM_LATENCIES            17
+    shardcache_histogram_t *latencies[SHARDCACHE_NUM_LATENCIES]; // latency histograms (microseconds)
+                                                                 // for the commands and the code paths
+                                                                 // which might be slow
+
+#define SHARDCACHE_LATENCY_RECORD(__cache, __i, __start) \
+    shardcache_histogram_record((__cache)->latencies[(__i)], shardcache_histogram_now() - (__start))
     connections_pool_t *connections_pool; // the connections_pool instance which
                                           // holds/distribute the available
                                           // filedescriptors // when using persistent
@@ -254,6 +325,15 @@ struct __shardcache_s {
 
     int tcp_timeout;        // the tcp timeout to use when setting up new connections
 
+    shardcache_peers_stats_t *peers_stats; // traffic and health statistics for each peer
+                                           // (exported together with the counters)
+
+    shardcache_hotkeys_t *hotkeys; // the keys requested most often (or moving most bytes)
+
+    shardcache_metrics_t *metrics; // renders the counters and the latencies in the OpenMetrics format
+
+    shardcache_tracer_t *tracer; // the spans of the sampled requests
+
     shardcache_async_io_context_t *async_context;
 
     int num_async;
@@ -262,19 +342,22 @@ struct __shardcache_s {
     int quit;
 };
 
-typedef struct {
-    void *data;
-    size_t dlen;
-    uint32_t expire;
-} volatile_object_t;
-
 int shardcache_test_migration_ownership(shardcache_t *cache,
         void *key, size_t klen, char *owner, size_t *len);
 
 int shardcache_get_connection_for_peer(shardcache_t *cache, char *peer);
 
+// same as shardcache_get_connection_for_peer() but never waits for a new
+// connection to be established (the returned filedescriptor is non-blocking
+// and must be handled through an iomux)
+int shardcache_get_connection_for_peer_nonblocking(shardcache_t *cache, char *peer);
+
 void shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd);
 
+// close a connection which can't be reused (error == true if the command sent
+// through the connection failed, so that it's accounted in the peer statistics)
+void shardcache_discard_connection_for_peer(shardcache_t *cache, char *peer, int fd, int error);
+
 int shardcache_set_internal(shardcache_t *cache,
                             void *key,
                             size_t klen,
@@ -300,5 +383,7 @@ int shardcache_unschedule_expiration(shardcache_t *cache, void *key, size_t klen
 
 void shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk);
 
+void shardcache_evict_volatile(shardcache_t *cache);
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -28,6 +28,27 @@ unsigned int shardcache_log_level();
  */
 void shardcache_log_message(int prio, int dbglevel, const char *fmt, ...);
 
+/**
+ * @brief Emit the log messages asynchronously
+ * @param enable If true the messages are queued into a lock-free ring buffer
+ *               and sent to syslog by a dedicated thread, so that logging never
+ *               blocks the caller.\n
+ *               If false the thread is stopped (once all the queued messages
+ *               have been emitted) and the messages are sent to syslog
+ *               synchronously again
+ * @return 0 on success, -1 otherwise
+ * @note When the ring buffer is full new messages are dropped (and counted,
+ *       see shardcache_log_dropped()) instead of waiting for the logger thread
+ * @note The queued messages are flushed at exit
+ */
+int shardcache_log_async(int enable);
+
+/**
+ * @brief Returns the number of messages dropped because the ring buffer
+ *        of the asynchronous logger was full
+ */
+uint64_t shardcache_log_dropped();
+
 /**
  * @brief Convert a binary buffer to an hexstring
  * @param buf The buffer
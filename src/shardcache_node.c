@@ -1,6 +1,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <regex.h>
+#include <time.h>
 
 #include "shardcache_node.h"
 #include "shardcache_log.h"
@@ -13,7 +14,9 @@ struct __shardcache_node_s {
     char *label;
     char **address;
     int num_replicas;
+    int weight;
     char *string;
+    shardcache_node_address_stats_t *stats; // the read statistics for each address
 }; 
 
 static int
@@ -38,6 +41,25 @@ shardcache_check_address_string(char *str)
     return 0;
 }
 
+static char *
+shardcache_node_build_string(char *label, char **addresses, int num_addresses, int weight)
+{
+    int i;
+    int slen = strlen(label) + 16;
+    for (i = 0; i < num_addresses; i++)
+        slen += strlen(addresses[i]) + 1;
+
+    char *node_string = malloc(slen);
+    int ofx = (weight != SHARDCACHE_NODE_WEIGHT_DEFAULT)
+            ? snprintf(node_string, slen, "%s@%d:", label, weight)
+            : snprintf(node_string, slen, "%s:", label);
+
+    for (i = 0; i < num_addresses; i++)
+        ofx += snprintf(node_string + ofx, slen - ofx, "%s%s", i > 0 ? ";" : "", addresses[i]);
+
+    return node_string;
+}
+
 shardcache_node_t *
 shardcache_node_create_from_string(char *str)
 {
@@ -48,6 +70,31 @@ shardcache_node_create_from_string(char *str)
     char *addr = NULL;
     char **addrlist = NULL;
     int num_addresses = 0;
+    int weight = SHARDCACHE_NODE_WEIGHT_DEFAULT;
+
+    char *weightstring = strchr(label, '@');
+    if (weightstring)
+        *weightstring++ = 0;
+
+    // 'label#n' names the extra points of a weighted node in the continuum
+    if (strchr(label, '#')) {
+        SHC_ERROR("Bad label for peer %s: '#' is not allowed", label);
+        free(copy);
+        return NULL;
+    }
+
+    if (weightstring) {
+        char *end = NULL;
+        weight = strtol(weightstring, &end, 10);
+        if (!*weightstring || *end ||
+            weight < 1 || weight > SHARDCACHE_NODE_WEIGHT_MAX)
+        {
+            SHC_ERROR("Bad weight for peer %s: '%s' (must be between 1 and %d)",
+                      label, weightstring, SHARDCACHE_NODE_WEIGHT_MAX);
+            free(copy);
+            return NULL;
+        }
+    }
 
     while ((addr = strsep(&addrstring, ";")) != NULL) {
         if (!addr || shardcache_check_address_string(addr) != 0) {
@@ -67,8 +114,10 @@ shardcache_node_create_from_string(char *str)
     shardcache_node_t *node = malloc(sizeof(shardcache_node_t));
     node->label = strdup(label);
     node->address = addrlist;
-    node->string = strdup(str);
     node->num_replicas = num_addresses;
+    node->weight = weight;
+    node->string = shardcache_node_build_string(node->label, addrlist, num_addresses, weight);
+    node->stats = calloc(num_addresses, sizeof(shardcache_node_address_stats_t));
 
     free(copy);
     return node;
@@ -81,22 +130,33 @@ shardcache_node_create(char *label, char **addresses, int num_addresses)
     shardcache_node_t *node = calloc(1, sizeof(shardcache_node_t));
     node->label = strdup(label);
     node->num_replicas = num_addresses;
+    node->weight = SHARDCACHE_NODE_WEIGHT_DEFAULT;
     node->address = calloc(num_addresses, sizeof(char *));
-    int slen = strlen(node->label) + 3;
-    char *node_string = malloc(slen);
-    snprintf(node_string, slen, "%s:", node->label);
-    for (i = 0; i < num_addresses; i++) {
-        if (i > 0)
-            strcat(node_string, ";");
-        slen += strlen(addresses[i]) + 1;
-        node_string = realloc(node_string, slen);
-        strcat(node_string, addresses[i]);
+    for (i = 0; i < num_addresses; i++)
         node->address[i] = strdup(addresses[i]);
-    }
-    node->string = node_string;
+    node->string = shardcache_node_build_string(node->label, node->address, num_addresses, node->weight);
+    node->stats = calloc(num_addresses, sizeof(shardcache_node_address_stats_t));
     return node;
 }
 
+int
+shardcache_node_get_weight(shardcache_node_t *node)
+{
+    return node->weight;
+}
+
+int
+shardcache_node_set_weight(shardcache_node_t *node, int weight)
+{
+    if (weight < 1 || weight > SHARDCACHE_NODE_WEIGHT_MAX)
+        return -1;
+
+    node->weight = weight;
+    free(node->string);
+    node->string = shardcache_node_build_string(node->label, node->address, node->num_replicas, weight);
+    return 0;
+}
+
 shardcache_node_t *
 shardcache_node_copy(shardcache_node_t *node)
 {
@@ -108,7 +168,9 @@ shardcache_node_copy(shardcache_node_t *node)
     for (i = 0; i < node->num_replicas; i++)
         copy->address[i] = strdup(node->address[i]);
     copy->num_replicas = node->num_replicas;
+    copy->weight = node->weight;
     copy->string = strdup(node->string);
+    copy->stats = calloc(node->num_replicas, sizeof(shardcache_node_address_stats_t));
     return copy;
 }
 
@@ -121,6 +183,7 @@ shardcache_node_destroy(shardcache_node_t *node)
         free(node->address[i]);
     free(node->address);
     free(node->string);
+    free(node->stats);
     free(node);
 }
 
@@ -142,6 +205,80 @@ shardcache_node_get_address(shardcache_node_t *node)
     return node->address[random() % node->num_replicas];
 }
 
+char *
+shardcache_node_acquire_address(shardcache_node_t *node, int *index)
+{
+    int selected = 0;
+
+    if (node->num_replicas > 1) {
+        time_t now = time(NULL);
+        int selected_healthy = 0;
+        int selected_outstanding = 0;
+        // start from a random replica so that ties are spread among all of them
+        int start = random() % node->num_replicas;
+        int i;
+        for (i = 0; i < node->num_replicas; i++) {
+            int idx = (start + i) % node->num_replicas;
+            shardcache_node_address_stats_t *stats = &node->stats[idx];
+            int healthy = (ATOMIC_READ(stats->consecutive_errors) < SHARDCACHE_NODE_MAX_ERRORS ||
+                           now - ATOMIC_READ(stats->last_error) >= SHARDCACHE_NODE_RETRY_INTERVAL);
+            int outstanding = ATOMIC_READ(stats->outstanding);
+            if (i == 0 ||
+                (healthy && !selected_healthy) ||
+                (healthy == selected_healthy && outstanding < selected_outstanding))
+            {
+                selected = idx;
+                selected_healthy = healthy;
+                selected_outstanding = outstanding;
+            }
+        }
+    }
+
+    ATOMIC_INCREMENT(node->stats[selected].outstanding);
+    if (index)
+        *index = selected;
+    return node->address[selected];
+}
+
+void
+shardcache_node_release_address(shardcache_node_t *node, int index, int error, uint64_t usecs)
+{
+    if (index < 0 || index >= node->num_replicas)
+        return;
+
+    shardcache_node_address_stats_t *stats = &node->stats[index];
+    ATOMIC_DECREMENT(stats->outstanding);
+    if (error) {
+        ATOMIC_INCREMENT(stats->errors);
+        ATOMIC_INCREMENT(stats->consecutive_errors);
+        ATOMIC_SET(stats->last_error, time(NULL));
+    } else {
+        ATOMIC_INCREMENT(stats->requests);
+        ATOMIC_SET(stats->consecutive_errors, 0);
+        // exponentially weighted moving average (alpha = 1/8)
+        uint64_t latency = ATOMIC_READ(stats->latency);
+        ATOMIC_SET(stats->latency, latency ? latency - (latency >> 3) + (usecs >> 3) : usecs);
+    }
+}
+
+int
+shardcache_node_get_address_stats(shardcache_node_t *node,
+                                  int index,
+                                  shardcache_node_address_stats_t *stats)
+{
+    if (index < 0 || index >= node->num_replicas)
+        return -1;
+
+    shardcache_node_address_stats_t *s = &node->stats[index];
+    stats->outstanding = ATOMIC_READ(s->outstanding);
+    stats->requests = ATOMIC_READ(s->requests);
+    stats->errors = ATOMIC_READ(s->errors);
+    stats->latency = ATOMIC_READ(s->latency);
+    stats->consecutive_errors = ATOMIC_READ(s->consecutive_errors);
+    stats->last_error = ATOMIC_READ(s->last_error);
+    return 0;
+}
+
 shardcache_node_t *
 shardcache_node_select(shardcache_t *cache, char *label)
 {
@@ -10,9 +10,34 @@ typedef struct __shardcache_node_s shardcache_node_t;
 
 #include <shardcache.h>
 
+#define SHARDCACHE_NODE_WEIGHT_DEFAULT 1
+#define SHARDCACHE_NODE_WEIGHT_MAX     100
+
+//! Consecutive failures after which an address is considered unhealthy
+#define SHARDCACHE_NODE_MAX_ERRORS     3
+//! Seconds after which an unhealthy address is tried again
+#define SHARDCACHE_NODE_RETRY_INTERVAL 5
+
+/**
+ * @struct shardcache_node_address_stats_t
+ *
+ * @brief The read statistics collected for one of the addresses of a node
+ * @see shardcache_node_acquire_address()
+ * @see shardcache_node_get_address_stats()
+ */
+typedef struct {
+    int outstanding;        //!< The requests currently in flight
+    uint64_t requests;      //!< The requests completed successfully
+    uint64_t errors;        //!< The requests which failed
+    uint64_t latency;       //!< Moving average of the latency (in microseconds)
+    int consecutive_errors; //!< The requests failed since the last successful one
+    time_t last_error;      //!< When the last failure happened
+} shardcache_node_address_stats_t;
+
 /**
  * @brief Create a new shardcache_node_t structure
  * @param label The label of the node
+ *              (it can't contain '#', used to name the extra points of weighted nodes)
  * @param addresses Array containing the addresses for all the replicas representing the node
  * @param num_addresses The number of items in the addresses array
  * @return A newly initialized shardcache_node_t structure
@@ -23,13 +48,35 @@ shardcache_node_t *shardcache_node_create(char *label, char **addresses, int num
 
 /**
  * @brief Create a new shardcache_node_t structure by parsing a full node string
- * @param str A valid node string
- * @return A newly initialized shardcache_node_t structure
+ * @param str A valid node string in the form: label[@weight]:address[;address...]
+ *            (where weight is an integer between 1 and SHARDCACHE_NODE_WEIGHT_MAX
+ *             and defaults to SHARDCACHE_NODE_WEIGHT_DEFAULT if omitted)
+ * @return A newly initialized shardcache_node_t structure,
+ *         NULL if the string is malformed or the label contains '#'
  * @note The caller MUST release the resources used to represent the node by calling
  *       shardcache_node_destroy() on the returned pointer
  */
 shardcache_node_t *shardcache_node_create_from_string(char *str);
 
+/**
+ * @brief Get the weight of a given node
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @return The weight of the node passed as argument
+ * @note The share of the keyspace owned by a node is proportional to its weight
+ */
+int shardcache_node_get_weight(shardcache_node_t *node);
+
+/**
+ * @brief Set the weight of a given node
+ * @param node   A previously initialized and valid shardcache_node_t structure
+ * @param weight The new weight (between 1 and SHARDCACHE_NODE_WEIGHT_MAX)
+ * @return 0 on success, -1 if the weight is out of range
+ * @note The weight must be set before the node is passed to shardcache_create(),
+ *       shardcache_client_create() or shardcache_migration_begin().
+ *       All the nodes (and clients) MUST agree on the weights
+ */
+int shardcache_node_set_weight(shardcache_node_t *node, int weight);
+
 /**
  * @brief Create a copy of an existing shardcache_node_t structure
  * @param node A previously initialized and valid shardcache_node_t structure
@@ -69,6 +116,40 @@ char *shardcache_node_get_string(shardcache_node_t *node);
  */
 char *shardcache_node_get_address(shardcache_node_t *node);
 
+/**
+ * @brief Select the address (among the replicas) a read request should be sent to
+ * @param node  A previously initialized and valid shardcache_node_t structure
+ * @param index If not NULL the index of the selected address will be stored here
+ * @return The address of the healthy replica with the least outstanding requests
+ * @note An address is considered unhealthy after SHARDCACHE_NODE_MAX_ERRORS
+ *       consecutive failures and it's tried again after SHARDCACHE_NODE_RETRY_INTERVAL
+ *       seconds. If no address is healthy the one with the least outstanding requests
+ *       is returned anyway
+ * @note The caller MUST call shardcache_node_release_address() once the request completes
+ */
+char *shardcache_node_acquire_address(shardcache_node_t *node, int *index);
+
+/**
+ * @brief Report the outcome of a request sent to an address returned by
+ *        shardcache_node_acquire_address()
+ * @param node  A previously initialized and valid shardcache_node_t structure
+ * @param index The index of the address
+ * @param error True if the request failed
+ * @param usecs The time the request took (in microseconds)
+ */
+void shardcache_node_release_address(shardcache_node_t *node, int index, int error, uint64_t usecs);
+
+/**
+ * @brief Get the read statistics collected for one of the addresses of a node
+ * @param node  A previously initialized and valid shardcache_node_t structure
+ * @param index The index of the address
+ * @param stats A pointer to the shardcache_node_address_stats_t structure to fill in
+ * @return 0 on success, -1 if there is no address at the given index
+ */
+int shardcache_node_get_address_stats(shardcache_node_t *node,
+                                      int index,
+                                      shardcache_node_address_stats_t *stats);
+
 /**
  * @brief Get the number of addresses (replicas) configured for a given node
  * @param node A previously initialized and valid shardcache_node_t structure
@@ -10,16 +10,42 @@
 #include "kepaxos.h"
 #include "shardcache_internal.h"
 #include "counters.h"
+#include "merkle_tree.h"
 
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #define SHARDCACHE_REPLICA_WRKDIR_DEFAULT "/tmp/shcrpl"
 #define KEPAXOS_LOG_FILENAME "kepaxos_log.db"
 
+#define SHARDCACHE_REPLICA_BATCH_MAX_SIZE (1<<16) // flush a batch once it grows bigger than this
+#define SHARDCACHE_REPLICA_IDLE_TIMEOUT 1          // max secs the async-io thread waits for events
+
+#define SHARDCACHE_REPLICA_TREE_DEPTH 3               // 4096 leaves
+#define SHARDCACHE_REPLICA_TREE_TTL 10                // secs the tree served to the peers is reused
+#define SHARDCACHE_REPLICA_TREE_SCAN_BATCH 256        // index items fetched at once when scanning the storage
+#define SHARDCACHE_REPLICA_TREE_LEAVES_PER_REQUEST 256
+#define SHARDCACHE_REPLICA_TREE_KEYS_PER_REQUEST 128
+
+typedef enum {
+    SHARDCACHE_REPLICA_TREE_HASHES = 0x00,
+    SHARDCACHE_REPLICA_TREE_ITEMS  = 0x01,
+    SHARDCACHE_REPLICA_TREE_VALUES = 0x02
+} shardcache_replica_tree_request_t;
+
+// the hash tree of the local storage together with the items in each leaf
+typedef struct {
+    merkle_tree_t *tree;
+    fbuf_t *leaves;     // the <KLEN><KEY><DIGEST> items held in each leaf
+    uint32_t *counts;   // the number of items held in each leaf
+    uint32_t num_leaves;
+    time_t built;       // when the snapshot has been built
+} shardcache_replica_tree_snapshot_t;
+
 #define MSG_WRITE_UINT64(__m, __o, __n) \
 { \
     *((uint32_t *)((__m) + (__o))) = htonl((__n) >> 32); \
@@ -60,6 +86,21 @@
     } \
 }
 
+typedef struct {
+    pthread_mutex_t lock;
+    fbuf_t blobs;         // the queued messages (<BLOB_LEN><KEPAXOS_BLOB>...)
+    uint32_t count;       // the number of queued messages
+    struct timeval first; // when the oldest message in the batch has been queued
+} shardcache_replica_batch_t;
+
+// a message waiting to be sent by the async-io thread
+typedef struct {
+    char *peer;           // the recipient (one of the addresses in replica->peers)
+    shardcache_hdr_t hdr;
+    void *msg;
+    size_t len;
+} shardcache_replica_message_t;
+
 struct __shardcache_replica_s {
     shardcache_t *shc;        // a valid shardcache instance
     shardcache_node_t *node;  // the shardcache node (union of all replicas)
@@ -77,7 +118,23 @@ struct __shardcache_replica_s {
         uint64_t responses;
         uint64_t commands;
         uint64_t acks;
+        uint64_t batches;
+        uint64_t tree_syncs;
+        uint64_t tree_keys;
     } counters; // counters exported to libshardcache
+    char **peers;             // the addresses of all the replicas
+    int num_peers;            // the number of addresses in the peers array
+    shardcache_replica_batch_t *batches; // the messages queued for each replica
+    int batch_window;         // max microsecs a message can be queued (0 == batching disabled)
+    linked_list_t *outgoing;  // the messages waiting to be sent by the async-io thread
+    int wakeup_pipe[2];       // used to wake up the async-io thread when there is work to do
+    int wakeup_pending;       // true if a wakeup has been already sent and not yet consumed
+    int anti_entropy_threshold; // diff size above which the hash trees are compared (0 == disabled)
+    uint64_t *tree_sync;      // the ballot reported by each peer we need to sync with (0 == none)
+    int *tree_fallback;       // true if the last sync with the peer failed (the next ping asks for the whole diff)
+    shardcache_replica_tree_snapshot_t *tree; // the last snapshot built to answer the peers
+    int tree_building;        // true while a thread is building a new snapshot
+    pthread_mutex_t tree_lock; // protects the tree pointer (not held while building the snapshot)
     int quit; // tells both the recovery and the async-io threads when to exit
     pthread_t recover_th; // the recovery thread
     pthread_t async_io_th; // the async-io thread
@@ -115,6 +172,9 @@ typedef struct {
 static void
 shardcache_replica_received_ack(shardcache_replica_t *replica, void *msg, size_t len);
 
+static void
+shardcache_replica_received_batch_response(shardcache_replica_t *replica, void *msg, size_t len);
+
 static int
 shardcache_replica_received_ping(shardcache_replica_t *replica,
                                  void *cmd,
@@ -122,6 +182,15 @@ shardcache_replica_received_ping(shardcache_replica_t *replica,
                                  void **response,
                                  size_t *response_len);
 
+static int
+shardcache_replica_tree_sync(shardcache_replica_t *replica, char *peer, uint64_t peer_ballot);
+
+static int
+shardcache_replica_tree_supported(shardcache_replica_t *replica);
+
+static void
+shardcache_replica_tree_snapshot_destroy(shardcache_replica_tree_snapshot_t *snapshot);
+
 
 
 static int
@@ -137,6 +206,18 @@ kepaxos_connection_append_input_data(void *data,
     return 0;
 }
 
+// the response has been received, the connection can go back to the pool
+static void
+shardcache_replica_connection_done(iomux_t *iomux, int fd, kepaxos_connection_t *connection)
+{
+    iomux_remove(iomux, fd);
+    // the connections in the pool are expected to be blocking
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    shardcache_release_connection_for_peer(connection->replica->shc, connection->peer, fd);
+    async_read_context_destroy(connection->ctx);
+    free(connection);
+}
+
 static int
 kepaxos_connection_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
 {
@@ -151,25 +232,25 @@ kepaxos_connection_input(iomux_t *iomux, int fd, unsigned char *data, int len, v
         read_state == SHC_STATE_AUTH_ERR)
     {
         shardcache_hdr_t hdr = async_read_context_hdr(connection->ctx);
-        if (hdr == SHC_HDR_REPLICA_RESPONSE || hdr == SHC_HDR_REPLICA_ACK)
+        if (hdr == SHC_HDR_REPLICA_RESPONSE ||
+            hdr == SHC_HDR_REPLICA_BATCH_RESPONSE ||
+            hdr == SHC_HDR_REPLICA_ACK)
         {
             if (hdr == SHC_HDR_REPLICA_RESPONSE) {
                 ATOMIC_INCREMENT(replica->counters.responses);
                 kepaxos_received_response(replica->kepaxos, fbuf_data(&connection->input), fbuf_used(&connection->input));
+            } else if (hdr == SHC_HDR_REPLICA_BATCH_RESPONSE) {
+                shardcache_replica_received_batch_response(replica,
+                                                           fbuf_data(&connection->input),
+                                                           fbuf_used(&connection->input));
             } else {
                 ATOMIC_INCREMENT(replica->counters.acks);
                 shardcache_replica_received_ack(replica, fbuf_data(&connection->input), fbuf_used(&connection->input));
             }
-            iomux_remove(iomux, fd);
-            shardcache_release_connection_for_peer(replica->shc, connection->peer, fd);
-            async_read_context_destroy(connection->ctx);
-            free(connection);
+            shardcache_replica_connection_done(iomux, fd, connection);
         }
         else if (hdr == SHC_HDR_REPLICA_ACK) {
-            iomux_remove(iomux, fd);
-            shardcache_release_connection_for_peer(replica->shc, connection->peer, fd);
-            async_read_context_destroy(connection->ctx);
-            free(connection);
+            shardcache_replica_connection_done(iomux, fd, connection);
         } else {
             // TODO - Error message for unexpected response
             iomux_close(iomux, fd);
@@ -181,13 +262,18 @@ kepaxos_connection_input(iomux_t *iomux, int fd, unsigned char *data, int len, v
 static void
 kepaxos_connection_timeout(iomux_t *iomux, int fd, void *priv)
 {
+    // either the peer couldn't be reached or it didn't answer in time
+    errno = ETIMEDOUT;
+    iomux_close(iomux, fd);
 }
 
 static void
 kepaxos_connection_eof(iomux_t *iomux, int fd, void *priv)
 {
+    // the connection has been closed (or it failed to connect)
+    // before the response has been received, it can't be reused
     kepaxos_connection_t *connection = (kepaxos_connection_t *)priv;
-    shardcache_release_connection_for_peer(connection->replica->shc, connection->peer, fd);
+    shardcache_discard_connection_for_peer(connection->replica->shc, connection->peer, fd, 1);
     async_read_context_destroy(connection->ctx);
     free(connection);
 }
@@ -274,11 +360,13 @@ kepaxos_commit(unsigned char type,
             while (s && *s) {
                 char *tok = strsep(&s, ",");
                 if(tok) {
-                    char *label = strsep(&tok, ":");
-                    char *addr = tok;
+                    shardcache_node_t *node = shardcache_node_create_from_string(tok);
+                    if (!node) {
+                        SHC_WARNING("Bad node string in the migration request: %s", tok);
+                        continue;
+                    }
                     size_t size = (num_shards + 1) * sizeof(shardcache_node_t *);
                     nodes = realloc(nodes, size);
-                    shardcache_node_t *node = shardcache_node_create(label, &addr, 1);
                     nodes[num_shards++] = node;
                 } 
             }
@@ -309,6 +397,215 @@ kepaxos_commit(unsigned char type,
     return rc;
 }
 
+static int
+shardcache_replica_send_message(shardcache_replica_t *replica,
+                                char *peer,
+                                shardcache_hdr_t hdr,
+                                void *msg,
+                                size_t len)
+{
+    // a peer which is down must not delay the messages queued for the others,
+    // so the async-io thread never waits for a connection to be established
+    int fd = shardcache_get_connection_for_peer_nonblocking(replica->shc, peer);
+    if (fd < 0)
+        return -1;
+    kepaxos_connection_t *connection = calloc(1, sizeof(kepaxos_connection_t));
+    connection->replica = replica;
+    connection->peer = peer;
+    connection->fd = fd;
+    connection->ctx = async_read_context_create((char *)replica->shc->auth,
+                                                kepaxos_connection_append_input_data,
+                                                connection);
+    shardcache_record_t record = {
+        .v = msg,
+        .l = len
+    };
+    int rc = build_message((char *)replica->shc->auth, 0, hdr, &record, 1, &connection->output);
+    if (rc == 0) {
+
+        iomux_callbacks_t callbacks = {
+            .mux_input = kepaxos_connection_input,
+            .mux_output = NULL,
+            .mux_timeout = kepaxos_connection_timeout,
+            .mux_eof = kepaxos_connection_eof,
+            .mux_connection = NULL,
+            .priv = connection
+        };
+
+        iomux_add(replica->iomux, fd, &callbacks);
+        char *data = NULL;
+        unsigned int len = fbuf_detach(&connection->output, &data, NULL);
+        iomux_write(replica->iomux, fd, (unsigned char *)data, len, 1);
+
+        int tcp_timeout = ATOMIC_READ(replica->shc->tcp_timeout);
+        if (tcp_timeout > 0) {
+            struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+            iomux_set_timeout(replica->iomux, fd, &maxwait);
+        }
+    } else {
+        shardcache_discard_connection_for_peer(replica->shc, peer, fd, 0);
+        async_read_context_destroy(connection->ctx);
+        fbuf_destroy(&connection->output);
+        free(connection);
+    }
+    return rc;
+}
+
+static void
+shardcache_replica_message_destroy(shardcache_replica_message_t *message)
+{
+    free(message->msg);
+    free(message);
+}
+
+static void
+shardcache_replica_wakeup(shardcache_replica_t *replica)
+{
+    // there is no need to write more than one byte
+    // until the async-io thread consumes the pending one
+    if (ATOMIC_CAS(replica->wakeup_pending, 0, 1)) {
+        if (write(replica->wakeup_pipe[1], "w", 1) != 1 && errno != EAGAIN)
+            SHC_ERROR("Can't wake up the replica async-io thread: %s", strerror(errno));
+    }
+}
+
+static int
+shardcache_replica_wakeup_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    shardcache_replica_t *replica = (shardcache_replica_t *)priv;
+    ATOMIC_SET(replica->wakeup_pending, 0);
+    return len;
+}
+
+// hands a message over to the async-io thread, which will take care of
+// connecting to the peer and sending it (so the caller never blocks)
+// NOTE: the message will be released once sent
+static void
+shardcache_replica_queue_message(shardcache_replica_t *replica,
+                                 char *peer,
+                                 shardcache_hdr_t hdr,
+                                 void *msg,
+                                 size_t len)
+{
+    shardcache_replica_message_t *message = malloc(sizeof(shardcache_replica_message_t));
+    message->peer = peer;
+    message->hdr = hdr;
+    message->msg = msg;
+    message->len = len;
+    list_push_value(replica->outgoing, message);
+    shardcache_replica_wakeup(replica);
+}
+
+// sends all the queued messages (called by the async-io thread)
+static void
+shardcache_replica_send_queued(shardcache_replica_t *replica)
+{
+    shardcache_replica_message_t *message;
+    while ((message = list_shift_value(replica->outgoing))) {
+        shardcache_replica_send_message(replica, message->peer, message->hdr, message->msg, message->len);
+        shardcache_replica_message_destroy(message);
+    }
+}
+
+// sends all the messages queued for a replica
+// NOTE: must be called with the batch lock held, which will be released
+static void
+shardcache_replica_flush_batch(shardcache_replica_t *replica, int index)
+{
+    shardcache_replica_batch_t *batch = &replica->batches[index];
+    if (!batch->count) {
+        MUTEX_UNLOCK(&batch->lock);
+        return;
+    }
+
+    uint32_t count = batch->count;
+    char *blobs = NULL;
+    unsigned int len = fbuf_detach(&batch->blobs, &blobs, NULL);
+    batch->count = 0;
+    MUTEX_UNLOCK(&batch->lock);
+
+    if (count == 1) {
+        // no need for a batch
+        memmove(blobs, blobs + sizeof(uint32_t), len - sizeof(uint32_t));
+        shardcache_replica_queue_message(replica, replica->peers[index], SHC_HDR_REPLICA_COMMAND,
+                                         blobs, len - sizeof(uint32_t));
+    } else {
+        size_t msg_len = sizeof(uint32_t) + len;
+        char *msg = malloc(msg_len);
+        size_t offset = 0;
+        MSG_WRITE_UINT32(msg, offset, count);
+        MSG_WRITE_POINTER(msg, offset, blobs, len);
+        ATOMIC_INCREMENT(replica->counters.batches);
+        shardcache_replica_queue_message(replica, replica->peers[index], SHC_HDR_REPLICA_BATCH, msg, msg_len);
+        free(blobs);
+    }
+}
+
+// flushes the batches whose oldest message has waited for
+// at least batch_window microsecs (or all of them if force is true)
+static void
+shardcache_replica_flush_batches(shardcache_replica_t *replica, int force)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int window = ATOMIC_READ(replica->batch_window);
+    int i;
+    for (i = 0; i < replica->num_peers; i++) {
+        shardcache_replica_batch_t *batch = &replica->batches[i];
+        MUTEX_LOCK(&batch->lock);
+        if (batch->count) {
+            struct timeval diff;
+            timersub(&now, &batch->first, &diff);
+            if (force || diff.tv_sec > 0 || diff.tv_usec >= window) {
+                shardcache_replica_flush_batch(replica, i);
+                continue;
+            }
+        }
+        MUTEX_UNLOCK(&batch->lock);
+    }
+}
+
+// reduces the timeout so that the async-io thread wakes up
+// in time to flush the oldest batch
+static void
+shardcache_replica_batch_timeout(shardcache_replica_t *replica, struct timeval *timeout)
+{
+    int window = ATOMIC_READ(replica->batch_window);
+    if (window <= 0)
+        return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timeval window_tv = { window / 1000000, window % 1000000 };
+    int i;
+    for (i = 0; i < replica->num_peers; i++) {
+        shardcache_replica_batch_t *batch = &replica->batches[i];
+        MUTEX_LOCK(&batch->lock);
+        if (batch->count) {
+            struct timeval deadline, left;
+            timeradd(&batch->first, &window_tv, &deadline);
+            if (timercmp(&deadline, &now, <))
+                timerclear(&left);
+            else
+                timersub(&deadline, &now, &left);
+            if (timercmp(&left, timeout, <))
+                *timeout = left;
+        }
+        MUTEX_UNLOCK(&batch->lock);
+    }
+}
+
+static int
+shardcache_replica_peer_index(shardcache_replica_t *replica, char *peer)
+{
+    int i;
+    for (i = 0; i < replica->num_peers; i++) {
+        if (strcmp(replica->peers[i], peer) == 0)
+            return i;
+    }
+    return -1;
+}
+
 static int
 kepaxos_send(char **recipients,
              int num_recipients,
@@ -317,44 +614,147 @@ kepaxos_send(char **recipients,
              void *priv)
 {
     shardcache_replica_t *replica = (shardcache_replica_t *)priv;
+    int batching = (ATOMIC_READ(replica->batch_window) > 0);
     int i;
     for (i = 0; i < num_recipients; i++) {
-        // TODO - parallelize
-        int fd = shardcache_get_connection_for_peer(replica->shc, recipients[i]);
-        if (fd < 0)
+        int index = shardcache_replica_peer_index(replica, recipients[i]);
+        if (index < 0) {
+            SHC_ERROR("Unknown replica %s", recipients[i]);
             continue;
-        kepaxos_connection_t *connection = calloc(1, sizeof(kepaxos_connection_t));
-        connection->replica = replica;
-        connection->peer = recipients[i];
-        connection->fd = fd;
-        connection->ctx = async_read_context_create((char *)replica->shc->auth,
-                                                    kepaxos_connection_append_input_data,
-                                                    connection);
-        shardcache_record_t record = {
-            .v = cmd,
-            .l = cmd_len
-        };
-        int rc = build_message((char *)replica->shc->auth, 0, SHC_HDR_REPLICA_COMMAND, &record, 1, &connection->output);
-        if (rc == 0) {
+        }
 
-            iomux_callbacks_t callbacks = {
-                .mux_input = kepaxos_connection_input,
-                .mux_output = NULL,
-                .mux_timeout = kepaxos_connection_timeout,
-                .mux_eof = kepaxos_connection_eof,
-                .mux_connection = NULL,
-                .priv = connection
-            };
-
-            iomux_add(replica->iomux, fd, &callbacks);
-            char *data = NULL;
-            unsigned int len = fbuf_detach(&connection->output, &data, NULL);
-            iomux_write(replica->iomux, fd, (unsigned char *)data, len, 1);
+        if (!batching) {
+            void *msg = malloc(cmd_len);
+            memcpy(msg, cmd, cmd_len);
+            shardcache_replica_queue_message(replica, replica->peers[index], SHC_HDR_REPLICA_COMMAND, msg, cmd_len);
+            continue;
+        }
+
+        // queue the message, it will be sent either when the batch
+        // is big enough or by the async-io thread once the window expires
+        shardcache_replica_batch_t *batch = &replica->batches[index];
+        MUTEX_LOCK(&batch->lock);
+        int first = !batch->count;
+        if (first)
+            gettimeofday(&batch->first, NULL);
+        uint32_t nlen = htonl(cmd_len);
+        fbuf_add_binary(&batch->blobs, (char *)&nlen, sizeof(nlen));
+        fbuf_add_binary(&batch->blobs, cmd, cmd_len);
+        batch->count++;
+        if (fbuf_used(&batch->blobs) >= SHARDCACHE_REPLICA_BATCH_MAX_SIZE) {
+            shardcache_replica_flush_batch(replica, index);
+        } else {
+            MUTEX_UNLOCK(&batch->lock);
+            // let the async-io thread know when the new batch must be flushed
+            if (first)
+                shardcache_replica_wakeup(replica);
         }
     }
     return 0;
 }
 
+// iterates over the blobs in a batch (<NUM_BLOBS>[<BLOB_LEN><KEPAXOS_BLOB>...])
+// returns the number of blobs or -1 if the batch is malformed
+static int
+shardcache_replica_batch_foreach(void *msg,
+                                 size_t len,
+                                 void (*cb)(void *blob, size_t blen, void *priv),
+                                 void *priv)
+{
+    char *p = msg;
+    uint32_t num_blobs;
+    if (len < sizeof(uint32_t))
+        return -1;
+    MSG_READ_UINT32(p, num_blobs);
+    size_t offset = sizeof(uint32_t);
+    int i;
+    for (i = 0; i < num_blobs; i++) {
+        uint32_t blen;
+        void *blob = NULL;
+        if (len < offset + sizeof(uint32_t))
+            return -1;
+        MSG_READ_UINT32(p, blen);
+        offset += sizeof(uint32_t);
+        if (len < offset + blen)
+            return -1;
+        MSG_READ_POINTER(p, blob, blen);
+        offset += blen;
+        if (blob)
+            cb(blob, blen, priv);
+    }
+    return num_blobs;
+}
+
+static void
+shardcache_replica_batch_response_cb(void *blob, size_t blen, void *priv)
+{
+    shardcache_replica_t *replica = (shardcache_replica_t *)priv;
+    ATOMIC_INCREMENT(replica->counters.responses);
+    kepaxos_received_response(replica->kepaxos, blob, blen);
+}
+
+static void
+shardcache_replica_received_batch_response(shardcache_replica_t *replica, void *msg, size_t len)
+{
+    if (shardcache_replica_batch_foreach(msg, len, shardcache_replica_batch_response_cb, replica) < 0)
+        SHC_ERROR("Malformed batch in shardcache_replica_received_batch_response()");
+}
+
+typedef struct {
+    shardcache_replica_t *replica;
+    fbuf_t out;
+    uint32_t count;
+} shardcache_replica_batch_arg_t;
+
+static void
+shardcache_replica_batch_command_cb(void *blob, size_t blen, void *priv)
+{
+    shardcache_replica_batch_arg_t *arg = (shardcache_replica_batch_arg_t *)priv;
+    void *response = NULL;
+    size_t response_len = 0;
+    ATOMIC_INCREMENT(arg->replica->counters.commands);
+    int rc = kepaxos_received_command(arg->replica->kepaxos, blob, blen, &response, &response_len);
+    if (rc == 0 && response_len) {
+        uint32_t nlen = htonl(response_len);
+        fbuf_add_binary(&arg->out, (char *)&nlen, sizeof(nlen));
+        fbuf_add_binary(&arg->out, response, response_len);
+        arg->count++;
+    }
+    free(response);
+}
+
+static int
+shardcache_replica_received_batch(shardcache_replica_t *replica,
+                                  void *cmd,
+                                  size_t cmdlen,
+                                  void **response,
+                                  size_t *response_len)
+{
+    shardcache_replica_batch_arg_t arg = {
+        .replica = replica,
+        .out = FBUF_STATIC_INITIALIZER,
+        .count = 0
+    };
+
+    // reserve room for the number of responses
+    uint32_t count = 0;
+    fbuf_add_binary(&arg.out, (char *)&count, sizeof(count));
+
+    if (shardcache_replica_batch_foreach(cmd, cmdlen, shardcache_replica_batch_command_cb, &arg) < 0) {
+        SHC_ERROR("Malformed batch in shardcache_replica_received_batch()");
+        fbuf_destroy(&arg.out);
+        return -1;
+    }
+
+    count = htonl(arg.count);
+    memcpy(fbuf_data(&arg.out), &count, sizeof(count));
+
+    char *out = NULL;
+    *response_len = fbuf_detach(&arg.out, &out, NULL);
+    *response = out;
+    return 0;
+}
+
 static void
 shardcache_replica_received_ack(shardcache_replica_t *replica, void *msg, size_t len)
 {
@@ -397,10 +797,26 @@ shardcache_replica_received_ack(shardcache_replica_t *replica, void *msg, size_t
             return;
         }
         MSG_READ_POINTER(p, key, klen);
+        offset += klen;
         uint64_t last_seq = kepaxos_seq(replica->kepaxos, key, klen);
         if (last_seq < seq)
             kepaxos_recover(peer, key, klen, seq, ballot, replica);
     }
+
+    // the peer didn't send the diff because it's too big,
+    // we need to compare our storage with the one of the peer
+    if (len >= offset + sizeof(uint32_t) + sizeof(uint64_t)) {
+        uint32_t total_items;
+        uint64_t peer_ballot;
+        MSG_READ_UINT32(p, total_items);
+        MSG_READ_UINT64(p, peer_ballot);
+        int index = shardcache_replica_peer_index(replica, peer);
+        if (total_items && peer_ballot && index >= 0) {
+            SHC_NOTICE("The diff from the replica %s is too big (%u items), "
+                       "the storage will be compared using hash trees", peer, total_items);
+            ATOMIC_SET(replica->tree_sync[index], peer_ballot);
+        }
+    }
 }
 
 static void
@@ -414,50 +830,25 @@ shardcache_replica_ping(shardcache_replica_t *replica)
         if (*replica->me != *peers[i] ||
             strcmp(replica->me, peers[i]) != 0)
         {
-            int fd = shardcache_get_connection_for_peer(replica->shc, peers[i]);
-            if (fd < 0)
-                continue;
-            kepaxos_connection_t *connection = calloc(1, sizeof(kepaxos_connection_t));
-            connection->replica = replica;
-            connection->peer = peers[i];
-            connection->fd = fd;
-            connection->ctx = async_read_context_create((char *)replica->shc->auth,
-                                                        kepaxos_connection_append_input_data,
-                                                        connection);
-
             uint64_t ballot = kepaxos_ballot(replica->kepaxos);
             size_t peer_len = strlen(replica->me) + 1;
-            uint32_t msg_len = sizeof(uint64_t) + sizeof(uint32_t) + peer_len;
+            uint32_t msg_len = sizeof(uint64_t) + (sizeof(uint32_t) * 2) + peer_len;
 
             char *msg = malloc(msg_len);
             size_t offset = 0;
             MSG_WRITE_UINT32(msg, offset, peer_len);
             MSG_WRITE_POINTER(msg, offset, replica->me, peer_len);
             MSG_WRITE_UINT64(msg, offset, ballot);
-
-            shardcache_record_t record = {
-                .v = msg,
-                .l = msg_len
-            };
-            int rc = build_message((char *)replica->shc->auth, 0, SHC_HDR_REPLICA_PING, &record, 1, &connection->output);
-            if (rc == 0) {
-
-                iomux_callbacks_t callbacks = {
-                    .mux_input = kepaxos_connection_input,
-                    .mux_output = NULL,
-                    .mux_timeout = kepaxos_connection_timeout,
-                    .mux_eof = kepaxos_connection_eof,
-                    .mux_connection = NULL,
-                    .priv = connection
-                };
-                iomux_add(replica->iomux, fd, &callbacks);
-                char *data = NULL;
-                unsigned int len = fbuf_detach(&connection->output, &data, NULL);
-                iomux_write(replica->iomux, fd, (unsigned char *)data, len, 1);
-            } else {
-                shardcache_release_connection_for_peer(replica->shc, peers[i], fd);
+            // the max number of items we want in the diff (0 == all of them)
+            uint32_t max_items = 0;
+            if (shardcache_replica_tree_supported(replica)) {
+                int index = shardcache_replica_peer_index(replica, peers[i]);
+                if (index < 0 || !ATOMIC_CAS(replica->tree_fallback[index], 1, 0))
+                    max_items = ATOMIC_READ(replica->anti_entropy_threshold);
             }
-            free(msg);
+            MSG_WRITE_UINT32(msg, offset, max_items);
+
+            shardcache_replica_queue_message(replica, peers[i], SHC_HDR_REPLICA_PING, msg, msg_len);
         }
     }
     free(peers);
@@ -488,6 +879,12 @@ shardcache_replica_recover(void *priv)
 
         int rc = pqueue_pull_highest(replica->recovery_queue, (void **)&k, &prio);
         if (rc != 0 || !k) {
+            int i;
+            for (i = 0; i < replica->num_peers && !ATOMIC_READ(replica->quit); i++) {
+                uint64_t ballot = ATOMIC_READ(replica->tree_sync[i]);
+                if (ballot && ATOMIC_CAS(replica->tree_sync[i], ballot, 0))
+                    shardcache_replica_tree_sync(replica, replica->peers[i], ballot);
+            }
             shardcache_replica_ping(replica);
             do {
                 rc = nanosleep(&timeout, &remainder);
@@ -527,6 +924,11 @@ shardcache_replica_recover(void *priv)
         // TODO - use fetch_from_peer_async() so that the download
         //        can be stopped earlier if the recovery is aborted
         rc = fetch_from_peer(item->peer, (char *)replica->shc->auth, 0, item->key, item->klen, &data, fd);
+        if (rc == 0)
+            shardcache_release_connection_for_peer(replica->shc, item->peer, fd);
+        else
+            shardcache_discard_connection_for_peer(replica->shc, item->peer, fd, 1);
+
         if (rc == 0) {
             void *check = NULL;
             rc = ht_delete(replica->recovery, item->key, item->klen, &check, NULL);
@@ -583,8 +985,17 @@ void *shardcache_replica_async_io(void *priv)
 {
     shardcache_replica_t *replica = (shardcache_replica_t *)priv;
     while (!ATOMIC_READ(replica->quit)) {
-        struct timeval timeout = { 0, 500 };
+        // block until either a socket is ready, a new message has been
+        // queued (see shardcache_replica_wakeup()) or a batch is due
+        struct timeval timeout = { SHARDCACHE_REPLICA_IDLE_TIMEOUT, 0 };
+        shardcache_replica_batch_timeout(replica, &timeout);
         iomux_run(replica->iomux, &timeout);
+        // flush even if batching has just been disabled, a sender which saw
+        // the old window might have queued a message after the forced flush
+        // done by shardcache_replica_set_batch_window() (with a 0 window
+        // all the queued batches are due)
+        shardcache_replica_flush_batches(replica, 0);
+        shardcache_replica_send_queued(replica);
     }
     return NULL;
 }
@@ -624,6 +1035,18 @@ shardcache_replica_register_counters(shardcache_replica_t *replica)
                            "replica_acks",
                            &replica->counters.acks);
 
+    shardcache_counter_add(replica->shc->counters,
+                           "replica_batches",
+                           &replica->counters.batches);
+
+    shardcache_counter_add(replica->shc->counters,
+                           "replica_tree_syncs",
+                           &replica->counters.tree_syncs);
+
+    shardcache_counter_add(replica->shc->counters,
+                           "replica_tree_keys",
+                           &replica->counters.tree_keys);
+
 }
 
 shardcache_replica_t *
@@ -673,6 +1096,16 @@ shardcache_replica_create(shardcache_t *shc,
         return NULL;
     }
 
+    replica->peers = malloc(sizeof(char *) * replica->num_replicas);
+    replica->num_peers = shardcache_node_get_all_addresses(replica->node, replica->peers, replica->num_replicas);
+    replica->batches = calloc(replica->num_peers, sizeof(shardcache_replica_batch_t));
+    replica->tree_sync = calloc(replica->num_peers, sizeof(uint64_t));
+    replica->tree_fallback = calloc(replica->num_peers, sizeof(int));
+    MUTEX_INIT(&replica->tree_lock);
+    int i;
+    for (i = 0; i < replica->num_peers; i++)
+        MUTEX_INIT(&replica->batches[i].lock);
+
     replica->recovery = ht_create(128, 1024, NULL);
 
     replica->recovery_queue = pqueue_create(PQUEUE_MODE_LOWEST, 1<<20,
@@ -680,6 +1113,27 @@ shardcache_replica_create(shardcache_t *shc,
 
     replica->iomux = iomux_create(0, 1);
 
+    replica->outgoing = list_create();
+    list_set_free_value_callback(replica->outgoing,
+                                 (free_value_callback_t)shardcache_replica_message_destroy);
+
+    if (pipe(replica->wakeup_pipe) != 0) {
+        SHC_ERROR("Can't create the wakeup pipe for the replica async-io thread: %s", strerror(errno));
+        replica->wakeup_pipe[0] = replica->wakeup_pipe[1] = -1;
+        shardcache_replica_destroy(replica);
+        free(peers);
+        return NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(replica->wakeup_pipe[i], F_SETFL, fcntl(replica->wakeup_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(replica->wakeup_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    iomux_callbacks_t wakeup_callbacks = {
+        .mux_input = shardcache_replica_wakeup_input,
+        .priv = replica
+    };
+    iomux_add(replica->iomux, replica->wakeup_pipe[0], &wakeup_callbacks);
+
     if (pthread_create(&replica->recover_th, NULL, shardcache_replica_recover, replica) != 0)
     {
         shardcache_replica_destroy(replica); 
@@ -705,7 +1159,19 @@ shardcache_replica_destroy(shardcache_replica_t *replica)
     if (replica->recover_th) {
         ATOMIC_INCREMENT(replica->quit);
         pthread_join(replica->recover_th, NULL);
-        pthread_join(replica->async_io_th, NULL);
+        if (replica->async_io_th) {
+            shardcache_replica_wakeup(replica);
+            pthread_join(replica->async_io_th, NULL);
+        }
+    }
+
+    if (replica->outgoing)
+        list_destroy(replica->outgoing);
+
+    if (replica->wakeup_pipe[0] > 0) {
+        iomux_remove(replica->iomux, replica->wakeup_pipe[0]);
+        close(replica->wakeup_pipe[0]);
+        close(replica->wakeup_pipe[1]);
     }
 
     shardcache_node_destroy(replica->node);
@@ -715,6 +1181,24 @@ shardcache_replica_destroy(shardcache_replica_t *replica)
     if (replica->recovery_queue)
         pqueue_destroy(replica->recovery_queue);
 
+    if (replica->batches) {
+        int i;
+        for (i = 0; i < replica->num_peers; i++) {
+            fbuf_destroy(&replica->batches[i].blobs);
+            MUTEX_DESTROY(&replica->batches[i].lock);
+        }
+        free(replica->batches);
+    }
+    free(replica->peers);
+
+    if (replica->tree_sync) {
+        free(replica->tree_sync);
+        free(replica->tree_fallback);
+        MUTEX_DESTROY(&replica->tree_lock);
+    }
+    if (replica->tree)
+        shardcache_replica_tree_snapshot_destroy(replica->tree);
+
     free(replica);
 }
 
@@ -741,10 +1225,23 @@ shardcache_replica_received_ping(shardcache_replica_t *replica,
     }
     MSG_READ_UINT64(p, ballot);
 
+    // older replicas don't tell how many items they want
+    uint32_t max_items = 0;
+    if (cmdlen >= (p - (char *)cmd) + sizeof(uint32_t))
+        MSG_READ_UINT32(p, max_items);
+
     kepaxos_diff_item_t *items = NULL;
     int num_items = 0;
     kepaxos_get_diff(replica->kepaxos, ballot, &items, &num_items);
 
+    int total_items = num_items;
+    if (max_items && num_items > max_items && shardcache_replica_tree_supported(replica)) {
+        // don't send the diff, the peer will compare the hash trees instead
+        kepaxos_diff_release(items, num_items);
+        items = NULL;
+        num_items = 0;
+    }
+
     size_t myname_len = strlen(replica->me) + 1;
     size_t outlen = (sizeof(uint32_t) * 2) + myname_len;
     char *out = malloc(outlen);
@@ -767,12 +1264,665 @@ shardcache_replica_received_ping(shardcache_replica_t *replica,
 
     kepaxos_diff_release(items, num_items);
 
+    if (total_items != num_items) {
+        int offset = outlen;
+        outlen += sizeof(uint32_t) + sizeof(uint64_t);
+        out = realloc(out, outlen);
+        MSG_WRITE_UINT32(out, offset, total_items);
+        MSG_WRITE_UINT64(out, offset, kepaxos_ballot(replica->kepaxos));
+    }
+
     *response = out;
     *response_len = outlen;
 
     return 0;
 }
 
+/*
+ * Anti-entropy
+ *
+ * When a replica is too far behind for the (ballot, seq, key) diff to be
+ * shipped in a REPLICA_ACK, it compares a hash tree of its storage with the
+ * one of the replica which is ahead, descending only into the subtrees
+ * which differ, and then fetches the differing keys in batches
+ * (see docs/replica_protocol.txt)
+ */
+
+static void
+tree_msg_add_uint32(fbuf_t *buf, uint32_t v)
+{
+    uint32_t nv = htonl(v);
+    fbuf_add_binary(buf, (char *)&nv, sizeof(nv));
+}
+
+static void
+tree_msg_add_uint64(fbuf_t *buf, uint64_t v)
+{
+    tree_msg_add_uint32(buf, v >> 32);
+    tree_msg_add_uint32(buf, v & 0x00000000FFFFFFFF);
+}
+
+static int
+tree_msg_read_uint32(char **p, size_t *left, uint32_t *v)
+{
+    if (*left < sizeof(uint32_t))
+        return -1;
+    MSG_READ_UINT32(*p, *v);
+    *left -= sizeof(uint32_t);
+    return 0;
+}
+
+static int
+tree_msg_read_uint64(char **p, size_t *left, uint64_t *v)
+{
+    if (*left < sizeof(uint64_t))
+        return -1;
+    MSG_READ_UINT64(*p, *v);
+    *left -= sizeof(uint64_t);
+    return 0;
+}
+
+static int
+tree_msg_read_pointer(char **p, size_t *left, void **ptr, uint32_t len)
+{
+    if (*left < len)
+        return -1;
+    MSG_READ_POINTER(*p, *ptr, len);
+    *left -= len;
+    return 0;
+}
+
+typedef void (*shardcache_replica_tree_scan_cb_t)(void *key,
+                                                  size_t klen,
+                                                  void *value,
+                                                  size_t vlen,
+                                                  void *priv);
+
+// calls the provided callback for each item in the local storage
+static int
+shardcache_replica_tree_scan(shardcache_replica_t *replica,
+                             shardcache_replica_tree_scan_cb_t cb,
+                             void *priv)
+{
+    shardcache_t *cache = replica->shc;
+    if (!cache->storage.fetch)
+        return -1;
+
+    shardcache_index_cursor_t *cursor = shardcache_index_cursor_open(cache);
+    if (!cursor)
+        return -1;
+
+    shardcache_storage_index_item_t items[SHARDCACHE_REPLICA_TREE_SCAN_BATCH];
+    size_t num_items;
+    while ((num_items = shardcache_index_cursor_next(cursor, items, SHARDCACHE_REPLICA_TREE_SCAN_BATCH))) {
+        int i;
+        for (i = 0; i < num_items; i++) {
+            void *value = NULL;
+            size_t vlen = 0;
+            if (cache->storage.fetch(items[i].key, items[i].klen, &value, &vlen, cache->storage.priv) == 0 && value)
+                cb(items[i].key, items[i].klen, value, vlen, priv);
+            free(value);
+            free(items[i].key);
+        }
+        if (ATOMIC_READ(replica->quit))
+            break;
+    }
+    shardcache_index_cursor_close(cursor);
+    return 0;
+}
+
+static int
+shardcache_replica_tree_supported(shardcache_replica_t *replica)
+{
+    // the trees are built scanning the index of the persistent storage
+    shardcache_t *cache = replica->shc;
+    return (cache->use_persistent_storage && cache->storage.fetch);
+}
+
+static void
+shardcache_replica_tree_snapshot_destroy(shardcache_replica_tree_snapshot_t *snapshot)
+{
+    if (snapshot->leaves) {
+        int i;
+        for (i = 0; i < snapshot->num_leaves; i++)
+            fbuf_destroy(&snapshot->leaves[i]);
+        free(snapshot->leaves);
+    }
+    free(snapshot->counts);
+    if (snapshot->tree)
+        merkle_tree_destroy(snapshot->tree);
+    free(snapshot);
+}
+
+static void
+shardcache_replica_tree_add_cb(void *key, size_t klen, void *value, size_t vlen, void *priv)
+{
+    shardcache_replica_tree_snapshot_t *snapshot = (shardcache_replica_tree_snapshot_t *)priv;
+    uint64_t digest = merkle_tree_digest(key, klen, value, vlen);
+    merkle_tree_add(snapshot->tree, key, klen, digest);
+
+    uint32_t leaf = merkle_tree_leaf(snapshot->tree, key, klen);
+    tree_msg_add_uint32(&snapshot->leaves[leaf], klen);
+    fbuf_add_binary(&snapshot->leaves[leaf], key, klen);
+    tree_msg_add_uint64(&snapshot->leaves[leaf], digest);
+    snapshot->counts[leaf]++;
+}
+
+// builds the hash tree of the local storage and keeps the items
+// of each leaf, so that a single scan of the storage is needed
+// to answer all the requests of a sync session
+static shardcache_replica_tree_snapshot_t *
+shardcache_replica_tree_snapshot_build(shardcache_replica_t *replica)
+{
+    shardcache_replica_tree_snapshot_t *snapshot = calloc(1, sizeof(shardcache_replica_tree_snapshot_t));
+    snapshot->built = time(NULL);
+    snapshot->tree = merkle_tree_create(SHARDCACHE_REPLICA_TREE_DEPTH);
+    if (!snapshot->tree) {
+        shardcache_replica_tree_snapshot_destroy(snapshot);
+        return NULL;
+    }
+    snapshot->num_leaves = merkle_tree_num_nodes(snapshot->tree, SHARDCACHE_REPLICA_TREE_DEPTH);
+    snapshot->leaves = malloc(sizeof(fbuf_t) * snapshot->num_leaves);
+    snapshot->counts = calloc(snapshot->num_leaves, sizeof(uint32_t));
+    int i;
+    for (i = 0; i < snapshot->num_leaves; i++) {
+        fbuf_t empty = FBUF_STATIC_INITIALIZER;
+        snapshot->leaves[i] = empty;
+    }
+
+    if (shardcache_replica_tree_scan(replica, shardcache_replica_tree_add_cb, snapshot) != 0) {
+        shardcache_replica_tree_snapshot_destroy(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+// the snapshot used to answer the peers is reused for a while,
+// so that a sync session doesn't rebuild it at each request.
+// A new one is built without holding the tree_lock, so the requests
+// served from the previous snapshot don't wait for the storage scan
+static void
+shardcache_replica_tree_refresh(shardcache_replica_t *replica)
+{
+    time_t now = time(NULL);
+
+    MUTEX_LOCK(&replica->tree_lock);
+    if (replica->tree && (now - replica->tree->built <= SHARDCACHE_REPLICA_TREE_TTL || replica->tree_building)) {
+        MUTEX_UNLOCK(&replica->tree_lock);
+        return;
+    }
+    replica->tree_building = 1;
+    MUTEX_UNLOCK(&replica->tree_lock);
+
+    shardcache_replica_tree_snapshot_t *snapshot = shardcache_replica_tree_snapshot_build(replica);
+
+    MUTEX_LOCK(&replica->tree_lock);
+    replica->tree_building = 0;
+    if (snapshot && (!replica->tree || replica->tree->built <= snapshot->built)) {
+        shardcache_replica_tree_snapshot_t *old = replica->tree;
+        replica->tree = snapshot;
+        snapshot = old;
+    }
+    MUTEX_UNLOCK(&replica->tree_lock);
+
+    // either the previous snapshot or the one which lost the race
+    if (snapshot)
+        shardcache_replica_tree_snapshot_destroy(snapshot);
+}
+
+static int
+shardcache_replica_received_tree(shardcache_replica_t *replica,
+                                 void *cmd,
+                                 size_t cmdlen,
+                                 void **response,
+                                 size_t *response_len)
+{
+    char *p = cmd;
+    size_t left = cmdlen;
+    uint32_t type, depth, num;
+    if (tree_msg_read_uint32(&p, &left, &type) != 0 ||
+        tree_msg_read_uint32(&p, &left, &depth) != 0)
+    {
+        SHC_ERROR("Buffer underrun in shardcache_replica_received_tree()");
+        return -1;
+    }
+
+    if (depth != SHARDCACHE_REPLICA_TREE_DEPTH) {
+        SHC_ERROR("Unsupported tree depth %u in shardcache_replica_received_tree()", depth);
+        return -1;
+    }
+
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    int rc = -1;
+    int i;
+
+    switch(type) {
+        case SHARDCACHE_REPLICA_TREE_HASHES:
+        {
+            uint32_t level;
+            if (tree_msg_read_uint32(&p, &left, &level) != 0 ||
+                tree_msg_read_uint32(&p, &left, &num) != 0)
+            {
+                break;
+            }
+            shardcache_replica_tree_refresh(replica);
+            MUTEX_LOCK(&replica->tree_lock);
+            if (replica->tree) {
+                tree_msg_add_uint32(&out, num);
+                for (i = 0; i < num; i++) {
+                    uint32_t index;
+                    if (tree_msg_read_uint32(&p, &left, &index) != 0)
+                        break;
+                    tree_msg_add_uint64(&out, merkle_tree_hash(replica->tree->tree, level, index));
+                }
+                if (i == num)
+                    rc = 0;
+            }
+            MUTEX_UNLOCK(&replica->tree_lock);
+            break;
+        }
+        case SHARDCACHE_REPLICA_TREE_ITEMS:
+        {
+            if (tree_msg_read_uint32(&p, &left, &num) != 0)
+                break;
+            shardcache_replica_tree_refresh(replica);
+            MUTEX_LOCK(&replica->tree_lock);
+            shardcache_replica_tree_snapshot_t *snapshot = replica->tree;
+            if (!snapshot) {
+                MUTEX_UNLOCK(&replica->tree_lock);
+                break;
+            }
+            char *wanted = calloc(1, snapshot->num_leaves);
+            uint32_t count = 0;
+            for (i = 0; i < num; i++) {
+                uint32_t index;
+                if (tree_msg_read_uint32(&p, &left, &index) != 0 || index >= snapshot->num_leaves)
+                    break;
+                if (!wanted[index])
+                    count += snapshot->counts[index];
+                wanted[index] = 1;
+            }
+            if (i == num) {
+                tree_msg_add_uint32(&out, count);
+                for (i = 0; i < snapshot->num_leaves; i++) {
+                    if (wanted[i] && snapshot->counts[i])
+                        fbuf_add_binary(&out, fbuf_data(&snapshot->leaves[i]), fbuf_used(&snapshot->leaves[i]));
+                }
+                rc = 0;
+            }
+            MUTEX_UNLOCK(&replica->tree_lock);
+            free(wanted);
+            break;
+        }
+        case SHARDCACHE_REPLICA_TREE_VALUES:
+        {
+            shardcache_t *cache = replica->shc;
+            if (tree_msg_read_uint32(&p, &left, &num) != 0 || !cache->storage.fetch)
+                break;
+            tree_msg_add_uint32(&out, num);
+            for (i = 0; i < num; i++) {
+                uint32_t klen;
+                void *key = NULL;
+                if (tree_msg_read_uint32(&p, &left, &klen) != 0 ||
+                    tree_msg_read_pointer(&p, &left, &key, klen) != 0 || !key)
+                {
+                    break;
+                }
+                uint64_t ballot = 0;
+                uint64_t seq = kepaxos_seq_ballot(replica->kepaxos, key, klen, &ballot);
+                void *value = NULL;
+                size_t vlen = 0;
+                if (cache->storage.fetch(key, klen, &value, &vlen, cache->storage.priv) != 0)
+                    vlen = 0;
+                tree_msg_add_uint32(&out, klen);
+                fbuf_add_binary(&out, key, klen);
+                tree_msg_add_uint64(&out, ballot);
+                tree_msg_add_uint64(&out, seq);
+                tree_msg_add_uint32(&out, value ? vlen : 0);
+                if (value && vlen)
+                    fbuf_add_binary(&out, value, vlen);
+                free(value);
+            }
+            if (i == num)
+                rc = 0;
+            break;
+        }
+        default:
+            SHC_ERROR("Unknown request type %u in shardcache_replica_received_tree()", type);
+            break;
+    }
+
+    if (rc != 0) {
+        fbuf_destroy(&out);
+        return -1;
+    }
+
+    char *data = NULL;
+    *response_len = fbuf_detach(&out, &data, NULL);
+    *response = data;
+    return 0;
+}
+
+static int
+shardcache_replica_tree_request(shardcache_replica_t *replica, char *peer, fbuf_t *req, fbuf_t *out)
+{
+    int fd = shardcache_get_connection_for_peer(replica->shc, peer);
+    if (fd < 0)
+        return -1;
+    int rc = replica_tree_from_peer(peer,
+                                    (char *)replica->shc->auth,
+                                    0,
+                                    fbuf_data(req),
+                                    fbuf_used(req),
+                                    out,
+                                    fd);
+    if (rc == 0)
+        shardcache_release_connection_for_peer(replica->shc, peer, fd);
+    else
+        shardcache_discard_connection_for_peer(replica->shc, peer, fd, 1);
+    return rc;
+}
+
+// compares the hashes of the provided nodes with the ones held by the peer
+// and returns (in the nodes array) only the ones which differ
+static int
+shardcache_replica_tree_compare(shardcache_replica_t *replica,
+                                char *peer,
+                                merkle_tree_t *tree,
+                                int level,
+                                uint32_t *nodes,
+                                uint32_t num_nodes)
+{
+    fbuf_t req = FBUF_STATIC_INITIALIZER;
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    tree_msg_add_uint32(&req, SHARDCACHE_REPLICA_TREE_HASHES);
+    tree_msg_add_uint32(&req, SHARDCACHE_REPLICA_TREE_DEPTH);
+    tree_msg_add_uint32(&req, level);
+    tree_msg_add_uint32(&req, num_nodes);
+    int i;
+    for (i = 0; i < num_nodes; i++)
+        tree_msg_add_uint32(&req, nodes[i]);
+
+    int num_differing = -1;
+    if (shardcache_replica_tree_request(replica, peer, &req, &out) == 0) {
+        char *p = fbuf_data(&out);
+        size_t left = fbuf_used(&out);
+        uint32_t num;
+        if (tree_msg_read_uint32(&p, &left, &num) == 0 && num == num_nodes) {
+            num_differing = 0;
+            for (i = 0; i < num_nodes; i++) {
+                uint64_t hash;
+                if (tree_msg_read_uint64(&p, &left, &hash) != 0) {
+                    num_differing = -1;
+                    break;
+                }
+                if (hash != merkle_tree_hash(tree, level, nodes[i]))
+                    nodes[num_differing++] = nodes[i];
+            }
+        }
+    }
+    fbuf_destroy(&req);
+    fbuf_destroy(&out);
+    return num_differing;
+}
+
+// fetches the items held by the peer in the provided leaves and
+// collects the keys whose digest doesn't match the local one.
+// The keys found in the local table are removed from it, so once
+// all the leaves have been processed the table will contain
+// only the keys the peer doesn't have
+static int
+shardcache_replica_tree_diff_leaves(shardcache_replica_t *replica,
+                                    char *peer,
+                                    uint32_t *leaves,
+                                    uint32_t num_leaves,
+                                    hashtable_t *local,
+                                    linked_list_t *keys)
+{
+    fbuf_t req = FBUF_STATIC_INITIALIZER;
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    tree_msg_add_uint32(&req, SHARDCACHE_REPLICA_TREE_ITEMS);
+    tree_msg_add_uint32(&req, SHARDCACHE_REPLICA_TREE_DEPTH);
+    tree_msg_add_uint32(&req, num_leaves);
+    int i;
+    for (i = 0; i < num_leaves; i++)
+        tree_msg_add_uint32(&req, leaves[i]);
+
+    int rc = shardcache_replica_tree_request(replica, peer, &req, &out);
+    if (rc == 0) {
+        char *p = fbuf_data(&out);
+        size_t left = fbuf_used(&out);
+        uint32_t num_items;
+        rc = tree_msg_read_uint32(&p, &left, &num_items);
+        for (i = 0; rc == 0 && i < num_items; i++) {
+            uint32_t klen;
+            void *key = NULL;
+            uint64_t digest;
+            if (tree_msg_read_uint32(&p, &left, &klen) != 0 ||
+                tree_msg_read_pointer(&p, &left, &key, klen) != 0 ||
+                tree_msg_read_uint64(&p, &left, &digest) != 0 || !key)
+            {
+                rc = -1;
+                break;
+            }
+            uint64_t *local_digest = NULL;
+            ht_delete(local, key, klen, (void **)&local_digest, NULL);
+            if (!local_digest || *local_digest != digest) {
+                shardcache_storage_index_item_t *item = malloc(sizeof(shardcache_storage_index_item_t));
+                item->key = malloc(klen);
+                memcpy(item->key, key, klen);
+                item->klen = klen;
+                item->vlen = 0;
+                list_push_value(keys, item);
+            }
+            free(local_digest);
+        }
+    }
+    fbuf_destroy(&req);
+    fbuf_destroy(&out);
+    return rc;
+}
+
+// fetches a batch of keys from the peer and applies its state for
+// the ones which have been updated more recently than the local copy
+static int
+shardcache_replica_tree_fetch(shardcache_replica_t *replica,
+                              char *peer,
+                              linked_list_t *keys,
+                              int *fetched)
+{
+    fbuf_t req = FBUF_STATIC_INITIALIZER;
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    tree_msg_add_uint32(&req, SHARDCACHE_REPLICA_TREE_VALUES);
+    tree_msg_add_uint32(&req, SHARDCACHE_REPLICA_TREE_DEPTH);
+    uint32_t num_keys = 0;
+    tree_msg_add_uint32(&req, num_keys);
+    shardcache_storage_index_item_t *item;
+    while (num_keys < SHARDCACHE_REPLICA_TREE_KEYS_PER_REQUEST && (item = list_shift_value(keys))) {
+        tree_msg_add_uint32(&req, item->klen);
+        fbuf_add_binary(&req, item->key, item->klen);
+        free(item->key);
+        free(item);
+        num_keys++;
+    }
+    uint32_t nnum_keys = htonl(num_keys);
+    memcpy(fbuf_data(&req) + 2 * sizeof(uint32_t), &nnum_keys, sizeof(nnum_keys));
+
+    int rc = shardcache_replica_tree_request(replica, peer, &req, &out);
+    if (rc == 0) {
+        char *p = fbuf_data(&out);
+        size_t left = fbuf_used(&out);
+        uint32_t num_items;
+        rc = tree_msg_read_uint32(&p, &left, &num_items);
+        int i;
+        for (i = 0; rc == 0 && i < num_items; i++) {
+            uint32_t klen, vlen;
+            void *key = NULL;
+            void *value = NULL;
+            uint64_t ballot, seq;
+            if (tree_msg_read_uint32(&p, &left, &klen) != 0 ||
+                tree_msg_read_pointer(&p, &left, &key, klen) != 0 ||
+                tree_msg_read_uint64(&p, &left, &ballot) != 0 ||
+                tree_msg_read_uint64(&p, &left, &seq) != 0 ||
+                tree_msg_read_uint32(&p, &left, &vlen) != 0 ||
+                tree_msg_read_pointer(&p, &left, &value, vlen) != 0 || !key)
+            {
+                rc = -1;
+                break;
+            }
+
+            uint64_t last_ballot = 0;
+            uint64_t last_seq = kepaxos_seq_ballot(replica->kepaxos, key, klen, &last_ballot);
+            if (seq == last_seq && ballot == last_ballot)
+                continue; // same version, the peer is not more authoritative than us
+
+            if (kepaxos_recovered(replica->kepaxos, key, klen, ballot, seq) != 0)
+                continue; // we have a more recent version
+
+            if (value)
+                shardcache_set_internal(replica->shc, key, klen, value, vlen, 0, 0, 1, NULL, NULL);
+            else
+                shardcache_del_internal(replica->shc, key, klen, 1, NULL, NULL);
+            (*fetched)++;
+        }
+    }
+    fbuf_destroy(&req);
+    fbuf_destroy(&out);
+    return rc;
+}
+
+static int
+shardcache_replica_tree_collect_missing(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    linked_list_t *keys = (linked_list_t *)user;
+    shardcache_storage_index_item_t *item = malloc(sizeof(shardcache_storage_index_item_t));
+    item->key = malloc(klen);
+    memcpy(item->key, key, klen);
+    item->klen = klen;
+    item->vlen = 0;
+    list_push_value(keys, item);
+    return 1;
+}
+
+static void
+shardcache_replica_index_item_destroy(shardcache_storage_index_item_t *item)
+{
+    free(item->key);
+    free(item);
+}
+
+// brings the local storage in sync with the one of a peer which is ahead of us
+static int
+shardcache_replica_tree_sync(shardcache_replica_t *replica, char *peer, uint64_t peer_ballot)
+{
+    shardcache_replica_tree_snapshot_t *snapshot = shardcache_replica_tree_snapshot_build(replica);
+    if (!snapshot) {
+        SHC_ERROR("Can't build the hash tree to sync with %s", peer);
+        return -1;
+    }
+    merkle_tree_t *tree = snapshot->tree;
+
+    SHC_NOTICE("Comparing the storage with the replica %s", peer);
+
+    int depth = merkle_tree_depth(tree);
+    uint32_t num_leaves = merkle_tree_num_nodes(tree, depth);
+    uint32_t *nodes = malloc(sizeof(uint32_t) * num_leaves);
+    nodes[0] = 0;
+    int num_nodes = 1;
+    int level;
+
+    // descend into the subtrees which differ
+    for (level = 0; level <= depth && num_nodes > 0; level++) {
+        num_nodes = shardcache_replica_tree_compare(replica, peer, tree, level, nodes, num_nodes);
+        if (num_nodes < 0)
+            break;
+        if (level < depth) {
+            int i, n;
+            for (i = num_nodes - 1; i >= 0; i--) {
+                uint32_t parent = nodes[i];
+                for (n = MERKLE_TREE_FANOUT - 1; n >= 0; n--)
+                    nodes[i * MERKLE_TREE_FANOUT + n] = parent * MERKLE_TREE_FANOUT + n;
+            }
+            num_nodes *= MERKLE_TREE_FANOUT;
+        }
+    }
+
+    if (num_nodes < 0) {
+        SHC_ERROR("Can't compare the hash tree with the replica %s", peer);
+        free(nodes);
+        shardcache_replica_tree_snapshot_destroy(snapshot);
+        return -1;
+    }
+
+    int rc = 0;
+    int fetched = 0;
+    linked_list_t *keys = list_create();
+    list_set_free_value_callback(keys, (free_value_callback_t)shardcache_replica_index_item_destroy);
+
+    if (num_nodes > 0) {
+        // collect the local digests for the differing leaves
+        hashtable_t *local = ht_create(1024, 0, free);
+        int i;
+        for (i = 0; i < num_nodes; i++) {
+            fbuf_t *leaf = &snapshot->leaves[nodes[i]];
+            char *p = fbuf_data(leaf);
+            size_t left = fbuf_used(leaf);
+            int n;
+            for (n = 0; n < snapshot->counts[nodes[i]]; n++) {
+                uint32_t klen;
+                void *key = NULL;
+                uint64_t *digest = malloc(sizeof(uint64_t));
+                tree_msg_read_uint32(&p, &left, &klen);
+                tree_msg_read_pointer(&p, &left, &key, klen);
+                tree_msg_read_uint64(&p, &left, digest);
+                ht_set(local, key, klen, digest, sizeof(uint64_t));
+            }
+        }
+
+        for (i = 0; rc == 0 && i < num_nodes; i += SHARDCACHE_REPLICA_TREE_LEAVES_PER_REQUEST) {
+            uint32_t num = num_nodes - i;
+            if (num > SHARDCACHE_REPLICA_TREE_LEAVES_PER_REQUEST)
+                num = SHARDCACHE_REPLICA_TREE_LEAVES_PER_REQUEST;
+            rc = shardcache_replica_tree_diff_leaves(replica, peer, &nodes[i], num, local, keys);
+        }
+
+        // the keys left in the local table are the ones the peer doesn't have
+        // (they might have been deleted while we were not reachable)
+        if (rc == 0)
+            ht_foreach_pair(local, shardcache_replica_tree_collect_missing, keys);
+        ht_destroy(local);
+
+        SHC_NOTICE("%d leaves and %d keys differ from the replica %s",
+                   num_nodes, list_count(keys), peer);
+
+        while (rc == 0 && list_count(keys) && !ATOMIC_READ(replica->quit))
+            rc = shardcache_replica_tree_fetch(replica, peer, keys, &fetched);
+    }
+
+    if (rc == 0 && !ATOMIC_READ(replica->quit)) {
+        // we are now up to date with the peer
+        kepaxos_update_ballot(replica->kepaxos, peer_ballot);
+        ATOMIC_INCREMENT(replica->counters.tree_syncs);
+        ATOMIC_INCREASE(replica->counters.tree_keys, fetched);
+        SHC_NOTICE("Recovered %d keys from the replica %s", fetched, peer);
+    } else {
+        SHC_ERROR("Can't sync with the replica %s", peer);
+        rc = -1;
+    }
+
+    if (rc != 0) {
+        // ask for the whole diff next time
+        int index = shardcache_replica_peer_index(replica, peer);
+        if (index >= 0)
+            ATOMIC_SET(replica->tree_fallback[index], 1);
+    }
+
+    list_destroy(keys);
+    free(nodes);
+    shardcache_replica_tree_snapshot_destroy(snapshot);
+    return rc;
+}
+
 shardcache_hdr_t
 shardcache_replica_received_command(shardcache_replica_t *replica,
                                     shardcache_hdr_t hdr,
@@ -794,6 +1944,24 @@ shardcache_replica_received_command(shardcache_replica_t *replica,
             if (rc == 0 && response_len)
                 ret = SHC_HDR_REPLICA_RESPONSE;
             break;
+        case SHC_HDR_REPLICA_BATCH:
+            rc = shardcache_replica_received_batch(replica,
+                                                   cmd,
+                                                   cmdlen,
+                                                   response,
+                                                   response_len);
+            if (rc == 0)
+                ret = SHC_HDR_REPLICA_BATCH_RESPONSE;
+            break;
+        case SHC_HDR_REPLICA_TREE:
+            rc = shardcache_replica_received_tree(replica,
+                                                  cmd,
+                                                  cmdlen,
+                                                  response,
+                                                  response_len);
+            if (rc == 0)
+                ret = SHC_HDR_REPLICA_TREE_RESPONSE;
+            break;
         case SHC_HDR_REPLICA_PING:
             rc = shardcache_replica_received_ping(replica,
                                                   cmd,
@@ -809,6 +1977,47 @@ shardcache_replica_received_command(shardcache_replica_t *replica,
     return ret;
 }
 
+void
+shardcache_replica_set_durability(shardcache_replica_t *replica, int mode)
+{
+    kepaxos_log_durability_t durability = KEPAXOS_LOG_DURABILITY_NONE;
+    switch(mode) {
+        case SHARDCACHE_REPLICA_DURABILITY_BATCHED:
+            durability = KEPAXOS_LOG_DURABILITY_BATCHED;
+            break;
+        case SHARDCACHE_REPLICA_DURABILITY_SYNC:
+            durability = KEPAXOS_LOG_DURABILITY_SYNC;
+            break;
+        default:
+            break;
+    }
+    kepaxos_set_durability(replica->kepaxos, durability, 0);
+}
+
+void
+shardcache_replica_set_batch_window(shardcache_replica_t *replica, int usecs)
+{
+    ATOMIC_SET(replica->batch_window, usecs > 0 ? usecs : 0);
+    if (usecs <= 0) {
+        // don't leave anything behind
+        shardcache_replica_flush_batches(replica, 1);
+    } else {
+        // the async-io thread might be waiting with a longer timeout
+        shardcache_replica_wakeup(replica);
+    }
+}
+
+int
+shardcache_replica_set_anti_entropy(shardcache_replica_t *replica, int threshold)
+{
+    if (threshold > 0 && !shardcache_replica_tree_supported(replica)) {
+        SHC_ERROR("The hash trees can't be built without a persistent storage");
+        return -1;
+    }
+    ATOMIC_SET(replica->anti_entropy_threshold, threshold > 0 ? threshold : 0);
+    return 0;
+}
+
 int
 shardcache_replica_dispatch(shardcache_replica_t *replica,
                             shardcache_replica_operation_t op,
@@ -25,6 +25,32 @@ shardcache_replica_t *shardcache_replica_create(shardcache_t *shc,
 
 void shardcache_replica_destroy(shardcache_replica_t *replica);
 
+/*
+ * @brief Set the durability mode of the replica log
+ * @param replica A valid pointer to a shardcache_replica_t structure
+ * @param mode    One of the SHARDCACHE_REPLICA_DURABILITY_* values
+ */
+void shardcache_replica_set_durability(shardcache_replica_t *replica, int mode);
+
+/*
+ * @brief Set how long a message to a replica can be queued waiting
+ *        for more messages to be sent together in a single frame
+ * @param replica A valid pointer to a shardcache_replica_t structure
+ * @param usecs   The window in microseconds (0 disables batching)
+ */
+void shardcache_replica_set_batch_window(shardcache_replica_t *replica, int usecs);
+
+/*
+ * @brief Set the size of the diff above which the storage is compared
+ *        with the one of the peer using hash trees instead of recovering
+ *        the keys in the diff one by one
+ * @param replica   A valid pointer to a shardcache_replica_t structure
+ * @param threshold The max number of items in the diff (0 disables the hash trees)
+ * @return 0 on success, -1 if the hash trees can't be built
+ *         (the storage doesn't support scanning its index)
+ */
+int shardcache_replica_set_anti_entropy(shardcache_replica_t *replica, int threshold);
+
 int shardcache_replica_dispatch(shardcache_replica_t *replica,
                                 shardcache_replica_operation_t op,
                                 void *key,
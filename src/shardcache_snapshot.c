@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <linklist.h>
+
+#include "shardcache.h"
+#include "shardcache_internal.h"
+#include "arc_ops.h"
+#include "messaging.h"
+
+/*
+ * Snapshot file format (all integers in network byte order):
+ *
+ *   <magic:8><dump_time:4>
+ *   <type:1><klen:4><vlen:4><time:4><key><value>   (repeated)
+ *   'E'<num_records:4>
+ *
+ * type is 'V' for volatile keys (time is the absolute expiration time,
+ * 0 if the key never expires) and 'C' for the objects in the ARC cache
+ * (time is when the object has been loaded into the cache).
+ * The trailer allows to tell a complete snapshot from a truncated one.
+ */
+
+#define SHARDCACHE_SNAPSHOT_MAGIC "SHCSNAP1"
+#define SHARDCACHE_SNAPSHOT_HDR_SIZE 13
+
+#define SHARDCACHE_SNAPSHOT_LOADERS 4
+#define SHARDCACHE_SNAPSHOT_BATCH_SIZE (1<<20)
+#define SHARDCACHE_SNAPSHOT_MAX_BATCHES 16
+// keys and values bigger than this can't have been received
+// through the protocol, so the snapshot must be corrupted
+#define SHARDCACHE_SNAPSHOT_MAX_DATA_SIZE SHARDCACHE_MSG_MAX_RECORD_LEN
+
+typedef struct {
+    shardcache_t *cache;
+    FILE *out;
+    time_t now;
+    int num_records;
+    int error;
+} shardcache_snapshot_writer_t;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t used;
+} shardcache_snapshot_batch_t;
+
+typedef struct {
+    shardcache_t *cache;
+    time_t now;
+    linked_list_t *batches;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int loaded;
+} shardcache_snapshot_loader_t;
+
+static int
+shardcache_snapshot_write_record(shardcache_snapshot_writer_t *writer,
+                                 char type,
+                                 void *key,
+                                 size_t klen,
+                                 void *value,
+                                 size_t vlen,
+                                 uint32_t time)
+{
+    uint32_t hdr[3] = { htonl(klen), htonl(vlen), htonl(time) };
+    if (fputc(type, writer->out) == EOF ||
+        fwrite(hdr, sizeof(hdr), 1, writer->out) != 1 ||
+        fwrite(key, 1, klen, writer->out) != klen ||
+        (vlen && fwrite(value, 1, vlen, writer->out) != vlen))
+    {
+        writer->error = 1;
+        return -1;
+    }
+    writer->num_records++;
+    return 0;
+}
+
+static int
+shardcache_snapshot_save_volatile(void *key,
+                                  size_t klen,
+                                  void *value,
+                                  size_t vlen,
+                                  uint32_t *expire,
+                                  void *priv)
+{
+    shardcache_snapshot_writer_t *writer = (shardcache_snapshot_writer_t *)priv;
+
+    // no point in saving keys which would be expired by the time they are loaded
+    if (*expire && *expire <= writer->now)
+        return 1;
+
+    return shardcache_snapshot_write_record(writer, 'V', key, klen, value, vlen, *expire) == 0 ? 1 : 0;
+}
+
+static void
+shardcache_snapshot_save_cached(const void *key, size_t klen, void *ptr, void *priv)
+{
+    shardcache_snapshot_writer_t *writer = (shardcache_snapshot_writer_t *)priv;
+    cached_object_t *obj = (cached_object_t *)ptr;
+
+    if (writer->error)
+        return;
+
+    MUTEX_LOCK(&obj->lock);
+    // only the objects whose value has been completely retrieved are worth saving
+    if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+        !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) &&
+        !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) &&
+        !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) &&
+        obj->data && obj->dlen)
+    {
+        shardcache_snapshot_write_record(writer, 'C', obj->key, obj->klen,
+                                         obj->data, obj->dlen, obj->ts.tv_sec);
+    }
+    MUTEX_UNLOCK(&obj->lock);
+}
+
+int
+shardcache_snapshot_save(shardcache_t *cache, char *path)
+{
+    if (!path)
+        path = cache->snapshot_path;
+
+    if (!path)
+        return -1;
+
+    size_t tlen = strlen(path) + 5;
+    char tmp_path[tlen];
+    snprintf(tmp_path, tlen, "%s.tmp", path);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        SHC_ERROR("Can't create the snapshot %s: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    shardcache_snapshot_writer_t writer = {
+        .cache = cache,
+        .out = out,
+        .now = time(NULL),
+        .num_records = 0,
+        .error = 0
+    };
+
+    uint32_t dump_time = htonl(writer.now);
+    if (fwrite(SHARDCACHE_SNAPSHOT_MAGIC, 1, 8, out) != 8 ||
+        fwrite(&dump_time, sizeof(dump_time), 1, out) != 1)
+    {
+        writer.error = 1;
+    }
+
+    // volatile keys first, so that when loading the snapshot the
+    // volatile storage is populated before the cache
+    if (!writer.error)
+        volatile_storage_foreach(cache->volatile_storage, shardcache_snapshot_save_volatile, &writer);
+
+    // the cached objects are visited from the least to the most recently used
+    // ones so that, if the snapshot doesn't fit in the cache anymore, the
+    // objects evicted while loading are the coldest ones
+    if (!writer.error)
+        arc_foreach(cache->arc, shardcache_snapshot_save_cached, &writer);
+
+    if (!writer.error) {
+        uint32_t num_records = htonl(writer.num_records);
+        if (fputc('E', out) == EOF || fwrite(&num_records, sizeof(num_records), 1, out) != 1)
+            writer.error = 1;
+    }
+
+    int rc = writer.error ? -1 : 0;
+    if (rc == 0 && (fflush(out) != 0 || fsync(fileno(out)) != 0))
+        rc = -1;
+    fclose(out);
+
+    if (rc == 0 && rename(tmp_path, path) != 0)
+        rc = -1;
+
+    if (rc != 0) {
+        SHC_ERROR("Can't save the snapshot %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    SHC_NOTICE("Saved %d items to the snapshot %s", writer.num_records, path);
+    return writer.num_records;
+}
+
+static int
+shardcache_snapshot_load_volatile(shardcache_snapshot_loader_t *loader,
+                                  void *key,
+                                  size_t klen,
+                                  void *value,
+                                  size_t vlen,
+                                  uint32_t expire)
+{
+    shardcache_t *cache = loader->cache;
+
+    if (expire && expire <= loader->now)
+        return 0;
+
+    // the shards might have changed since the snapshot has been saved
+    if (shardcache_test_ownership(cache, key, klen, NULL, NULL) != 1)
+        return 0;
+
+    // don't overwrite keys which have been set in the meanwhile
+    if (volatile_storage_set(cache->volatile_storage, key, klen,
+                             value, vlen, expire, 1, NULL) != VOLATILE_STORAGE_STORED)
+    {
+        return 0;
+    }
+
+    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
+
+    if (expire)
+        shardcache_schedule_expiration(cache, key, klen, expire - loader->now, 1);
+
+    return 1;
+}
+
+static int
+shardcache_snapshot_load_cached(shardcache_snapshot_loader_t *loader,
+                                void *key,
+                                size_t klen,
+                                void *value,
+                                size_t vlen,
+                                uint32_t ts)
+{
+    shardcache_t *cache = loader->cache;
+    int expire_time = cache->expire_time;
+
+    if (expire_time > 0 && ts + expire_time <= loader->now)
+        return 0;
+
+    // the copies of the keys owned by other nodes might have been updated
+    // while this node was down (and it missed the evictions), so they are
+    // restored only if they are going to expire anyway
+    if (expire_time <= 0 && shardcache_test_ownership(cache, key, klen, NULL, NULL) != 1)
+        return 0;
+
+    arc_resource_t res = arc_preload(cache->arc, key, klen, value, vlen);
+    if (!res)
+        return 0;
+
+    cached_object_t *obj = (cached_object_t *)arc_get_resource_ptr(res);
+    MUTEX_LOCK(&obj->lock);
+    // keep the original timestamp so that the object expires when it
+    // would have expired if the node had not been restarted
+    obj->ts.tv_sec = ts;
+    obj->ts.tv_usec = 0;
+    if (expire_time > 0 && !cache->lazy_expiration)
+        shardcache_schedule_expiration(cache, obj->key, obj->klen, ts + expire_time - loader->now, 0);
+    MUTEX_UNLOCK(&obj->lock);
+
+    arc_release_resource(cache->arc, res);
+    return 1;
+}
+
+static void
+shardcache_snapshot_load_batch(shardcache_snapshot_loader_t *loader, shardcache_snapshot_batch_t *batch)
+{
+    size_t offset = 0;
+    int loaded = 0;
+    while (offset + SHARDCACHE_SNAPSHOT_HDR_SIZE <= batch->used) {
+        char type = batch->data[offset];
+        uint32_t hdr[3];
+        memcpy(hdr, batch->data + offset + 1, sizeof(hdr));
+        size_t klen = ntohl(hdr[0]);
+        size_t vlen = ntohl(hdr[1]);
+        uint32_t time = ntohl(hdr[2]);
+        void *key = batch->data + offset + SHARDCACHE_SNAPSHOT_HDR_SIZE;
+        void *value = key + klen;
+
+        if (type == 'V')
+            loaded += shardcache_snapshot_load_volatile(loader, key, klen, value, vlen, time);
+        else
+            loaded += shardcache_snapshot_load_cached(loader, key, klen, value, vlen, time);
+
+        offset += SHARDCACHE_SNAPSHOT_HDR_SIZE + klen + vlen;
+    }
+    ATOMIC_INCREASE(loader->loaded, loaded);
+}
+
+static void *
+shardcache_snapshot_loader(void *priv)
+{
+    shardcache_snapshot_loader_t *loader = (shardcache_snapshot_loader_t *)priv;
+
+    for (;;) {
+        pthread_mutex_lock(&loader->lock);
+        while (!list_count(loader->batches) && !loader->done)
+            pthread_cond_wait(&loader->cond, &loader->lock);
+        shardcache_snapshot_batch_t *batch = list_shift_value(loader->batches);
+        // wake up the reader if it was waiting for some room in the queue
+        pthread_cond_broadcast(&loader->cond);
+        pthread_mutex_unlock(&loader->lock);
+
+        if (!batch)
+            break;
+
+        shardcache_snapshot_load_batch(loader, batch);
+        free(batch->data);
+        free(batch);
+    }
+
+    return NULL;
+}
+
+static void
+shardcache_snapshot_queue_batch(shardcache_snapshot_loader_t *loader,
+                                shardcache_snapshot_batch_t *batch,
+                                int num_loaders)
+{
+    if (!num_loaders) {
+        // no loader thread could be started, apply the batch right away
+        shardcache_snapshot_load_batch(loader, batch);
+        free(batch->data);
+        free(batch);
+        return;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    while (list_count(loader->batches) >= SHARDCACHE_SNAPSHOT_MAX_BATCHES)
+        pthread_cond_wait(&loader->cond, &loader->lock);
+    list_push_value(loader->batches, batch);
+    pthread_cond_broadcast(&loader->cond);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+static shardcache_snapshot_batch_t *
+shardcache_snapshot_batch_create()
+{
+    shardcache_snapshot_batch_t *batch = calloc(1, sizeof(shardcache_snapshot_batch_t));
+    batch->size = SHARDCACHE_SNAPSHOT_BATCH_SIZE;
+    batch->data = malloc(batch->size);
+    return batch;
+}
+
+static int
+shardcache_snapshot_load(shardcache_t *cache, char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        if (errno == ENOENT)
+            return 0;
+        SHC_ERROR("Can't open the snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fileno(in), &st) != 0) {
+        SHC_ERROR("Can't stat the snapshot %s: %s", path, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+
+    char magic[8];
+    uint32_t dump_time = 0;
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, SHARDCACHE_SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+        fread(&dump_time, sizeof(dump_time), 1, in) != 1)
+    {
+        SHC_ERROR("%s is not a valid snapshot", path);
+        fclose(in);
+        return -1;
+    }
+
+    shardcache_snapshot_loader_t loader = {
+        .cache = cache,
+        .now = time(NULL),
+        .batches = list_create(),
+        .done = 0,
+        .loaded = 0
+    };
+    pthread_mutex_init(&loader.lock, NULL);
+    pthread_cond_init(&loader.cond, NULL);
+
+    pthread_t loaders[SHARDCACHE_SNAPSHOT_LOADERS];
+    int num_loaders = 0;
+    int i;
+    for (i = 0; i < SHARDCACHE_SNAPSHOT_LOADERS; i++) {
+        if (pthread_create(&loaders[num_loaders], NULL, shardcache_snapshot_loader, &loader) == 0)
+            num_loaders++;
+    }
+
+    // the file is read sequentially by this thread while the records
+    // are applied by the loaders, a batch at a time
+    shardcache_snapshot_batch_t *batch = shardcache_snapshot_batch_create();
+    int num_records = 0;
+    int complete = 0;
+    int corrupted = 0;
+    size_t left = st.st_size - sizeof(magic) - sizeof(dump_time);
+    for (;;) {
+        int type = fgetc(in);
+        if (type == EOF)
+            break;
+
+        if (type == 'E') {
+            uint32_t expected = 0;
+            if (fread(&expected, sizeof(expected), 1, in) == 1 && ntohl(expected) == num_records)
+                complete = 1;
+            break;
+        }
+
+        uint32_t hdr[3];
+        if ((type != 'V' && type != 'C') || fread(hdr, sizeof(hdr), 1, in) != 1) {
+            corrupted = 1;
+            break;
+        }
+
+        size_t klen = ntohl(hdr[0]);
+        size_t vlen = ntohl(hdr[1]);
+        if (!klen || klen > SHARDCACHE_SNAPSHOT_MAX_DATA_SIZE || vlen > SHARDCACHE_SNAPSHOT_MAX_DATA_SIZE) {
+            corrupted = 1;
+            break;
+        }
+
+        size_t rlen = SHARDCACHE_SNAPSHOT_HDR_SIZE + klen + vlen;
+        if (rlen > left) // truncated
+            break;
+        left -= rlen;
+
+        if (batch->used && batch->used + rlen > batch->size) {
+            shardcache_snapshot_queue_batch(&loader, batch, num_loaders);
+            batch = shardcache_snapshot_batch_create();
+        }
+
+        if (rlen > batch->size) {
+            char *data = realloc(batch->data, rlen);
+            if (!data) {
+                corrupted = 1;
+                break;
+            }
+            batch->data = data;
+            batch->size = rlen;
+        }
+
+        char *record = batch->data + batch->used;
+        record[0] = type;
+        memcpy(record + 1, hdr, sizeof(hdr));
+        size_t dlen = rlen - SHARDCACHE_SNAPSHOT_HDR_SIZE;
+        if (dlen && fread(record + SHARDCACHE_SNAPSHOT_HDR_SIZE, 1, dlen, in) != dlen)
+            break;
+
+        batch->used += rlen;
+        num_records++;
+    }
+
+    if (batch->used) {
+        shardcache_snapshot_queue_batch(&loader, batch, num_loaders);
+    } else {
+        free(batch->data);
+        free(batch);
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    loader.done = 1;
+    pthread_cond_broadcast(&loader.cond);
+    pthread_mutex_unlock(&loader.lock);
+
+    for (i = 0; i < num_loaders; i++)
+        pthread_join(loaders[i], NULL);
+
+    list_destroy(loader.batches);
+    pthread_mutex_destroy(&loader.lock);
+    pthread_cond_destroy(&loader.cond);
+    fclose(in);
+
+    if (corrupted)
+        SHC_WARNING("The snapshot %s is corrupted, only the first %d records have been read", path, num_records);
+    else if (!complete)
+        SHC_WARNING("The snapshot %s is truncated, only the first %d records have been read", path, num_records);
+
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+    shardcache_evict_volatile(cache);
+
+    SHC_NOTICE("Loaded %d items (out of %d records) from the snapshot %s (saved %d seconds ago)",
+               loader.loaded, num_records, path, (int)(loader.now - ntohl(dump_time)));
+
+    return loader.loaded;
+}
+
+int
+shardcache_snapshot(shardcache_t *cache, char *path)
+{
+    free(cache->snapshot_path);
+    cache->snapshot_path = path ? strdup(path) : NULL;
+
+    if (!path)
+        return 0;
+
+    return shardcache_snapshot_load(cache, path);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
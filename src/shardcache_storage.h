@@ -180,6 +180,55 @@ typedef size_t (*shardcache_count_items_callback_t)(void *priv);
 typedef size_t (*shardcache_get_index_callback_t)
     (shardcache_storage_index_item_t *index, size_t isize, void *priv);
 
+/**
+ * @brief Callback to start iterating over the stored keys.
+ *
+ *        The shardcache instance will call this callback when it needs
+ *        to walk the index without holding all the keys in memory at once
+ *        (for instance during a migration or when serving a GET_INDEX request)
+ *
+ * @param priv  The priv pointer owned by the storage
+ *
+ * @return An opaque cursor which will be passed to the index_next()
+ *         and index_close() callbacks, NULL in case of errors
+ * @note Multiple cursors might be open at the same time (by different threads)
+ * @note A key added or removed while a cursor is open might or might not
+ *       be returned by the cursor
+ * @note A key present for the whole life of the cursor must be returned
+ *       exactly once, even if other keys (including the ones already returned)
+ *       are removed while the cursor is open: a migration removes each key
+ *       from the storage as soon as its new owner has it, without closing
+ *       the cursor. A cursor which is just a position in a list the removed
+ *       keys are taken out of would skip keys
+ * @see shardcache_index_next_callback_t
+ * @see shardcache_index_close_callback_t
+ */
+typedef void *(*shardcache_index_open_callback_t)(void *priv);
+
+/**
+ * @brief Callback to fetch the next batch of keys from an open cursor
+ *
+ * @param cursor The cursor returned by the index_open() callback
+ * @param index  An array of shardcache_storage_index_item_t structures
+ *               to hold the next batch of keys
+ * @param isize  The number of slots in the provided index array
+ * @param priv   The priv pointer owned by the storage
+ *
+ * @return The number of items stored in the index array, 0 if the cursor
+ *         has been exhausted (or in case of errors)
+ * @note The caller will release the memory used by the returned keys
+ */
+typedef size_t (*shardcache_index_next_callback_t)
+    (void *cursor, shardcache_storage_index_item_t *index, size_t isize, void *priv);
+
+/**
+ * @brief Callback to release a cursor previously returned by the index_open() callback
+ *
+ * @param cursor The cursor to release
+ * @param priv   The priv pointer owned by the storage
+ */
+typedef void (*shardcache_index_close_callback_t)(void *cursor, void *priv);
+
 /**
  * @brief Callback used to notify the underlying storage about the creation of a new worker thread
  *
@@ -205,7 +254,7 @@ typedef void (*shardcache_thread_start_callback_t)(void *priv);
 typedef void (*shardcache_thread_exit_callback_t)(void *priv);
 
 
-#define SHARDCACHE_STORAGE_API_VERSION 0x01
+#define SHARDCACHE_STORAGE_API_VERSION 0x02
 
 typedef struct __shardcache_storage_s shardcache_storage_t;
 typedef int (*shardcache_storage_init_t)(shardcache_storage_t *, char **);
@@ -250,6 +299,32 @@ struct __shardcache_storage_s {
      */
     shardcache_count_items_callback_t      count;
 
+    /**
+     * @brief Optional callbacks allowing to iterate over the index in batches
+     * @note If set, these callbacks will be preferred to the index callback
+     *       when walking the whole index (migrations and GET_INDEX requests)
+     *       so that the memory used is bounded by the size of the batches.
+     *       If the count callback is also set it will be used only to estimate
+     *       the number of items which are going to be returned
+     * @note index_open, index_next and index_close must be either all set or none
+     */
+    shardcache_index_open_callback_t       index_open;
+    //! @see index_open
+    shardcache_index_next_callback_t       index_next;
+    //! @see index_open
+    shardcache_index_close_callback_t      index_close;
+
+    /**
+     * @brief If set to a non zero value, shardcache will assume that the index
+     *        (either walked through a cursor or returned by the index callback)
+     *        always lists the keys in the same order, the keys added or removed
+     *        in the meanwhile aside
+     * @note An interrupted migration can skip the keys it already processed
+     *       when resumed only if the order is stable, otherwise it rescans
+     *       the whole index (the keys already migrated are gone anyway,
+     *       so only the keys still owned are looked at again)
+     */
+    int                                    index_stable;
     
     /**
      * @brief Optional callback which, if set, will be called everytime a new worker
@@ -352,13 +427,124 @@ typedef struct {
  *                 memory holding the array of counters
  * @note           The counters array needs to be released using
  *                 free() once not necessary anymore.
+ * @note           The traffic and health statistics of each peer are included
+ *                 as counters named peer_<label>_<stat> (requests, bytes_out,
+ *                 bytes_in, errors, timeouts, connects, connect_time,
+ *                 connections_in_use, fetches_in_flight, connections_idle
+ *                 and connections_pooled)
  * @return The number of counters contained in the counters array
  */
 int shardcache_get_counters(shardcache_t *cache,
                             shardcache_counter_t **counters);
 
 /**
- * @brief Resets all the counters to 0
+ * @brief Structure holding the summary of a latency histogram
+ *        (all the values are in microseconds)
+ * @note  Commands are measured from when the request has been read to when
+ *        the response has been completely handed to the socket, the other
+ *        histograms measure the calls to the storage module (storage_fetch,
+ *        storage_store), the fetches from the peers (peer_fetch) and the time
+ *        spent on each key while migrating (migration_key)
+ * @note  Percentiles are accurate within 6.25%
+ */
+typedef struct {
+    char name[256];
+    uint64_t count;
+    uint64_t min;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} shardcache_latency_t;
+
+/**
+ * @brief Returns the latency histograms collected so far
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param latencies A reference to a pointer which will be set to the initialized
+ *                  memory holding the array of latencies
+ * @note            The latencies array needs to be released using
+ *                  free() once not necessary anymore.
+ * @return The number of histograms contained in the latencies array
+ */
+int shardcache_get_latencies(shardcache_t *cache,
+                             shardcache_latency_t **latencies);
+
+#define SHARDCACHE_HOTKEY_MAXLEN 256
+
+/**
+ * @brief Structure representing one of the hottest keys served by a node
+ * @note  The values are estimated by sampling the requests
+ *        (see shardcache_hotkeys_sample_rate())
+ */
+typedef struct {
+    char key[SHARDCACHE_HOTKEY_MAXLEN]; //!< The key (truncated if longer)
+    size_t klen;       //!< The actual length of the key
+    uint64_t requests; //!< The requests for the key (get and set)
+    uint64_t bytes;    //!< The bytes read or written for the key
+    uint64_t error;    //!< Max overestimation of the value the key is ranked by
+    uint64_t rate;     //!< The value the key is ranked by, per second
+} shardcache_hotkey_t;
+
+/**
+ * @brief Returns the hottest keys served by the node
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param by_bytes If true the keys are ranked by the bytes read or written,
+ *                 otherwise by the number of requests
+ * @param hotkeys  A reference to a pointer which will be set to the initialized
+ *                 memory holding the array of keys (hottest first)
+ * @note           The hotkeys array needs to be released using
+ *                 free() once not necessary anymore.
+ * @note           The ranking follows the recent traffic: the older requests
+ *                 weigh half every minute
+ * @return The number of keys contained in the hotkeys array
+ */
+int shardcache_get_hotkeys(shardcache_t *cache,
+                           int by_bytes,
+                           shardcache_hotkey_t **hotkeys);
+
+/**
+ * @brief Returns the slowest of the recent traced requests
+ *        (see shardcache_tracing_sample_rate())
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param min_usecs Only the requests which took at least min_usecs
+ *                  microseconds are returned
+ * @param out       A reference to a pointer which will be set to the
+ *                  (null-terminated) text describing the traces: a line
+ *                  "trace;<trace_id>;<usecs>;<key>" for each request, followed
+ *                  by a line "span;<stage>;<offset_usecs>;<usecs>[;<info>]"
+ *                  for each stage of the request
+ * @param len       If not NULL, the length of the text is stored in *len
+ * @note            The text needs to be released using free()
+ *                  once not necessary anymore.
+ * @note            The trace ids are shared by all the nodes involved in
+ *                  serving a request, so the traces returned by different
+ *                  nodes can be matched
+ * @return The number of traces returned
+ */
+int shardcache_get_traces(shardcache_t *cache,
+                          uint64_t min_usecs,
+                          char **out,
+                          size_t *len);
+
+/**
+ * @brief Renders all the statistics of the node (the counters, including the
+ *        per-worker and per-peer ones, and the latency histograms)
+ *        in the OpenMetrics (Prometheus) text format
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param out   A reference to a pointer which will be set to the
+ *              (null-terminated) rendered text
+ * @param len   If not NULL, the length of the text is stored in *len
+ * @note        The text needs to be released using free()
+ *              once not necessary anymore.
+ * @return 0 on success, -1 otherwise
+ */
+int shardcache_get_metrics(shardcache_t *cache, char **out, size_t *len);
+
+/**
+ * @brief Resets all the counters to 0, empties the latency histograms
+ *        and forgets the hot keys tracked so far
  * @param cache A valid pointer to a shardcache_t structure
  */
 void shardcache_clear_counters(shardcache_t *cache);
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <atomic_defs.h>
+
+#include "shardcache.h"
+#include "counters.h"
+#include "histogram.h"
+#include "tracing.h"
+
+typedef struct {
+    uint64_t seq;      // the position in the ring + 1 (0 while being written)
+    uint64_t trace_id;
+    uint64_t start;    // usecs (monotonic clock)
+    uint32_t duration; // usecs
+    uint8_t span;
+    uint8_t ilen;
+    uint8_t truncated;
+    char info[SHARDCACHE_TRACE_INFO_MAXLEN];
+} shardcache_trace_span_t;
+
+typedef struct {
+    uint64_t head; // the position of the next span to write
+    shardcache_trace_span_t spans[SHARDCACHE_TRACE_RING_SIZE];
+} __attribute__((aligned(SHARDCACHE_COUNTERS_CACHE_LINE_SIZE))) shardcache_trace_ring_t;
+
+struct __shardcache_tracer_s {
+    int sample_rate;
+    // one ring per thread slot, allocated the first time
+    // a thread records a span
+    shardcache_trace_ring_t *rings[SHARDCACHE_COUNTERS_SLOTS];
+};
+
+static __thread uint64_t shardcache_trace_current_id = 0;
+static __thread uint64_t shardcache_tracer_seed = 0;
+
+// xorshift64*, cheap enough to be called for each request
+static inline uint64_t
+shardcache_tracer_random()
+{
+    uint64_t x = shardcache_tracer_seed;
+    if (!x)
+        x = (uint64_t)(uintptr_t)&shardcache_tracer_seed ^ shardcache_histogram_now();
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    shardcache_tracer_seed = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+shardcache_tracer_t *
+shardcache_tracer_create(int sample_rate)
+{
+    shardcache_tracer_t *t = calloc(1, sizeof(shardcache_tracer_t));
+    if (!t)
+        return NULL;
+    t->sample_rate = sample_rate;
+    return t;
+}
+
+void
+shardcache_tracer_destroy(shardcache_tracer_t *t)
+{
+    int i;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++)
+        free(t->rings[i]);
+    free(t);
+}
+
+int
+shardcache_tracer_set_sample_rate(shardcache_tracer_t *t, int new_value)
+{
+    int old_value = ATOMIC_READ(t->sample_rate);
+    if (new_value >= 0)
+        ATOMIC_SET(t->sample_rate, new_value);
+    return old_value;
+}
+
+uint64_t
+shardcache_tracer_sample(shardcache_tracer_t *t)
+{
+    int sample_rate = ATOMIC_READ(t->sample_rate);
+    if (!sample_rate || (sample_rate > 1 && shardcache_tracer_random() % sample_rate != 0))
+        return 0;
+
+    uint64_t trace_id;
+    do {
+        trace_id = shardcache_tracer_random();
+    } while (!trace_id);
+    return trace_id;
+}
+
+static shardcache_trace_ring_t *
+shardcache_tracer_ring(shardcache_tracer_t *t)
+{
+    int index = shardcache_counters_thread_slot();
+    shardcache_trace_ring_t *ring = __sync_fetch_and_add(&t->rings[index], 0);
+    if (ring)
+        return ring;
+
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, SHARDCACHE_COUNTERS_CACHE_LINE_SIZE, sizeof(shardcache_trace_ring_t)) != 0)
+        return NULL;
+    ring = ptr;
+    memset(ring, 0, sizeof(shardcache_trace_ring_t));
+
+    // the slot might be shared with other threads
+    // (if there are more threads than slots)
+    if (!__sync_bool_compare_and_swap(&t->rings[index], NULL, ring)) {
+        free(ring);
+        ring = t->rings[index];
+    }
+    return ring;
+}
+
+void
+shardcache_tracer_span(shardcache_tracer_t *t,
+                       uint64_t trace_id,
+                       int span,
+                       uint64_t start,
+                       uint64_t end,
+                       void *info,
+                       size_t ilen)
+{
+    if (!trace_id)
+        return;
+
+    shardcache_trace_ring_t *ring = shardcache_tracer_ring(t);
+    if (!ring)
+        return;
+
+    // the position is reserved atomically since the slot might be shared,
+    // the sequence number tells the readers if the span is stable
+    uint64_t pos = __sync_fetch_and_add(&ring->head, 1);
+    shardcache_trace_span_t *s = &ring->spans[pos & (SHARDCACHE_TRACE_RING_SIZE - 1)];
+    ATOMIC_SET(s->seq, 0);
+    __sync_synchronize();
+
+    s->trace_id = trace_id;
+    s->start = start;
+    uint64_t duration = end > start ? end - start : 0;
+    s->duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+    s->span = span;
+    s->ilen = ilen < SHARDCACHE_TRACE_INFO_MAXLEN ? ilen : SHARDCACHE_TRACE_INFO_MAXLEN;
+    s->truncated = (ilen > SHARDCACHE_TRACE_INFO_MAXLEN);
+    if (s->ilen)
+        memcpy(s->info, info, s->ilen);
+
+    __sync_synchronize();
+    ATOMIC_SET(s->seq, pos + 1);
+}
+
+static int
+shardcache_tracer_span_cmp(const void *a, const void *b)
+{
+    const shardcache_trace_span_t *sa = (const shardcache_trace_span_t *)a;
+    const shardcache_trace_span_t *sb = (const shardcache_trace_span_t *)b;
+    if (sa->trace_id != sb->trace_id)
+        return (sa->trace_id < sb->trace_id) ? -1 : 1;
+    if (sa->start != sb->start)
+        return (sa->start < sb->start) ? -1 : 1;
+    // the request span first (it starts together with the parse span)
+    return (int)sa->span - (int)sb->span;
+}
+
+typedef struct {
+    int first;         // the index of the first span of the trace
+    int count;         // the number of spans of the trace
+    int request;       // the index of the request span
+    uint32_t duration; // the duration of the request span
+} shardcache_trace_t;
+
+static int
+shardcache_tracer_trace_cmp(const void *a, const void *b)
+{
+    const shardcache_trace_t *ta = (const shardcache_trace_t *)a;
+    const shardcache_trace_t *tb = (const shardcache_trace_t *)b;
+    return (ta->duration < tb->duration) ? 1 : (ta->duration > tb->duration) ? -1 : 0;
+}
+
+// the info can hold any byte (it's usually the key)
+static void
+shardcache_tracer_escape(fbuf_t *out, shardcache_trace_span_t *s)
+{
+    int i;
+    for (i = 0; i < s->ilen; i++) {
+        unsigned char c = (unsigned char)s->info[i];
+        if (c < 0x20 || c > 0x7e || c == '\\' || c == ';')
+            fbuf_printf(out, "\\x%02x", c);
+        else
+            fbuf_add_binary(out, (char *)&c, 1);
+    }
+    if (s->truncated)
+        fbuf_add(out, "...");
+}
+
+// one line per trace: trace;<trace_id>;<usecs>;<key>
+// followed by one line per span: span;<name>;<offset_usecs>;<usecs>[;<info>]
+int
+shardcache_tracer_dump(shardcache_tracer_t *t, uint64_t min_usecs, fbuf_t *out)
+{
+    static const char *labels[] = SHARDCACHE_TRACE_SPAN_LABELS_ARRAY;
+    int i, n;
+
+    int num_rings = 0;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        if (ATOMIC_READ(t->rings[i]))
+            num_rings++;
+    }
+    if (!num_rings)
+        return 0;
+
+    shardcache_trace_span_t *spans = malloc(num_rings * SHARDCACHE_TRACE_RING_SIZE * sizeof(shardcache_trace_span_t));
+    if (!spans)
+        return 0;
+
+    int num_spans = 0;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS && num_rings; i++) {
+        shardcache_trace_ring_t *ring = ATOMIC_READ(t->rings[i]);
+        if (!ring)
+            continue;
+        num_rings--;
+        for (n = 0; n < SHARDCACHE_TRACE_RING_SIZE; n++) {
+            shardcache_trace_span_t *s = &ring->spans[n];
+            uint64_t seq = ATOMIC_READ(s->seq);
+            if (!seq)
+                continue;
+            __sync_synchronize();
+            memcpy(&spans[num_spans], s, sizeof(shardcache_trace_span_t));
+            __sync_synchronize();
+            // skip the spans overwritten while being copied
+            if (ATOMIC_READ(s->seq) == seq)
+                num_spans++;
+        }
+    }
+
+    qsort(spans, num_spans, sizeof(shardcache_trace_span_t), shardcache_tracer_span_cmp);
+
+    shardcache_trace_t *traces = malloc((num_spans + 1) * sizeof(shardcache_trace_t));
+    if (!traces) {
+        free(spans);
+        return 0;
+    }
+
+    int num_traces = 0;
+    for (i = 0; i < num_spans; i = n) {
+        int request = -1;
+        for (n = i; n < num_spans && spans[n].trace_id == spans[i].trace_id; n++) {
+            if (spans[n].span == SHARDCACHE_TRACE_SPAN_REQUEST &&
+                (request == -1 || spans[n].duration > spans[request].duration))
+            {
+                request = n;
+            }
+        }
+        // the request is still being served
+        // (or its span has been already overwritten)
+        if (request == -1 || spans[request].duration < min_usecs)
+            continue;
+        traces[num_traces].first = i;
+        traces[num_traces].count = n - i;
+        traces[num_traces].request = request;
+        traces[num_traces].duration = spans[request].duration;
+        num_traces++;
+    }
+
+    qsort(traces, num_traces, sizeof(shardcache_trace_t), shardcache_tracer_trace_cmp);
+
+    if (num_traces > SHARDCACHE_TRACE_DUMP_MAX)
+        num_traces = SHARDCACHE_TRACE_DUMP_MAX;
+
+    for (i = 0; i < num_traces; i++) {
+        shardcache_trace_t *trace = &traces[i];
+        shardcache_trace_span_t *request = &spans[trace->request];
+        // the spans are sorted by start time, so the first one starts the trace
+        uint64_t trace_start = spans[trace->first].start;
+
+        fbuf_printf(out, "trace;%016llx;%u;", (unsigned long long)request->trace_id, request->duration);
+        shardcache_tracer_escape(out, request);
+        fbuf_add(out, "\r\n");
+
+        for (n = trace->first; n < trace->first + trace->count; n++) {
+            shardcache_trace_span_t *s = &spans[n];
+            if (n == trace->request || s->span >= SHARDCACHE_TRACE_NUM_SPANS)
+                continue;
+            fbuf_printf(out, "span;%s;%llu;%u", labels[s->span],
+                        (unsigned long long)(s->start - trace_start), s->duration);
+            if (s->ilen) {
+                fbuf_add(out, ";");
+                shardcache_tracer_escape(out, s);
+            }
+            fbuf_add(out, "\r\n");
+        }
+    }
+
+    free(traces);
+    free(spans);
+    return num_traces;
+}
+
+void
+shardcache_trace_set_current(uint64_t trace_id)
+{
+    shardcache_trace_current_id = trace_id;
+}
+
+uint64_t
+shardcache_trace_current()
+{
+    return shardcache_trace_current_id;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
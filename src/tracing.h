@@ -0,0 +1,116 @@
+#ifndef __SHARDCACHE_TRACING_H__
+#define __SHARDCACHE_TRACING_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <fbuf.h>
+
+/* Sampled request tracing.
+ *
+ * One GET out of sample_rate is given a (random) trace id when it's read
+ * from the network, and the trace id is forwarded as an extra record of the
+ * GET_ASYNC/GET_OFFSET request sent to the owner of the key if the value
+ * needs to be fetched from a peer. The peer records its own spans under the
+ * same trace id, so the traces dumped by the two nodes can be correlated.
+ *
+ * Each stage of the request (parse, ARC lookup, peer fetch, storage fetch,
+ * write) is recorded as a span in a ring owned by the thread slot of the
+ * thread which executed it (see shardcache_counters_thread_slot()), so the
+ * spans of a request served by different threads (the worker reading the
+ * request and the thread completing the remote fetch) are merged only when
+ * the traces are dumped. Recording a span is lock-free and doesn't allocate
+ * memory once the ring of the slot exists, older spans are overwritten.
+ *
+ * Stages running in the thread which parsed the request find the trace id
+ * in a thread-local variable (see shardcache_trace_set_current()), so it
+ * doesn't need to be passed through the ARC.
+ */
+
+#define SHARDCACHE_TRACE_SPAN_REQUEST       0
+#define SHARDCACHE_TRACE_SPAN_PARSE         1
+#define SHARDCACHE_TRACE_SPAN_ARC_LOOKUP    2
+#define SHARDCACHE_TRACE_SPAN_PEER_FETCH    3
+#define SHARDCACHE_TRACE_SPAN_STORAGE_FETCH 4
+#define SHARDCACHE_TRACE_SPAN_WRITE         5
+#define SHARDCACHE_TRACE_NUM_SPANS          6
+
+#define SHARDCACHE_TRACE_SPAN_LABELS_ARRAY \
+        { "request", "parse", "arc_lookup", "peer_fetch", "storage_fetch", "write" }
+
+#define SHARDCACHE_TRACE_RING_SIZE 1024  // spans kept for each thread slot (must be a power of 2)
+#define SHARDCACHE_TRACE_INFO_MAXLEN 32  // bytes of the key (or of the peer address) kept in a span
+#define SHARDCACHE_TRACE_DUMP_MAX 32     // traces returned by a dump (the slowest ones)
+
+typedef struct __shardcache_tracer_s shardcache_tracer_t;
+
+/*
+ * @brief Create a new tracer
+ * @param sample_rate Trace one request out of sample_rate (0 disables the sampling)
+ * @return A valid shardcache_tracer_t structure, NULL in case of errors
+ */
+shardcache_tracer_t *shardcache_tracer_create(int sample_rate);
+
+/*
+ * @brief Release all the resources used by a tracer
+ */
+void shardcache_tracer_destroy(shardcache_tracer_t *t);
+
+/*
+ * @brief Get/Set the sample rate
+ * @param new_value The new sample rate (-1 to leave it unchanged)
+ * @return The previous sample rate
+ */
+int shardcache_tracer_set_sample_rate(shardcache_tracer_t *t, int new_value);
+
+/*
+ * @brief Decide if a new request has to be traced
+ * @return A new (non-zero) trace id if the request has been sampled, 0 otherwise
+ */
+uint64_t shardcache_tracer_sample(shardcache_tracer_t *t);
+
+/*
+ * @brief Record a span
+ * @param t        A valid shardcache_tracer_t structure
+ * @param trace_id The trace the span belongs to (nothing is recorded if 0)
+ * @param span     The stage (one of SHARDCACHE_TRACE_SPAN_*)
+ * @param start    When the stage started (see shardcache_histogram_now())
+ * @param end      When the stage ended
+ * @param info     Optional data describing the span (the key or the peer),
+ *                 truncated to SHARDCACHE_TRACE_INFO_MAXLEN bytes
+ * @param ilen     The length of info
+ */
+void shardcache_tracer_span(shardcache_tracer_t *t,
+                            uint64_t trace_id,
+                            int span,
+                            uint64_t start,
+                            uint64_t end,
+                            void *info,
+                            size_t ilen);
+
+/*
+ * @brief Dump the slowest traces still held in the rings
+ * @param t         A valid shardcache_tracer_t structure
+ * @param min_usecs Skip the traces whose request took less than min_usecs
+ * @param out       The buffer the traces are appended to (as text)
+ * @return The number of traces dumped
+ * @note Only the traces whose request span has been recorded (by this node)
+ *       are dumped, at most SHARDCACHE_TRACE_DUMP_MAX of them, slowest first
+ */
+int shardcache_tracer_dump(shardcache_tracer_t *t, uint64_t min_usecs, fbuf_t *out);
+
+/*
+ * @brief Set the trace id of the request being handled by the calling thread
+ * @param trace_id The trace id (0 once done with the request)
+ */
+void shardcache_trace_set_current(uint64_t trace_id);
+
+/*
+ * @brief Get the trace id of the request being handled by the calling thread
+ * @return The trace id, 0 if the request is not traced
+ */
+uint64_t shardcache_trace_current();
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,670 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifndef HAVE_UINT64_T
+#define HAVE_UINT64_T
+#endif
+#include <siphash.h>
+#include <atomic_defs.h>
+
+#include "volatile_storage.h"
+
+#define VOLATILE_STORAGE_INITIAL_SIZE 256          // slots in each partition
+#define VOLATILE_STORAGE_SLAB_PAGE_SIZE (1<<16)    // bytes allocated at once for a size class
+#define VOLATILE_STORAGE_NO_CLASS 0xFF
+
+#define VOLATILE_ENTRY_FLAG_EXTERNAL 0x01 // the value is stored out-of-line
+
+#define VOLATILE_STORAGE_EVICTION_SAMPLES 4 // candidates sampled for each key to evict
+#define VOLATILE_STORAGE_EVICTION_MAX_CANDIDATES 8192
+
+// NOTE: the classes are ~20% apart, so at most ~20% of an entry is wasted
+static size_t volatile_storage_classes[] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024
+};
+
+#define VOLATILE_STORAGE_NUM_CLASSES \
+    (sizeof(volatile_storage_classes) / sizeof(volatile_storage_classes[0]))
+#define VOLATILE_STORAGE_SLAB_MAX \
+    volatile_storage_classes[VOLATILE_STORAGE_NUM_CLASSES - 1]
+
+static unsigned char volatile_storage_seed[16] = "shc_volatile_key";
+
+typedef struct {
+    uint32_t expire;
+    uint32_t klen;
+    uint32_t vlen;
+    uint8_t cls;     // the size class (VOLATILE_STORAGE_NO_CLASS if malloc()'d)
+    uint8_t flags;
+    char data[];     // the key followed by the value (or by the pointer
+                     // to the value if VOLATILE_ENTRY_FLAG_EXTERNAL is set)
+} volatile_entry_t;
+
+// marks a slot whose entry has been removed (the probe sequences
+// going through it must not stop there)
+#define VOLATILE_SLOT_DELETED ((volatile_entry_t *)1)
+#define VOLATILE_SLOT_IS_LIVE(__s) ((__s)->entry && (__s)->entry != VOLATILE_SLOT_DELETED)
+
+typedef struct {
+    uint64_t hash;
+    volatile_entry_t *entry;
+} volatile_slot_t;
+
+typedef struct {
+    void *free_list;  // the free entries (the first bytes point to the next one)
+    void **pages;
+    int num_pages;
+} volatile_slab_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    volatile_slot_t *slots;
+    uint32_t size;    // number of slots (always a power of 2)
+    uint32_t count;   // live entries
+    uint32_t used;    // live entries + deleted slots
+    size_t memory;
+    volatile_slab_t slabs[VOLATILE_STORAGE_NUM_CLASSES];
+} volatile_partition_t;
+
+struct __volatile_storage_s {
+    volatile_partition_t partitions[VOLATILE_STORAGE_PARTITIONS];
+    size_t used; // the memory taken by the live entries
+                 // (to be accessed using the atomic builtins)
+};
+
+static inline void *
+volatile_entry_value(volatile_entry_t *entry)
+{
+    if (entry->flags & VOLATILE_ENTRY_FLAG_EXTERNAL) {
+        void *value;
+        memcpy(&value, entry->data + entry->klen, sizeof(void *));
+        return value;
+    }
+    return entry->data + entry->klen;
+}
+
+// the memory taken by an entry: its slab chunk (or allocation),
+// the out-of-line value (if any) and its slot in the table
+static inline size_t
+volatile_entry_size(volatile_entry_t *entry)
+{
+    size_t size = (entry->cls == VOLATILE_STORAGE_NO_CLASS)
+                ? sizeof(volatile_entry_t) + entry->klen + sizeof(void *)
+                : volatile_storage_classes[entry->cls];
+    if (entry->flags & VOLATILE_ENTRY_FLAG_EXTERNAL)
+        size += entry->vlen;
+    return size + sizeof(volatile_slot_t);
+}
+
+static inline int
+volatile_storage_class(size_t size)
+{
+    int i;
+    for (i = 0; i < VOLATILE_STORAGE_NUM_CLASSES; i++) {
+        if (size <= volatile_storage_classes[i])
+            return i;
+    }
+    return -1;
+}
+
+static void *
+volatile_slab_alloc(volatile_partition_t *p, int cls)
+{
+    volatile_slab_t *slab = &p->slabs[cls];
+    if (!slab->free_list) {
+        char *page = malloc(VOLATILE_STORAGE_SLAB_PAGE_SIZE);
+        if (!page)
+            return NULL;
+        void **pages = realloc(slab->pages, sizeof(void *) * (slab->num_pages + 1));
+        if (!pages) {
+            free(page);
+            return NULL;
+        }
+        slab->pages = pages;
+        slab->pages[slab->num_pages++] = page;
+        p->memory += VOLATILE_STORAGE_SLAB_PAGE_SIZE;
+
+        size_t size = volatile_storage_classes[cls];
+        size_t offset;
+        for (offset = 0; offset + size <= VOLATILE_STORAGE_SLAB_PAGE_SIZE; offset += size) {
+            *((void **)(page + offset)) = slab->free_list;
+            slab->free_list = page + offset;
+        }
+    }
+
+    void *ptr = slab->free_list;
+    slab->free_list = *((void **)ptr);
+    return ptr;
+}
+
+static volatile_entry_t *
+volatile_entry_create(volatile_partition_t *p,
+                      void *key,
+                      size_t klen,
+                      void *value,
+                      size_t vlen,
+                      uint32_t expire)
+{
+    int external = 0;
+    size_t size = sizeof(volatile_entry_t) + klen + vlen;
+    if (size > VOLATILE_STORAGE_SLAB_MAX) {
+        external = 1;
+        size = sizeof(volatile_entry_t) + klen + sizeof(void *);
+    }
+
+    int cls = volatile_storage_class(size);
+    volatile_entry_t *entry = NULL;
+    if (cls >= 0) {
+        entry = volatile_slab_alloc(p, cls);
+    } else {
+        // keys too big to fit in any size class
+        entry = malloc(size);
+        if (entry)
+            p->memory += size;
+    }
+    if (!entry)
+        return NULL;
+
+    entry->expire = expire;
+    entry->klen = klen;
+    entry->vlen = vlen;
+    entry->cls = (cls >= 0) ? cls : VOLATILE_STORAGE_NO_CLASS;
+    entry->flags = 0;
+    memcpy(entry->data, key, klen);
+
+    if (external) {
+        void *copy = malloc(vlen);
+        if (!copy) {
+            if (cls >= 0) {
+                *((void **)entry) = p->slabs[cls].free_list;
+                p->slabs[cls].free_list = entry;
+            } else {
+                p->memory -= size;
+                free(entry);
+            }
+            return NULL;
+        }
+        memcpy(copy, value, vlen);
+        memcpy(entry->data + klen, &copy, sizeof(void *));
+        entry->flags |= VOLATILE_ENTRY_FLAG_EXTERNAL;
+        p->memory += vlen;
+    } else {
+        memcpy(entry->data + klen, value, vlen);
+    }
+
+    return entry;
+}
+
+static void
+volatile_entry_destroy(volatile_partition_t *p, volatile_entry_t *entry)
+{
+    if (entry->flags & VOLATILE_ENTRY_FLAG_EXTERNAL) {
+        free(volatile_entry_value(entry));
+        p->memory -= entry->vlen;
+    }
+
+    if (entry->cls == VOLATILE_STORAGE_NO_CLASS) {
+        p->memory -= sizeof(volatile_entry_t) + entry->klen + sizeof(void *);
+        free(entry);
+    } else {
+        volatile_slab_t *slab = &p->slabs[entry->cls];
+        *((void **)entry) = slab->free_list;
+        slab->free_list = entry;
+    }
+}
+
+static inline volatile_partition_t *
+volatile_storage_partition(volatile_storage_t *vs, uint64_t hash)
+{
+    // the low bits select the slot, the high bits the partition
+    return &vs->partitions[(hash >> 32) % VOLATILE_STORAGE_PARTITIONS];
+}
+
+// returns the index of the slot holding the key (or -1 if not found)
+// and stores in *free_slot the first slot usable to insert it
+static int
+volatile_partition_lookup(volatile_partition_t *p,
+                          uint64_t hash,
+                          void *key,
+                          size_t klen,
+                          int *free_slot)
+{
+    uint32_t mask = p->size - 1;
+    uint32_t i = hash & mask;
+    int first_deleted = -1;
+
+    // the table is never full, so there is always an empty slot
+    // which terminates the probe sequence
+    for (;;) {
+        volatile_slot_t *slot = &p->slots[i];
+        if (!slot->entry) {
+            if (free_slot)
+                *free_slot = (first_deleted >= 0) ? first_deleted : (int)i;
+            return -1;
+        }
+        if (slot->entry == VOLATILE_SLOT_DELETED) {
+            if (first_deleted < 0)
+                first_deleted = i;
+        } else if (slot->hash == hash &&
+                   slot->entry->klen == klen &&
+                   memcmp(slot->entry->data, key, klen) == 0)
+        {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int
+volatile_partition_resize(volatile_partition_t *p, uint32_t size)
+{
+    volatile_slot_t *slots = calloc(size, sizeof(volatile_slot_t));
+    if (!slots)
+        return -1;
+
+    uint32_t mask = size - 1;
+    uint32_t i;
+    for (i = 0; i < p->size; i++) {
+        volatile_slot_t *slot = &p->slots[i];
+        if (!VOLATILE_SLOT_IS_LIVE(slot))
+            continue;
+        uint32_t n = slot->hash & mask;
+        while (slots[n].entry)
+            n = (n + 1) & mask;
+        slots[n] = *slot;
+    }
+
+    p->memory -= p->size * sizeof(volatile_slot_t);
+    p->memory += size * sizeof(volatile_slot_t);
+    free(p->slots);
+    p->slots = slots;
+    p->size = size;
+    p->used = p->count;
+    return 0;
+}
+
+volatile_storage_t *
+volatile_storage_create()
+{
+    volatile_storage_t *vs = calloc(1, sizeof(volatile_storage_t));
+    if (!vs)
+        return NULL;
+
+    int i;
+    for (i = 0; i < VOLATILE_STORAGE_PARTITIONS; i++) {
+        volatile_partition_t *p = &vs->partitions[i];
+        pthread_mutex_init(&p->lock, NULL);
+        p->size = VOLATILE_STORAGE_INITIAL_SIZE;
+        p->slots = calloc(p->size, sizeof(volatile_slot_t));
+        if (!p->slots) {
+            volatile_storage_destroy(vs);
+            return NULL;
+        }
+        p->memory = p->size * sizeof(volatile_slot_t);
+    }
+
+    return vs;
+}
+
+void
+volatile_storage_destroy(volatile_storage_t *vs)
+{
+    int i;
+    for (i = 0; i < VOLATILE_STORAGE_PARTITIONS; i++) {
+        volatile_partition_t *p = &vs->partitions[i];
+        uint32_t n;
+        if (p->slots) {
+            // the slab entries go away with their pages,
+            // only the out-of-line allocations need to be released
+            for (n = 0; n < p->size; n++) {
+                volatile_slot_t *slot = &p->slots[n];
+                if (!VOLATILE_SLOT_IS_LIVE(slot))
+                    continue;
+                if (slot->entry->flags & VOLATILE_ENTRY_FLAG_EXTERNAL)
+                    free(volatile_entry_value(slot->entry));
+                if (slot->entry->cls == VOLATILE_STORAGE_NO_CLASS)
+                    free(slot->entry);
+            }
+            free(p->slots);
+        }
+        int c;
+        for (c = 0; c < VOLATILE_STORAGE_NUM_CLASSES; c++) {
+            int pg;
+            for (pg = 0; pg < p->slabs[c].num_pages; pg++)
+                free(p->slabs[c].pages[pg]);
+            free(p->slabs[c].pages);
+        }
+        pthread_mutex_destroy(&p->lock);
+    }
+    free(vs);
+}
+
+int
+volatile_storage_set(volatile_storage_t *vs,
+                     void *key,
+                     size_t klen,
+                     void *value,
+                     size_t vlen,
+                     uint32_t expire,
+                     int inx,
+                     size_t *prev_len)
+{
+    if (klen > UINT32_MAX || vlen > UINT32_MAX)
+        return -1;
+
+    uint64_t hash = sip_hash24(volatile_storage_seed, key, klen);
+    volatile_partition_t *p = volatile_storage_partition(vs, hash);
+
+    pthread_mutex_lock(&p->lock);
+
+    // keep the load factor (including the deleted slots) below 3/4
+    if ((p->used + 1) * 4 > p->size * 3) {
+        uint32_t size = p->size;
+        while ((p->count + 1) * 2 > size)
+            size <<= 1;
+        if (volatile_partition_resize(p, size) != 0) {
+            pthread_mutex_unlock(&p->lock);
+            return -1;
+        }
+    }
+
+    int free_slot = -1;
+    int index = volatile_partition_lookup(p, hash, key, klen, &free_slot);
+    if (index >= 0 && inx) {
+        pthread_mutex_unlock(&p->lock);
+        return VOLATILE_STORAGE_EXISTS;
+    }
+
+    volatile_entry_t *entry = volatile_entry_create(p, key, klen, value, vlen, expire);
+    if (!entry) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+
+    ATOMIC_INCREASE(vs->used, volatile_entry_size(entry));
+
+    int rc = VOLATILE_STORAGE_STORED;
+    if (index >= 0) {
+        volatile_slot_t *slot = &p->slots[index];
+        if (prev_len)
+            *prev_len = slot->entry->vlen;
+        ATOMIC_DECREASE(vs->used, volatile_entry_size(slot->entry));
+        volatile_entry_destroy(p, slot->entry);
+        slot->entry = entry;
+        rc = VOLATILE_STORAGE_REPLACED;
+    } else {
+        volatile_slot_t *slot = &p->slots[free_slot];
+        if (!slot->entry)
+            p->used++;
+        slot->hash = hash;
+        slot->entry = entry;
+        p->count++;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return rc;
+}
+
+int
+volatile_storage_get(volatile_storage_t *vs,
+                     void *key,
+                     size_t klen,
+                     volatile_storage_get_cb cb,
+                     void *priv)
+{
+    uint64_t hash = sip_hash24(volatile_storage_seed, key, klen);
+    volatile_partition_t *p = volatile_storage_partition(vs, hash);
+
+    pthread_mutex_lock(&p->lock);
+    int index = volatile_partition_lookup(p, hash, key, klen, NULL);
+    if (index >= 0 && cb) {
+        volatile_entry_t *entry = p->slots[index].entry;
+        cb(volatile_entry_value(entry), entry->vlen, entry->expire, priv);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return (index >= 0) ? 0 : -1;
+}
+
+int
+volatile_storage_exists(volatile_storage_t *vs, void *key, size_t klen)
+{
+    return (volatile_storage_get(vs, key, klen, NULL, NULL) == 0);
+}
+
+static inline void
+volatile_partition_remove(volatile_storage_t *vs, volatile_partition_t *p, volatile_slot_t *slot)
+{
+    ATOMIC_DECREASE(vs->used, volatile_entry_size(slot->entry));
+    volatile_entry_destroy(p, slot->entry);
+    slot->entry = VOLATILE_SLOT_DELETED;
+    p->count--;
+}
+
+int
+volatile_storage_delete(volatile_storage_t *vs,
+                        void *key,
+                        size_t klen,
+                        size_t *prev_len,
+                        uint32_t *prev_expire)
+{
+    uint64_t hash = sip_hash24(volatile_storage_seed, key, klen);
+    volatile_partition_t *p = volatile_storage_partition(vs, hash);
+
+    pthread_mutex_lock(&p->lock);
+    int index = volatile_partition_lookup(p, hash, key, klen, NULL);
+    if (index >= 0) {
+        volatile_slot_t *slot = &p->slots[index];
+        if (prev_len)
+            *prev_len = slot->entry->vlen;
+        if (prev_expire)
+            *prev_expire = slot->entry->expire;
+        volatile_partition_remove(vs, p, slot);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return (index >= 0) ? 0 : -1;
+}
+
+void
+volatile_storage_foreach(volatile_storage_t *vs, volatile_storage_iterator_cb cb, void *priv)
+{
+    int i;
+    for (i = 0; i < VOLATILE_STORAGE_PARTITIONS; i++) {
+        volatile_partition_t *p = &vs->partitions[i];
+        int stop = 0;
+        uint32_t n;
+        pthread_mutex_lock(&p->lock);
+        for (n = 0; n < p->size && !stop; n++) {
+            volatile_slot_t *slot = &p->slots[n];
+            if (!VOLATILE_SLOT_IS_LIVE(slot))
+                continue;
+            volatile_entry_t *entry = slot->entry;
+            int rc = cb(entry->data, entry->klen,
+                        volatile_entry_value(entry), entry->vlen,
+                        &entry->expire, priv);
+            if (rc == -1)
+                volatile_partition_remove(vs, p, slot);
+            else if (rc == 0)
+                stop = 1;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+    }
+}
+
+int
+volatile_storage_sample(volatile_storage_t *vs,
+                        int num_samples,
+                        volatile_storage_iterator_cb cb,
+                        void *priv)
+{
+    int sampled = 0;
+    int i;
+    for (i = 0; i < num_samples; i++) {
+        int start = random() % VOLATILE_STORAGE_PARTITIONS;
+        int found = 0;
+        int n;
+        // skip the empty partitions
+        for (n = 0; n < VOLATILE_STORAGE_PARTITIONS && !found; n++) {
+            volatile_partition_t *p = &vs->partitions[(start + n) % VOLATILE_STORAGE_PARTITIONS];
+            pthread_mutex_lock(&p->lock);
+            if (p->count) {
+                // the first live entry after a random slot
+                uint32_t mask = p->size - 1;
+                uint32_t index = random() & mask;
+                while (!VOLATILE_SLOT_IS_LIVE(&p->slots[index]))
+                    index = (index + 1) & mask;
+                volatile_entry_t *entry = p->slots[index].entry;
+                cb(entry->data, entry->klen,
+                   volatile_entry_value(entry), entry->vlen,
+                   &entry->expire, priv);
+                found = 1;
+            }
+            pthread_mutex_unlock(&p->lock);
+        }
+        if (!found)
+            break;
+        sampled++;
+    }
+    return sampled;
+}
+
+size_t
+volatile_storage_count(volatile_storage_t *vs)
+{
+    size_t count = 0;
+    int i;
+    for (i = 0; i < VOLATILE_STORAGE_PARTITIONS; i++) {
+        volatile_partition_t *p = &vs->partitions[i];
+        pthread_mutex_lock(&p->lock);
+        count += p->count;
+        pthread_mutex_unlock(&p->lock);
+    }
+    return count;
+}
+
+size_t
+volatile_storage_used(volatile_storage_t *vs)
+{
+    return ATOMIC_READ(vs->used);
+}
+
+size_t
+volatile_storage_memory(volatile_storage_t *vs)
+{
+    size_t memory = sizeof(volatile_storage_t);
+    int i;
+    for (i = 0; i < VOLATILE_STORAGE_PARTITIONS; i++) {
+        volatile_partition_t *p = &vs->partitions[i];
+        pthread_mutex_lock(&p->lock);
+        memory += p->memory;
+        pthread_mutex_unlock(&p->lock);
+    }
+    return memory;
+}
+
+typedef struct {
+    void *key;
+    size_t klen;
+    uint32_t expire;
+} volatile_eviction_candidate_t;
+
+typedef struct {
+    volatile_eviction_candidate_t *candidates;
+    int num_candidates;
+} volatile_eviction_sample_t;
+
+static int
+volatile_eviction_sample(void *key, size_t klen, void *value, size_t vlen, uint32_t *expire, void *priv)
+{
+    volatile_eviction_sample_t *sample = (volatile_eviction_sample_t *)priv;
+
+    volatile_eviction_candidate_t *candidate = &sample->candidates[sample->num_candidates++];
+    candidate->key = malloc(klen);
+    memcpy(candidate->key, key, klen);
+    candidate->klen = klen;
+    candidate->expire = *expire;
+
+    return 1;
+}
+
+static int
+volatile_eviction_candidate_cmp(const void *a, const void *b)
+{
+    // items which never expire go last
+    uint32_t ea = ((volatile_eviction_candidate_t *)a)->expire;
+    uint32_t eb = ((volatile_eviction_candidate_t *)b)->expire;
+    if (!ea)
+        ea = UINT32_MAX;
+    if (!eb)
+        eb = UINT32_MAX;
+    return (ea > eb) - (ea < eb);
+}
+
+size_t
+volatile_storage_evict(volatile_storage_t *vs, size_t size, volatile_storage_evict_cb cb, void *priv)
+{
+    size_t evicted = 0;
+    size_t used = volatile_storage_used(vs);
+    size_t count = volatile_storage_count(vs);
+
+    while (used > size && count) {
+        // estimate how many items need to go given their average size
+        size_t avg = used / count;
+        size_t needed = avg ? (used - size) / avg + 1 : count;
+        size_t wanted = needed * VOLATILE_STORAGE_EVICTION_SAMPLES;
+        if (wanted > VOLATILE_STORAGE_EVICTION_MAX_CANDIDATES)
+            wanted = VOLATILE_STORAGE_EVICTION_MAX_CANDIDATES;
+
+        volatile_eviction_sample_t sample = {
+            .candidates = calloc(wanted, sizeof(volatile_eviction_candidate_t)),
+            .num_candidates = 0
+        };
+        if (!sample.candidates)
+            break;
+        volatile_storage_sample(vs, wanted, volatile_eviction_sample, &sample);
+
+        qsort(sample.candidates, sample.num_candidates,
+              sizeof(volatile_eviction_candidate_t), volatile_eviction_candidate_cmp);
+
+        // only the best candidates go, so that the eviction stays selective
+        // even when the sample has been capped
+        size_t max_removals = sample.num_candidates / VOLATILE_STORAGE_EVICTION_SAMPLES + 1;
+        size_t removed = 0;
+        int i;
+        for (i = 0; i < sample.num_candidates; i++) {
+            volatile_eviction_candidate_t *candidate = &sample.candidates[i];
+            size_t prev_len = 0;
+            uint32_t prev_expire = 0;
+            // the same key might have been sampled more than once
+            // (or removed in the meanwhile), in which case the delete fails
+            if (removed < max_removals && volatile_storage_used(vs) > size &&
+                volatile_storage_delete(vs, candidate->key, candidate->klen,
+                                        &prev_len, &prev_expire) == 0)
+            {
+                if (cb)
+                    cb(candidate->key, candidate->klen, prev_len, prev_expire, priv);
+                removed++;
+            }
+            free(candidate->key);
+        }
+        free(sample.candidates);
+
+        if (!removed)
+            break;
+
+        evicted += removed;
+        used = volatile_storage_used(vs);
+        count = volatile_storage_count(vs);
+    }
+
+    return evicted;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
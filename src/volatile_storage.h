@@ -0,0 +1,202 @@
+#ifndef __SHARDCACHE_VOLATILE_STORAGE_H__
+#define __SHARDCACHE_VOLATILE_STORAGE_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* Compact in-memory storage for the volatile keys.
+ *
+ * The keys are spread among VOLATILE_STORAGE_PARTITIONS partitions
+ * (each one protected by its own lock). Each partition is an open-addressing
+ * table (linear probing) whose slots hold the hash of the key and a pointer
+ * to the entry. Entries are carved out of slabs (one free list per size class)
+ * and hold the expiration time, the key and, if small enough, the value inline.
+ * Values which don't fit in the largest size class are stored out-of-line.
+ *
+ * This avoids the per-item malloc()s (and their headers) needed when storing
+ * volatile_object_t structures in a libhl hashtable, which for small values
+ * dominated the memory actually used by the payload.
+ */
+
+typedef struct __volatile_storage_s volatile_storage_t;
+
+#define VOLATILE_STORAGE_PARTITIONS 64
+
+// return values for volatile_storage_set()
+#define VOLATILE_STORAGE_STORED   0 // the key didn't exist and has been stored
+#define VOLATILE_STORAGE_REPLACED 1 // the value of an existing key has been replaced
+#define VOLATILE_STORAGE_EXISTS   2 // the key exists and the value has not been replaced
+
+/*
+ * @brief Create a new volatile storage
+ * @return A valid volatile_storage_t structure, NULL in case of errors
+ */
+volatile_storage_t *volatile_storage_create();
+
+/*
+ * @brief Release all the resources used by a volatile storage
+ * @param vs A valid volatile_storage_t structure
+ */
+void volatile_storage_destroy(volatile_storage_t *vs);
+
+/*
+ * @brief Store a value
+ * @param vs       A valid volatile_storage_t structure
+ * @param key      The key
+ * @param klen     The length of the key
+ * @param value    The value (which will be copied)
+ * @param vlen     The length of the value
+ * @param expire   The expiration time (0 if the key never expires)
+ * @param inx      If true the value is stored only if the key doesn't exist yet
+ * @param prev_len If not NULL and an existing value has been replaced,
+ *                 its length will be stored here
+ * @return VOLATILE_STORAGE_STORED, VOLATILE_STORAGE_REPLACED or
+ *         VOLATILE_STORAGE_EXISTS on success, -1 otherwise
+ */
+int volatile_storage_set(volatile_storage_t *vs,
+                         void *key,
+                         size_t klen,
+                         void *value,
+                         size_t vlen,
+                         uint32_t expire,
+                         int inx,
+                         size_t *prev_len);
+
+/*
+ * @brief Callback receiving the value of a key (while the partition is locked)
+ * @note The value can't be accessed anymore once the callback returns
+ */
+typedef void (*volatile_storage_get_cb)(void *value, size_t vlen, uint32_t expire, void *priv);
+
+/*
+ * @brief Look up a key
+ * @param vs   A valid volatile_storage_t structure
+ * @param key  The key
+ * @param klen The length of the key
+ * @param cb   If not NULL, the callback which will receive the value
+ *             (and can copy it where needed)
+ * @param priv A pointer which will be passed to the callback
+ * @return 0 if the key has been found, -1 otherwise
+ */
+int volatile_storage_get(volatile_storage_t *vs,
+                         void *key,
+                         size_t klen,
+                         volatile_storage_get_cb cb,
+                         void *priv);
+
+/*
+ * @brief Check if a key exists
+ * @param vs   A valid volatile_storage_t structure
+ * @param key  The key
+ * @param klen The length of the key
+ * @return 1 if the key exists, 0 otherwise
+ */
+int volatile_storage_exists(volatile_storage_t *vs, void *key, size_t klen);
+
+/*
+ * @brief Remove a key
+ * @param vs          A valid volatile_storage_t structure
+ * @param key         The key
+ * @param klen        The length of the key
+ * @param prev_len    If not NULL the length of the removed value will be stored here
+ * @param prev_expire If not NULL the expiration time of the removed value will be stored here
+ * @return 0 if the key has been removed, -1 if it didn't exist
+ */
+int volatile_storage_delete(volatile_storage_t *vs,
+                            void *key,
+                            size_t klen,
+                            size_t *prev_len,
+                            uint32_t *prev_expire);
+
+/*
+ * @brief Callback called for each key when iterating over the storage
+ * @note The expiration time can be changed by updating *expire
+ * @return 1 to go ahead, 0 to stop the iteration, -1 to remove the key
+ *         and go ahead
+ */
+typedef int (*volatile_storage_iterator_cb)(void *key,
+                                            size_t klen,
+                                            void *value,
+                                            size_t vlen,
+                                            uint32_t *expire,
+                                            void *priv);
+
+/*
+ * @brief Iterate over all the keys
+ * @param vs   A valid volatile_storage_t structure
+ * @param cb   The callback
+ * @param priv A pointer which will be passed to the callback
+ * @note Only one partition at a time is locked during the iteration
+ */
+void volatile_storage_foreach(volatile_storage_t *vs, volatile_storage_iterator_cb cb, void *priv);
+
+/*
+ * @brief Call the callback for (up to) num_samples keys picked at random
+ * @param vs          A valid volatile_storage_t structure
+ * @param num_samples The number of keys to sample
+ * @param cb          The callback (the value returned is ignored,
+ *                    keys can't be removed while sampling)
+ * @param priv        A pointer which will be passed to the callback
+ * @return The number of keys passed to the callback
+ * @note The same key can be returned more than once
+ */
+int volatile_storage_sample(volatile_storage_t *vs,
+                            int num_samples,
+                            volatile_storage_iterator_cb cb,
+                            void *priv);
+
+/*
+ * @brief Get the number of keys in the storage
+ * @param vs A valid volatile_storage_t structure
+ * @return The number of keys
+ */
+size_t volatile_storage_count(volatile_storage_t *vs);
+
+/*
+ * @brief Get the memory used by the storage
+ * @param vs A valid volatile_storage_t structure
+ * @return The number of bytes allocated for the tables, the slabs
+ *         and the out-of-line values
+ */
+size_t volatile_storage_memory(volatile_storage_t *vs);
+
+/*
+ * @brief Get the memory taken by the keys in the storage
+ * @param vs A valid volatile_storage_t structure
+ * @return The number of bytes taken by the live entries (including the keys,
+ *         their headers and the slab rounding), the out-of-line values
+ *         and their slots in the tables
+ * @note Unlike volatile_storage_memory() this drops as soon as keys are removed
+ *       (the slab pages are never released but their chunks are reused)
+ */
+size_t volatile_storage_used(volatile_storage_t *vs);
+
+/*
+ * @brief Callback called for each key evicted by volatile_storage_evict()
+ */
+typedef void (*volatile_storage_evict_cb)(void *key,
+                                          size_t klen,
+                                          size_t vlen,
+                                          uint32_t expire,
+                                          void *priv);
+
+/*
+ * @brief Evict keys until the memory taken by the storage drops to the given size
+ * @param vs   A valid volatile_storage_t structure
+ * @param size The size (as returned by volatile_storage_used()) to drop to
+ * @param cb   If not NULL, the callback which will be called for each evicted key
+ * @param priv A pointer which will be passed to the callback
+ * @return The number of keys evicted
+ * @note A random sample of the keys is taken (a few candidates for each key which
+ *       needs to go) and the candidates are evicted starting from the ones closest
+ *       to their expiration time (the keys which never expire go last)
+ */
+size_t volatile_storage_evict(volatile_storage_t *vs,
+                              size_t size,
+                              volatile_storage_evict_cb cb,
+                              void *priv);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
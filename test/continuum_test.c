@@ -0,0 +1,263 @@
+#include <shardcache.h>
+#include <continuum.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 10
+#define NUM_KEYS 100000
+
+static shardcache_node_t **
+create_nodes(int num_nodes)
+{
+    int i;
+    shardcache_node_t **nodes = malloc(sizeof(shardcache_node_t *) * num_nodes);
+    for (i = 0; i < num_nodes; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:%d", 9750 + i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+    return nodes;
+}
+
+static void
+test_stability(shardcache_continuum_mode_t mode, char *name)
+{
+    int i;
+    shardcache_node_t **nodes = create_nodes(NUM_NODES + 1);
+
+    shardcache_continuum_t *before = shardcache_continuum_create(nodes, NUM_NODES, mode);
+    shardcache_continuum_t *after = shardcache_continuum_create(nodes, NUM_NODES + 1, mode);
+
+    // same set of nodes provided in reverse order
+    shardcache_node_t *reversed[NUM_NODES];
+    for (i = 0; i < NUM_NODES; i++)
+        reversed[i] = nodes[NUM_NODES - 1 - i];
+    shardcache_continuum_t *shuffled = shardcache_continuum_create(reversed, NUM_NODES, mode);
+
+    int moved_to_new = 0;
+    int moved_among_old = 0;
+    int mismatches = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "test_key%d", i);
+        int owner_before = shardcache_continuum_lookup(before, key, strlen(key));
+        int owner_after = shardcache_continuum_lookup(after, key, strlen(key));
+        int owner_shuffled = shardcache_continuum_lookup(shuffled, key, strlen(key));
+
+        if (owner_after == NUM_NODES)
+            moved_to_new++;
+        else if (owner_after != owner_before)
+            moved_among_old++;
+
+        if (strcmp(shardcache_node_get_label(nodes[owner_before]),
+                   shardcache_node_get_label(reversed[owner_shuffled])) != 0)
+        {
+            mismatches++;
+        }
+    }
+
+    ut_testing("%s: the owner doesn't depend on the order of the nodes", name);
+    ut_validate_int(mismatches, 0);
+
+    double expected_share = (double)NUM_KEYS / (NUM_NODES + 1);
+    ut_testing("%s: the new node gets its share of the keys (%d ~= %.0f)",
+               name, moved_to_new, expected_share);
+    if (moved_to_new < expected_share * 0.7 || moved_to_new > expected_share * 1.3) {
+        ut_failure("%d keys moved to the new node", moved_to_new);
+    } else {
+        ut_success();
+    }
+
+    ut_testing("%s: less than 1%% of the keys move among the existing nodes (%d)",
+               name, moved_among_old);
+    if (moved_among_old > NUM_KEYS / 100) {
+        ut_failure("%d keys moved among the old nodes", moved_among_old);
+    } else {
+        ut_success();
+    }
+
+    shardcache_continuum_destroy(before);
+    shardcache_continuum_destroy(after);
+    shardcache_continuum_destroy(shuffled);
+    shardcache_free_nodes(nodes, NUM_NODES + 1);
+}
+
+static void
+test_weights(shardcache_continuum_mode_t mode, char *name)
+{
+    int i;
+    shardcache_node_t **nodes = create_nodes(NUM_NODES);
+
+    // the first node weighs as much as 4 nodes
+    shardcache_node_set_weight(nodes[0], 4);
+
+    shardcache_continuum_t *continuum = shardcache_continuum_create(nodes, NUM_NODES, mode);
+
+    int owned = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "test_key%d", i);
+        if (shardcache_continuum_lookup(continuum, key, strlen(key)) == 0)
+            owned++;
+    }
+
+    double expected_share = (double)NUM_KEYS * 4 / (NUM_NODES + 3);
+    ut_testing("%s: a node with weight 4 owns its share of the keys (%d ~= %.0f)",
+               name, owned, expected_share);
+    if (owned < expected_share * 0.7 || owned > expected_share * 1.3)
+        ut_failure("the weighted node owns %d keys", owned);
+    else
+        ut_success();
+
+    shardcache_continuum_destroy(continuum);
+    shardcache_free_nodes(nodes, NUM_NODES);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    shardcache_log_init("continuum_test", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    shardcache_node_t **nodes = create_nodes(NUM_NODES);
+
+    ut_testing("shardcache_continuum_create(nodes, %d, SHARDCACHE_CONTINUUM_MODE_TABLE)", NUM_NODES);
+    shardcache_continuum_t *table = shardcache_continuum_create(nodes, NUM_NODES,
+                                                                SHARDCACHE_CONTINUUM_MODE_TABLE);
+    ut_validate_int((table != NULL), 1);
+
+    ut_testing("all the buckets are assigned to a valid node");
+    int owned[NUM_NODES];
+    memset(owned, 0, sizeof(owned));
+    int failed = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "test_key%d", i);
+        int owner = shardcache_continuum_lookup(table, key, strlen(key));
+        if (owner < 0 || owner >= NUM_NODES) {
+            ut_failure("Bad owner %d for key %s", owner, key);
+            failed = 1;
+            break;
+        }
+        owned[owner]++;
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("the keys are evenly distributed among the nodes");
+    failed = 0;
+    for (i = 0; i < NUM_NODES; i++) {
+        if (owned[i] < (NUM_KEYS / NUM_NODES) * 0.8 || owned[i] > (NUM_KEYS / NUM_NODES) * 1.2) {
+            ut_failure("node %d owns %d keys out of %d", i, owned[i], NUM_KEYS);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    shardcache_continuum_destroy(table);
+    shardcache_free_nodes(nodes, NUM_NODES);
+
+    test_stability(SHARDCACHE_CONTINUUM_MODE_CHASH, "chash");
+    test_stability(SHARDCACHE_CONTINUUM_MODE_TABLE, "table");
+
+    ut_testing("shardcache_node_create_from_string(peer0@3:127.0.0.1:9750;127.0.0.1:9751)");
+    shardcache_node_t *node = shardcache_node_create_from_string("peer0@3:127.0.0.1:9750;127.0.0.1:9751");
+    if (node && shardcache_node_get_weight(node) == 3 &&
+        strcmp(shardcache_node_get_label(node), "peer0") == 0 &&
+        shardcache_node_num_addresses(node) == 2 &&
+        strcmp(shardcache_node_get_string(node), "peer0@3:127.0.0.1:9750;127.0.0.1:9751") == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("Can't parse a weighted node string");
+    }
+    if (node)
+        shardcache_node_destroy(node);
+
+    ut_testing("shardcache_node_create_from_string(peer0@0:127.0.0.1:9750) == NULL");
+    node = shardcache_node_create_from_string("peer0@0:127.0.0.1:9750");
+    ut_validate_int((node == NULL), 1);
+    if (node)
+        shardcache_node_destroy(node);
+
+    ut_testing("shardcache_node_create_from_string(peer0#1:127.0.0.1:9750) == NULL");
+    node = shardcache_node_create_from_string("peer0#1:127.0.0.1:9750");
+    ut_validate_int((node == NULL), 1);
+    if (node)
+        shardcache_node_destroy(node);
+
+    ut_testing("a label clashing with the extra points of a weighted node is refused by the continuum");
+    char *clash_addr[1] = { "127.0.0.1:9750" };
+    shardcache_node_t *clash[2];
+    clash[0] = shardcache_node_create("peer0", clash_addr, 1);
+    shardcache_node_set_weight(clash[0], 2);
+    clash[1] = shardcache_node_create("peer0#1", clash_addr, 1);
+    shardcache_continuum_t *clashing = shardcache_continuum_create(clash, 2, SHARDCACHE_CONTINUUM_MODE_CHASH);
+    ut_validate_int((clashing == NULL), 1);
+    if (clashing)
+        shardcache_continuum_destroy(clashing);
+    shardcache_node_destroy(clash[0]);
+    shardcache_node_destroy(clash[1]);
+
+    test_weights(SHARDCACHE_CONTINUUM_MODE_CHASH, "chash");
+    test_weights(SHARDCACHE_CONTINUUM_MODE_TABLE, "table");
+
+    node = shardcache_node_create_from_string("peer0:127.0.0.1:9750;127.0.0.1:9751");
+
+    ut_testing("shardcache_node_acquire_address() spreads the outstanding requests among the replicas");
+    int first = -1, second = -1;
+    shardcache_node_acquire_address(node, &first);
+    shardcache_node_acquire_address(node, &second);
+    ut_validate_int((first != second), 1);
+    shardcache_node_release_address(node, first, 0, 100);
+    shardcache_node_release_address(node, second, 0, 100);
+
+    ut_testing("shardcache_node_acquire_address() skips a failing replica");
+    // the first replica fails all the requests routed to it
+    int errors = 0;
+    for (i = 0; i < 1000 && errors < SHARDCACHE_NODE_MAX_ERRORS; i++) {
+        int index = -1;
+        shardcache_node_acquire_address(node, &index);
+        shardcache_node_release_address(node, index, (index == 0), 100);
+        if (index == 0)
+            errors++;
+    }
+    failed = 0;
+    for (i = 0; i < 10; i++) {
+        int index = -1;
+        shardcache_node_acquire_address(node, &index);
+        shardcache_node_release_address(node, index, 0, 100);
+        if (index != 1)
+            failed++;
+    }
+    ut_validate_int(failed, 0);
+
+    ut_testing("shardcache_node_get_address_stats() reports the errors");
+    shardcache_node_address_stats_t stats;
+    if (shardcache_node_get_address_stats(node, 0, &stats) == 0 &&
+        stats.errors == SHARDCACHE_NODE_MAX_ERRORS && stats.consecutive_errors == SHARDCACHE_NODE_MAX_ERRORS)
+    {
+        ut_success();
+    } else {
+        ut_failure("Unexpected stats for a failing replica");
+    }
+
+    shardcache_node_destroy(node);
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
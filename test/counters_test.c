@@ -0,0 +1,103 @@
+#include <shardcache.h>
+#include <counters.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_THREADS 256
+
+static shardcache_sharded_counters_t *sc = NULL;
+static int slots[NUM_THREADS];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int started = 0;
+static int release = 0;
+
+static void *
+count(void *priv)
+{
+    int *slot = (int *)priv;
+    *slot = shardcache_counters_thread_slot();
+    shardcache_sharded_counter_add(sc, 0, 1);
+    return NULL;
+}
+
+// keeps its slot until all the threads have started
+static void *
+count_and_wait(void *priv)
+{
+    count(priv);
+    pthread_mutex_lock(&lock);
+    started++;
+    pthread_cond_broadcast(&cond);
+    while (!release)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    ut_init(basename(argv[0]));
+
+    sc = shardcache_sharded_counters_create(1);
+
+    ut_testing("the slot of an exited thread is reused by the next one");
+    pthread_t threads[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, count, &slots[i]);
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 1; i < NUM_THREADS && slots[i] == slots[0]; i++)
+        ;
+    if (i == NUM_THREADS)
+        ut_success();
+    else
+        ut_failure("thread %d got slot %d (thread 0 got slot %d)", i, slots[i], slots[0]);
+
+    ut_testing("the counts of the exited threads are preserved");
+    ut_validate_int(shardcache_sharded_counter_get(sc, 0), NUM_THREADS);
+
+    ut_testing("%d live threads get all the %d slots, each shared by the same number of threads",
+               NUM_THREADS, SHARDCACHE_COUNTERS_SLOTS);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, count_and_wait, &slots[i]);
+    pthread_mutex_lock(&lock);
+    while (started < NUM_THREADS)
+        pthread_cond_wait(&cond, &lock);
+    release = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    int threads_per_slot[SHARDCACHE_COUNTERS_SLOTS];
+    memset(threads_per_slot, 0, sizeof(threads_per_slot));
+    for (i = 0; i < NUM_THREADS; i++)
+        threads_per_slot[slots[i]]++;
+    for (i = 0; i < SHARDCACHE_COUNTERS_SLOTS; i++) {
+        if (threads_per_slot[i] != NUM_THREADS / SHARDCACHE_COUNTERS_SLOTS)
+            break;
+    }
+    if (i == SHARDCACHE_COUNTERS_SLOTS)
+        ut_success();
+    else
+        ut_failure("slot %d is shared by %d threads", i, threads_per_slot[i]);
+
+    ut_testing("the counts of all the threads are summed");
+    ut_validate_int(shardcache_sharded_counter_get(sc, 0), NUM_THREADS * 2);
+
+    shardcache_sharded_counters_destroy(sc);
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
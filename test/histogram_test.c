@@ -0,0 +1,96 @@
+#include <shardcache.h>
+#include <histogram.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_THREADS 8
+#define NUM_VALUES 100000
+
+static shardcache_histogram_t *histogram = NULL;
+
+static void *
+record_values(void *priv)
+{
+    int i;
+    for (i = 1; i <= NUM_VALUES; i++)
+        shardcache_histogram_record(histogram, i);
+    return NULL;
+}
+
+static int
+within(uint64_t value, uint64_t expected)
+{
+    // the error is expected to be below 1/16th of the value
+    return (value >= expected - expected / 16 && value <= expected + expected / 16);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    ut_init(basename(argv[0]));
+
+    ut_testing("shardcache_histogram_create()");
+    histogram = shardcache_histogram_create();
+    ut_validate_int((histogram != NULL), 1);
+
+    ut_testing("an empty histogram reports 0 for all the percentiles");
+    shardcache_histogram_snapshot_t *snapshot = malloc(sizeof(shardcache_histogram_snapshot_t));
+    shardcache_histogram_merge(histogram, snapshot);
+    ut_validate_int(snapshot->count + shardcache_histogram_percentile(snapshot, 99) + snapshot->min, 0);
+
+    ut_testing("values recorded by %d threads are merged", NUM_THREADS);
+    pthread_t threads[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, record_values, NULL);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    shardcache_histogram_merge(histogram, snapshot);
+    ut_validate_int(snapshot->count, NUM_THREADS * NUM_VALUES);
+
+    ut_testing("min and max are exact");
+    if (snapshot->min == 1 && snapshot->max == NUM_VALUES)
+        ut_success();
+    else
+        ut_failure("min: %llu, max: %llu", (unsigned long long)snapshot->min, (unsigned long long)snapshot->max);
+
+    ut_testing("the percentiles are within 6.25%% of the actual values");
+    double percentiles[] = { 10, 50, 90, 99, 99.9 };
+    int failed = 0;
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        uint64_t expected = (uint64_t)(NUM_VALUES * percentiles[i] / 100);
+        uint64_t value = shardcache_histogram_percentile(snapshot, percentiles[i]);
+        if (!within(value, expected)) {
+            ut_failure("p%.1f is %llu (expected: %llu)", percentiles[i],
+                       (unsigned long long)value, (unsigned long long)expected);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("the largest values are clamped");
+    shardcache_histogram_record(histogram, UINT64_MAX);
+    shardcache_histogram_merge(histogram, snapshot);
+    ut_validate_int((shardcache_histogram_percentile(snapshot, 100) == SHARDCACHE_HISTOGRAM_MAX_VALUE), 1);
+
+    ut_testing("shardcache_histogram_reset() empties the histogram");
+    shardcache_histogram_reset(histogram);
+    shardcache_histogram_merge(histogram, snapshot);
+    ut_validate_int(snapshot->count + snapshot->sum + snapshot->max, 0);
+
+    free(snapshot);
+    shardcache_histogram_destroy(histogram);
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,137 @@
+#include <shardcache.h>
+#include <hotkeys.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_THREADS 4
+#define NUM_COLD_KEYS 10000
+#define NUM_HOT_KEYS 10
+
+static shardcache_hotkeys_t *hotkeys = NULL;
+
+// each thread requests all the cold keys once, each hot key
+// hot_requests times and the big key (with a large value) 10 times
+static int hot_requests = 1000;
+
+static void *
+request_keys(void *priv)
+{
+    char key[32];
+    int i, n;
+    for (i = 0; i < NUM_COLD_KEYS; i++) {
+        snprintf(key, sizeof(key), "cold_%d", i);
+        shardcache_hotkeys_sample(hotkeys, key, strlen(key), 100);
+
+        // interleave the hot keys with the cold ones
+        if (i % (NUM_COLD_KEYS / 10) == 0) {
+            for (n = 0; n < NUM_HOT_KEYS * hot_requests / 10; n++) {
+                snprintf(key, sizeof(key), "hot_%d", n % NUM_HOT_KEYS);
+                shardcache_hotkeys_sample(hotkeys, key, strlen(key), 100);
+            }
+            shardcache_hotkeys_sample(hotkeys, "big", 3, 1<<20);
+        }
+    }
+    return NULL;
+}
+
+static int
+is_hot(shardcache_hotkey_t *hot)
+{
+    return (hot->klen > 4 && strncmp(hot->key, "hot_", 4) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    ut_init(basename(argv[0]));
+
+    ut_testing("shardcache_hotkeys_create()");
+    hotkeys = shardcache_hotkeys_create(1);
+    ut_validate_int((hotkeys != NULL), 1);
+
+    shardcache_hotkey_t *top = calloc(SHARDCACHE_HOTKEYS_CAPACITY, sizeof(shardcache_hotkey_t));
+
+    ut_testing("an empty tracker reports no keys");
+    ut_validate_int(shardcache_hotkeys_top(hotkeys, 0, top, SHARDCACHE_HOTKEYS_CAPACITY), 0);
+
+    ut_testing("the hot keys requested by %d threads are the top %d by requests",
+               NUM_THREADS, NUM_HOT_KEYS);
+    pthread_t threads[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, request_keys, NULL);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    int num_keys = shardcache_hotkeys_top(hotkeys, 0, top, SHARDCACHE_HOTKEYS_CAPACITY);
+    int failed = (num_keys != SHARDCACHE_HOTKEYS_CAPACITY);
+    for (i = 0; !failed && i < NUM_HOT_KEYS; i++)
+        failed = !is_hot(&top[i]);
+    if (failed)
+        ut_failure("got %d keys, key %d is '%.*s'", num_keys, i, (int)top[i].klen, top[i].key);
+    else
+        ut_success();
+
+    ut_testing("the requests of the hot keys are counted exactly");
+    // the hot keys are never evicted, so their count has no error
+    uint64_t expected = NUM_THREADS * hot_requests;
+    failed = 0;
+    for (i = 0; i < NUM_HOT_KEYS; i++) {
+        if (top[i].requests != expected || top[i].error != 0) {
+            ut_failure("'%.*s' has %llu requests (expected: %llu), error: %llu",
+                       (int)top[i].klen, top[i].key, (unsigned long long)top[i].requests,
+                       (unsigned long long)expected, (unsigned long long)top[i].error);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("the key moving most bytes is the top one by bytes");
+    num_keys = shardcache_hotkeys_top(hotkeys, 1, top, SHARDCACHE_HOTKEYS_CAPACITY);
+    if (num_keys > 0 && top[0].klen == 3 && memcmp(top[0].key, "big", 3) == 0 &&
+        top[0].bytes == (uint64_t)NUM_THREADS * 10 * (1<<20))
+    {
+        ut_success();
+    } else {
+        ut_failure("top key: '%.*s' (%llu bytes)", (int)top[0].klen, top[0].key,
+                   (unsigned long long)top[0].bytes);
+    }
+
+    ut_testing("the sampled counts are scaled back by the sample rate");
+    shardcache_hotkeys_set_sample_rate(hotkeys, 8);
+    for (i = 0; i < 80000; i++)
+        shardcache_hotkeys_sample(hotkeys, "sampled", 7, 0);
+    num_keys = shardcache_hotkeys_top(hotkeys, 0, top, SHARDCACHE_HOTKEYS_CAPACITY);
+    // the error is expected to be well below 5%
+    if (num_keys == 1 && top[0].requests > 76000 && top[0].requests < 84000)
+        ut_success();
+    else
+        ut_failure("got %d keys, %llu requests", num_keys, (unsigned long long)top[0].requests);
+
+    ut_testing("a sample rate of 0 disables the tracking");
+    shardcache_hotkeys_set_sample_rate(hotkeys, 0);
+    shardcache_hotkeys_sample(hotkeys, "ignored", 7, 0);
+    ut_validate_int(shardcache_hotkeys_top(hotkeys, 0, top, SHARDCACHE_HOTKEYS_CAPACITY), 0);
+
+    ut_testing("shardcache_hotkeys_reset() forgets all the keys");
+    shardcache_hotkeys_set_sample_rate(hotkeys, 1);
+    shardcache_hotkeys_sample(hotkeys, "key", 3, 10);
+    shardcache_hotkeys_reset(hotkeys);
+    ut_validate_int(shardcache_hotkeys_top(hotkeys, 0, top, SHARDCACHE_HOTKEYS_CAPACITY) +
+                    shardcache_hotkeys_top(hotkeys, 1, top, SHARDCACHE_HOTKEYS_CAPACITY), 0);
+
+    free(top);
+    shardcache_hotkeys_destroy(hotkeys);
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -8,13 +8,13 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <errno.h>
 
-#define HAVE_UINT64_T
-#include <siphash.h>
-
 #include <kepaxos.h>
 
 static int total_messages_sent = 0;
@@ -69,6 +69,33 @@ static int send_callback(char **recipients,
     return 0;
 }
 
+#define BLOCKED_KEY "blocked_key"
+
+// when blocking is set, the first replica committing BLOCKED_KEY
+// waits (holding the lock of the key) until the block is released
+static int blocking = 0;
+static int block_held = 0;
+static int block_released = 0;
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t block_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+block_commit(void)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10; // never hang the test
+
+    pthread_mutex_lock(&block_lock);
+    block_held = 1;
+    pthread_cond_broadcast(&block_cond);
+    while (!block_released) {
+        if (pthread_cond_timedwait(&block_cond, &block_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&block_lock);
+}
+
 static int commit_callback(unsigned char type,
                            void *key,
                            size_t klen,
@@ -78,6 +105,11 @@ static int commit_callback(unsigned char type,
                            void *priv)
 {
     __sync_add_and_fetch(&total_values_committed, 1);
+    if (!leader && __sync_fetch_and_add(&blocking, 0) &&
+        klen == strlen(BLOCKED_KEY) && memcmp(key, BLOCKED_KEY, klen) == 0)
+    {
+        block_commit();
+    }
     return 0;
 }
 
@@ -96,84 +128,439 @@ typedef struct {
     uint32_t ballot;
 } kepaxos_log_item;
 
-char *hex_escape(char *buf, int len)
+int fetch_log(kepaxos_t *ke, void *key, size_t klen, kepaxos_log_item *item)
+{
+    uint64_t ballot = 0;
+    uint64_t seq = kepaxos_seq_ballot(ke, key, klen, &ballot);
+    item->seq = seq;
+    item->ballot = ballot;
+    return 0;
+}
+
+static void
+remove_log(char *dbfile)
 {
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/log", dbfile);
+    unlink(path);
+    rmdir(dbfile);
+}
+
+#define SCALING_MAX_THREADS 8
+
+typedef struct {
+    kepaxos_node *contexts;
+    int id;
+    int num_commands;
+    int failed;
+} scaling_arg;
+
+static void *
+scaling_worker(void *priv)
+{
+    scaling_arg *arg = (scaling_arg *)priv;
     int i;
-    static char str[1024];
+    for (i = 0; i < arg->num_commands; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "scaling_key_%d_%d", arg->id, i);
+        if (kepaxos_run_command(arg->contexts[0].ke, 0x00, key, strlen(key), "test_value", 10) != 0)
+            arg->failed++;
+    }
+    return NULL;
+}
 
-    if (len > 512)
-        len = 512;
+// runs num_commands commands from each of num_threads clients
+// and returns the number of commands which failed
+static int
+run_scaling(kepaxos_node *contexts, int num_threads, int num_commands)
+{
+    struct timeval start, end, diff;
+    gettimeofday(&start, NULL);
 
-    char *p = str;
+    pthread_t threads[num_threads];
+    scaling_arg args[num_threads];
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        args[i].contexts = contexts;
+        args[i].id = i;
+        args[i].num_commands = num_commands;
+        args[i].failed = 0;
+        pthread_create(&threads[i], NULL, scaling_worker, &args[i]);
+    }
 
-    for (i = 0; i < len; i++) {
-        sprintf(p, "%02x", (unsigned char)buf[i]);
-        p+=2;
+    int failed = 0;
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        failed += args[i].failed;
     }
-    return str;
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    double elapsed = diff.tv_sec + (double)diff.tv_usec / 1000000;
+    int total = num_commands * num_threads;
+    printf("%d clients: %d commands in %.3fs (%.0f commits/sec)\n",
+           num_threads, total, elapsed, elapsed > 0 ? total / elapsed : 0);
+
+    return failed;
 }
 
+#define STRIPE_KEYS 4
 
-int fetch_log(char *dbfile, void *key, size_t klen, kepaxos_log_item *item)
+typedef struct {
+    kepaxos_node *contexts;
+    char key[64];
+    int done;
+    int rc;
+} stripe_arg;
+
+static void *
+stripe_worker(void *priv)
 {
-    uint64_t keyhash1 = sip_hash24((unsigned char *)"0123456789ABCDEF", key, klen);
-    uint64_t keyhash2 = sip_hash24((unsigned char *)"ABCDEF0987654321", key, klen);
+    stripe_arg *arg = (stripe_arg *)priv;
+    arg->rc = kepaxos_run_command(arg->contexts[0].ke, 0x00, arg->key, strlen(arg->key), "test_value", 10);
+    __sync_add_and_fetch(&arg->done, 1);
+    return NULL;
+}
 
-    char kstr[35]; // 32 + 0x + null-terminator
-    snprintf(kstr, sizeof(kstr), "%s%s",
-             hex_escape((char *)&keyhash1, sizeof(keyhash1)),
-             hex_escape((char *)&keyhash2, sizeof(keyhash2)));
+// runs a command on BLOCKED_KEY whose commit is held by a replica
+// and returns how many of the commands on STRIPE_KEYS other keys
+// complete successfully before the block is released
+static int
+run_while_blocked(kepaxos_node *contexts)
+{
+    pthread_t blocked_thread;
+    stripe_arg blocked_arg = { .contexts = contexts };
+    snprintf(blocked_arg.key, sizeof(blocked_arg.key), "%s", BLOCKED_KEY);
+
+    __sync_lock_test_and_set(&blocking, 1);
+    pthread_create(&blocked_thread, NULL, stripe_worker, &blocked_arg);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    pthread_mutex_lock(&block_lock);
+    while (!block_held) {
+        if (pthread_cond_timedwait(&block_cond, &block_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    int held = block_held;
+    pthread_mutex_unlock(&block_lock);
 
+    pthread_t threads[STRIPE_KEYS];
+    stripe_arg args[STRIPE_KEYS];
+    int i;
+    for (i = 0; i < STRIPE_KEYS; i++) {
+        memset(&args[i], 0, sizeof(stripe_arg));
+        args[i].contexts = contexts;
+        snprintf(args[i].key, sizeof(args[i].key), "stripe_key_%d", i);
+        pthread_create(&threads[i], NULL, stripe_worker, &args[i]);
+    }
 
-    struct stat st;
-    size_t kprefix_path_len = strlen(dbfile) + 6;
-    char kprefix_path[kprefix_path_len];
-    snprintf(kprefix_path, kprefix_path_len, "%s/%02x%02x", dbfile, ((char *)key)[0], ((char *)key)[klen-1]);
+    // a key may share the lock with BLOCKED_KEY, so don't wait for all of them
+    int completed = 0;
+    int n;
+    for (n = 0; n < 200 && completed < STRIPE_KEYS; n++) {
+        usleep(10000);
+        completed = 0;
+        for (i = 0; i < STRIPE_KEYS; i++) {
+            if (__sync_fetch_and_add(&args[i].done, 0) && args[i].rc == 0)
+                completed++;
+        }
+    }
 
-    size_t kpath_len = kprefix_path_len + 1 + strlen(kstr) + 1;
-    char kpath[kpath_len];
-    snprintf(kpath, sizeof(kpath), "%s/%s", kprefix_path, kstr);
+    // nothing has been measured if the commit of BLOCKED_KEY was never held
+    if (!held)
+        completed = -1;
 
-    if (stat(kprefix_path, &st) != 0 || !S_ISDIR(st.st_mode))
-        return 0;
-    
-    if (stat(kpath, &st) != 0 || !S_ISDIR(st.st_mode))
-        return 0;
+    pthread_mutex_lock(&block_lock);
+    block_released = 1;
+    pthread_cond_broadcast(&block_cond);
+    pthread_mutex_unlock(&block_lock);
 
-    char seq_path[kpath_len + 5]; // kpath_len + / + "seq" + null-terminator
-    snprintf(seq_path, sizeof(seq_path), "%s/seq", kpath);
+    for (i = 0; i < STRIPE_KEYS; i++)
+        pthread_join(threads[i], NULL);
+    pthread_join(blocked_thread, NULL);
+    __sync_lock_test_and_set(&blocking, 0);
 
-    FILE *seq_file = fopen(seq_path, "r");
-    if (!seq_file)
-        return 0;
+    return completed;
+}
 
-    uint64_t seq = 0;
-    size_t nitems = fread(&seq, sizeof(seq), 1, seq_file);
+#define BENCH_THREADS 8
 
+typedef struct {
+    kepaxos_log_t *log;
+    int id;
+    int num_commits;
+} bench_arg;
 
-    if (nitems < 1 && ferror(seq_file))
-        fprintf(stderr, "Error reading the seq_file %s: %s\n", seq_path, strerror(errno));
+static void *
+bench_worker(void *priv)
+{
+    bench_arg *arg = (bench_arg *)priv;
+    int i;
+    for (i = 0; i < arg->num_commits; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "bench_key_%d_%d", arg->id, i);
+        kepaxos_set_last_seq_for_key(arg->log, key, strlen(key), (i + 1) << 8, i + 1);
+    }
+    return NULL;
+}
 
-    fclose(seq_file);
+// measures the commits/sec sustained by the log in the given durability mode
+// and returns the number of keys found with the expected seq once reopened
+static int
+bench_log(kepaxos_log_durability_t mode, char *name, int num_commits)
+{
+    char *dbfile = "/tmp/kepaxos_bench.db";
+    remove_log(dbfile);
 
-    uint64_t ballot = 0;
-    char ballot_path[kpath_len + 8];
-    snprintf(ballot_path, sizeof(ballot_path), "%s/ballot", kpath);
-
-    FILE *ballot_file = fopen(ballot_path, "r");
-    if (ballot_file) {
-        nitems = fread(&ballot, sizeof(ballot), 1, ballot_file);
-        if (nitems < 1 && ferror(ballot_file))
-            fprintf(stderr, "Error reading the ballot_file %s: %s\n", ballot_path, strerror(errno));
-        fclose(ballot_file);
-    } else {
-        fprintf(stderr, "Error reading the ballot_file %s: %s\n", ballot_path, strerror(errno));
+    kepaxos_log_t *log = kepaxos_log_create(dbfile);
+    if (!log)
+        return -1;
+    kepaxos_log_set_durability(log, mode, 0);
+
+    struct timeval start, end, diff;
+    gettimeofday(&start, NULL);
+
+    pthread_t threads[BENCH_THREADS];
+    bench_arg args[BENCH_THREADS];
+    int i;
+    for (i = 0; i < BENCH_THREADS; i++) {
+        args[i].log = log;
+        args[i].id = i;
+        args[i].num_commits = num_commits;
+        pthread_create(&threads[i], NULL, bench_worker, &args[i]);
     }
+    for (i = 0; i < BENCH_THREADS; i++)
+        pthread_join(threads[i], NULL);
 
-    item->seq = seq;
-    item->ballot = ballot;
- 
-    return 0;
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    double elapsed = diff.tv_sec + (double)diff.tv_usec / 1000000;
+    int total = num_commits * BENCH_THREADS;
+    printf("durability %-8s: %d commits from %d threads in %.3fs (%.0f commits/sec)\n",
+           name, total, BENCH_THREADS, elapsed, elapsed > 0 ? total / elapsed : 0);
+
+    kepaxos_log_destroy(log);
+
+    int found = 0;
+    log = kepaxos_log_create(dbfile);
+    if (log) {
+        int n;
+        for (i = 0; i < BENCH_THREADS; i++) {
+            for (n = 0; n < num_commits; n++) {
+                char key[64];
+                snprintf(key, sizeof(key), "bench_key_%d_%d", i, n);
+                uint64_t ballot = 0;
+                if (kepaxos_last_seq_for_key(log, key, strlen(key), &ballot) == n + 1 &&
+                    ballot == (n + 1) << 8)
+                {
+                    found++;
+                }
+            }
+        }
+        kepaxos_log_destroy(log);
+    }
+    remove_log(dbfile);
+    return found;
+}
+
+// makes a write to the log fail (by lowering the max file size) and
+// returns a bitmask of the checks which didn't behave as expected
+static int
+log_failure(kepaxos_log_durability_t mode)
+{
+    char *dbfile = "/tmp/kepaxos_failure.db";
+    remove_log(dbfile);
+
+    kepaxos_log_t *log = kepaxos_log_create(dbfile);
+    if (!log)
+        return -1;
+    kepaxos_log_set_durability(log, mode, 0);
+
+    int result = 0;
+    if (kepaxos_set_last_seq_for_key(log, "key1", 4, 1 << 8, 1) != 0)
+        result |= 0x01;
+
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/log", dbfile);
+    struct stat st;
+    struct rlimit old_limit, limit;
+    if (stat(path, &st) != 0 || getrlimit(RLIMIT_FSIZE, &old_limit) != 0) {
+        kepaxos_log_destroy(log);
+        remove_log(dbfile);
+        return -1;
+    }
+    limit = old_limit;
+    limit.rlim_cur = st.st_size;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    if (kepaxos_set_last_seq_for_key(log, "key2", 4, 2 << 8, 2) == 0)
+        result |= 0x02;
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+
+    // the error is sticky
+    if (kepaxos_set_last_seq_for_key(log, "key3", 4, 3 << 8, 3) == 0)
+        result |= 0x04;
+
+    if (kepaxos_log_reopen(log) != 0 ||
+        kepaxos_set_last_seq_for_key(log, "key3", 4, 3 << 8, 3) != 0)
+    {
+        result |= 0x08;
+    }
+
+    // the record which failed is not in the log
+    if (kepaxos_last_seq_for_key(log, "key1", 4, NULL) != 1 ||
+        kepaxos_last_seq_for_key(log, "key2", 4, NULL) != 0 ||
+        kepaxos_last_seq_for_key(log, "key3", 4, NULL) != 3)
+    {
+        result |= 0x10;
+    }
+
+    kepaxos_log_destroy(log);
+    remove_log(dbfile);
+    return result;
+}
+
+// makes the leader fail to record a commit (by lowering the max file size) and
+// returns a bitmask of the checks which didn't behave as expected
+static int
+command_failure(kepaxos_node *contexts)
+{
+    char *path = "/tmp/kepaxos_test0.db/log";
+    struct stat st;
+    struct rlimit old_limit, limit;
+    if (stat(path, &st) != 0 || getrlimit(RLIMIT_FSIZE, &old_limit) != 0)
+        return -1;
+
+    int result = 0;
+    limit = old_limit;
+    limit.rlim_cur = st.st_size;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    int rc = kepaxos_run_command(contexts[0].ke, 0x00, "failing_key", 11, "value", 5);
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    if (rc != -1)
+        result |= 0x01;
+
+    // the commit which couldn't be recorded has not been propagated
+    if (kepaxos_seq(contexts[1].ke, "failing_key", 11) != 0)
+        result |= 0x02;
+
+    // the log is reopened in the background and the commands succeed again
+    int i;
+    for (i = 0; i < 20; i++) {
+        if (kepaxos_run_command(contexts[0].ke, 0x00, "failing_key", 11, "value", 5) == 0)
+            break;
+        usleep(100000);
+    }
+    if (i == 20 || kepaxos_seq(contexts[1].ke, "failing_key", 11) == 0)
+        result |= 0x04;
+
+    return result;
+}
+
+#define LEGACY_DBFILE "/tmp/kepaxos_legacy.db"
+
+// writes an entry of the old directory-based log
+// (a NULL key or a 0 seq leave the corresponding file out)
+static void
+write_legacy_entry(char *prefix, char *hashes, char *key, uint64_t seq, uint64_t ballot)
+{
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/%s", LEGACY_DBFILE, prefix);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/%s/%s", LEGACY_DBFILE, prefix, hashes);
+    mkdir(path, 0700);
+
+    char *names[] = { "key", "seq", "ballot" };
+    void *values[] = { key, &seq, &ballot };
+    size_t lens[] = { key ? strlen(key) : 0, sizeof(seq), sizeof(ballot) };
+    int i;
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s/%s", LEGACY_DBFILE, prefix, hashes, names[i]);
+        unlink(path);
+        if ((i == 0 && !key) || (i > 0 && !seq))
+            continue;
+        FILE *out = fopen(path, "w");
+        if (out) {
+            fwrite(values[i], lens[i], 1, out);
+            fclose(out);
+        }
+    }
+}
+
+static void
+remove_legacy_entry(char *prefix, char *hashes)
+{
+    char *names[] = { "key", "seq", "ballot" };
+    char path[2048];
+    int i;
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s/%s", LEGACY_DBFILE, prefix, hashes, names[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", LEGACY_DBFILE, prefix, hashes);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/%s", LEGACY_DBFILE, prefix);
+    rmdir(path);
+}
+
+// builds an old directory-based log and returns a bitmask
+// of the checks which didn't behave as expected once imported
+static int
+legacy_import(void)
+{
+    char path[2048];
+    remove_log(LEGACY_DBFILE);
+    mkdir(LEGACY_DBFILE, 0700);
+    snprintf(path, sizeof(path), "%s/ballots", LEGACY_DBFILE);
+    mkdir(path, 0700);
+    write_legacy_entry("6b31", "0001", "key1", 5, 7 << 8);
+    write_legacy_entry("6b32", "0002", "key2", 3, 2 << 8);
+    write_legacy_entry("6b33", "0003", "key3", 0, 0); // never committed
+
+    int result = 0;
+    uint64_t ballot = 0;
+    kepaxos_log_t *log = kepaxos_log_create(LEGACY_DBFILE);
+    if (!log ||
+        kepaxos_last_seq_for_key(log, "key1", 4, &ballot) != 5 || ballot != 7 << 8 ||
+        kepaxos_last_seq_for_key(log, "key2", 4, NULL) != 3 ||
+        kepaxos_last_seq_for_key(log, "key3", 4, NULL) != 0)
+    {
+        result |= 0x01;
+    }
+    if (log)
+        kepaxos_log_destroy(log);
+
+    // the old log is imported only once
+    write_legacy_entry("6b31", "0001", "key1", 9, 8 << 8);
+    log = kepaxos_log_create(LEGACY_DBFILE);
+    if (!log || kepaxos_last_seq_for_key(log, "key1", 4, NULL) != 5)
+        result |= 0x02;
+    if (log)
+        kepaxos_log_destroy(log);
+
+    // an entry which can't be imported prevents the log from being opened
+    snprintf(path, sizeof(path), "%s/log", LEGACY_DBFILE);
+    unlink(path);
+    write_legacy_entry("6b31", "0001", NULL, 5, 7 << 8);
+    log = kepaxos_log_create(LEGACY_DBFILE);
+    if (log) {
+        result |= 0x04;
+        kepaxos_log_destroy(log);
+    }
+    snprintf(path, sizeof(path), "%s/log.import", LEGACY_DBFILE);
+    if (access(path, F_OK) == 0)
+        result |= 0x08;
+
+    remove_legacy_entry("6b31", "0001");
+    remove_legacy_entry("6b32", "0002");
+    remove_legacy_entry("6b33", "0003");
+    snprintf(path, sizeof(path), "%s/ballots", LEGACY_DBFILE);
+    rmdir(path);
+    remove_log(LEGACY_DBFILE);
+    return result;
 }
 
 int check_log_consistency(kepaxos_node *contexts, int start_index, int end_index)
@@ -182,10 +569,8 @@ int check_log_consistency(kepaxos_node *contexts, int start_index, int end_index
     int check = 1;
     kepaxos_log_item prev_item = { 0, 0 };
     for (i = start_index; i <= end_index; i++) {
-        char dbfile[2048];
-        snprintf(dbfile, sizeof(dbfile), "/tmp/kepaxos_test%d.db", i);
         kepaxos_log_item item;
-        fetch_log(dbfile, "test_key", 8, &item);
+        fetch_log(contexts[i].ke, "test_key", 8, &item);
         if (i > 0 && memcmp(&prev_item, &item, sizeof(prev_item)) != 0) {
             check = 0;
             break;
@@ -323,12 +708,80 @@ int main(int argc, char **argv)
     else
         ut_failure("Log is not aligned on all the replicas");
 
+    ut_testing("the log is restored when a replica is restarted");
+    kepaxos_log_item before, after;
+    fetch_log(contexts[0].ke, "test_key", 8, &before);
+    kepaxos_context_destroy(contexts[0].ke);
+    kepaxos_callbacks_t callbacks = {
+        .send = send_callback,
+        .commit = commit_callback,
+        .recover = recover_callback,
+        .priv = &arg[0]
+    };
+    contexts[0].ke = kepaxos_context_create("/tmp/kepaxos_test0.db", nodes, 5, 0, 1, &callbacks);
+    if (contexts[0].ke) {
+        fetch_log(contexts[0].ke, "test_key", 8, &after);
+        if (before.seq && memcmp(&before, &after, sizeof(before)) == 0)
+            ut_success();
+        else
+            ut_failure("seq/ballot %u/%u != %u/%u", after.seq, after.ballot, before.seq, before.ballot);
+    } else {
+        ut_failure("Can't reopen the kepaxos instance");
+        exit(ut_failed);
+    }
+
+    // commands on unrelated keys don't serialize on a single lock
+    ut_testing("commands on other keys complete while a replica holds the lock of a key");
+    int completed = run_while_blocked(contexts);
+    if (completed >= STRIPE_KEYS - 1)
+        ut_success();
+    else
+        ut_failure("%d commands out of %d completed while the key was locked", completed, STRIPE_KEYS);
+
+    ut_testing("kepaxos_run_command() fails if the leader can't record the commit");
+    ut_validate_int(command_failure(contexts), 0);
+
+    // (the throughput is printed for reference only, it depends on the host)
+    for (i = 0; i < 5; i++)
+        kepaxos_set_durability(contexts[i].ke, KEPAXOS_LOG_DURABILITY_BATCHED, 0);
+
+    int num_threads;
+    for (num_threads = 1; num_threads <= SCALING_MAX_THREADS; num_threads *= 2) {
+        int failed = run_scaling(contexts, num_threads, 200);
+        ut_testing("%d concurrent clients running commands on distinct keys", num_threads);
+        ut_validate_int(failed, 0);
+    }
+
     for (i = 0; i < 5; i++) {
         kepaxos_context_destroy(contexts[i].ke);
         char dbfile[2048];
         snprintf(dbfile, sizeof(dbfile), "/tmp/kepaxos_test%d.db", i);
-        unlink(dbfile);
+        remove_log(dbfile);
     }
+    int found = bench_log(KEPAXOS_LOG_DURABILITY_NONE, "none", 20000);
+    ut_testing("all the records are found when reopening the log (durability: none)");
+    ut_validate_int(found, 20000 * BENCH_THREADS);
+
+    found = bench_log(KEPAXOS_LOG_DURABILITY_BATCHED, "batched", 500);
+    ut_testing("all the records are found when reopening the log (durability: batched)");
+    ut_validate_int(found, 500 * BENCH_THREADS);
+
+    found = bench_log(KEPAXOS_LOG_DURABILITY_SYNC, "sync", 250);
+    ut_testing("all the records are found when reopening the log (durability: sync)");
+    ut_validate_int(found, 250 * BENCH_THREADS);
+
+    ut_testing("a failed write fails the records until the log is reopened (durability: none)");
+    ut_validate_int(log_failure(KEPAXOS_LOG_DURABILITY_NONE), 0);
+
+    ut_testing("a failed write fails the records until the log is reopened (durability: batched)");
+    ut_validate_int(log_failure(KEPAXOS_LOG_DURABILITY_BATCHED), 0);
+
+    ut_testing("a failed write fails the records until the log is reopened (durability: sync)");
+    ut_validate_int(log_failure(KEPAXOS_LOG_DURABILITY_SYNC), 0);
+
+    ut_testing("the old directory-based log is imported into the segment");
+    ut_validate_int(legacy_import(), 0);
+
 __exit:
     ut_summary();
     exit(ut_failed); 
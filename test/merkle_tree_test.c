@@ -0,0 +1,104 @@
+#include <merkle_tree.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_KEYS 10000
+#define TREE_DEPTH 3
+
+static void
+add_items(merkle_tree_t *tree, int from, int to, char *value)
+{
+    int i;
+    for (i = from; i < to; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "test_key%d", i);
+        uint64_t digest = merkle_tree_digest(key, strlen(key), value, strlen(value));
+        merkle_tree_add(tree, key, strlen(key), digest);
+    }
+}
+
+// returns the number of leaves which differ, descending only
+// into the subtrees whose hashes don't match
+static int
+diff_leaves(merkle_tree_t *a, merkle_tree_t *b, int *visited)
+{
+    int depth = merkle_tree_depth(a);
+    uint32_t *nodes = malloc(sizeof(uint32_t) * merkle_tree_num_nodes(a, depth));
+    uint32_t *next = malloc(sizeof(uint32_t) * merkle_tree_num_nodes(a, depth));
+    int num_nodes = 1;
+    nodes[0] = 0;
+    *visited = 0;
+    int level;
+    for (level = 0; level <= depth; level++) {
+        int i, n, num_next = 0;
+        for (i = 0; i < num_nodes; i++) {
+            (*visited)++;
+            if (merkle_tree_hash(a, level, nodes[i]) == merkle_tree_hash(b, level, nodes[i]))
+                continue;
+            if (level == depth) {
+                next[num_next++] = nodes[i];
+                continue;
+            }
+            for (n = 0; n < MERKLE_TREE_FANOUT; n++)
+                next[num_next++] = nodes[i] * MERKLE_TREE_FANOUT + n;
+        }
+        uint32_t *tmp = nodes;
+        nodes = next;
+        next = tmp;
+        num_nodes = num_next;
+    }
+    free(nodes);
+    free(next);
+    return num_nodes;
+}
+
+int
+main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    ut_testing("merkle_tree_create(%d)", TREE_DEPTH);
+    merkle_tree_t *a = merkle_tree_create(TREE_DEPTH);
+    merkle_tree_t *b = merkle_tree_create(TREE_DEPTH);
+    ut_validate_int((a && b), 1);
+
+    ut_testing("merkle_tree_create(%d) == NULL", MERKLE_TREE_MAX_DEPTH + 1);
+    ut_validate_int((merkle_tree_create(MERKLE_TREE_MAX_DEPTH + 1) == NULL), 1);
+
+    ut_testing("the root hash doesn't depend on the order of the items");
+    add_items(a, 0, NUM_KEYS, "value");
+    add_items(b, NUM_KEYS / 2, NUM_KEYS, "value");
+    add_items(b, 0, NUM_KEYS / 2, "value");
+    ut_validate_int((merkle_tree_hash(a, 0, 0) == merkle_tree_hash(b, 0, 0)), 1);
+
+    ut_testing("a changed value is found by descending a single path");
+    add_items(b, 42, 43, "value");
+    add_items(b, 42, 43, "other value");
+    int visited = 0;
+    int differing = diff_leaves(a, b, &visited);
+    if (differing == 1 && visited == 1 + TREE_DEPTH * MERKLE_TREE_FANOUT)
+        ut_success();
+    else
+        ut_failure("%d leaves differ (%d nodes visited)", differing, visited);
+
+    ut_testing("removing the changed item restores the root hash");
+    add_items(b, 42, 43, "other value");
+    add_items(b, 42, 43, "value");
+    ut_validate_int((merkle_tree_hash(a, 0, 0) == merkle_tree_hash(b, 0, 0)), 1);
+
+    ut_testing("a missing item is detected");
+    add_items(b, 7, 8, "value");
+    ut_validate_int(diff_leaves(a, b, &visited), 1);
+
+    merkle_tree_destroy(a);
+    merkle_tree_destroy(b);
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
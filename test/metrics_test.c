@@ -0,0 +1,236 @@
+#include <shardcache.h>
+#include <shardcache_internal.h>
+#include <connections.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define METRICS_PEER "127.0.0.1:9790"
+#define METRICS_HTTP_HOST "127.0.0.1"
+#define METRICS_HTTP_PORT 9791
+
+static int
+is_sample_of(const char *name, size_t len, const char *family)
+{
+    static const char *suffixes[] = { "", "_total", "_sum", "_count", NULL };
+    size_t flen = strlen(family);
+    int i;
+    if (len < flen || strncmp(name, family, flen) != 0)
+        return 0;
+    for (i = 0; suffixes[i]; i++) {
+        if (len - flen == strlen(suffixes[i]) && strncmp(name + flen, suffixes[i], len - flen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// checks that each family is declared once by a TYPE line, that its samples
+// immediately follow the declaration, that all the names are valid and that
+// the text is terminated by the EOF marker (returns the line of the first
+// error, 0 if the text is valid)
+static int
+check_exposition(char *text)
+{
+    char families[1024][128];
+    int num_families = 0;
+    int line = 0;
+    char *p = text;
+    while (*p) {
+        char *eol = strchr(p, '\n');
+        if (!eol)
+            return line + 1; // the last line must be terminated as well
+        line++;
+
+        if (strncmp(p, "# EOF", 5) == 0)
+            return (eol - p == 5 && eol[1] == 0) ? 0 : line;
+
+        if (strncmp(p, "# TYPE ", 7) == 0) {
+            char *name = p + 7;
+            size_t len = strcspn(name, " \n");
+            if (len >= sizeof(families[0]) || num_families == sizeof(families) / sizeof(families[0]))
+                return line;
+            int i;
+            for (i = 0; i < num_families; i++) {
+                if (strlen(families[i]) == len && strncmp(families[i], name, len) == 0)
+                    return line;
+            }
+            snprintf(families[num_families++], sizeof(families[0]), "%.*s", (int)len, name);
+        } else if (*p != '#') {
+            size_t len = strcspn(p, "{ \n");
+            size_t i;
+            for (i = 0; i < len; i++) {
+                char c = p[i];
+                if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+                    return line;
+            }
+            if (!num_families || !is_sample_of(p, len, families[num_families - 1]))
+                return line;
+        }
+        p = eol + 1;
+    }
+    return line + 1; // no EOF marker
+}
+
+static char *
+http_get(char *request, int *closed_after)
+{
+    struct timeval start, end, diff;
+    int fd = open_connection(METRICS_HTTP_HOST, METRICS_HTTP_PORT, 5000);
+    if (fd < 0)
+        return NULL;
+
+    gettimeofday(&start, NULL);
+    if (request)
+        write_socket(fd, request, strlen(request));
+
+    size_t size = 1024, used = 0;
+    char *response = malloc(size);
+    for (;;) {
+        if (used == size - 1)
+            response = realloc(response, size *= 2);
+        int rb = read_socket(fd, response + used, size - 1 - used, 0);
+        if (rb <= 0)
+            break;
+        used += rb;
+    }
+    response[used] = 0;
+    gettimeofday(&end, NULL);
+    close(fd);
+
+    timersub(&end, &start, &diff);
+    if (closed_after)
+        *closed_after = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+    return response;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    shardcache_log_init("metrics_test", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    char *address[1] = { METRICS_PEER };
+    shardcache_node_t *node = shardcache_node_create("metrics_peer", address, 1);
+    shardcache_t *cache = shardcache_create(METRICS_PEER, &node, 1, NULL, NULL, 1, 0, 1<<20);
+    ut_testing("shardcache_create()");
+    ut_validate_int((cache != NULL), 1);
+    if (!cache) {
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    shardcache_clear_counters(cache);
+    shardcache_sharded_counter_add(cache->sharded_counters, SHARDCACHE_COUNTER_GETS, 7);
+    for (i = 0; i < 5; i++)
+        shardcache_histogram_record(cache->latencies[SHARDCACHE_LATENCY_CMD_GET], 100);
+
+    char *text = NULL;
+    ut_testing("shardcache_get_metrics()");
+    ut_validate_int(shardcache_get_metrics(cache, &text, NULL), 0);
+    if (!text) {
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    ut_testing("the rendered text is a valid exposition terminated by # EOF");
+    ut_validate_int(check_exposition(text), 0);
+
+    ut_testing("a counter is exported as a counter family with the _total suffix");
+    ut_validate_int((strstr(text, "# TYPE shardcache_gets counter\nshardcache_gets_total 7\n") != NULL), 1);
+
+    ut_testing("a gauge is exported as a gauge family");
+    ut_validate_int((strstr(text, "# TYPE shardcache_cache_size gauge\nshardcache_cache_size ") != NULL), 1);
+
+    ut_testing("the sizes of the arc lists are grouped in a labeled family");
+    ut_validate_int((strstr(text, "# TYPE shardcache_arc_list_size gauge\n") != NULL &&
+                     strstr(text, "shardcache_arc_list_size{list=\"mfu\"} ") != NULL), 1);
+
+    ut_testing("the per-worker statistics are grouped in a labeled family");
+    ut_validate_int((strstr(text, "# TYPE shardcache_worker_numfds gauge\n") != NULL &&
+                     strstr(text, "shardcache_worker_numfds{worker=\"0\"} ") != NULL), 1);
+
+    ut_testing("a latency histogram is exported as a summary");
+    ut_validate_int((strstr(text, "# TYPE shardcache_latency_microseconds summary\n") != NULL &&
+                     strstr(text, "shardcache_latency_microseconds{path=\"cmd_get\",quantile=\"0.99\"} ") != NULL &&
+                     strstr(text, "shardcache_latency_microseconds_sum{path=\"cmd_get\"} 500\n") != NULL &&
+                     strstr(text, "shardcache_latency_microseconds_count{path=\"cmd_get\"} 5\n") != NULL), 1);
+
+    ut_testing("the latencies of the code paths never hit are not exported");
+    ut_validate_int((strstr(text, "{path=\"cmd_set\"") == NULL), 1);
+    free(text);
+
+    char listen_address[64];
+    snprintf(listen_address, sizeof(listen_address), "%s:%d", METRICS_HTTP_HOST, METRICS_HTTP_PORT);
+    ut_testing("shardcache_metrics_listen()");
+    ut_validate_int(shardcache_metrics_listen(cache, listen_address), 0);
+
+    ut_testing("GET /metrics returns the exposition");
+    char *response = http_get("GET /metrics HTTP/1.0\r\n\r\n", NULL);
+    char *body = response ? strstr(response, "\r\n\r\n") : NULL;
+    if (response && strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0 &&
+        strstr(response, "Content-Type: " SHARDCACHE_METRICS_CONTENT_TYPE "\r\n") &&
+        body && check_exposition(body + 4) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("Unexpected response: %.64s", response ? response : "(null)");
+    }
+    free(response);
+
+    ut_testing("GET of any other path returns 404");
+    response = http_get("GET /other HTTP/1.0\r\n\r\n", NULL);
+    ut_validate_int((response && strncmp(response, "HTTP/1.0 404 ", 13) == 0), 1);
+    free(response);
+
+    ut_testing("a client which doesn't send the request is dropped after the timeout");
+    int elapsed = 0;
+    response = http_get(NULL, &elapsed);
+    if (response && !*response && elapsed < 3000)
+        ut_success();
+    else
+        ut_failure("dropped after %dms", elapsed);
+    free(response);
+
+    ut_testing("a client trickling the request is dropped after the timeout");
+    int fd = open_connection(METRICS_HTTP_HOST, METRICS_HTTP_PORT, 5000);
+    struct timeval start, end, diff;
+    gettimeofday(&start, NULL);
+    int sent = 0;
+    for (i = 0; i < 50 && fd >= 0; i++) {
+        if (write_socket(fd, "G", 1) != 1)
+            break;
+        sent++;
+        usleep(100000);
+    }
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    if (fd >= 0)
+        close(fd);
+    // the writes start failing once the listener closes the connection
+    if (fd >= 0 && sent < 50 && diff.tv_sec < 3)
+        ut_success();
+    else
+        ut_failure("still connected after %d bytes", sent);
+
+    ut_testing("the listener still serves the requests after the timeouts");
+    response = http_get("GET /metrics HTTP/1.0\r\n\r\n", NULL);
+    ut_validate_int((response && strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0), 1);
+    free(response);
+
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
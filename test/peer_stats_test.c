@@ -0,0 +1,135 @@
+#include <shardcache.h>
+#include <shardcache_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define PEER0 "127.0.0.1:9780"
+#define PEER1 "127.0.0.1:9781"
+
+static uint64_t
+peer_counter(shardcache_t *cache, char *label, char *stat)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "peer_%s_%s", label, stat);
+
+    uint64_t value = (uint64_t)-1;
+    shardcache_counter_t *counters = NULL;
+    int i, num_counters = shardcache_get_counters(cache, &counters);
+    for (i = 0; i < num_counters; i++) {
+        if (strcmp(counters[i].name, name) == 0) {
+            value = counters[i].value;
+            break;
+        }
+    }
+    free(counters);
+    return value;
+}
+
+int
+main(int argc, char **argv)
+{
+    shardcache_log_init("peer_stats_test", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    char *addr0[1] = { PEER0 };
+    char *addr1[1] = { PEER1 };
+    shardcache_node_t *nodes[2];
+    nodes[0] = shardcache_node_create("peer0", addr0, 1);
+    nodes[1] = shardcache_node_create("peer1", addr1, 1);
+
+    shardcache_t *cache0 = shardcache_create(PEER0, nodes, 2, NULL, NULL, 1, 0, 1<<20);
+    shardcache_t *cache1 = shardcache_create(PEER1, nodes, 2, NULL, NULL, 1, 0, 1<<20);
+    ut_testing("shardcache_create()");
+    ut_validate_int((cache0 != NULL && cache1 != NULL), 1);
+    if (!cache0 || !cache1) {
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    ut_testing("the statistics of the local node aren't exported");
+    ut_validate_int((peer_counter(cache0, "peer0", "connections_in_use") == (uint64_t)-1), 1);
+
+    ut_testing("shardcache_get_connection_for_peer() accounts the connection in use");
+    int fd = shardcache_get_connection_for_peer(cache0, PEER1);
+    if (fd >= 0)
+        ut_validate_int(peer_counter(cache0, "peer1", "connections_in_use"), 1);
+    else
+        ut_failure("Can't connect to %s", PEER1);
+
+    ut_testing("shardcache_release_connection_for_peer() puts the connection back in the pool");
+    shardcache_release_connection_for_peer(cache0, PEER1, fd);
+    uint64_t in_use = peer_counter(cache0, "peer1", "connections_in_use");
+    uint64_t idle = peer_counter(cache0, "peer1", "connections_idle");
+    if (in_use == 0 && idle == 1)
+        ut_success();
+    else
+        ut_failure("in use: %"PRIu64", idle: %"PRIu64, in_use, idle);
+
+    ut_testing("a discarded connection is not in use anymore and is not pooled");
+    fd = shardcache_get_connection_for_peer(cache0, PEER1);
+    shardcache_discard_connection_for_peer(cache0, PEER1, fd, 0);
+    in_use = peer_counter(cache0, "peer1", "connections_in_use");
+    uint64_t pooled = peer_counter(cache0, "peer1", "connections_pooled");
+    uint64_t errors = peer_counter(cache0, "peer1", "errors");
+    if (fd >= 0 && in_use == 0 && pooled == 0 && errors == 0)
+        ut_success();
+    else
+        ut_failure("in use: %"PRIu64", pooled: %"PRIu64", errors: %"PRIu64,
+                   in_use, pooled, errors);
+
+    ut_testing("a connection discarded because of a timeout counts an error and a timeout");
+    fd = shardcache_get_connection_for_peer(cache0, PEER1);
+    errno = ETIMEDOUT;
+    shardcache_discard_connection_for_peer(cache0, PEER1, fd, 1);
+    in_use = peer_counter(cache0, "peer1", "connections_in_use");
+    errors = peer_counter(cache0, "peer1", "errors");
+    uint64_t timeouts = peer_counter(cache0, "peer1", "timeouts");
+    if (fd >= 0 && in_use == 0 && errors == 1 && timeouts == 1)
+        ut_success();
+    else
+        ut_failure("in use: %"PRIu64", errors: %"PRIu64", timeouts: %"PRIu64,
+                   in_use, errors, timeouts);
+
+    ut_testing("shardcache_clear_counters() preserves the connections in use");
+    fd = shardcache_get_connection_for_peer(cache0, PEER1);
+    shardcache_clear_counters(cache0);
+    in_use = peer_counter(cache0, "peer1", "connections_in_use");
+    errors = peer_counter(cache0, "peer1", "errors");
+    if (fd >= 0 && in_use == 1 && errors == 0)
+        ut_success();
+    else
+        ut_failure("in use: %"PRIu64", errors: %"PRIu64, in_use, errors);
+    shardcache_release_connection_for_peer(cache0, PEER1, fd);
+
+    ut_testing("the connections in use are back to 0 after a round of commands");
+    int i;
+    for (i = 0; i < 100; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "peer_stats_key%d", i);
+        shardcache_set(cache0, key, strlen(key), "value", 5);
+        shardcache_del(cache0, key, strlen(key));
+    }
+    // the callbacks of the asynchronous commands may still be running
+    for (i = 0; i < 100 && peer_counter(cache0, "peer1", "connections_in_use") != 0; i++)
+        usleep(10000);
+    ut_validate_int(peer_counter(cache0, "peer1", "connections_in_use"), 0);
+
+    shardcache_destroy(cache0);
+    shardcache_destroy(cache1);
+    shardcache_node_destroy(nodes[0]);
+    shardcache_node_destroy(nodes[1]);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -5,6 +5,334 @@
 #include <libgen.h>
 #include <arpa/inet.h>
 
+#define INDEX_TEST_KEYS 3000 // more than SHARDCACHE_INDEX_BATCH_SIZE
+
+static int
+index_test_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    *value = malloc(klen);
+    memcpy(*value, key, klen);
+    *vlen = klen;
+    return 0;
+}
+
+static void *
+index_test_open(void *priv)
+{
+    return calloc(1, sizeof(int));
+}
+
+static size_t
+index_test_next(void *cursor, shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    int *next = (int *)cursor;
+    size_t count = 0;
+    while (count < isize && *next < INDEX_TEST_KEYS) {
+        char key[32];
+        snprintf(key, sizeof(key), "index_key%d", *next);
+        index[count].key = strdup(key);
+        index[count].klen = strlen(key);
+        index[count].vlen = strlen(key);
+        (*next)++;
+        count++;
+    }
+    return count;
+}
+
+static void
+index_test_close(void *cursor, void *priv)
+{
+    free(cursor);
+}
+
+static int
+index_test_item(void *key, size_t klen, size_t vlen, void *priv)
+{
+    int *count = (int *)priv;
+    if (klen != vlen || klen < 9 || memcmp(key, "index_key", 9) != 0)
+        return -1;
+    (*count)++;
+    return 0;
+}
+
+static void
+test_index_cursor()
+{
+    shardcache_storage_t storage;
+    memset(&storage, 0, sizeof(storage));
+    storage.version = SHARDCACHE_STORAGE_API_VERSION;
+    storage.fetch = index_test_fetch;
+    storage.index_open = index_test_open;
+    storage.index_next = index_test_next;
+    storage.index_close = index_test_close;
+
+    char *address_array[1] = { "127.0.0.1:9760" };
+    shardcache_node_t *node = shardcache_node_create("index_peer", address_array, 1);
+
+    shardcache_t *cache = shardcache_create("index_peer", &node, 1, &storage, NULL, 1, 0, 1<<20);
+
+    ut_testing("shardcache_index_cursor_next() returns all the keys in batches");
+    shardcache_index_cursor_t *cursor = shardcache_index_cursor_open(cache);
+    int count = 0;
+    if (cursor) {
+        shardcache_storage_index_item_t items[SHARDCACHE_INDEX_BATCH_SIZE];
+        size_t n;
+        while ((n = shardcache_index_cursor_next(cursor, items, SHARDCACHE_INDEX_BATCH_SIZE)) > 0) {
+            int i;
+            for (i = 0; i < n; i++)
+                free(items[i].key);
+            count += n;
+        }
+        shardcache_index_cursor_close(cursor);
+    }
+    ut_validate_int(count, INDEX_TEST_KEYS);
+
+    ut_testing("shardcache_get_index() works with a cursor-only storage");
+    shardcache_storage_index_t *index = shardcache_get_index(cache);
+    ut_validate_int(index ? index->size : 0, INDEX_TEST_KEYS);
+    if (index)
+        shardcache_free_index(index);
+
+    sleep(1); // let the server complete its startup
+
+    ut_testing("shardcache_client_index_foreach() streams the whole index");
+    shardcache_client_t *client = shardcache_client_create(&node, 1, NULL);
+    count = 0;
+    int rc = shardcache_client_index_foreach(client, "index_peer", index_test_item, &count);
+    if (rc == INDEX_TEST_KEYS && count == INDEX_TEST_KEYS)
+        ut_success();
+    else
+        ut_failure("rc: %d, items: %d", rc, count);
+
+    ut_testing("shardcache_client_index() still returns the whole index");
+    index = shardcache_client_index(client, "index_peer");
+    ut_validate_int(index ? index->size : 0, INDEX_TEST_KEYS);
+    if (index)
+        shardcache_free_index(index);
+
+    shardcache_client_destroy(client);
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+}
+
+#define MIGRATION_TEST_KEYS 3072 // three chunks of the index
+#define MIGRATION_TEST_CHECKPOINT "/tmp/shardcache_migration_test.cp"
+
+static volatile int migration_local[MIGRATION_TEST_KEYS];  // keys in the old owner's storage
+static volatile int migration_copied[MIGRATION_TEST_KEYS]; // keys stored by the new owner
+static int migration_owned[MIGRATION_TEST_KEYS];           // keys moving to the new owner
+static volatile int migration_fail_key = -1;  // the key the new owner refuses to store
+static volatile int migration_block_key = -1; // the key the migrator stalls on
+static volatile int migration_blocked = 0;
+
+static int
+migration_test_key_index(void *key, size_t klen)
+{
+    char buf[32];
+    if (klen <= 13 || klen >= sizeof(buf) || memcmp(key, "migration_key", 13) != 0)
+        return -1;
+    memcpy(buf, key, klen);
+    buf[klen] = 0;
+    int index = atoi(buf + 13);
+    return (index >= 0 && index < MIGRATION_TEST_KEYS) ? index : -1;
+}
+
+static int
+migration_test_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    volatile int *keys = (volatile int *)priv;
+    int index = migration_test_key_index(key, klen);
+    if (index < 0 || !keys[index])
+        return 0;
+
+    if (keys == migration_local && index == migration_block_key) {
+        // stall the migrator in the middle of the second chunk
+        migration_blocked = 1;
+        sleep(3);
+    }
+
+    *value = malloc(klen);
+    memcpy(*value, key, klen);
+    *vlen = klen;
+    return 0;
+}
+
+static int
+migration_test_store(void *key, size_t klen, void *value, size_t vlen, void *priv)
+{
+    volatile int *keys = (volatile int *)priv;
+    int index = migration_test_key_index(key, klen);
+    if (index < 0 || (keys == migration_copied && index == migration_fail_key))
+        return -1;
+    keys[index] = 1;
+    return 0;
+}
+
+static int
+migration_test_remove(void *key, size_t klen, void *priv)
+{
+    volatile int *keys = (volatile int *)priv;
+    int index = migration_test_key_index(key, klen);
+    if (index < 0)
+        return -1;
+    keys[index] = 0;
+    return 0;
+}
+
+static size_t
+migration_test_next(void *cursor, shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    volatile int *keys = (volatile int *)priv;
+    int *next = (int *)cursor;
+    size_t count = 0;
+    while (count < isize && *next < MIGRATION_TEST_KEYS) {
+        if (keys[*next]) {
+            char key[32];
+            snprintf(key, sizeof(key), "migration_key%d", *next);
+            index[count].key = strdup(key);
+            index[count].klen = strlen(key);
+            index[count].vlen = strlen(key);
+            count++;
+        }
+        (*next)++;
+    }
+    return count;
+}
+
+static shardcache_t *
+migration_test_create(char *me, shardcache_node_t **nodes, int num_nodes, volatile int *keys)
+{
+    shardcache_storage_t storage;
+    memset(&storage, 0, sizeof(storage));
+    storage.version = SHARDCACHE_STORAGE_API_VERSION;
+    storage.fetch = migration_test_fetch;
+    storage.store = migration_test_store;
+    storage.remove = migration_test_remove;
+    storage.index_open = index_test_open;
+    storage.index_next = migration_test_next;
+    storage.index_close = index_test_close;
+    storage.index_stable = 1;
+    storage.priv = (void *)keys;
+
+    shardcache_t *cache = shardcache_create(me, nodes, num_nodes, &storage, NULL, 1, 0, 1<<20);
+    if (cache) {
+        shardcache_migration_workers(cache, 1);
+        shardcache_migration_checkpoint(cache, MIGRATION_TEST_CHECKPOINT);
+        shardcache_migration_checkpoint_interval(cache, 1);
+    }
+    return cache;
+}
+
+static void
+test_migration_resume()
+{
+    int i;
+
+    unlink(MIGRATION_TEST_CHECKPOINT);
+
+    shardcache_node_t *nodes[3];
+    for (i = 0; i < 3; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "migration_peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:976%d", i + 1);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    // the keys owned by migration_peer1 move to migration_peer2
+    shardcache_node_t *old_nodes[2] = { nodes[0], nodes[1] };
+    shardcache_node_t *new_nodes[2] = { nodes[0], nodes[2] };
+
+    shardcache_t *target = migration_test_create("migration_peer2", new_nodes, 2, migration_copied);
+
+    int to_migrate = 0;
+    for (i = 0; i < MIGRATION_TEST_KEYS; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "migration_key%d", i);
+        migration_local[i] = 1;
+        if (!target || shardcache_test_ownership(target, key, strlen(key), NULL, NULL) != 1)
+            continue;
+        migration_owned[i] = 1;
+        to_migrate++;
+        if (migration_fail_key == -1)
+            migration_fail_key = i;
+        else if (migration_block_key == -1 && i >= SHARDCACHE_INDEX_BATCH_SIZE)
+            migration_block_key = i;
+    }
+
+    shardcache_t *cache = migration_test_create("migration_peer0", old_nodes, 2, migration_local);
+
+    sleep(1); // let the servers complete their startup
+
+    ut_testing("an interrupted migration leaves its checkpoint on disk");
+    if (cache && target && migration_block_key != -1 &&
+        shardcache_migration_begin(cache, new_nodes, 2, 0) == 0)
+    {
+        for (i = 0; i < 100 && !migration_blocked; i++)
+            usleep(100000);
+        sleep(2); // let the migrator save a checkpoint while stalled
+        shardcache_destroy(cache);
+        cache = NULL;
+        if (migration_blocked && !migration_copied[migration_fail_key] &&
+            access(MIGRATION_TEST_CHECKPOINT, F_OK) == 0)
+        {
+            ut_success();
+        } else {
+            ut_failure("blocked: %d, copied: %d, checkpoint: %d", migration_blocked,
+                       migration_copied[migration_fail_key], access(MIGRATION_TEST_CHECKPOINT, F_OK));
+        }
+    } else {
+        ut_failure("Can't start the migration");
+    }
+    if (cache)
+        shardcache_destroy(cache);
+
+    ut_testing("the migrated keys are removed from the old owner right away");
+    int copied = 0;
+    int kept = 0;
+    for (i = 0; i < MIGRATION_TEST_KEYS; i++) {
+        if (migration_copied[i]) {
+            copied++;
+            kept += migration_local[i];
+        }
+    }
+    if (copied > 0 && kept == 0)
+        ut_success();
+    else
+        ut_failure("%d keys copied, %d still in the old owner", copied, kept);
+
+    ut_testing("a resumed migration retries the keys which couldn't be migrated");
+    int fail_key = migration_fail_key;
+    migration_fail_key = -1;
+    migration_block_key = -1;
+    cache = migration_test_create("migration_peer0", old_nodes, 2, migration_local);
+    if (cache && target && shardcache_migration_begin(cache, new_nodes, 2, 0) == 0) {
+        int left = to_migrate;
+        for (i = 0; i < 300 && left; i++) {
+            usleep(100000);
+            int n;
+            for (n = 0, left = 0; n < MIGRATION_TEST_KEYS; n++)
+                left += (migration_owned[n] && (migration_local[n] || !migration_copied[n]));
+        }
+        if (!left && migration_copied[fail_key])
+            ut_success();
+        else
+            ut_failure("%d keys left, failed key copied: %d", left, migration_copied[fail_key]);
+    } else {
+        ut_failure("Can't resume the migration");
+    }
+
+    if (cache)
+        shardcache_destroy(cache);
+    if (target)
+        shardcache_destroy(target);
+    for (i = 0; i < 3; i++)
+        shardcache_node_destroy(nodes[i]);
+
+    unlink(MIGRATION_TEST_CHECKPOINT);
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -338,6 +666,10 @@ int main(int argc, char **argv)
 
     free(nodes);
 
+    test_index_cursor();
+
+    test_migration_resume();
+
     ut_summary();
     exit(ut_failed);
 }
@@ -0,0 +1,161 @@
+#include <shardcache.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_KEYS 1000
+#define SNAPSHOT_PATH "/tmp/shardcache_snapshot_test.snap"
+
+static shardcache_t *
+create_cache(shardcache_node_t **node, char *address)
+{
+    char *address_array[1] = { address };
+    *node = shardcache_node_create("snapshot_peer", address_array, 1);
+    return shardcache_create("snapshot_peer", node, 1, NULL, NULL, 1, 0, 1<<20);
+}
+
+static int
+count_keys(shardcache_t *cache)
+{
+    int i;
+    int found = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        char value[32];
+        snprintf(key, sizeof(key), "snapshot_key%d", i);
+        snprintf(value, sizeof(value), "snapshot_value%d", i);
+        size_t vlen = 0;
+        void *data = shardcache_get(cache, key, strlen(key), &vlen, NULL);
+        if (data && vlen == strlen(value) && memcmp(data, value, vlen) == 0)
+            found++;
+        free(data);
+    }
+    return found;
+}
+
+static int
+load_snapshot(char *address)
+{
+    shardcache_node_t *node = NULL;
+    shardcache_t *cache = create_cache(&node, address);
+    if (!cache)
+        return -2;
+    int loaded = shardcache_snapshot(cache, SNAPSHOT_PATH);
+    // don't overwrite the snapshot when destroying the instance
+    shardcache_snapshot(cache, NULL);
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+    return loaded;
+}
+
+static void
+write_record(FILE *out, char type, char *key, uint32_t klen, char *value, uint32_t vlen)
+{
+    uint32_t hdr[3] = { htonl(klen), htonl(vlen), 0 };
+    fputc(type, out);
+    fwrite(hdr, sizeof(hdr), 1, out);
+    fwrite(key, 1, strlen(key), out);
+    fwrite(value, 1, strlen(value), out);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    shardcache_log_init("snapshot_test", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    unlink(SNAPSHOT_PATH);
+
+    shardcache_node_t *node = NULL;
+    shardcache_t *cache = create_cache(&node, "127.0.0.1:9770");
+    ut_testing("shardcache_create()");
+    ut_validate_int((cache != NULL), 1);
+    if (!cache) {
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        char value[32];
+        snprintf(key, sizeof(key), "snapshot_key%d", i);
+        snprintf(value, sizeof(value), "snapshot_value%d", i);
+        shardcache_set_volatile(cache, key, strlen(key), value, strlen(value), 3600);
+    }
+
+    ut_testing("shardcache_snapshot() returns 0 if there is no snapshot yet");
+    ut_validate_int(shardcache_snapshot(cache, SNAPSHOT_PATH), 0);
+
+    ut_testing("shardcache_snapshot_save() saves %d keys", NUM_KEYS);
+    ut_validate_int(shardcache_snapshot_save(cache, NULL), NUM_KEYS);
+
+    shardcache_snapshot(cache, NULL);
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+
+    ut_testing("a new instance loads all the keys from the snapshot");
+    cache = create_cache(&node, "127.0.0.1:9771");
+    int loaded = cache ? shardcache_snapshot(cache, SNAPSHOT_PATH) : -1;
+    int found = cache ? count_keys(cache) : 0;
+    if (loaded == NUM_KEYS && found == NUM_KEYS)
+        ut_success();
+    else
+        ut_failure("loaded: %d, found: %d", loaded, found);
+    if (cache) {
+        shardcache_snapshot(cache, NULL);
+        shardcache_destroy(cache);
+    }
+    shardcache_node_destroy(node);
+
+    ut_testing("a truncated snapshot loads the complete records only");
+    FILE *snap = fopen(SNAPSHOT_PATH, "r+");
+    if (snap) {
+        fseek(snap, 0, SEEK_END);
+        long size = ftell(snap);
+        fclose(snap);
+        // cut the trailer and part of the last record
+        if (truncate(SNAPSHOT_PATH, size - 10) == 0)
+            ut_validate_int(load_snapshot("127.0.0.1:9772"), NUM_KEYS - 1);
+        else
+            ut_failure("Can't truncate the snapshot");
+    } else {
+        ut_failure("Can't open the snapshot");
+    }
+
+    uint32_t dump_time = htonl(time(NULL));
+
+    ut_testing("a record with a length bigger than the file stops the load");
+    snap = fopen(SNAPSHOT_PATH, "w");
+    fwrite("SHCSNAP1", 1, 8, snap);
+    fwrite(&dump_time, sizeof(dump_time), 1, snap);
+    write_record(snap, 'V', "snapshot_key0", 13, "snapshot_value0", 15);
+    write_record(snap, 'V', "snapshot_key1", 13, "snapshot_value1", 1<<20);
+    fclose(snap);
+    ut_validate_int(load_snapshot("127.0.0.1:9773"), 1);
+
+    ut_testing("a record with an insane length stops the load");
+    snap = fopen(SNAPSHOT_PATH, "w");
+    fwrite("SHCSNAP1", 1, 8, snap);
+    fwrite(&dump_time, sizeof(dump_time), 1, snap);
+    write_record(snap, 'V', "snapshot_key0", 0xFFFFFFF0, "snapshot_value0", 15);
+    write_record(snap, 'V', "snapshot_key1", 13, "snapshot_value1", 15);
+    fclose(snap);
+    ut_validate_int(load_snapshot("127.0.0.1:9774"), 0);
+
+    unlink(SNAPSHOT_PATH);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,147 @@
+#include <shardcache.h>
+#include <tracing.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_THREADS 4
+#define SPANS_PER_THREAD 10000
+
+static shardcache_tracer_t *tracer = NULL;
+
+// the fetch completes in another thread, as a fetch from a peer does
+static void *
+complete_fetch(void *priv)
+{
+    uint64_t trace_id = *((uint64_t *)priv);
+    shardcache_tracer_span(tracer, trace_id, SHARDCACHE_TRACE_SPAN_PEER_FETCH,
+                           1100, 1900, "peer:4444", 9);
+    return NULL;
+}
+
+static void *
+read_current(void *priv)
+{
+    *((uint64_t *)priv) = shardcache_trace_current();
+    return NULL;
+}
+
+static void *
+record_spans(void *priv)
+{
+    int i;
+    for (i = 0; i < SPANS_PER_THREAD; i++) {
+        uint64_t trace_id = shardcache_tracer_sample(tracer);
+        shardcache_tracer_span(tracer, trace_id, SHARDCACHE_TRACE_SPAN_REQUEST,
+                               1000, 1010, "key", 3);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    ut_testing("shardcache_tracer_create()");
+    tracer = shardcache_tracer_create(0);
+    ut_validate_int((tracer != NULL), 1);
+
+    ut_testing("a sample rate of 0 doesn't trace any request");
+    int i, sampled = 0;
+    for (i = 0; i < 1000; i++)
+        sampled += (shardcache_tracer_sample(tracer) != 0);
+    ut_validate_int(sampled, 0);
+
+    ut_testing("a sample rate of 1 traces all the requests with different ids");
+    shardcache_tracer_set_sample_rate(tracer, 1);
+    uint64_t first = shardcache_tracer_sample(tracer);
+    uint64_t second = shardcache_tracer_sample(tracer);
+    ut_validate_int((first != 0 && second != 0 && first != second), 1);
+
+    ut_testing("an empty tracer dumps no traces");
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    ut_validate_int(shardcache_tracer_dump(tracer, 0, &out), 0);
+
+    ut_testing("the spans recorded by different threads are merged in one trace");
+    uint64_t trace_id = 0x1234;
+    shardcache_tracer_span(tracer, trace_id, SHARDCACHE_TRACE_SPAN_PARSE, 1000, 1050, NULL, 0);
+    shardcache_tracer_span(tracer, trace_id, SHARDCACHE_TRACE_SPAN_ARC_LOOKUP, 1050, 1100, NULL, 0);
+    pthread_t th;
+    pthread_create(&th, NULL, complete_fetch, &trace_id);
+    pthread_join(th, NULL);
+    shardcache_tracer_span(tracer, trace_id, SHARDCACHE_TRACE_SPAN_WRITE, 1900, 2000, NULL, 0);
+    shardcache_tracer_span(tracer, trace_id, SHARDCACHE_TRACE_SPAN_REQUEST, 1000, 2000, "slow\nkey", 8);
+    fbuf_clear(&out);
+    int num_traces = shardcache_tracer_dump(tracer, 0, &out);
+    char *expected = "trace;0000000000001234;1000;slow\\x0akey\r\n"
+                     "span;parse;0;50\r\n"
+                     "span;arc_lookup;50;50\r\n"
+                     "span;peer_fetch;100;800;peer:4444\r\n"
+                     "span;write;900;100\r\n";
+    if (num_traces == 1 && fbuf_used(&out) == strlen(expected) &&
+        memcmp(fbuf_data(&out), expected, strlen(expected)) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("got %d traces: '%.*s'", num_traces, fbuf_used(&out), fbuf_data(&out));
+    }
+
+    ut_testing("the traces faster than min_usecs are skipped");
+    fbuf_clear(&out);
+    ut_validate_int(shardcache_tracer_dump(tracer, 1001, &out), 0);
+
+    ut_testing("the traces whose request is still being served are skipped");
+    shardcache_tracer_span(tracer, 0x5678, SHARDCACHE_TRACE_SPAN_ARC_LOOKUP, 1000, 5000, NULL, 0);
+    fbuf_clear(&out);
+    ut_validate_int(shardcache_tracer_dump(tracer, 0, &out), 1);
+
+    ut_testing("the slowest traces are dumped first");
+    shardcache_tracer_span(tracer, 0x9abc, SHARDCACHE_TRACE_SPAN_REQUEST, 3000, 6000, "slower", 6);
+    fbuf_clear(&out);
+    num_traces = shardcache_tracer_dump(tracer, 0, &out);
+    if (num_traces == 2 && strncmp(fbuf_data(&out), "trace;0000000000009abc;3000;slower\r\n", 36) == 0)
+        ut_success();
+    else
+        ut_failure("got %d traces: '%.*s'", num_traces, fbuf_used(&out), fbuf_data(&out));
+
+    ut_testing("at most %d traces are dumped while %d threads record spans",
+               SHARDCACHE_TRACE_DUMP_MAX, NUM_THREADS);
+    pthread_t threads[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, record_spans, NULL);
+    int failed = 0;
+    for (i = 0; i < 100 && !failed; i++) {
+        fbuf_clear(&out);
+        num_traces = shardcache_tracer_dump(tracer, 0, &out);
+        failed = (num_traces > SHARDCACHE_TRACE_DUMP_MAX);
+    }
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    fbuf_clear(&out);
+    num_traces = shardcache_tracer_dump(tracer, 0, &out);
+    if (!failed && num_traces == SHARDCACHE_TRACE_DUMP_MAX)
+        ut_success();
+    else
+        ut_failure("got %d traces", num_traces);
+
+    ut_testing("the current trace id is per thread");
+    shardcache_trace_set_current(trace_id);
+    uint64_t other = 1;
+    pthread_create(&th, NULL, read_current, &other);
+    pthread_join(th, NULL);
+    ut_validate_int((shardcache_trace_current() == trace_id && other == 0), 1);
+    shardcache_trace_set_current(0);
+
+    fbuf_destroy(&out);
+    shardcache_tracer_destroy(tracer);
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
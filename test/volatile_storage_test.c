@@ -0,0 +1,234 @@
+#include <volatile_storage.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_KEYS 100000
+
+static void
+copy_value(void *value, size_t vlen, uint32_t expire, void *priv)
+{
+    memcpy(priv, value, vlen);
+    ((char *)priv)[vlen] = 0;
+}
+
+static int
+count_keys(void *key, size_t klen, void *value, size_t vlen, uint32_t *expire, void *priv)
+{
+    (*((int *)priv))++;
+    return 1;
+}
+
+typedef struct {
+    int evicted;
+    int never_expiring;
+    uint64_t expire_sum;
+} eviction_stats_t;
+
+static void
+count_evicted(void *key, size_t klen, size_t vlen, uint32_t expire, void *priv)
+{
+    eviction_stats_t *stats = (eviction_stats_t *)priv;
+    stats->evicted++;
+    if (expire)
+        stats->expire_sum += expire;
+    else
+        stats->never_expiring++;
+}
+
+static int
+sum_expire(void *key, size_t klen, void *value, size_t vlen, uint32_t *expire, void *priv)
+{
+    eviction_stats_t *stats = (eviction_stats_t *)priv;
+    if (*expire)
+        stats->expire_sum += *expire;
+    else
+        stats->never_expiring++;
+    stats->evicted++;
+    return 1;
+}
+
+static int
+remove_odd_keys(void *key, size_t klen, void *value, size_t vlen, uint32_t *expire, void *priv)
+{
+    char num_str[32];
+    if (vlen >= sizeof(num_str))
+        return 1;
+    memcpy(num_str, value, vlen);
+    num_str[vlen] = 0;
+    int num = strtol(num_str, NULL, 10);
+    return (num % 2) ? -1 : 1;
+}
+
+static int
+remove_all_keys(void *key, size_t klen, void *value, size_t vlen, uint32_t *expire, void *priv)
+{
+    return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+    char key[32];
+    char value[32];
+    char buf[4096];
+
+    ut_init(basename(argv[0]));
+
+    ut_testing("volatile_storage_create()");
+    volatile_storage_t *vs = volatile_storage_create();
+    ut_validate_int((vs != NULL), 1);
+
+    ut_testing("volatile_storage_set() stores %d keys", NUM_KEYS);
+    int failed = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        size_t klen = snprintf(key, sizeof(key), "test_key%d", i);
+        size_t vlen = snprintf(value, sizeof(value), "%d", i);
+        if (volatile_storage_set(vs, key, klen, value, vlen, 0, 0, NULL) != VOLATILE_STORAGE_STORED) {
+            ut_failure("Can't store the key %s", key);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("volatile_storage_count() == %d", NUM_KEYS);
+    ut_validate_int(volatile_storage_count(vs), NUM_KEYS);
+
+    ut_testing("volatile_storage_get() returns the stored values");
+    failed = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        size_t klen = snprintf(key, sizeof(key), "test_key%d", i);
+        snprintf(value, sizeof(value), "%d", i);
+        if (volatile_storage_get(vs, key, klen, copy_value, buf) != 0 || strcmp(buf, value) != 0) {
+            ut_failure("Bad value for key %s", key);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("volatile_storage_set(inx = 1) doesn't replace an existing key");
+    ut_validate_int(volatile_storage_set(vs, "test_key0", 9, "new", 3, 0, 1, NULL), VOLATILE_STORAGE_EXISTS);
+
+    ut_testing("volatile_storage_set() replaces an existing key with a large value");
+    char large[2048];
+    memset(large, 'x', sizeof(large) - 1);
+    large[sizeof(large) - 1] = 0;
+    size_t prev_len = 0;
+    int rc = volatile_storage_set(vs, "test_key0", 9, large, sizeof(large) - 1, 0, 0, &prev_len);
+    if (rc == VOLATILE_STORAGE_REPLACED && prev_len == 1 &&
+        volatile_storage_get(vs, "test_key0", 9, copy_value, buf) == 0 && strcmp(buf, large) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("Can't replace the value (rc: %d, prev_len: %d)", rc, (int)prev_len);
+    }
+
+    ut_testing("volatile_storage_foreach() removes the keys for which the callback returns -1");
+    volatile_storage_foreach(vs, remove_odd_keys, NULL);
+    ut_validate_int(volatile_storage_count(vs), NUM_KEYS / 2);
+
+    ut_testing("the probe sequences still work after the removals");
+    failed = 0;
+    for (i = 1; i < NUM_KEYS; i++) {
+        size_t klen = snprintf(key, sizeof(key), "test_key%d", i);
+        if (volatile_storage_exists(vs, key, klen) != !(i % 2)) {
+            ut_failure("Unexpected existence for key %s", key);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("volatile_storage_delete() removes the even keys");
+    failed = 0;
+    for (i = 0; i < NUM_KEYS; i += 2) {
+        size_t klen = snprintf(key, sizeof(key), "test_key%d", i);
+        if (volatile_storage_delete(vs, key, klen, NULL, NULL) != 0) {
+            ut_failure("Can't delete the key %s", key);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("the storage is empty");
+    int count = 0;
+    volatile_storage_foreach(vs, count_keys, &count);
+    ut_validate_int(count + volatile_storage_count(vs), 0);
+
+    ut_testing("volatile_storage_sample() returns nothing from an empty storage");
+    ut_validate_int(volatile_storage_sample(vs, 10, count_keys, &count), 0);
+
+    ut_testing("volatile_storage_sample() returns the requested number of samples");
+    volatile_storage_set(vs, "test_key", 8, "value", 5, 0, 0, NULL);
+    count = 0;
+    rc = volatile_storage_sample(vs, 10, count_keys, &count);
+    ut_validate_int(rc + count, 20);
+
+    volatile_storage_destroy(vs);
+
+    vs = volatile_storage_create();
+
+    ut_testing("volatile_storage_used() accounts the keys and the per-key overhead");
+    size_t payload = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        size_t klen = snprintf(key, sizeof(key), "test_key%d", i);
+        size_t vlen = snprintf(value, sizeof(value), "%d", i);
+        // the last 10% of the keys never expire
+        uint32_t expire = (i < NUM_KEYS - NUM_KEYS / 10) ? i + 1 : 0;
+        volatile_storage_set(vs, key, klen, value, vlen, expire, 0, NULL);
+        payload += klen + vlen;
+    }
+    size_t used = volatile_storage_used(vs);
+    if (used > payload && used <= volatile_storage_memory(vs))
+        ut_success();
+    else
+        ut_failure("used: %zu, payload: %zu, memory: %zu", used, payload, volatile_storage_memory(vs));
+
+    ut_testing("volatile_storage_evict() drops the storage below the given size");
+    size_t budget = used / 2;
+    eviction_stats_t evicted = { 0, 0, 0 };
+    size_t num_evicted = volatile_storage_evict(vs, budget, count_evicted, &evicted);
+    if (volatile_storage_used(vs) <= budget && num_evicted > 0 &&
+        num_evicted == evicted.evicted &&
+        volatile_storage_count(vs) == NUM_KEYS - num_evicted)
+    {
+        ut_success();
+    } else {
+        ut_failure("used: %zu, budget: %zu, evicted: %zu (%d notified), keys: %zu",
+                   volatile_storage_used(vs), budget, num_evicted, evicted.evicted,
+                   volatile_storage_count(vs));
+    }
+
+    ut_testing("volatile_storage_evict() evicts the keys closest to their expiration first");
+    eviction_stats_t kept = { 0, 0, 0 };
+    volatile_storage_foreach(vs, sum_expire, &kept);
+    double evicted_avg = (double)evicted.expire_sum / (evicted.evicted - evicted.never_expiring);
+    double kept_avg = (double)kept.expire_sum / (kept.evicted - kept.never_expiring);
+    if (evicted.never_expiring == 0 && kept.never_expiring == NUM_KEYS / 10 && evicted_avg < kept_avg)
+        ut_success();
+    else
+        ut_failure("never expiring evicted: %d, avg expire evicted: %.0f, kept: %.0f",
+                   evicted.never_expiring, evicted_avg, kept_avg);
+
+    ut_testing("volatile_storage_used() drops to 0 once all the keys are removed");
+    volatile_storage_foreach(vs, remove_all_keys, NULL);
+    ut_validate_int(volatile_storage_used(vs), 0);
+
+    volatile_storage_destroy(vs);
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
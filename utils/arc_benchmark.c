@@ -0,0 +1,646 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <sys/time.h>
+
+#include <linklist.h>
+
+#include <shardcache.h>
+#include <histogram.h>
+#include <arc.h>
+#include <arc_ops.h>
+
+#include "key_dist.h"
+
+#define DEFAULT_NUM_KEYS   1000000
+#define DEFAULT_VALUE_SIZE 100
+#define DEFAULT_CACHE_SIZE (1<<26)
+#define DEFAULT_NUM_OPS    10000000
+#define DEFAULT_THREADS    "1,2,4,8"
+#define MAX_THREAD_COUNTS  32
+
+/*
+ * Trace files are made of a 24 bytes header:
+ *
+ *   magic (8 bytes: "SHCTRACE"), version (4 bytes), reserved (4 bytes),
+ *   the number of records (8 bytes)
+ *
+ * followed by one 16 bytes record for each request:
+ *
+ *   key (8 bytes), value size (4 bytes, 0 to use the size given with -s),
+ *   op (1 byte: 0 = get, 1 = set, 2 = del), reserved (3 bytes)
+ *
+ * All the integers are little endian.
+ * Keys are 64 bit identifiers, the converter (-x) hashes the keys
+ * which are not numbers.
+ */
+#define TRACE_MAGIC        "SHCTRACE"
+#define TRACE_VERSION      1
+#define TRACE_HEADER_SIZE  24
+#define TRACE_RECORD_SIZE  16
+
+#define TRACE_OP_GET 0
+#define TRACE_OP_SET 1
+#define TRACE_OP_DEL 2
+
+typedef struct {
+    uint64_t key;
+    uint32_t size;
+    uint8_t op;
+} trace_record_t;
+
+// what the benchmark keeps in the memory reserved by the arc for each
+// object (which is as big as the cached_object_t used by shardcache,
+// so that the memory used for each object matches the one of a node)
+typedef struct {
+    uint32_t size;
+} bench_object_t;
+
+typedef struct {
+    arc_t *arc;
+    int index;
+    int num_threads;
+    uint64_t num_ops;
+    uint64_t random_state;
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t loads;
+    uint64_t removes;
+    uint64_t errors;
+} worker_t;
+
+static key_dist_t key_dist = KEY_DIST_INITIALIZER;
+static uint32_t num_keys = DEFAULT_NUM_KEYS;
+static uint32_t value_size = DEFAULT_VALUE_SIZE;
+static int load_rate = 0;
+static int remove_rate = 0;
+static char **keys = NULL;
+static size_t *klens = NULL;
+static trace_record_t *trace = NULL;
+static uint64_t trace_size = 0;
+
+// the values are never materialized, the arc only accounts their size
+// (which the fetch callback finds here, since it runs in the thread
+// calling arc_lookup())
+static __thread uint32_t next_size = 0;
+static __thread int fetched = 0;
+
+static void
+bench_init(const void *key, size_t klen, int async, arc_resource_t res, void *ptr, void *priv)
+{
+    ((bench_object_t *)ptr)->size = 0;
+}
+
+static int
+bench_fetch(void *obj, size_t *size, void *priv)
+{
+    fetched = 1;
+    ((bench_object_t *)obj)->size = next_size;
+    *size = next_size;
+    return 0;
+}
+
+static void
+bench_store(void *obj, void *data, size_t size, void *priv)
+{
+    ((bench_object_t *)obj)->size = size;
+}
+
+static void
+bench_evict(void *obj, void *priv)
+{
+}
+
+static size_t
+heap_used()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+    struct mallinfo mi = mallinfo();
+    return (unsigned int)mi.uordblks + (unsigned int)mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static arc_t *
+bench_arc_create(size_t cache_size, arc_mode_t mode, arc_ops_t *ops)
+{
+    static size_t *lists_size[4];
+    memset(ops, 0, sizeof(arc_ops_t));
+    ops->init = bench_init;
+    ops->fetch = bench_fetch;
+    ops->store = bench_store;
+    ops->evict = bench_evict;
+    return arc_create(ops, cache_size, sizeof(cached_object_t), lists_size, mode);
+}
+
+static inline void
+bench_lookup(worker_t *w, void *key, size_t klen, uint32_t size)
+{
+    void *ptr = NULL;
+    next_size = size;
+    fetched = 0;
+    arc_resource_t res = arc_lookup(w->arc, key, klen, &ptr, 0);
+    if (!res) {
+        w->errors++;
+        return;
+    }
+    w->lookups++;
+    // the objects found in the ghost lists still hold their value
+    // (the arc calls the evict callback only once they leave the cache)
+    // so they are hits as well
+    if (!fetched)
+        w->hits++;
+    arc_release_resource(w->arc, res);
+}
+
+static inline void
+bench_op(worker_t *w, int op, void *key, size_t klen, uint32_t size)
+{
+    char dummy = 0; // the store callback doesn't look at the value
+
+    switch(op) {
+        case TRACE_OP_SET:
+            if (arc_load(w->arc, key, klen, &dummy, size) < 0)
+                w->errors++;
+            else
+                w->loads++;
+            break;
+        case TRACE_OP_DEL:
+            arc_remove(w->arc, key, klen);
+            w->removes++;
+            break;
+        default:
+            bench_lookup(w, key, klen, size);
+            break;
+    }
+}
+
+static void *
+synthetic_worker(void *priv)
+{
+    worker_t *w = (worker_t *)priv;
+    uint64_t i;
+    for (i = 0; i < w->num_ops; i++) {
+        uint32_t idx = key_dist_next(&key_dist, &w->random_state);
+        int op = TRACE_OP_GET;
+        if (load_rate || remove_rate) {
+            int r = key_dist_random(&w->random_state) % 100;
+            if (r < remove_rate)
+                op = TRACE_OP_DEL;
+            else if (r < remove_rate + load_rate)
+                op = TRACE_OP_SET;
+        }
+        bench_op(w, op, keys[idx], klens[idx], value_size);
+    }
+    return NULL;
+}
+
+// the threads replay interleaved records of the trace
+static void *
+trace_worker(void *priv)
+{
+    worker_t *w = (worker_t *)priv;
+    uint64_t i;
+    for (i = w->index; i < trace_size; i += w->num_threads) {
+        trace_record_t *r = &trace[i];
+        bench_op(w, r->op, &r->key, sizeof(r->key), r->size ? r->size : value_size);
+        w->num_ops++;
+    }
+    return NULL;
+}
+
+static void
+run(arc_mode_t mode, size_t cache_size, int num_threads, uint64_t num_ops, uint64_t seed)
+{
+    arc_ops_t ops;
+    arc_t *arc = bench_arc_create(cache_size, mode, &ops);
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    worker_t *workers = calloc(num_threads, sizeof(worker_t));
+    int i;
+
+    uint64_t start = shardcache_histogram_now();
+    for (i = 0; i < num_threads; i++) {
+        worker_t *w = &workers[i];
+        w->arc = arc;
+        w->index = i;
+        w->num_threads = num_threads;
+        if (!trace)
+            w->num_ops = num_ops / num_threads + (i < num_ops % num_threads);
+        w->random_state = (seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+        if (!w->random_state)
+            w->random_state = 1;
+        pthread_create(&threads[i], NULL, trace ? trace_worker : synthetic_worker, w);
+    }
+
+    uint64_t total_ops = 0, lookups = 0, hits = 0, errors = 0;
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        total_ops += workers[i].num_ops;
+        lookups += workers[i].lookups;
+        hits += workers[i].hits;
+        errors += workers[i].errors;
+    }
+    double elapsed = (shardcache_histogram_now() - start) / 1e6;
+
+    printf("%-6s %7d %12" PRIu64 " %8.3f %12.0f %9.4f %10" PRIu64 " %12zu %7" PRIu64 "\n",
+           mode == SHARDCACHE_ARC_MODE_LOOSE ? "loose" : "strict",
+           num_threads,
+           total_ops,
+           elapsed,
+           elapsed > 0 ? total_ops / elapsed : 0,
+           lookups ? (double)hits / lookups : 0,
+           arc_count(arc),
+           arc_size(arc),
+           errors);
+
+    arc_destroy(arc);
+    free(threads);
+    free(workers);
+}
+
+// fill a cache large enough to hold all the keys and look at how much
+// the heap grew (the values are not allocated, so it's all metadata)
+static void
+measure_metadata()
+{
+    arc_ops_t ops;
+    worker_t w;
+    memset(&w, 0, sizeof(w));
+
+    size_t heap_before = heap_used();
+    w.arc = bench_arc_create(SIZE_MAX >> 1, SHARDCACHE_ARC_MODE_STRICT, &ops);
+
+    uint64_t i;
+    if (trace) {
+        for (i = 0; i < trace_size; i++)
+            bench_lookup(&w, &trace[i].key, sizeof(trace[i].key), value_size);
+    } else {
+        for (i = 0; i < num_keys; i++)
+            bench_lookup(&w, keys[i], klens[i], value_size);
+    }
+
+    size_t heap_after = heap_used();
+    uint64_t count = arc_count(w.arc);
+    if (count && heap_after > heap_before) {
+        printf("metadata: %.1f bytes per cached object (%" PRIu64 " objects, "
+               "including the %zu bytes of the object used by shardcache)\n",
+               (double)(heap_after - heap_before) / count, count, sizeof(cached_object_t));
+    }
+    arc_destroy(w.arc);
+}
+
+static inline void
+put_le(unsigned char *buf, uint64_t value, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+        buf[i] = (value >> (i * 8)) & 0xff;
+}
+
+static inline uint64_t
+get_le(unsigned char *buf, int size)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < size; i++)
+        value |= (uint64_t)buf[i] << (i * 8);
+    return value;
+}
+
+static int
+trace_load(char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return -1;
+    }
+
+    unsigned char header[TRACE_HEADER_SIZE];
+    if (fread(header, TRACE_HEADER_SIZE, 1, in) != 1 ||
+        memcmp(header, TRACE_MAGIC, 8) != 0 ||
+        get_le(header + 8, 4) != TRACE_VERSION)
+    {
+        fprintf(stderr, "%s is not a trace file (see -x)\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    trace_size = get_le(header + 16, 8);
+    trace = malloc(sizeof(trace_record_t) * (trace_size ? trace_size : 1));
+    if (!trace) {
+        fprintf(stderr, "Can't allocate %" PRIu64 " records\n", trace_size);
+        fclose(in);
+        return -1;
+    }
+
+    uint64_t i;
+    for (i = 0; i < trace_size; i++) {
+        unsigned char record[TRACE_RECORD_SIZE];
+        if (fread(record, TRACE_RECORD_SIZE, 1, in) != 1) {
+            fprintf(stderr, "%s is truncated (%" PRIu64 " records out of %" PRIu64 ")\n",
+                    path, i, trace_size);
+            fclose(in);
+            return -1;
+        }
+        trace[i].key = get_le(record, 8);
+        trace[i].size = get_le(record + 8, 4);
+        trace[i].op = record[12];
+    }
+    fclose(in);
+    return 0;
+}
+
+// FNV-1a
+static uint64_t
+trace_key_hash(char *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// one request per line: [get|set|del] <key> [<size>]
+// (separated by spaces, tabs or commas, lines starting with # are skipped)
+static int
+trace_convert(char *input, char *output)
+{
+    FILE *in = strcmp(input, "-") == 0 ? stdin : fopen(input, "r");
+    if (!in) {
+        fprintf(stderr, "Can't open %s\n", input);
+        return -1;
+    }
+
+    FILE *out = fopen(output, "w");
+    if (!out) {
+        fprintf(stderr, "Can't open %s for writing\n", output);
+        if (in != stdin)
+            fclose(in);
+        return -1;
+    }
+
+    unsigned char header[TRACE_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, TRACE_MAGIC, 8);
+    put_le(header + 8, TRACE_VERSION, 4);
+    fwrite(header, TRACE_HEADER_SIZE, 1, out);
+
+    uint64_t count = 0, line_num = 0, skipped = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, in) != -1) {
+        line_num++;
+        char *saveptr = NULL;
+        char *token = strtok_r(line, " \t,\r\n", &saveptr);
+        if (!token || *token == '#')
+            continue;
+
+        int op = TRACE_OP_GET;
+        if (strcasecmp(token, "get") == 0 || strcasecmp(token, "set") == 0 || strcasecmp(token, "del") == 0) {
+            op = (tolower(*token) == 'g') ? TRACE_OP_GET
+               : (tolower(*token) == 's') ? TRACE_OP_SET
+               : TRACE_OP_DEL;
+            token = strtok_r(NULL, " \t,\r\n", &saveptr);
+        }
+        if (!token) {
+            fprintf(stderr, "No key at line %" PRIu64 ", skipping it\n", line_num);
+            skipped++;
+            continue;
+        }
+
+        char *end = NULL;
+        uint64_t key = strtoull(token, &end, 10);
+        if (*end)
+            key = trace_key_hash(token);
+
+        char *size = strtok_r(NULL, " \t,\r\n", &saveptr);
+
+        unsigned char record[TRACE_RECORD_SIZE];
+        memset(record, 0, sizeof(record));
+        put_le(record, key, 8);
+        put_le(record + 8, size ? strtoul(size, NULL, 10) : 0, 4);
+        record[12] = op;
+        if (fwrite(record, TRACE_RECORD_SIZE, 1, out) != 1) {
+            fprintf(stderr, "Can't write to %s\n", output);
+            break;
+        }
+        count++;
+    }
+    free(line);
+
+    put_le(header + 16, count, 8);
+    fseek(out, 0, SEEK_SET);
+    fwrite(header, TRACE_HEADER_SIZE, 1, out);
+    fclose(out);
+    if (in != stdin)
+        fclose(in);
+
+    printf("Converted %" PRIu64 " requests (%" PRIu64 " lines skipped) to %s\n", count, skipped, output);
+    return 0;
+}
+
+static void
+usage(char *prog, int rc)
+{
+    printf("usage: %s [OPTIONS]...\n"
+           "    -c <cache_size>       the size of the cache (defaults to: %d)\n"
+           "    -k <num_keys>         the number of keys (defaults to: %d)\n"
+           "    -s <value_size>       the size of the values (defaults to: %d)\n"
+           "    -d <key_dist>         the distribution of the keys (defaults to: uniform)\n"
+           "                          uniform, zipf[:<theta>] (theta in (0, 1), defaults to 0.99) or\n"
+           "                          hotspot[:<hot_keys>:<hot_requests>] (fractions, defaults to 0.2:0.8)\n"
+           "    -n <num_ops>          the number of operations (defaults to: %d)\n"
+           "    -l <load_rate>        the percentage of arc_load() calls (defaults to: 0)\n"
+           "    -r <remove_rate>      the percentage of arc_remove() calls (defaults to: 0)\n"
+           "    -t <threads>          comma separated thread counts to run with (defaults to: %s)\n"
+           "    -m <mode>             strict, loose or all (defaults to: all)\n"
+           "    -S <seed>             the seed of the key generators (defaults to: 1)\n"
+           "    -f <trace_file>       replay a trace instead of generating the keys\n"
+           "    -x <text_trace>       convert a text trace (one '[get|set|del] <key> [<size>]'\n"
+           "                          per line, '-' for stdin) to a trace file and exit\n"
+           "    -o <trace_file>       the trace file written by -x\n"
+           "    -h                    prints this help\n",
+           prog,
+           DEFAULT_CACHE_SIZE,
+           DEFAULT_NUM_KEYS,
+           DEFAULT_VALUE_SIZE,
+           DEFAULT_NUM_OPS,
+           DEFAULT_THREADS);
+    exit(rc);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    uint64_t num_ops = DEFAULT_NUM_OPS;
+    uint64_t seed = 1;
+    char *threads_string = DEFAULT_THREADS;
+    char *mode_string = "all";
+    char *trace_file = NULL;
+    char *convert_input = NULL;
+    char *convert_output = NULL;
+
+    static struct option long_options[] = {
+        { "cache_size",  1, 0, 'c' },
+        { "keys",        1, 0, 'k' },
+        { "value_size",  1, 0, 's' },
+        { "key_dist",    1, 0, 'd' },
+        { "ops",         1, 0, 'n' },
+        { "load_rate",   1, 0, 'l' },
+        { "remove_rate", 1, 0, 'r' },
+        { "threads",     1, 0, 't' },
+        { "mode",        1, 0, 'm' },
+        { "seed",        1, 0, 'S' },
+        { "trace",       1, 0, 'f' },
+        { "convert",     1, 0, 'x' },
+        { "output",      1, 0, 'o' },
+        { "help",        0, 0, 'h' },
+        { NULL,          0, 0,  0  }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "c:k:s:d:n:l:r:t:m:S:f:x:o:h", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'c':
+                cache_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                num_keys = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                value_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                if (key_dist_parse(&key_dist, optarg) != 0) {
+                    fprintf(stderr, "Bad key distribution %s\n", optarg);
+                    usage(argv[0], -1);
+                }
+                break;
+            case 'n':
+                num_ops = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                load_rate = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                remove_rate = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                threads_string = optarg;
+                break;
+            case 'm':
+                mode_string = optarg;
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                trace_file = optarg;
+                break;
+            case 'x':
+                convert_input = optarg;
+                break;
+            case 'o':
+                convert_output = optarg;
+                break;
+            case 'h':
+                usage(argv[0], 0);
+                break;
+            default:
+                usage(argv[0], -1);
+        }
+    }
+
+    if (convert_input) {
+        if (!convert_output)
+            usage(argv[0], -1);
+        exit(trace_convert(convert_input, convert_output) == 0 ? 0 : -1);
+    }
+
+    if (!cache_size || !num_keys || !num_ops || load_rate < 0 || remove_rate < 0 ||
+        load_rate + remove_rate > 100)
+    {
+        usage(argv[0], -1);
+    }
+
+    int modes[2];
+    int num_modes = 0;
+    if (strcmp(mode_string, "strict") == 0 || strcmp(mode_string, "all") == 0)
+        modes[num_modes++] = SHARDCACHE_ARC_MODE_STRICT;
+    if (strcmp(mode_string, "loose") == 0 || strcmp(mode_string, "all") == 0)
+        modes[num_modes++] = SHARDCACHE_ARC_MODE_LOOSE;
+    if (!num_modes)
+        usage(argv[0], -1);
+
+    int thread_counts[MAX_THREAD_COUNTS];
+    int num_thread_counts = 0;
+    char *copy = strdup(threads_string);
+    char *saveptr = NULL;
+    char *token = strtok_r(copy, ",", &saveptr);
+    while (token && num_thread_counts < MAX_THREAD_COUNTS) {
+        int count = strtol(token, NULL, 10);
+        if (count <= 0)
+            usage(argv[0], -1);
+        thread_counts[num_thread_counts++] = count;
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    free(copy);
+    if (!num_thread_counts)
+        usage(argv[0], -1);
+
+    int i, n;
+    if (trace_file) {
+        if (trace_load(trace_file) != 0)
+            exit(-1);
+        printf("trace: %s (%" PRIu64 " requests), cache: %zu bytes\n",
+               trace_file, trace_size, cache_size);
+    } else {
+        key_dist_setup(&key_dist, num_keys);
+        keys = malloc(sizeof(char *) * num_keys);
+        klens = malloc(sizeof(size_t) * num_keys);
+        for (i = 0; i < num_keys; i++) {
+            char key[32];
+            klens[i] = snprintf(key, sizeof(key), "key:%d", i);
+            keys[i] = strdup(key);
+        }
+        printf("keys: %u, value: %u bytes, cache: %zu bytes, loads: %d%%, removes: %d%%\n",
+               num_keys, value_size, cache_size, load_rate, remove_rate);
+    }
+
+    measure_metadata();
+
+    printf("%-6s %7s %12s %8s %12s %9s %10s %12s %7s\n",
+           "mode", "threads", "ops", "seconds", "ops/s", "hit_ratio", "objects", "cache_bytes", "errors");
+    for (i = 0; i < num_modes; i++) {
+        for (n = 0; n < num_thread_counts; n++)
+            run(modes[i], cache_size, thread_counts[n], num_ops, seed);
+    }
+
+    if (keys) {
+        for (i = 0; i < num_keys; i++)
+            free(keys[i]);
+        free(keys);
+        free(klens);
+    }
+    free(trace);
+
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,548 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include <fbuf.h>
+#include <hashtable.h>
+
+#include <shardcache.h>
+#include <histogram.h>
+#include <messaging.h>
+
+#include "key_dist.h"
+
+#define DEFAULT_NUM_NODES    3
+#define DEFAULT_BASE_PORT    9870
+#define DEFAULT_NUM_CLIENTS  4
+#define DEFAULT_NUM_WORKERS  4
+#define DEFAULT_NUM_KEYS     100000
+#define DEFAULT_VALUE_SIZE   100
+#define DEFAULT_CACHE_SIZE   (1<<26)
+#define DEFAULT_DURATION     10
+
+static int num_nodes = DEFAULT_NUM_NODES;
+static int num_clients = DEFAULT_NUM_CLIENTS;
+static uint32_t num_keys = DEFAULT_NUM_KEYS;
+static size_t value_size = DEFAULT_VALUE_SIZE;
+static int write_rate = 0;
+static uint64_t seed = 1;
+static char *value = NULL;
+static int quit = 0;
+
+static key_dist_t key_dist = KEY_DIST_INITIALIZER;
+
+// what the clients connected to a node measured
+typedef struct {
+    char address[64];
+    shardcache_t *cache;
+    shardcache_histogram_t *get_latencies;
+    shardcache_histogram_t *set_latencies;
+    uint64_t gets;
+    uint64_t sets;
+    uint64_t errors;
+} node_stats_t;
+
+static node_stats_t *nodes_stats = NULL;
+
+typedef struct {
+    node_stats_t *node;
+    uint64_t random_state; // seeded from the command line so that runs can be repeated
+} client_arg_t;
+
+/*
+ * The in-memory storage shared by all the nodes.
+ * Each key is accessed only through its owner (the storage is not flagged
+ * as shared), so the other nodes still fetch it from the owner.
+ */
+
+static int
+mem_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    size_t len = 0;
+    *value = ht_get_copy((hashtable_t *)priv, key, klen, &len);
+    if (vlen)
+        *vlen = *value ? len : 0;
+    return 0;
+}
+
+static int
+mem_store(void *key, size_t klen, void *value, size_t vlen, void *priv)
+{
+    void *copy = malloc(vlen);
+    memcpy(copy, value, vlen);
+    void *prev = NULL;
+    if (ht_get_and_set((hashtable_t *)priv, key, klen, copy, vlen, &prev, NULL) != 0) {
+        free(copy);
+        return -1;
+    }
+    free(prev);
+    return 0;
+}
+
+static int
+mem_remove(void *key, size_t klen, void *priv)
+{
+    return ht_delete((hashtable_t *)priv, key, klen, NULL, NULL);
+}
+
+static int
+mem_exist(void *key, size_t klen, void *priv)
+{
+    return ht_exists((hashtable_t *)priv, key, klen);
+}
+
+static void
+stop(int sig)
+{
+    __sync_add_and_fetch(&quit, 1);
+}
+
+// each client drives a single node through its own connection
+static void *
+client(void *priv)
+{
+    client_arg_t *arg = (client_arg_t *)priv;
+    node_stats_t *node = arg->node;
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    int fd = -1;
+
+    while (!__sync_fetch_and_add(&quit, 0)) {
+        if (fd < 0) {
+            fd = connect_to_peer(node->address, 5000);
+            if (fd < 0) {
+                __sync_add_and_fetch(&node->errors, 1);
+                usleep(1000);
+                continue;
+            }
+        }
+
+        char key[32];
+        size_t klen = snprintf(key, sizeof(key), "key:%u", key_dist_next(&key_dist, &arg->random_state));
+        int is_set = (write_rate && key_dist_random(&arg->random_state) % 100 < write_rate);
+        uint64_t start = shardcache_histogram_now();
+        int rc;
+
+        if (is_set) {
+            rc = send_to_peer(node->address, NULL, 0, key, klen, value, value_size, 0, fd, 1);
+        } else {
+            fbuf_clear(&out);
+            rc = fetch_from_peer(node->address, NULL, 0, key, klen, &out, fd);
+        }
+
+        if (rc != 0) {
+            __sync_add_and_fetch(&node->errors, 1);
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        uint64_t usecs = shardcache_histogram_now() - start;
+        if (is_set) {
+            shardcache_histogram_record(node->set_latencies, usecs);
+            __sync_add_and_fetch(&node->sets, 1);
+        } else {
+            shardcache_histogram_record(node->get_latencies, usecs);
+            __sync_add_and_fetch(&node->gets, 1);
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    fbuf_destroy(&out);
+    return NULL;
+}
+
+static uint64_t
+counter_value(shardcache_counter_t *counters, int num_counters, char *name)
+{
+    int i;
+    for (i = 0; i < num_counters; i++) {
+        if (strcmp(counters[i].name, name) == 0)
+            return counters[i].value;
+    }
+    return 0;
+}
+
+static uint64_t
+latency_p99(shardcache_latency_t *latencies, int num_latencies, char *name)
+{
+    int i;
+    for (i = 0; i < num_latencies; i++) {
+        if (strcmp(latencies[i].name, name) == 0)
+            return latencies[i].p99;
+    }
+    return 0;
+}
+
+static void
+reset_stats()
+{
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        node_stats_t *node = &nodes_stats[i];
+        shardcache_clear_counters(node->cache);
+        shardcache_histogram_reset(node->get_latencies);
+        shardcache_histogram_reset(node->set_latencies);
+        __sync_fetch_and_and(&node->gets, 0);
+        __sync_fetch_and_and(&node->sets, 0);
+        __sync_fetch_and_and(&node->errors, 0);
+    }
+}
+
+#define REPORT_COLUMNS "node,requests/s,gets,sets,errors,hit_ratio,remote_fetch_ratio," \
+                       "remote_fetches/s,get_p50,get_p99,get_p999,get_max," \
+                       "set_p50,set_p99,set_p999,set_max,peer_fetch_p99\n"
+
+static void
+report_line(FILE *out, int csv, char *label, double elapsed, uint64_t gets, uint64_t sets, uint64_t errors,
+            uint64_t server_gets, uint64_t cache_misses, uint64_t fetch_remote,
+            shardcache_histogram_snapshot_t *get_snapshot, shardcache_histogram_snapshot_t *set_snapshot,
+            uint64_t peer_fetch_p99)
+{
+    // a GET served from the ARC doesn't miss,
+    // a miss is either fetched from the owner or from the storage
+    double hit_ratio = server_gets ? 1.0 - (double)cache_misses / server_gets : 0;
+    double remote_ratio = server_gets ? (double)fetch_remote / server_gets : 0;
+
+    fprintf(out, csv ? "%s,%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.4f,%.4f,%.0f,"
+                       "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ","
+                       "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n"
+                     : "%-21s %9.0f %10" PRIu64 " %9" PRIu64 " %6" PRIu64 " %6.4f %6.4f %9.0f"
+                       "   %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %7" PRIu64
+                       "   %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %7" PRIu64 "   %6" PRIu64 "\n",
+            label,
+            (gets + sets) / elapsed,
+            gets,
+            sets,
+            errors,
+            hit_ratio,
+            remote_ratio,
+            fetch_remote / elapsed,
+            shardcache_histogram_percentile(get_snapshot, 50),
+            shardcache_histogram_percentile(get_snapshot, 99),
+            shardcache_histogram_percentile(get_snapshot, 99.9),
+            shardcache_histogram_percentile(get_snapshot, 100),
+            shardcache_histogram_percentile(set_snapshot, 50),
+            shardcache_histogram_percentile(set_snapshot, 99),
+            shardcache_histogram_percentile(set_snapshot, 99.9),
+            shardcache_histogram_percentile(set_snapshot, 100),
+            peer_fetch_p99);
+}
+
+static void
+snapshot_add(shardcache_histogram_snapshot_t *total, shardcache_histogram_snapshot_t *snapshot)
+{
+    int b;
+    for (b = 0; b < SHARDCACHE_HISTOGRAM_NUM_BUCKETS; b++)
+        total->buckets[b] += snapshot->buckets[b];
+    total->count += snapshot->count;
+    total->sum += snapshot->sum;
+    if (snapshot->count && (!total->min || snapshot->min < total->min))
+        total->min = snapshot->min;
+    if (snapshot->max > total->max)
+        total->max = snapshot->max;
+}
+
+static void
+report(FILE *out, int csv, double elapsed)
+{
+    shardcache_histogram_snapshot_t *get_snapshot = malloc(sizeof(shardcache_histogram_snapshot_t));
+    shardcache_histogram_snapshot_t *set_snapshot = malloc(sizeof(shardcache_histogram_snapshot_t));
+    shardcache_histogram_snapshot_t *get_total = calloc(1, sizeof(shardcache_histogram_snapshot_t));
+    shardcache_histogram_snapshot_t *set_total = calloc(1, sizeof(shardcache_histogram_snapshot_t));
+    uint64_t gets = 0, sets = 0, errors = 0, server_gets = 0, cache_misses = 0, fetch_remote = 0;
+
+    if (csv) {
+        fprintf(out, REPORT_COLUMNS);
+    } else {
+        fprintf(out, "%-21s %9s %10s %9s %6s %6s %6s %9s   %-29s   %-29s   %s\n",
+                "", "", "", "", "", "", "", "remote",
+                "get latency (usecs)", "set latency (usecs)", "peer fetch");
+        fprintf(out, "%-21s %9s %10s %9s %6s %6s %6s %9s   %6s %6s %6s %7s   %6s %6s %6s %7s   %6s\n",
+                "node", "req/s", "gets", "sets", "errors", "hits", "remote", "fetches/s",
+                "p50", "p99", "p99.9", "max", "p50", "p99", "p99.9", "max", "p99");
+    }
+
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        node_stats_t *node = &nodes_stats[i];
+
+        shardcache_counter_t *counters = NULL;
+        int num_counters = shardcache_get_counters(node->cache, &counters);
+        uint64_t node_server_gets = counter_value(counters, num_counters, "gets");
+        uint64_t node_cache_misses = counter_value(counters, num_counters, "cache_misses");
+        uint64_t node_fetch_remote = counter_value(counters, num_counters, "fetch_remote");
+        free(counters);
+
+        shardcache_latency_t *latencies = NULL;
+        int num_latencies = shardcache_get_latencies(node->cache, &latencies);
+        uint64_t peer_fetch_p99 = latency_p99(latencies, num_latencies, "peer_fetch");
+        free(latencies);
+
+        shardcache_histogram_merge(node->get_latencies, get_snapshot);
+        shardcache_histogram_merge(node->set_latencies, set_snapshot);
+
+        uint64_t node_gets = __sync_fetch_and_add(&node->gets, 0);
+        uint64_t node_sets = __sync_fetch_and_add(&node->sets, 0);
+        uint64_t node_errors = __sync_fetch_and_add(&node->errors, 0);
+
+        report_line(out, csv, node->address, elapsed, node_gets, node_sets, node_errors,
+                    node_server_gets, node_cache_misses, node_fetch_remote,
+                    get_snapshot, set_snapshot, peer_fetch_p99);
+
+        gets += node_gets;
+        sets += node_sets;
+        errors += node_errors;
+        server_gets += node_server_gets;
+        cache_misses += node_cache_misses;
+        fetch_remote += node_fetch_remote;
+        snapshot_add(get_total, get_snapshot);
+        snapshot_add(set_total, set_snapshot);
+    }
+
+    report_line(out, csv, "total", elapsed, gets, sets, errors,
+                server_gets, cache_misses, fetch_remote, get_total, set_total, 0);
+
+    free(get_snapshot);
+    free(set_snapshot);
+    free(get_total);
+    free(set_total);
+}
+
+static void
+usage(char *prog, int rc)
+{
+    printf("usage: %s [OPTIONS]...\n"
+           "    -n <num_nodes>    the number of nodes to run in this process (defaults to: %d)\n"
+           "    -b <base_port>    the nodes listen on 127.0.0.1 from this port on (defaults to: %d)\n"
+           "    -c <num_clients>  the number of clients (connections) per node (defaults to: %d)\n"
+           "    -W <num_workers>  the number of worker threads per node (defaults to: %d)\n"
+           "    -k <num_keys>     the number of keys loaded in the storage (defaults to: %d)\n"
+           "    -s <value_size>   the size of the values (defaults to: %d)\n"
+           "    -C <cache_size>   the size of the ARC cache of each node (defaults to: %d)\n"
+           "    -w <write_rate>   the percentage of SET requests (defaults to: 0)\n"
+           "    -d <key_dist>     the distribution of the requested keys (defaults to: uniform)\n"
+           "                      uniform, zipf[:<theta>] (theta in (0, 1), defaults to 0.99) or\n"
+           "                      hotspot[:<hot_keys>:<hot_requests>] (fractions, defaults to 0.2:0.8)\n"
+           "    -t <seconds>      how long to measure (defaults to: %d)\n"
+           "    -u <seconds>      warm up the caches before measuring (defaults to: 0)\n"
+           "    -S <seed>         the seed of the key generators, the same seed requests\n"
+           "                      the same keys (defaults to: 1)\n"
+           "    -o <file>         also write the report to file (in CSV format)\n"
+           "    -h                prints this help\n",
+           prog,
+           DEFAULT_NUM_NODES,
+           DEFAULT_BASE_PORT,
+           DEFAULT_NUM_CLIENTS,
+           DEFAULT_NUM_WORKERS,
+           DEFAULT_NUM_KEYS,
+           DEFAULT_VALUE_SIZE,
+           DEFAULT_CACHE_SIZE,
+           DEFAULT_DURATION);
+    exit(rc);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, n;
+    int base_port = DEFAULT_BASE_PORT;
+    int num_workers = DEFAULT_NUM_WORKERS;
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    int duration = DEFAULT_DURATION;
+    int warmup = 0;
+    FILE *csv_file = NULL;
+
+    static struct option long_options[] = {
+        { "nodes",      1, 0, 'n' },
+        { "base_port",  1, 0, 'b' },
+        { "clients",    1, 0, 'c' },
+        { "workers",    1, 0, 'W' },
+        { "keys",       1, 0, 'k' },
+        { "value_size", 1, 0, 's' },
+        { "cache_size", 1, 0, 'C' },
+        { "write_rate", 1, 0, 'w' },
+        { "key_dist",   1, 0, 'd' },
+        { "time",       1, 0, 't' },
+        { "warmup",     1, 0, 'u' },
+        { "seed",       1, 0, 'S' },
+        { "output",     1, 0, 'o' },
+        { "help",       0, 0, 'h' },
+        { NULL,         0, 0,  0  }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "n:b:c:W:k:s:C:w:d:t:u:S:o:h", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'n':
+                num_nodes = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                base_port = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                num_clients = strtol(optarg, NULL, 10);
+                break;
+            case 'W':
+                num_workers = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                num_keys = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                value_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                cache_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                write_rate = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                if (key_dist_parse(&key_dist, optarg) != 0) {
+                    fprintf(stderr, "Bad key distribution %s\n", optarg);
+                    usage(argv[0], -1);
+                }
+                break;
+            case 't':
+                duration = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                warmup = strtol(optarg, NULL, 10);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                csv_file = fopen(optarg, "w");
+                if (!csv_file) {
+                    fprintf(stderr, "Can't open %s for writing\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'h':
+                usage(argv[0], 0);
+                break;
+            default:
+                usage(argv[0], -1);
+        }
+    }
+
+    if (num_nodes <= 0 || num_clients <= 0 || num_workers <= 0 || !num_keys ||
+        !value_size || write_rate < 0 || write_rate > 100 || duration <= 0 || warmup < 0)
+    {
+        usage(argv[0], -1);
+    }
+
+    shardcache_log_init("cluster_benchmark", LOG_WARNING);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+
+    // the storage holds all the keys before the nodes start
+    hashtable_t *table = ht_create(1<<16, 1<<24, free);
+    value = malloc(value_size);
+    memset(value, 'v', value_size);
+    for (n = 0; n < num_keys; n++) {
+        char key[32];
+        size_t klen = snprintf(key, sizeof(key), "key:%u", n);
+        mem_store(key, klen, value, value_size, table);
+    }
+    key_dist_setup(&key_dist, num_keys);
+
+    shardcache_storage_t storage;
+    memset(&storage, 0, sizeof(storage));
+    storage.version = SHARDCACHE_STORAGE_API_VERSION;
+    storage.fetch = mem_fetch;
+    storage.store = mem_store;
+    storage.remove = mem_remove;
+    storage.exist = mem_exist;
+    storage.priv = table;
+
+    shardcache_node_t **nodes = malloc(sizeof(shardcache_node_t *) * num_nodes);
+    nodes_stats = calloc(num_nodes, sizeof(node_stats_t));
+    for (i = 0; i < num_nodes; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "node%d", i);
+        snprintf(nodes_stats[i].address, sizeof(nodes_stats[i].address), "127.0.0.1:%d", base_port + i);
+        char *address_array[1] = { nodes_stats[i].address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < num_nodes; i++) {
+        node_stats_t *node = &nodes_stats[i];
+        node->cache = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, num_nodes,
+                                        &storage, NULL, num_workers, 0, cache_size);
+        if (!node->cache) {
+            fprintf(stderr, "Can't create the node %s\n", node->address);
+            exit(-1);
+        }
+        node->get_latencies = shardcache_histogram_create();
+        node->set_latencies = shardcache_histogram_create();
+    }
+
+    sleep(1); // let the nodes complete their startup
+
+    printf("%d nodes, %d clients per node, %u keys of %zu bytes, %d%% writes\n",
+           num_nodes, num_clients, num_keys, value_size, write_rate);
+
+    int num_threads = num_nodes * num_clients;
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    client_arg_t *args = calloc(num_threads, sizeof(client_arg_t));
+    for (i = 0; i < num_threads; i++) {
+        args[i].node = &nodes_stats[i % num_nodes];
+        // a different (non-zero) sequence for each client
+        args[i].random_state = (seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+        if (!args[i].random_state)
+            args[i].random_state = 1;
+        pthread_create(&threads[i], NULL, client, &args[i]);
+    }
+
+    if (warmup) {
+        printf("Warming up for %d seconds\n", warmup);
+        for (i = 0; i < warmup && !__sync_fetch_and_add(&quit, 0); i++)
+            sleep(1);
+        reset_stats();
+    }
+
+    printf("Measuring for %d seconds\n", duration);
+    uint64_t start = shardcache_histogram_now();
+    for (i = 0; i < duration && !__sync_fetch_and_add(&quit, 0); i++)
+        sleep(1);
+    __sync_add_and_fetch(&quit, 1);
+    double elapsed = (shardcache_histogram_now() - start) / 1e6;
+
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    report(stdout, 0, elapsed);
+    if (csv_file) {
+        report(csv_file, 1, elapsed);
+        fclose(csv_file);
+    }
+
+    for (i = 0; i < num_nodes; i++) {
+        shardcache_destroy(nodes_stats[i].cache);
+        shardcache_histogram_destroy(nodes_stats[i].get_latencies);
+        shardcache_histogram_destroy(nodes_stats[i].set_latencies);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    free(threads);
+    free(args);
+    free(nodes);
+    free(nodes_stats);
+    free(value);
+    ht_destroy(table);
+
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
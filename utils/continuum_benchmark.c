@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include <shardcache.h>
+#include <continuum.h>
+
+#define DEFAULT_NUM_NODES    10
+#define DEFAULT_NUM_KEYS     (1<<20)
+#define DEFAULT_NUM_LOOKUPS  10000000
+
+typedef struct {
+    char **keys;
+    size_t *lens;
+    int num_keys;
+} keyset_t;
+
+static double
+elapsed(struct timeval *start)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    return diff.tv_sec + (double)diff.tv_usec / 1000000;
+}
+
+static void
+run_benchmark(shardcache_node_t **nodes,
+              int num_nodes,
+              keyset_t *keyset,
+              int num_lookups,
+              shardcache_continuum_mode_t mode,
+              char *name)
+{
+    int i;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    shardcache_continuum_t *continuum = shardcache_continuum_create(nodes, num_nodes, mode);
+    if (!continuum) {
+        fprintf(stderr, "Can't create the %s continuum\n", name);
+        return;
+    }
+    double build_time = elapsed(&start);
+
+    // avoid the compiler optimizing out the lookups
+    uint64_t checksum = 0;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_lookups; i++) {
+        int k = i % keyset->num_keys;
+        checksum += shardcache_continuum_lookup(continuum, keyset->keys[k], keyset->lens[k]);
+    }
+    double lookup_time = elapsed(&start);
+
+    printf("%-6s  nodes: %d  build: %.3fms  lookups: %d in %.3fs  -> %.0f lookups/sec  (checksum: %llu)\n",
+           name, num_nodes, build_time * 1000, num_lookups, lookup_time,
+           lookup_time > 0 ? num_lookups / lookup_time : 0,
+           (unsigned long long)checksum);
+
+    shardcache_continuum_destroy(continuum);
+}
+
+static void
+usage(char *prog, int rc)
+{
+    printf("usage: %s [OPTIONS]...\n"
+           "    -n <num_nodes>        the number of nodes in the continuum (defaults to: %d)\n"
+           "    -k <num_keys>         the number of distinct keys to look up (defaults to: %d)\n"
+           "    -l <num_lookups>      the number of lookups to perform (defaults to: %d)\n"
+           "    -h                    prints this help\n",
+           prog,
+           DEFAULT_NUM_NODES,
+           DEFAULT_NUM_KEYS,
+           DEFAULT_NUM_LOOKUPS);
+    exit(rc);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+    int num_nodes = DEFAULT_NUM_NODES;
+    int num_lookups = DEFAULT_NUM_LOOKUPS;
+    keyset_t keyset = { NULL, NULL, DEFAULT_NUM_KEYS };
+
+    static struct option long_options[] = {
+        { "nodes",   1, 0, 'n' },
+        { "keys",    1, 0, 'k' },
+        { "lookups", 1, 0, 'l' },
+        { "help",    0, 0, 'h' },
+        { NULL,      0, 0,  0  }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "n:k:l:h", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'n':
+                num_nodes = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                keyset.num_keys = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                num_lookups = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(argv[0], 0);
+                break;
+            default:
+                usage(argv[0], -1);
+        }
+    }
+
+    if (num_nodes <= 0 || keyset.num_keys <= 0 || num_lookups <= 0)
+        usage(argv[0], -1);
+
+    shardcache_log_init("continuum_benchmark", LOG_WARNING);
+
+    shardcache_node_t **nodes = malloc(sizeof(shardcache_node_t *) * num_nodes);
+    for (i = 0; i < num_nodes; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:%d", 4444 + i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    keyset.keys = malloc(sizeof(char *) * keyset.num_keys);
+    keyset.lens = malloc(sizeof(size_t) * keyset.num_keys);
+    for (i = 0; i < keyset.num_keys; i++) {
+        char key[64];
+        keyset.lens[i] = snprintf(key, sizeof(key), "benchmark_key_%d", i);
+        keyset.keys[i] = strdup(key);
+    }
+
+    run_benchmark(nodes, num_nodes, &keyset, num_lookups, SHARDCACHE_CONTINUUM_MODE_CHASH, "chash");
+    run_benchmark(nodes, num_nodes, &keyset, num_lookups, SHARDCACHE_CONTINUUM_MODE_TABLE, "table");
+
+    for (i = 0; i < keyset.num_keys; i++)
+        free(keyset.keys[i]);
+    free(keyset.keys);
+    free(keyset.lens);
+    shardcache_free_nodes(nodes, num_nodes);
+
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <shardcache.h>
+#include <counters.h>
+
+#define DEFAULT_NUM_GETS 10000000
+#define NUM_COUNTERS 15
+
+// the counters touched by a GET served from the local storage
+#define COUNTER_GETS         0
+#define COUNTER_CACHE_MISSES 6
+#define COUNTER_FETCH_LOCAL  8
+
+// the layout used before the counters were sharded
+static struct {
+    const char *name;
+    uint64_t value;
+} packed[NUM_COUNTERS];
+
+static shardcache_sharded_counters_t *sharded = NULL;
+
+typedef struct {
+    char *name;
+    void (*get)(int miss);
+    uint64_t (*read)(int index);
+} counters_ops_t;
+
+typedef struct {
+    counters_ops_t *ops;
+    int num_gets;
+} worker_arg_t;
+
+static void
+packed_get(int miss)
+{
+    __sync_fetch_and_add(&packed[COUNTER_GETS].value, 1);
+    if (miss) {
+        __sync_fetch_and_add(&packed[COUNTER_CACHE_MISSES].value, 1);
+        __sync_fetch_and_add(&packed[COUNTER_FETCH_LOCAL].value, 1);
+    }
+}
+
+static uint64_t
+packed_read(int index)
+{
+    return __sync_fetch_and_add(&packed[index].value, 0);
+}
+
+static void
+sharded_get(int miss)
+{
+    shardcache_sharded_counter_add(sharded, COUNTER_GETS, 1);
+    if (miss) {
+        shardcache_sharded_counter_add(sharded, COUNTER_CACHE_MISSES, 1);
+        shardcache_sharded_counter_add(sharded, COUNTER_FETCH_LOCAL, 1);
+    }
+}
+
+static uint64_t
+sharded_read(int index)
+{
+    return shardcache_sharded_counter_get(sharded, index);
+}
+
+static void *
+worker(void *priv)
+{
+    worker_arg_t *arg = (worker_arg_t *)priv;
+    int i;
+    for (i = 0; i < arg->num_gets; i++)
+        arg->ops->get((i % 10) == 0); // 10% of misses
+    return NULL;
+}
+
+static void
+run_benchmark(counters_ops_t *ops, int num_threads, int num_gets)
+{
+    int i;
+    pthread_t threads[num_threads];
+    worker_arg_t arg = {
+        .ops = ops,
+        .num_gets = num_gets / num_threads
+    };
+
+    struct timeval start, end, diff;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, worker, &arg);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+
+    double elapsed = diff.tv_sec + (double)diff.tv_usec / 1000000;
+    uint64_t total = (uint64_t)arg.num_gets * num_threads;
+    printf("%-8s threads: %-3d  gets: %llu  %.3fs -> %.1f ns/get (%.0f gets/sec)  [gets counter: %llu]\n",
+           ops->name, num_threads, (unsigned long long)total, elapsed,
+           total ? (elapsed * 1e9) / total * num_threads : 0,
+           elapsed > 0 ? total / elapsed : 0,
+           (unsigned long long)ops->read(COUNTER_GETS));
+}
+
+static void
+usage(char *prog, int rc)
+{
+    printf("usage: %s [OPTIONS]...\n"
+           "    -g <num_gets>         the total number of gets to simulate (defaults to: %d)\n"
+           "    -t <num_threads>      the number of threads to run the gets with,\n"
+           "                          can be specified more than once (defaults to: 1 and 32)\n"
+           "    -h                    prints this help\n",
+           prog,
+           DEFAULT_NUM_GETS);
+    exit(rc);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, j;
+    int num_gets = DEFAULT_NUM_GETS;
+    int threads[32];
+    int num_runs = 0;
+
+    static struct option long_options[] = {
+        { "gets",    1, 0, 'g' },
+        { "threads", 1, 0, 't' },
+        { "help",    0, 0, 'h' },
+        { NULL,      0, 0,  0  }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "g:t:h", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'g':
+                num_gets = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                if (num_runs < sizeof(threads) / sizeof(threads[0]))
+                    threads[num_runs++] = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(argv[0], 0);
+                break;
+            default:
+                usage(argv[0], -1);
+        }
+    }
+
+    if (!num_runs) {
+        threads[num_runs++] = 1;
+        threads[num_runs++] = 32;
+    }
+
+    if (num_gets <= 0)
+        usage(argv[0], -1);
+
+    for (i = 0; i < num_runs; i++) {
+        if (threads[i] <= 0)
+            usage(argv[0], -1);
+    }
+
+    sharded = shardcache_sharded_counters_create(NUM_COUNTERS);
+
+    counters_ops_t ops[] = {
+        { "packed",  packed_get,  packed_read },
+        { "sharded", sharded_get, sharded_read }
+    };
+
+    // the ns/get figure is the time spent by each thread on a single get
+    // (so it doesn't improve just because more threads run in parallel)
+    for (i = 0; i < num_runs; i++) {
+        for (j = 0; j < sizeof(ops) / sizeof(ops[0]); j++) {
+            memset(packed, 0, sizeof(packed));
+            shardcache_sharded_counter_set(sharded, COUNTER_GETS, 0);
+            run_benchmark(&ops[j], threads[i], num_gets);
+        }
+    }
+
+    shardcache_sharded_counters_destroy(sharded);
+
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "key_dist.h"
+
+uint64_t
+key_dist_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+double
+key_dist_random_double(uint64_t *state)
+{
+    return (key_dist_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int
+key_dist_parse(key_dist_t *dist, char *str)
+{
+    char *copy = strdup(str);
+    char *s = copy;
+    char *name = strsep(&s, ":");
+    char *arg1 = strsep(&s, ":");
+    char *arg2 = strsep(&s, ":");
+    int rc = 0;
+
+    if (strcmp(name, "uniform") == 0) {
+        dist->type = KEY_DIST_UNIFORM;
+    } else if (strcmp(name, "zipf") == 0) {
+        dist->type = KEY_DIST_ZIPF;
+        if (arg1)
+            dist->theta = strtod(arg1, NULL);
+        // the generator can't handle theta >= 1
+        if (dist->theta <= 0 || dist->theta >= 1)
+            rc = -1;
+    } else if (strcmp(name, "hotspot") == 0) {
+        dist->type = KEY_DIST_HOTSPOT;
+        if (arg1)
+            dist->hot_fraction = strtod(arg1, NULL);
+        if (arg2)
+            dist->hot_requests = strtod(arg2, NULL);
+        if (dist->hot_fraction <= 0 || dist->hot_fraction > 1 ||
+            dist->hot_requests < 0 || dist->hot_requests > 1)
+        {
+            rc = -1;
+        }
+    } else {
+        rc = -1;
+    }
+    free(copy);
+    return rc;
+}
+
+void
+key_dist_setup(key_dist_t *dist, uint32_t num_keys)
+{
+    dist->num_keys = num_keys;
+    if (dist->type != KEY_DIST_ZIPF)
+        return;
+
+    // Gray et al., "Quickly Generating Billion-Record Synthetic Databases"
+    // (the same generator used by YCSB), key 0 is the most popular one
+    uint32_t i;
+    dist->zetan = 0;
+    for (i = 1; i <= num_keys; i++)
+        dist->zetan += 1.0 / pow(i, dist->theta);
+    double zeta2 = 1.0 + 1.0 / pow(2, dist->theta);
+    dist->alpha = 1.0 / (1.0 - dist->theta);
+    dist->eta = (1.0 - pow(2.0 / num_keys, 1.0 - dist->theta)) / (1.0 - zeta2 / dist->zetan);
+}
+
+uint32_t
+key_dist_next(key_dist_t *dist, uint64_t *state)
+{
+    uint32_t n = dist->num_keys;
+    switch(dist->type) {
+        case KEY_DIST_ZIPF:
+        {
+            double u = key_dist_random_double(state);
+            double uz = u * dist->zetan;
+            if (uz < 1.0)
+                return 0;
+            if (uz < 1.0 + pow(0.5, dist->theta))
+                return 1;
+            uint32_t idx = (uint32_t)(n * pow(dist->eta * u - dist->eta + 1, dist->alpha));
+            return idx < n ? idx : n - 1;
+        }
+        case KEY_DIST_HOTSPOT:
+        {
+            uint32_t hot_keys = (uint32_t)(n * dist->hot_fraction);
+            if (!hot_keys)
+                hot_keys = 1;
+            if (hot_keys == n || key_dist_random_double(state) < dist->hot_requests)
+                return key_dist_random(state) % hot_keys;
+            return hot_keys + key_dist_random(state) % (n - hot_keys);
+        }
+        default:
+            return key_dist_random(state) % n;
+    }
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
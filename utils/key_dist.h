@@ -0,0 +1,49 @@
+#ifndef __KEY_DIST_H__
+#define __KEY_DIST_H__
+
+#include <stdint.h>
+
+/*
+ * Key distributions shared by the benchmarks.
+ * Keys are indexes in [0, num_keys), the random numbers come from a
+ * xorshift64* state owned by the caller (one per thread), so a run can be
+ * repeated by seeding the states the same way.
+ */
+
+#define KEY_DIST_UNIFORM 0
+#define KEY_DIST_ZIPF    1
+#define KEY_DIST_HOTSPOT 2
+
+typedef struct {
+    int type;
+    uint32_t num_keys;   // the size of the key space
+    double theta;        // zipf
+    double alpha;        // zipf: 1 / (1 - theta)
+    double zetan;        // zipf: sum of 1 / i^theta for i in [1, num_keys]
+    double eta;          // zipf
+    double hot_fraction; // hotspot: the fraction of the keys which are hot
+    double hot_requests; // hotspot: the fraction of the requests hitting the hot keys
+} key_dist_t;
+
+#define KEY_DIST_INITIALIZER { KEY_DIST_UNIFORM, 0, 0.99, 0, 0, 0, 0.2, 0.8 }
+
+// parse "uniform", "zipf[:theta]" or "hotspot[:hot_keys:hot_requests]",
+// returns 0 on success and -1 if the string is not valid
+int key_dist_parse(key_dist_t *dist, char *str);
+
+// must be called once the size of the key space is known
+void key_dist_setup(key_dist_t *dist, uint32_t num_keys);
+
+// the index of the next key to request
+uint32_t key_dist_next(key_dist_t *dist, uint64_t *state);
+
+// xorshift64* (the state must not be 0)
+uint64_t key_dist_random(uint64_t *state);
+
+// uniformly distributed in [0, 1)
+double key_dist_random_double(uint64_t *state);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -24,6 +24,9 @@ void usage(char *prgname) {
            "        evict     <key>\n"
            "        index   [ <node> ]\n"
            "        stats   [ <node> ]\n"
+           "        metrics [ <node> ]\n"
+           "        hotkeys [ <node> ]\n"
+           "        traces  [ <node> ] [ -m <min_usecs> ]\n"
            "        check   [ <node> ]\n\n", prgname);
     exit(-2);
 }
@@ -39,14 +42,12 @@ static int parse_nodes_string(char *str)
     while (s && *s) {
         char *tok = strsep(&s, ",");
         if(tok) {
-            char *label = strsep(&tok, ":");
-            char *addr = tok;
-            if (!addr) {
+            shardcache_node_t *node = shardcache_node_create_from_string(tok);
+            if (!node) {
                 free(copy);
                 return -1;
             }
             nodes = realloc(nodes, (num_nodes + 1) * sizeof(shardcache_node_t *));
-            shardcache_node_t *node = shardcache_node_create(label, &addr, 1);
             nodes[num_nodes++] = node;
         } 
     }
@@ -68,9 +69,21 @@ int print_chunk(char *peer,
     return error;
 }
 
+int print_index_item(void *key, size_t klen, size_t vlen, void *priv)
+{
+    char keystr[klen+1];
+    memcpy(keystr, key, klen);
+    keystr[klen] = 0;
+    printf("%s => %u\n", keystr, (uint32_t)vlen);
+    return 0;
+}
+
 int main (int argc, char **argv) {
     if ((argc < 3) && (argc != 2 ||
         (strcmp(argv[1], "stats") != 0 && 
+         strcmp(argv[1], "metrics") != 0 &&
+         strcmp(argv[1], "hotkeys") != 0 &&
+         strcmp(argv[1], "traces") != 0 &&
          strcmp(argv[1], "check") != 0 &&
          strcmp(argv[1], "index") != 0)))
     {
@@ -319,6 +332,92 @@ int main (int argc, char **argv) {
         }
         if (found == 0 && selected_node)
             fprintf(stderr, "Error: Unknown node %s\n", selected_node);
+    } else if (strcasecmp(cmd, "metrics") == 0) {
+        int found = 0;
+        char *selected_node = NULL;
+        if (argc > 2)
+            selected_node = argv[2];
+
+        // no decorations, so that the output of a single node
+        // can be fed as is to an OpenMetrics parser
+        int i;
+        for (i = 0; i < num_nodes; i++) {
+            char *label = shardcache_node_get_label(nodes[i]);
+            char *address = shardcache_node_get_address(nodes[i]);
+            if (selected_node && strcmp(label, selected_node) != 0)
+                continue;
+            found++;
+            char *metrics = NULL;
+            size_t len;
+            int rc = shardcache_client_metrics(client, label, &metrics, &len);
+            if (rc == 0)
+                printf("%s", metrics);
+            else
+                fprintf(stderr, "Error querying node: %s (%s)\n", label, address);
+            free(metrics);
+        }
+        if (found == 0 && selected_node)
+            fprintf(stderr, "Error: Unknown node %s\n", selected_node);
+    } else if (strcasecmp(cmd, "hotkeys") == 0) {
+        int found = 0;
+        char *selected_node = NULL;
+        if (argc > 2)
+            selected_node = argv[2];
+
+        int i;
+        for (i = 0; i < num_nodes; i++) {
+            char *label = shardcache_node_get_label(nodes[i]);
+            char *address = shardcache_node_get_address(nodes[i]);
+            if (selected_node && strcmp(label, selected_node) != 0)
+                continue;
+            found++;
+            printf("* Hot keys for node: %s (%s)\n\n", label, address);
+            char *hotkeys = NULL;
+            size_t len;
+            int rc = shardcache_client_hotkeys(client, label, &hotkeys, &len);
+            if (rc == 0)
+                printf("%s\n", hotkeys);
+            else
+                printf("Error querying node: %s (%s)\n", label, address);
+            free(hotkeys);
+            printf("\n");
+        }
+        if (found == 0 && selected_node)
+            fprintf(stderr, "Error: Unknown node %s\n", selected_node);
+    } else if (strcasecmp(cmd, "traces") == 0) {
+        int found = 0;
+        char *selected_node = NULL;
+        uint32_t min_usecs = 0;
+
+        int i;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+                min_usecs = strtoul(argv[++i], NULL, 10);
+            else
+                selected_node = argv[i];
+        }
+
+        // the trace ids are shared by the nodes, so the traces
+        // of a request fetched from a peer can be matched
+        for (i = 0; i < num_nodes; i++) {
+            char *label = shardcache_node_get_label(nodes[i]);
+            char *address = shardcache_node_get_address(nodes[i]);
+            if (selected_node && strcmp(label, selected_node) != 0)
+                continue;
+            found++;
+            printf("* Traces for node: %s (%s)\n\n", label, address);
+            char *traces = NULL;
+            size_t len;
+            int rc = shardcache_client_traces(client, label, min_usecs, &traces, &len);
+            if (rc == 0)
+                printf("%s\n", traces);
+            else
+                printf("Error querying node: %s (%s)\n", label, address);
+            free(traces);
+            printf("\n");
+        }
+        if (found == 0 && selected_node)
+            fprintf(stderr, "Error: Unknown node %s\n", selected_node);
     } else if (strcasecmp(cmd, "check") == 0) {
         int found = 0;
         char *selected_node = NULL;
@@ -353,17 +452,7 @@ int main (int argc, char **argv) {
                 continue;
             found++;
             printf("* Index for node: %s (%s)\n\n", label, address);
-            shardcache_storage_index_t *index = shardcache_client_index(client, label);
-            if (index) {
-                int n;
-                for (n = 0; n < index->size; n ++) {
-                    shardcache_storage_index_item_t *item = &index->items[n];
-                    char keystr[item->klen+1];
-                    snprintf(keystr, sizeof(keystr), "%s", (char *)item->key);
-                    printf("%s => %u\n", keystr, (uint32_t)item->vlen);
-                }
-                shardcache_free_index(index);
-            } else {
+            if (shardcache_client_index_foreach(client, label, print_index_item, NULL) == -1) {
                 printf("%s NOT OK\n", label);
             }
             printf("\n");
@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <time.h>
 #include <regex.h>
+#include <math.h>
 #include <pthread.h>
 #include <iomux.h>
 #include <fbuf.h>
@@ -14,8 +15,11 @@
 
 #include <shardcache_client.h>
 #include <counters.h>
+#include <histogram.h>
 #include <messaging.h>
 
+#include "key_dist.h"
+
 #include <inttypes.h>
 
 #include <sys/types.h>
@@ -43,18 +47,121 @@ static uint64_t num_gets = 0;
 static uint64_t num_sets = 0;
 static uint64_t num_responses = 0;
 static uint64_t num_running_clients = 0;
+static uint32_t request_rate = 0;
+static key_dist_t key_dist = KEY_DIST_INITIALIZER;
 char *index_file = NULL;
 shardcache_counters_t *counters = NULL;
 hashtable_t *prev_counts = NULL;
 
+// response latencies (from the time the request was due, see client_ctx)
+static shardcache_histogram_t *get_latencies = NULL;
+static shardcache_histogram_t *set_latencies = NULL;
+
+#define VALUE_DIST_NONE    0
+#define VALUE_DIST_FIXED   1
+#define VALUE_DIST_UNIFORM 2
+#define VALUE_DIST_PARETO  3
+
+static struct {
+    int type;
+    uint32_t min;
+    uint32_t max;
+    char *buf; // max bytes of data the values are taken from
+} value_dist = { VALUE_DIST_NONE, 0, 0, NULL };
+
+// requests sent and not yet answered (responses come back in order)
+#define CLIENT_INFLIGHT_MAX (1<<16)
+
+typedef struct {
+    uint64_t due;   // when the request was due (usecs)
+    int is_get;
+} inflight_request;
+
 typedef struct {
     fbuf_t *output;
     async_read_ctx_t *reader; 
     uint64_t num_requests;
     uint64_t num_responses;
     char *node;
+    uint64_t start;             // when the client started sending (usecs)
+    inflight_request *inflight; // ring of CLIENT_INFLIGHT_MAX requests
 } client_ctx;
 
+// random() would serialize the threads on its lock
+static __thread uint64_t random_state = 0;
+
+static inline uint64_t *
+bench_random_state()
+{
+    if (!random_state)
+        random_state = (uint64_t)(uintptr_t)&random_state ^ shardcache_histogram_now();
+    return &random_state;
+}
+
+static inline uint64_t
+bench_random()
+{
+    return key_dist_random(bench_random_state());
+}
+
+static int
+value_dist_init(char *str)
+{
+    char *copy = strdup(str);
+    char *s = copy;
+    char *name = strsep(&s, ":");
+    char *arg1 = strsep(&s, ":");
+    char *arg2 = strsep(&s, ":");
+    int rc = 0;
+
+    value_dist.min = arg1 ? strtoul(arg1, NULL, 10) : 0;
+    value_dist.max = arg2 ? strtoul(arg2, NULL, 10) : value_dist.min;
+
+    if (strcmp(name, "fixed") == 0) {
+        value_dist.type = VALUE_DIST_FIXED;
+        value_dist.max = value_dist.min;
+    } else if (strcmp(name, "uniform") == 0) {
+        value_dist.type = VALUE_DIST_UNIFORM;
+    } else if (strcmp(name, "pareto") == 0) {
+        value_dist.type = VALUE_DIST_PARETO;
+    } else {
+        rc = -1;
+    }
+
+    // a record can't be larger than this
+    if (!value_dist.min || value_dist.max < value_dist.min || value_dist.max > (1<<28))
+        rc = -1;
+
+    if (rc == 0) {
+        value_dist.buf = malloc(value_dist.max);
+        uint32_t i;
+        for (i = 0; i < value_dist.max; i++)
+            value_dist.buf[i] = 'a' + i % 26;
+    }
+
+    free(copy);
+    return rc;
+}
+
+static inline uint32_t
+value_dist_next()
+{
+    switch(value_dist.type) {
+        case VALUE_DIST_UNIFORM:
+            return value_dist.min + bench_random() % (value_dist.max - value_dist.min + 1);
+        case VALUE_DIST_PARETO:
+        {
+            // heavy tailed (shape 1.2, most values are close to min)
+            // truncated at max
+            double u = 1.0 - key_dist_random_double(bench_random_state());
+            double size = value_dist.min / pow(u, 1.0 / 1.2);
+            return size < value_dist.max ? (uint32_t)size : value_dist.max;
+        }
+        default:
+            return value_dist.min;
+    }
+}
+
 static void
 usage(char *progname, int rc, char *msg, ...)
 {
@@ -67,6 +174,9 @@ usage(char *progname, int rc, char *msg, ...)
 
     printf("Usage: %s [OPTION]...\n"
            "    -c <num_clients>  The number of clients per thread (defaults to: %d)\n"
+           "    -d <key_dist>     The distribution of the requested keys (defaults to: uniform)\n"
+           "                      uniform, zipf[:<theta>] (theta in (0, 1), defaults to 0.99) or\n"
+           "                      hotspot[:<hot_keys>:<hot_requests>] (fractions, defaults to 0.2:0.8)\n"
            "    -m <max_requests> Number of requests to receive before renewing a client connection\n"
            "                      (0 never refresh the connections)\n"
            "    -t <num_threads>  The number of threads (defaults to: %d)\n"
@@ -77,10 +187,17 @@ usage(char *progname, int rc, char *msg, ...)
            "    -e <expire_time>  Optionally set the expiration time for the test keys (defaults to: 0)\n"
            "    -p <prefix>       A custom prefix to use for generated keys (defaults to: %s)\n"
            "    -P                Print stats to stdout every second\n"
+           "    -r <rate>         Send <rate> requests per second per client (open loop) instead of\n"
+           "                      waiting for the responses, the latencies are measured from when each\n"
+           "                      request was due (0 (default) sends a new request as soon as\n"
+           "                      there are less than 128 in flight)\n"
            "    -s <stats_file>   File where to (optionally) dump the stats every second (in CSV format)\n"
            "    -w <wrate>        Rate at which to send set/del/evict commands instead of get\n"
            "    -W <write_mode>   Determines which command to send at the requested write rate\n"
            "                      0 => 'set', 1 => 'del' , 2 => 'evict' (defaults to 0)\n"
+           "    -V <value_dist>   The distribution of the size of the values to set (defaults to\n"
+           "                      short 'TEST' strings): fixed:<size>, uniform:<min>:<max> or\n"
+           "                      pareto:<min>:<max> (heavy tailed)\n"
            "    -v                Be verbose\n"
            , progname
            , num_clients
@@ -97,6 +214,18 @@ stop(int sig)
 }
 
 
+static client_ctx *
+client_ctx_create(char *node)
+{
+    client_ctx *ctx = calloc(1, sizeof(client_ctx));
+    ctx->reader = async_read_context_create(secret, NULL, NULL);
+    ctx->output = fbuf_create(0);
+    ctx->node = node;
+    ctx->start = shardcache_histogram_now();
+    ctx->inflight = malloc(CLIENT_INFLIGHT_MAX * sizeof(inflight_request));
+    return ctx;
+}
+
 static void
 close_connection(iomux_t *iomux, int fd, void *priv)
 {
@@ -112,6 +241,7 @@ close_connection(iomux_t *iomux, int fd, void *priv)
     async_read_context_destroy(ctx->reader);
     fbuf_free(ctx->output);
 
+    free(ctx->inflight);
     free(ctx);
     close(fd);
     __sync_sub_and_fetch(&num_running_clients, 1);
@@ -122,12 +252,30 @@ send_command(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
 {
     client_ctx *ctx = (client_ctx *)priv;
     fbuf_t *output_buffer = ctx->output;
+    uint64_t now = shardcache_histogram_now();
+    char value[256];
+
+    for (;;) {
+        uint64_t num_requests = __sync_fetch_and_add(&ctx->num_requests, 0);
+        uint64_t pending = num_requests - __sync_fetch_and_add(&ctx->num_responses, 0);
+        uint64_t due = now;
+
+        if (max_requests && max_requests <= num_requests)
+            break;
+
+        if (request_rate) {
+            // open loop: the requests are due at a constant rate no matter
+            // how fast the responses come back, so a stalled server can't
+            // hide its stalls by slowing down the client
+            due = ctx->start + num_requests * 1000000 / request_rate;
+            if (due > now || pending >= CLIENT_INFLIGHT_MAX)
+                break;
+        } else if (pending >= 128) {
+            // don't pipeline more than 128 requests ahead
+            break;
+        }
 
-    // don't pipeline more than 1024 requests ahead
-    if (__sync_fetch_and_add(&ctx->num_requests, 0) - __sync_fetch_and_add(&ctx->num_responses, 0) < 128 &&
-       (!max_requests || max_requests > __sync_fetch_and_add(&ctx->num_requests, 0)))
-    {
-        uint32_t idx = random() % ((num_keys && num_keys < keys_index->size) ? num_keys : keys_index->size);
+        uint32_t idx = key_dist_next(&key_dist, bench_random_state());
 
         shardcache_record_t record[2] = {
             {
@@ -143,14 +291,18 @@ send_command(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
         unsigned char hdr = SHC_HDR_GET;
         unsigned char sig_hdr = secret ? SHC_HDR_SIGNATURE_SIP : 0;
 
-        if (wrate && random()%100 > wrate) {
+        if (wrate && bench_random() % 100 < wrate) {
             switch(wmode) {
                 case 0:
                 {
-                    char value[256];
-                    snprintf(value, sizeof(value), "TEST%d", (int)time(NULL));
-                    record[1].v = value;
-                    record[1].l = strlen(value);
+                    if (value_dist.type != VALUE_DIST_NONE) {
+                        record[1].v = value_dist.buf;
+                        record[1].l = value_dist_next();
+                    } else {
+                        snprintf(value, sizeof(value), "TEST%d", (int)time(NULL));
+                        record[1].v = value;
+                        record[1].l = strlen(value);
+                    }
                     num_records = 2;
                     hdr = SHC_HDR_SET;
                     break;
@@ -172,7 +324,16 @@ send_command(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
         else
             __sync_add_and_fetch(&num_sets, 1);
 
+        inflight_request *req = &ctx->inflight[num_requests % CLIENT_INFLIGHT_MAX];
+        req->due = due;
+        req->is_get = (hdr == SHC_HDR_GET);
+
         __sync_fetch_and_add(&ctx->num_requests, 1);
+
+        // in the closed loop one request is sent each time
+        // the connection is writable
+        if (!request_rate)
+            break;
     }
 
     // flush as much as we can
@@ -193,6 +354,11 @@ discard_response(iomux_t *iomux, int fd, unsigned char *data, int len, void *pri
     //printf("received %d\n", len);
     async_read_context_state_t state = async_read_context_input_data(ctx->reader, data, len, &processed);
     while (state == SHC_STATE_READING_DONE) {
+        // the responses come back in the same order as the requests
+        uint64_t num_responses_ctx = __sync_fetch_and_add(&ctx->num_responses, 0);
+        inflight_request *req = &ctx->inflight[num_responses_ctx % CLIENT_INFLIGHT_MAX];
+        shardcache_histogram_record(req->is_get ? get_latencies : set_latencies,
+                                    shardcache_histogram_now() - req->due);
         __sync_add_and_fetch(&num_responses, 1);
         __sync_add_and_fetch(&ctx->num_responses, 1);
         state = async_read_context_update(ctx->reader);
@@ -207,10 +373,7 @@ discard_response(iomux_t *iomux, int fd, unsigned char *data, int len, void *pri
             exit(-99);
         }
 
-        client_ctx *newctx = calloc(1, sizeof(client_ctx));
-        newctx->reader = async_read_context_create(secret, NULL, NULL);
-        newctx->output = fbuf_create(0);
-        newctx->node = ctx->node;
+        client_ctx *newctx = client_ctx_create(ctx->node);
         iomux_callbacks_t cbs = {
             .mux_output = send_command,
             .mux_timeout = NULL,
@@ -248,10 +411,7 @@ static void
                 exit(-99);
             }
 
-            client_ctx *ctx = calloc(1, sizeof(client_ctx));
-            ctx->reader = async_read_context_create(secret, NULL, NULL);
-            ctx->output = fbuf_create(0);
-            ctx->node = addr;
+            client_ctx *ctx = client_ctx_create(addr);
             iomux_callbacks_t cbs = {
                 .mux_output = send_command,
                 .mux_timeout = NULL,
@@ -280,6 +440,63 @@ static void
     return NULL;
 }
 
+typedef struct {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} latency_percentiles;
+
+// the percentiles of the latencies recorded since the previous call
+// (the histogram is never reset, prev holds the previous snapshot)
+static void
+latency_interval(shardcache_histogram_t *h, shardcache_histogram_snapshot_t *prev, latency_percentiles *out)
+{
+    shardcache_histogram_snapshot_t *cur = malloc(sizeof(shardcache_histogram_snapshot_t));
+    shardcache_histogram_merge(h, cur);
+
+    shardcache_histogram_snapshot_t *diff = malloc(sizeof(shardcache_histogram_snapshot_t));
+    memset(diff, 0, sizeof(shardcache_histogram_snapshot_t));
+    int b;
+    for (b = 0; b < SHARDCACHE_HISTOGRAM_NUM_BUCKETS; b++)
+        diff->buckets[b] = cur->buckets[b] - prev->buckets[b];
+    diff->count = cur->count - prev->count;
+    diff->max = cur->max;
+
+    out->count = diff->count;
+    out->p50 = shardcache_histogram_percentile(diff, 50);
+    out->p90 = shardcache_histogram_percentile(diff, 90);
+    out->p99 = shardcache_histogram_percentile(diff, 99);
+    out->p999 = shardcache_histogram_percentile(diff, 99.9);
+    out->max = shardcache_histogram_percentile(diff, 100);
+
+    memcpy(prev, cur, sizeof(shardcache_histogram_snapshot_t));
+    free(cur);
+    free(diff);
+}
+
+static void
+print_latency_summary(char *label, shardcache_histogram_t *h)
+{
+    shardcache_histogram_snapshot_t *snapshot = malloc(sizeof(shardcache_histogram_snapshot_t));
+    shardcache_histogram_merge(h, snapshot);
+    if (snapshot->count) {
+        printf("%s latency (usecs): count: %" PRIu64 " min: %" PRIu64 " mean: %" PRIu64
+               " p50: %" PRIu64 " p90: %" PRIu64 " p99: %" PRIu64 " p99.9: %" PRIu64
+               " p99.99: %" PRIu64 " max: %" PRIu64 "\n",
+               label, snapshot->count, snapshot->min, snapshot->sum / snapshot->count,
+               shardcache_histogram_percentile(snapshot, 50),
+               shardcache_histogram_percentile(snapshot, 90),
+               shardcache_histogram_percentile(snapshot, 99),
+               shardcache_histogram_percentile(snapshot, 99.9),
+               shardcache_histogram_percentile(snapshot, 99.99),
+               snapshot->max);
+    }
+    free(snapshot);
+}
+
 #define ADDR_REGEXP "^([a-z0-9_\\.\\-]+|\\*)(:[0-9]+)?$"
 
 static int
@@ -336,6 +553,7 @@ main (int argc, char **argv)
 {
     static struct option long_options[] = {
         { "clients", 2, 0, 'c' },
+        { "key_dist", 2, 0, 'd' },
         { "threads", 2, 0, 't' },
         { "help", 0, 0, 'h' },
         { "hosts", 2, 0, 'H' },
@@ -346,9 +564,11 @@ main (int argc, char **argv)
         { "max_requests", 2, 0, 'm' },
         { "prefix", 2, 0, 'p' },
         { "print_stats", 2, 0, 'P' },
+        { "rate", 2, 0, 'r' },
         { "stats_file", 2, 0, 's' },
         { "write_rate", 2, 0, 'w' },
         { "write_mode", 2, 0, 'W' },
+        { "value_dist", 2, 0, 'V' },
         { "verbose", 0, 0, 'v' },
         { NULL, 0, 0,  0 }
     };
@@ -356,13 +576,17 @@ main (int argc, char **argv)
     hosts_string = getenv("SHC_HOSTS");
     int option_index = 0;
     char c;
-    while ((c = getopt_long(argc, argv, "c:hH:iI:m:k:p:s:Pt:w:W:v", long_options, &option_index))) {
+    while ((c = getopt_long(argc, argv, "c:d:hH:iI:m:k:p:r:s:Pt:w:W:vV:", long_options, &option_index))) {
         if (c == -1)
             break;
         switch(c) {
             case 'c':
                 num_clients = strtol(optarg, NULL, 10);
                 break;
+            case 'd':
+                if (key_dist_parse(&key_dist, optarg) != 0)
+                    usage(argv[0], -1, "Bad key distribution %s", optarg);
+                break;
             case 'e':
                 key_expire_time = strtol(optarg, NULL, 10);
                 break;
@@ -391,6 +615,9 @@ main (int argc, char **argv)
             case 'P':
                 print_stats = 1;
                 break;
+            case 'r':
+                request_rate = strtoul(optarg, NULL, 10);
+                break;
             case 's':
                 stats_file = fopen(optarg, "w");
                 if (!stats_file)
@@ -411,6 +638,10 @@ main (int argc, char **argv)
             case 'v':
                 verbose++;
                 break;
+            case 'V':
+                if (value_dist_init(optarg) != 0)
+                    usage(argv[0], -1, "Bad value size distribution %s", optarg);
+                break;
             default:
                 break;
         }
@@ -461,9 +692,15 @@ main (int argc, char **argv)
             item->key = malloc(maxklen);
             snprintf(item->key, maxklen, "%s%d", prefix, n);
             item->klen = strlen(item->key);
-            item->vlen = 4;
             printf("Setting key %s\n", (char *)item->key);
-            if (shardcache_client_set(client, item->key, item->klen, "TEST", 4, key_expire_time) != 0) {
+            void *value = "TEST";
+            size_t vlen = 4;
+            if (value_dist.type != VALUE_DIST_NONE) {
+                value = value_dist.buf;
+                vlen = value_dist_next();
+            }
+            item->vlen = vlen;
+            if (shardcache_client_set(client, item->key, item->klen, value, vlen, key_expire_time) != 0) {
                 fprintf(stderr, "Can't set key %s : %s\n", (char *)item->key, shardcache_client_errstr(client));
                 exit(-1);
             }
@@ -477,10 +714,13 @@ main (int argc, char **argv)
     shardcache_client_destroy(client);
     signal (SIGINT, stop);
 
-    srandom(time(NULL));
+    key_dist_setup(&key_dist, (num_keys && num_keys < keys_index->size) ? num_keys : keys_index->size);
 
     counters = shardcache_init_counters();
 
+    get_latencies = shardcache_histogram_create();
+    set_latencies = shardcache_histogram_create();
+
     prev_counts = ht_create(1<<16, 1<<20, free);
 
     int i;
@@ -497,11 +737,15 @@ main (int argc, char **argv)
 
     if (stats_file) {
         char *columns = "num_clients,gets,sets,num_responses,total_responses/s,"
-                        "avg_responses/s,slowest,fastest,stuck_clients\n";
+                        "avg_responses/s,slowest,fastest,stuck_clients,"
+                        "get_p50,get_p90,get_p99,get_p999,get_max,"
+                        "set_p50,set_p90,set_p99,set_p999,set_max\n";
         fwrite(columns, strlen(columns), 1, stats_file);
     }
 
     uint64_t num_responses_prev = 0;
+    shardcache_histogram_snapshot_t *get_prev = calloc(1, sizeof(shardcache_histogram_snapshot_t));
+    shardcache_histogram_snapshot_t *set_prev = calloc(1, sizeof(shardcache_histogram_snapshot_t));
 
     while (!__sync_fetch_and_add(&quit, 0)) {
 
@@ -548,6 +792,11 @@ main (int argc, char **argv)
         uint64_t gets_total = __sync_fetch_and_add(&num_gets, 0);
         uint64_t sets_total = __sync_fetch_and_add(&num_sets, 0);
         uint64_t responses_total = __sync_fetch_and_add(&num_responses, 0);
+
+        latency_percentiles get_lat, set_lat;
+        latency_interval(get_latencies, get_prev, &get_lat);
+        latency_interval(set_latencies, set_prev, &set_lat);
+
         if (print_stats) {
             
             printf("\033[H\033[J"
@@ -559,7 +808,11 @@ main (int argc, char **argv)
                    "\navg_responses/s: %" PRIu64
                    "\nslowest: %" PRIu64 " (%s)"
                    "\nfastest: %" PRIu64
-                   "\nstuck_clients: %" PRIu64,
+                   "\nstuck_clients: %" PRIu64
+                   "\nget latency (usecs): p50: %" PRIu64 " p90: %" PRIu64
+                   " p99: %" PRIu64 " p99.9: %" PRIu64 " max: %" PRIu64
+                   "\nset latency (usecs): p50: %" PRIu64 " p90: %" PRIu64
+                   " p99: %" PRIu64 " p99.9: %" PRIu64 " max: %" PRIu64 "\n",
                    running_clients,
                    gets_total,
                    sets_total,
@@ -569,16 +822,20 @@ main (int argc, char **argv)
                    slowest_client,
                    slowest_label,
                    fastest_client,
-                   stuck_clients);
+                   stuck_clients,
+                   get_lat.p50, get_lat.p90, get_lat.p99, get_lat.p999, get_lat.max,
+                   set_lat.p50, set_lat.p90, set_lat.p99, set_lat.p999, set_lat.max);
         }
         if (slowest_label)
             free(slowest_label);
 
         if (stats_file) {
-            char line[(10*9) + 10];
+            char line[(21*19) + 10];
             snprintf(line, sizeof(line),
                      "%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"
-                     PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",\n",
+                     PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"
+                     PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"
+                     PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
                      running_clients,
                      gets_total,
                      sets_total,
@@ -587,7 +844,9 @@ main (int argc, char **argv)
                      avg_responses,
                      slowest_client,
                      fastest_client,
-                     stuck_clients);
+                     stuck_clients,
+                     get_lat.p50, get_lat.p90, get_lat.p99, get_lat.p999, get_lat.max,
+                     set_lat.p50, set_lat.p90, set_lat.p99, set_lat.p999, set_lat.max);
             if (fwrite(line, strlen(line), 1, stats_file) != 1) {
                 fprintf(stderr, "Can't dump the new line to the stats file: %s\n", strerror(errno));
                 exit(-2);
@@ -606,6 +865,14 @@ main (int argc, char **argv)
         fprintf(stderr, "Thread %d done\n", i);
     }
 
+    print_latency_summary("get", get_latencies);
+    print_latency_summary("set", set_latencies);
+    free(get_prev);
+    free(set_prev);
+    shardcache_histogram_destroy(get_latencies);
+    shardcache_histogram_destroy(set_latencies);
+    free(value_dist.buf);
+
     if (prev_counts)
         ht_destroy(prev_counts);
 
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <malloc.h>
+
+#include <hashtable.h>
+#include <volatile_storage.h>
+
+#define DEFAULT_NUM_KEYS   (1<<20)
+#define DEFAULT_VALUE_SIZE 100
+#define DEFAULT_NUM_GETS   10000000
+
+// the representation used for the volatile keys
+// before the volatile storage was introduced
+typedef struct {
+    void *data;
+    size_t dlen;
+    uint32_t expire;
+} ht_volatile_object_t;
+
+typedef struct {
+    char **keys;
+    size_t *lens;
+    int num_keys;
+} keyset_t;
+
+typedef struct {
+    char *name;
+    void *(*create)();
+    void (*destroy)(void *storage);
+    void (*set)(void *storage, void *key, size_t klen, void *value, size_t vlen);
+    size_t (*get)(void *storage, void *key, size_t klen, void *buf);
+    size_t (*memory)(void *storage);
+} storage_ops_t;
+
+static double
+elapsed(struct timeval *start)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    return diff.tv_sec + (double)diff.tv_usec / 1000000;
+}
+
+static size_t
+heap_used()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+    struct mallinfo mi = mallinfo();
+    return (unsigned int)mi.uordblks + (unsigned int)mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static void
+ht_volatile_object_destroy(void *ptr)
+{
+    ht_volatile_object_t *obj = (ht_volatile_object_t *)ptr;
+    free(obj->data);
+    free(obj);
+}
+
+static void *
+ht_storage_create()
+{
+    return ht_create(1<<16, 1<<20, ht_volatile_object_destroy);
+}
+
+static void
+ht_storage_destroy(void *storage)
+{
+    ht_destroy((hashtable_t *)storage);
+}
+
+static void
+ht_storage_set(void *storage, void *key, size_t klen, void *value, size_t vlen)
+{
+    ht_volatile_object_t *obj = malloc(sizeof(ht_volatile_object_t));
+    obj->data = malloc(vlen);
+    memcpy(obj->data, value, vlen);
+    obj->dlen = vlen;
+    obj->expire = 0;
+    void *prev = NULL;
+    ht_get_and_set((hashtable_t *)storage, key, klen, obj, sizeof(ht_volatile_object_t), &prev, NULL);
+    if (prev)
+        ht_volatile_object_destroy(prev);
+}
+
+static void *
+ht_storage_copy_cb(void *ptr, size_t len, void *user)
+{
+    ht_volatile_object_t *obj = (ht_volatile_object_t *)ptr;
+    memcpy(user, obj->data, obj->dlen);
+    return user;
+}
+
+static size_t
+ht_storage_get(void *storage, void *key, size_t klen, void *buf)
+{
+    return ht_get_deep_copy((hashtable_t *)storage, key, klen, NULL, ht_storage_copy_cb, buf) ? 1 : 0;
+}
+
+static void *
+vs_storage_create()
+{
+    return volatile_storage_create();
+}
+
+static void
+vs_storage_destroy(void *storage)
+{
+    volatile_storage_destroy((volatile_storage_t *)storage);
+}
+
+static void
+vs_storage_set(void *storage, void *key, size_t klen, void *value, size_t vlen)
+{
+    volatile_storage_set((volatile_storage_t *)storage, key, klen, value, vlen, 0, 0, NULL);
+}
+
+static void
+vs_storage_copy_cb(void *value, size_t vlen, uint32_t expire, void *priv)
+{
+    memcpy(priv, value, vlen);
+}
+
+static size_t
+vs_storage_get(void *storage, void *key, size_t klen, void *buf)
+{
+    return volatile_storage_get((volatile_storage_t *)storage, key, klen, vs_storage_copy_cb, buf) == 0 ? 1 : 0;
+}
+
+static size_t
+vs_storage_memory(void *storage)
+{
+    return volatile_storage_memory((volatile_storage_t *)storage);
+}
+
+static void
+run_benchmark(storage_ops_t *ops, keyset_t *keyset, size_t value_size, int num_gets)
+{
+    int i;
+    struct timeval start;
+    char *value = malloc(value_size);
+    char *buf = malloc(value_size);
+    memset(value, 'v', value_size);
+
+    size_t heap_before = heap_used();
+    void *storage = ops->create();
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < keyset->num_keys; i++)
+        ops->set(storage, keyset->keys[i], keyset->lens[i], value, value_size);
+    double set_time = elapsed(&start);
+
+    size_t heap_after = heap_used();
+
+    // avoid the compiler optimizing out the lookups
+    uint64_t found = 0;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_gets; i++) {
+        int k = i % keyset->num_keys;
+        found += ops->get(storage, keyset->keys[k], keyset->lens[k], buf);
+    }
+    double get_time = elapsed(&start);
+
+    printf("%-9s  keys: %d  value: %zu bytes\n", ops->name, keyset->num_keys, value_size);
+    printf("           sets: %.3fs -> %.0f sets/sec\n",
+           set_time, set_time > 0 ? keyset->num_keys / set_time : 0);
+    printf("           gets: %.3fs -> %.0f gets/sec  (found: %llu)\n",
+           get_time, get_time > 0 ? num_gets / get_time : 0, (unsigned long long)found);
+    if (heap_after > heap_before) {
+        printf("           heap: %zu bytes -> %.1f bytes/item\n",
+               heap_after - heap_before, (double)(heap_after - heap_before) / keyset->num_keys);
+    }
+    if (ops->memory) {
+        size_t memory = ops->memory(storage);
+        printf("           allocated by the storage: %zu bytes -> %.1f bytes/item\n",
+               memory, (double)memory / keyset->num_keys);
+    }
+
+    ops->destroy(storage);
+    free(value);
+    free(buf);
+}
+
+static void
+usage(char *prog, int rc)
+{
+    printf("usage: %s [OPTIONS]...\n"
+           "    -k <num_keys>         the number of keys to store (defaults to: %d)\n"
+           "    -s <value_size>       the size of the values (defaults to: %d)\n"
+           "    -g <num_gets>         the number of gets to perform (defaults to: %d)\n"
+           "    -h                    prints this help\n",
+           prog,
+           DEFAULT_NUM_KEYS,
+           DEFAULT_VALUE_SIZE,
+           DEFAULT_NUM_GETS);
+    exit(rc);
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+    int value_size = DEFAULT_VALUE_SIZE;
+    int num_gets = DEFAULT_NUM_GETS;
+    keyset_t keyset = { NULL, NULL, DEFAULT_NUM_KEYS };
+
+    static struct option long_options[] = {
+        { "keys",       1, 0, 'k' },
+        { "value_size", 1, 0, 's' },
+        { "gets",       1, 0, 'g' },
+        { "help",       0, 0, 'h' },
+        { NULL,         0, 0,  0  }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "k:s:g:h", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'k':
+                keyset.num_keys = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                value_size = strtol(optarg, NULL, 10);
+                break;
+            case 'g':
+                num_gets = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(argv[0], 0);
+                break;
+            default:
+                usage(argv[0], -1);
+        }
+    }
+
+    if (keyset.num_keys <= 0 || value_size <= 0 || num_gets <= 0)
+        usage(argv[0], -1);
+
+    keyset.keys = malloc(sizeof(char *) * keyset.num_keys);
+    keyset.lens = malloc(sizeof(size_t) * keyset.num_keys);
+    for (i = 0; i < keyset.num_keys; i++) {
+        char key[64];
+        keyset.lens[i] = snprintf(key, sizeof(key), "session:%d", i);
+        keyset.keys[i] = strdup(key);
+    }
+
+    storage_ops_t storages[] = {
+        { "hashtable", ht_storage_create, ht_storage_destroy, ht_storage_set, ht_storage_get, NULL },
+        { "volatile",  vs_storage_create, vs_storage_destroy, vs_storage_set, vs_storage_get, vs_storage_memory }
+    };
+
+    for (i = 0; i < sizeof(storages) / sizeof(storages[0]); i++)
+        run_benchmark(&storages[i], &keyset, value_size, num_gets);
+
+    for (i = 0; i < keyset.num_keys; i++)
+        free(keyset.keys[i]);
+    free(keyset.keys);
+    free(keyset.lens);
+
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */